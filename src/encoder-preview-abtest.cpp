@@ -0,0 +1,358 @@
+#include "encoder-preview-abtest.hpp"
+#include "encoder-preview-overlay.hpp"
+#include "plugin-encoders.hpp"
+#include "roi-history.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+/* QP and PSNR arrive after decoding, and PSNR only once the stats are
+ * taken, a GOP is kept around this long after it ended. */
+static constexpr uint64_t kSettleNs = 5000000000;
+/* Bounds the GOPs waiting for samples, e.g. with one frame GOPs */
+static constexpr size_t kMaxGops = 600;
+/* Fewer GOPs per arm do not give a useful variance */
+static constexpr uint64_t kMinGops = 3;
+
+static const char *ArmName(RoiAbTest::Arm arm)
+{
+	return arm == RoiAbTest::ArmOn ? "on" : "off";
+}
+
+static bool SameRegions(const vector<obs_encoder_roi> &a,
+			const vector<obs_encoder_roi> &b)
+{
+	return equal(a.begin(), a.end(), b.begin(), b.end(),
+		     [](const obs_encoder_roi &x, const obs_encoder_roi &y) {
+			     return x.top == y.top && x.bottom == y.bottom &&
+				    x.left == y.left && x.right == y.right &&
+				    x.priority == y.priority;
+		     });
+}
+
+/* Two-sided 95% quantile of Student's t-distribution, Cornish-Fisher
+ * expansion around the normal one. Within a few percent from two degrees
+ * of freedom on, which is all a confidence interval needs. */
+static double StudentQuantile(double df)
+{
+	const double z = 1.959964;
+	const double z3 = z * z * z;
+	const double z5 = z3 * z * z;
+	const double z7 = z5 * z * z;
+
+	return z + (z3 + z) / (4.0 * df) +
+	       (5.0 * z5 + 16.0 * z3 + 3.0 * z) / (96.0 * df * df) +
+	       (3.0 * z7 + 19.0 * z5 + 17.0 * z3 - 15.0 * z) /
+		       (384.0 * df * df * df);
+}
+
+void RoiAbTest::Accumulator::Add(double value)
+{
+	count++;
+	double delta = value - mean;
+	mean += delta / (double)count;
+	m2 += delta * (value - mean);
+}
+
+double RoiAbTest::Accumulator::Variance() const
+{
+	return count > 1 ? m2 / (double)(count - 1) : 0.0;
+}
+
+void RoiAbTest::Start(obs_encoder_t *new_encoder)
+{
+	lock_guard lock(mutex);
+
+	encoder = new_encoder;
+	haveShift = false;
+	restarts = 0;
+
+	lock_guard roi_lock(RoiEncoderMutex());
+	Restart();
+
+	blog(LOG_INFO,
+	     "ROI A/B test on '%s' with %zu regions, switching every %u GOPs",
+	     obs_encoder_get_name(encoder), regions.size(), gopsPerPhase);
+}
+
+void RoiAbTest::Stop()
+{
+	lock_guard lock(mutex);
+
+	if (!encoder)
+		return;
+
+	/* Unless someone else has set regions since */
+	{
+		lock_guard roi_lock(RoiEncoderMutex());
+		if (arm == ArmOff &&
+		    obs_encoder_get_roi_increment(encoder) == roiIncrement) {
+			arm = ArmOn;
+			ApplyArm();
+		}
+	}
+
+	blog(LOG_INFO,
+	     "ROI A/B test on '%s' stopped after %llu GOPs with regions and "
+	     "%llu without",
+	     obs_encoder_get_name(encoder),
+	     (unsigned long long)kbps[ArmOn].count,
+	     (unsigned long long)kbps[ArmOff].count);
+
+	encoder = nullptr;
+	gops.clear();
+}
+
+bool RoiAbTest::Active()
+{
+	lock_guard lock(mutex);
+	return encoder != nullptr;
+}
+
+void RoiAbTest::SetGopsPerPhase(uint32_t new_gops)
+{
+	lock_guard lock(mutex);
+	gopsPerPhase = max(new_gops, 2u);
+}
+
+/* Takes whatever is set now as the regions to compare against, in the
+ * order they were added. RoiEncoderMutex() is held. */
+void RoiAbTest::Restart()
+{
+	GetEncoderRegions(encoder, regions);
+	roiIncrement = obs_encoder_get_roi_increment(encoder);
+	arm = ArmOn;
+	phaseGops = 0;
+	gops.clear();
+
+	for (int idx = 0; idx < ArmCount; idx++) {
+		kbps[idx] = {};
+		qp[idx] = {};
+		psnr[idx] = {};
+	}
+}
+
+/* Encoders pick the change up with the next frame they encode. Only this
+ * encoder's previews see it in the history. RoiEncoderMutex() is held. */
+void RoiAbTest::ApplyArm()
+{
+	obs_encoder_clear_roi(encoder);
+
+	if (arm == ArmOn) {
+		for (const obs_encoder_roi &roi : regions)
+			obs_encoder_add_roi(encoder, &roi);
+	}
+
+	RoiHistory::Shared().Push(obs_get_video_frame_time() +
+					  obs_get_frame_interval_ns(),
+				  arm == ArmOn ? regions
+					       : vector<obs_encoder_roi>(),
+				  encoder);
+
+	roiIncrement = obs_encoder_get_roi_increment(encoder);
+}
+
+void RoiAbTest::CheckRegions()
+{
+	lock_guard roi_lock(RoiEncoderMutex());
+
+	uint32_t increment = obs_encoder_get_roi_increment(encoder);
+	if (increment == roiIncrement)
+		return;
+
+	vector<obs_encoder_roi> current;
+	GetEncoderRegions(encoder, current);
+
+	/* The editor applies the regions again whenever anything in the
+	 * scene changes, the measurement only has to start over if they
+	 * actually are different. */
+	if (SameRegions(current, regions)) {
+		roiIncrement = increment;
+		if (!gops.empty() && !gops.back().closed)
+			gops.back().mixed = true;
+		if (arm == ArmOff)
+			ApplyArm();
+		return;
+	}
+
+	restarts++;
+	blog(LOG_INFO, "Regions of '%s' changed, restarting ROI A/B test",
+	     obs_encoder_get_name(encoder));
+	Restart();
+}
+
+void RoiAbTest::PushPacket(const encoder_packet *pkt)
+{
+	lock_guard lock(mutex);
+
+	if (!encoder)
+		return;
+
+	CheckRegions();
+
+	/* Same mapping to capture time as the decoder uses */
+	if (pkt->keyframe && !haveShift) {
+		dtsShift = pkt->pts - pkt->dts;
+		haveShift = true;
+	}
+
+	if (pkt->keyframe) {
+		const double time_base =
+			(double)pkt->timebase_num / (double)pkt->timebase_den;
+		int64_t shift = pkt->pts - pkt->dts - dtsShift;
+		uint64_t capture_ts = (uint64_t)(pkt->dts_usec * 1000 +
+						 (int64_t)((double)shift *
+							   time_base * 1e9));
+
+		if (!gops.empty()) {
+			Gop &last = gops.back();
+			last.closed = true;
+			last.seconds =
+				(double)(pkt->pts - last.startPts) * time_base;
+		}
+
+		/* Without regions there is nothing to turn off */
+		if (!regions.empty()) {
+			if (phaseGops >= gopsPerPhase) {
+				arm = arm == ArmOn ? ArmOff : ArmOn;
+				{
+					lock_guard roi_lock(RoiEncoderMutex());
+					ApplyArm();
+				}
+				phaseGops = 0;
+
+				blog(LOG_DEBUG,
+				     "ROI A/B test: regions %s on '%s'",
+				     ArmName(arm),
+				     obs_encoder_get_name(encoder));
+			}
+
+			Gop gop;
+			gop.arm = arm;
+			/* Frames already queued in the encoder still had
+			 * the previous regions */
+			gop.mixed = phaseGops == 0;
+			gop.start = capture_ts;
+			gop.startPts = pkt->pts;
+			gops.push_back(gop);
+			phaseGops++;
+		}
+
+		Settle(capture_ts);
+	}
+
+	if (!gops.empty() && !gops.back().closed) {
+		gops.back().bytes += pkt->size;
+		gops.back().frames++;
+	}
+}
+
+RoiAbTest::Gop *RoiAbTest::FindGop(uint64_t capture_ts)
+{
+	for (auto gop = gops.rbegin(); gop != gops.rend(); ++gop) {
+		if (gop->start <= capture_ts)
+			return &*gop;
+	}
+	return nullptr;
+}
+
+void RoiAbTest::PushQp(uint64_t capture_ts, double value)
+{
+	lock_guard lock(mutex);
+
+	if (Gop *gop = FindGop(capture_ts)) {
+		gop->qpSum += value;
+		gop->qpFrames++;
+	}
+}
+
+void RoiAbTest::PushPsnr(uint64_t capture_ts, double value)
+{
+	lock_guard lock(mutex);
+
+	if (Gop *gop = FindGop(capture_ts)) {
+		gop->psnrSum += value;
+		gop->psnrFrames++;
+	}
+}
+
+/* Turns GOPs that ended long enough ago into samples */
+void RoiAbTest::Settle(uint64_t capture_ts)
+{
+	while (gops.size() > 1) {
+		const Gop &gop = gops.front();
+		uint64_t end = gops[1].start;
+
+		if (end + kSettleNs > capture_ts && gops.size() <= kMaxGops)
+			break;
+
+		if (!gop.mixed && gop.seconds > 0.0) {
+			kbps[gop.arm].Add((double)gop.bytes * 8.0 /
+					  gop.seconds / 1000.0);
+
+			/* Decoding fell behind or only kept keyframes, the
+			 * rest would not be representative. */
+			if (gop.qpFrames && gop.qpFrames * 2 >= gop.frames)
+				qp[gop.arm].Add(gop.qpSum /
+						(double)gop.qpFrames);
+			if (gop.psnrFrames)
+				psnr[gop.arm].Add(gop.psnrSum /
+						  (double)gop.psnrFrames);
+		}
+
+		gops.pop_front();
+	}
+}
+
+void RoiAbTest::Compare(const Accumulator (&arms)[ArmCount],
+			Comparison &comparison)
+{
+	for (int idx = 0; idx < ArmCount; idx++) {
+		comparison.gops[idx] = arms[idx].count;
+		comparison.mean[idx] = arms[idx].mean;
+		comparison.stddev[idx] = sqrt(arms[idx].Variance());
+	}
+
+	const Accumulator &on = arms[ArmOn];
+	const Accumulator &off = arms[ArmOff];
+	if (on.count < kMinGops || off.count < kMinGops)
+		return;
+
+	comparison.valid = true;
+	comparison.difference = on.mean - off.mean;
+
+	double se_on = on.Variance() / (double)on.count;
+	double se_off = off.Variance() / (double)off.count;
+	double se = se_on + se_off;
+	if (se <= 0.0)
+		return;
+
+	/* Welch-Satterthwaite, the arms need not have the same variance */
+	double df = se * se / (se_on * se_on / (double)(on.count - 1) +
+			       se_off * se_off / (double)(off.count - 1));
+
+	comparison.interval = StudentQuantile(df) * sqrt(se);
+}
+
+RoiAbTest::Stats RoiAbTest::GetStats()
+{
+	lock_guard lock(mutex);
+
+	Stats stats;
+	stats.active = encoder != nullptr;
+	if (!stats.active)
+		return stats;
+
+	stats.idle = regions.empty();
+	stats.arm = arm;
+	stats.remaining = gopsPerPhase - min(phaseGops, gopsPerPhase);
+	stats.restarts = restarts;
+
+	Compare(kbps, stats.kbps);
+	Compare(qp, stats.qp);
+	Compare(psnr, stats.psnr);
+
+	return stats;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <obs.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/* Measures what the regions cost and gain on the live content by turning
+ * them off and on again on the previewed encoder, a few GOPs at a time.
+ * Every GOP is one sample of bitrate, mean QP and PSNR, the arms are then
+ * compared with Welch's t-test. GOPs the switch happened in mix both arms
+ * and are left out. */
+class RoiAbTest {
+public:
+	enum Arm { ArmOff, ArmOn, ArmCount };
+
+	/* One metric compared between the arms, over whole GOPs */
+	struct Comparison {
+		uint64_t gops[ArmCount] = {};
+		double mean[ArmCount] = {};
+		double stddev[ArmCount] = {};
+		/* On minus off, and the half width of its 95% confidence
+		 * interval. Only valid with a few GOPs in each arm. */
+		double difference = 0.0;
+		double interval = 0.0;
+		bool valid = false;
+	};
+
+	struct Stats {
+		bool active = false;
+		/* No regions are set, there is nothing to compare */
+		bool idle = false;
+		Arm arm = ArmOn;
+		/* GOPs until the next switch */
+		uint32_t remaining = 0;
+		/* Regions were changed by someone else, the measurement
+		 * started over */
+		uint32_t restarts = 0;
+		Comparison kbps;
+		Comparison qp;
+		Comparison psnr;
+	};
+
+	~RoiAbTest() { Stop(); }
+
+	/* The regions set on the encoder at the time are the "on" arm */
+	void Start(obs_encoder_t *encoder);
+	/* Leaves the encoder with its regions set again */
+	void Stop();
+	bool Active();
+
+	/* Including the one the switch happened in, at least two */
+	void SetGopsPerPhase(uint32_t gops);
+
+	/* Encoder thread, switches arms at keyframes */
+	void PushPacket(const encoder_packet *pkt);
+	/* Per decoded frame, by capture time */
+	void PushQp(uint64_t capture_ts, double qp);
+	void PushPsnr(uint64_t capture_ts, double psnr);
+
+	Stats GetStats();
+
+private:
+	/* Running mean and variance */
+	struct Accumulator {
+		uint64_t count = 0;
+		double mean = 0.0;
+		double m2 = 0.0;
+
+		void Add(double value);
+		double Variance() const;
+	};
+
+	struct Gop {
+		Arm arm = ArmOn;
+		/* Regions changed while its frames were encoded */
+		bool mixed = false;
+		bool closed = false;
+		/* Capture time of the keyframe */
+		uint64_t start = 0;
+		int64_t startPts = 0;
+		double seconds = 0.0;
+		uint64_t bytes = 0;
+		uint64_t frames = 0;
+		double qpSum = 0.0;
+		uint64_t qpFrames = 0;
+		double psnrSum = 0.0;
+		uint64_t psnrFrames = 0;
+	};
+
+	void Restart();
+	void ApplyArm();
+	void CheckRegions();
+	Gop *FindGop(uint64_t capture_ts);
+	void Settle(uint64_t capture_ts);
+	static void Compare(const Accumulator (&arms)[ArmCount],
+			    Comparison &comparison);
+
+	std::mutex mutex;
+	OBSEncoder encoder;
+	uint32_t gopsPerPhase = 3;
+
+	std::vector<obs_encoder_roi> regions;
+	/* What the encoder's increment is after our own last change */
+	uint32_t roiIncrement = 0;
+	Arm arm = ArmOn;
+	uint32_t phaseGops = 0;
+	uint32_t restarts = 0;
+
+	bool haveShift = false;
+	int64_t dtsShift = 0;
+	/* Open GOP last, closed ones wait for late samples */
+	std::deque<Gop> gops;
+
+	Accumulator kbps[ArmCount];
+	Accumulator qp[ArmCount];
+	Accumulator psnr[ArmCount];
+};
@@ -0,0 +1,765 @@
+#include "encoder-preview-bitstream.hpp"
+
+#include <util/platform.h>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+/* A few seconds of video, enough to cover several GOPs */
+static constexpr size_t kWindowFrames = 600;
+static constexpr size_t kMaxIntervals = 16;
+/* Parsing only falls behind if its thread is starved */
+static constexpr size_t kMaxQueuedPackets = 240;
+static constexpr size_t kSizeBuckets = 24;
+/* Slice and frame headers are parsed up to the fields we need, which are
+ * always within the first few bytes. */
+static constexpr size_t kHeaderBytes = 256;
+
+/* AV1 frame types and "select" values of the sequence header */
+static constexpr int kAv1Key = 0;
+static constexpr int kAv1Inter = 1;
+static constexpr int kAv1IntraOnly = 2;
+static constexpr int kAv1Switch = 3;
+static constexpr int kAv1Select = 2;
+
+/*
+ * BitReader
+ */
+
+BitReader::BitReader(const uint8_t *data, size_t size, bool rbsp)
+	: data(data),
+	  size(size),
+	  rbsp(rbsp)
+{
+}
+
+bool BitReader::LoadByte()
+{
+	/* 0x000003 is an escaped 0x0000 */
+	if (rbsp && zeros >= 2 && pos < size && data[pos] == 3) {
+		pos++;
+		zeros = 0;
+	}
+
+	if (pos >= size)
+		return false;
+
+	current = data[pos++];
+	zeros = current ? 0 : zeros + 1;
+	return true;
+}
+
+int BitReader::ReadBit()
+{
+	if (bit == 0 && !LoadByte()) {
+		overrun = true;
+		return 0;
+	}
+
+	int value = (current >> (7 - bit)) & 1;
+	bit = (bit + 1) & 7;
+	return value;
+}
+
+uint32_t BitReader::Read(int bits)
+{
+	uint32_t value = 0;
+	for (int idx = 0; idx < bits; idx++)
+		value = (value << 1) | (uint32_t)ReadBit();
+	return value;
+}
+
+uint32_t BitReader::ReadUe()
+{
+	int leading = 0;
+	while (!ReadBit() && !overrun) {
+		if (++leading >= 32)
+			return UINT32_MAX;
+	}
+
+	if (overrun)
+		return 0;
+
+	return ((1u << leading) - 1) + Read(leading);
+}
+
+/*
+ * Control
+ */
+
+bool BitstreamAnalyzer::Start(const char *codec_name)
+{
+	Stop();
+
+	if (strcmp(codec_name, "h264") == 0)
+		codec = CodecH264;
+	else if (strcmp(codec_name, "hevc") == 0)
+		codec = CodecHEVC;
+	else if (strcmp(codec_name, "av1") == 0)
+		codec = CodecAV1;
+	else
+		codec = CodecUnknown;
+
+	if (codec == CodecUnknown) {
+		blog(LOG_WARNING, "Cannot analyse bitstream of codec %s",
+		     codec_name);
+		return false;
+	}
+
+	hevcPps = {};
+	av1Sequence = {};
+	av1RefTypes.fill(-1);
+	packetCount = 0;
+	haveKeyframe = false;
+
+	queue.clear();
+	frames.clear();
+	intervals.clear();
+	dropped = 0;
+	stopping = false;
+
+	thread = std::thread(&BitstreamAnalyzer::Thread, this);
+	return true;
+}
+
+void BitstreamAnalyzer::Stop()
+{
+	if (!thread.joinable())
+		return;
+
+	{
+		lock_guard lock(mutex);
+		stopping = true;
+	}
+
+	cond.notify_one();
+	thread.join();
+
+	queue.clear();
+}
+
+void BitstreamAnalyzer::Push(const packet &pkt)
+{
+	{
+		lock_guard lock(mutex);
+		if (stopping)
+			return;
+
+		/* Unlike decoding, skipping packets only costs accuracy */
+		if (queue.size() >= kMaxQueuedPackets) {
+			dropped++;
+			return;
+		}
+
+		queue.push_back(pkt);
+	}
+
+	cond.notify_one();
+}
+
+BitstreamAnalyzer::Stats BitstreamAnalyzer::TakeStats()
+{
+	Stats ret;
+
+	lock_guard lock(mutex);
+
+	ret.codec = codec;
+	ret.dropped = dropped;
+	dropped = 0;
+
+	/* Buckets are sized to fit the largest frame of the window */
+	uint64_t max_size = 0;
+	for (const Frame &frame : frames)
+		max_size = std::max<uint64_t>(max_size, frame.size);
+
+	int64_t width = (int64_t)((max_size + kSizeBuckets - 1) / kSizeBuckets);
+	width = std::max<int64_t>((width + 1023) / 1024 * 1024, 1024);
+	ret.sizes.assign(FrameTypeCount,
+			 Histogram(0, width * (int64_t)kSizeBuckets,
+				   kSizeBuckets));
+
+	for (const Frame &frame : frames) {
+		TypeStats &type = ret.types[frame.type];
+		type.frames++;
+		type.bytes += frame.size;
+		type.maxSize = std::max<uint64_t>(type.maxSize, frame.size);
+		type.references += frame.reference;
+
+		ret.frames++;
+		ret.references += frame.reference;
+		ret.slices += frame.slices;
+		ret.maxSlices = std::max(ret.maxSlices, frame.slices);
+		ret.temporalLayers =
+			std::max<uint32_t>(ret.temporalLayers, frame.layer + 1);
+		ret.sizes[frame.type].Add(frame.size);
+	}
+
+	if (!intervals.empty()) {
+		for (const Interval &interval : intervals) {
+			ret.keyframeFrames += (double)interval.frames;
+			ret.keyframeSeconds += interval.seconds;
+		}
+
+		ret.keyframeFrames /= (double)intervals.size();
+		ret.keyframeSeconds /= (double)intervals.size();
+	}
+
+	return ret;
+}
+
+/*
+ * Analysis thread
+ */
+
+void BitstreamAnalyzer::Thread()
+{
+	os_set_thread_name("encoder-preview: bitstream analysis");
+
+	unique_lock lock(mutex);
+
+	for (;;) {
+		cond.wait(lock, [&] { return stopping || !queue.empty(); });
+		if (stopping)
+			break;
+
+		packet pkt = std::move(queue.front());
+		queue.pop_front();
+
+		lock.unlock();
+		Analyze(pkt);
+		lock.lock();
+	}
+}
+
+void BitstreamAnalyzer::Analyze(const packet &pkt)
+{
+	const encoder_packet &info = pkt.m_pkt;
+
+	vector<Frame> parsed;
+	if (codec == CodecAV1)
+		ParseObus(info.data, info.size, parsed);
+	else
+		ParseAnnexB(info.data, info.size, parsed);
+
+	lock_guard lock(mutex);
+
+	for (const Frame &frame : parsed)
+		AddFrame(frame);
+
+	/* The interval is counted in packets, which are what gets shown.
+	 * AV1 packets can carry hidden frames next to the shown one. */
+	if (info.keyframe) {
+		if (haveKeyframe) {
+			double seconds = (double)(info.pts - lastKeyframe.pts) *
+					 (double)info.timebase_num /
+					 (double)info.timebase_den;
+			intervals.push_back(
+				{packetCount - lastKeyframe.packet, seconds});
+			if (intervals.size() > kMaxIntervals)
+				intervals.pop_front();
+		}
+
+		lastKeyframe = {packetCount, info.pts};
+		haveKeyframe = true;
+	}
+
+	packetCount++;
+}
+
+void BitstreamAnalyzer::AddFrame(const Frame &frame)
+{
+	frames.push_back(frame);
+	if (frames.size() > kWindowFrames)
+		frames.pop_front();
+}
+
+/*
+ * H.264 and HEVC
+ */
+
+static const uint8_t *FindStartCode(const uint8_t *data, const uint8_t *end)
+{
+	for (; data + 3 <= end; data++) {
+		if (data[0] == 0 && data[1] == 0 && data[2] == 1)
+			return data;
+	}
+
+	return end;
+}
+
+/* Slices of one picture can differ in type, the picture counts as the most
+ * complex of them. */
+static BitstreamAnalyzer::FrameType
+CombineTypes(BitstreamAnalyzer::FrameType a, BitstreamAnalyzer::FrameType b)
+{
+	auto rank = [](BitstreamAnalyzer::FrameType type) {
+		switch (type) {
+		case BitstreamAnalyzer::FrameKey:
+			return 1;
+		case BitstreamAnalyzer::FrameIntra:
+			return 2;
+		case BitstreamAnalyzer::FrameP:
+			return 3;
+		case BitstreamAnalyzer::FrameB:
+			return 4;
+		default:
+			return 0;
+		}
+	};
+
+	return rank(b) > rank(a) ? b : a;
+}
+
+void BitstreamAnalyzer::ParseAnnexB(const uint8_t *data, size_t size,
+				    vector<Frame> &out)
+{
+	/* Packets are whole access units, parameter sets and SEI count
+	 * towards the size of the picture they come with. */
+	Frame frame;
+	frame.size = (uint32_t)size;
+	bool vcl = false;
+
+	const uint8_t *end = data + size;
+	const uint8_t *nal = FindStartCode(data, end);
+
+	while (nal < end) {
+		nal += 3;
+		const uint8_t *next = FindStartCode(nal, end);
+
+		if (next > nal) {
+			if (codec == CodecH264)
+				ParseH264Nal(nal, next - nal, frame, vcl);
+			else
+				ParseHevcNal(nal, next - nal, frame, vcl);
+		}
+
+		nal = next;
+	}
+
+	if (vcl)
+		out.push_back(frame);
+}
+
+void BitstreamAnalyzer::ParseH264Nal(const uint8_t *nal, size_t size,
+				     Frame &frame, bool &vcl)
+{
+	const int ref_idc = (nal[0] >> 5) & 3;
+	const int type = nal[0] & 0x1f;
+
+	/* Coded slice of a non-IDR or an IDR picture */
+	if (type != 1 && type != 5)
+		return;
+
+	vcl = true;
+	frame.slices++;
+	frame.reference = frame.reference || ref_idc != 0;
+
+	BitReader br(nal + 1, std::min(size - 1, kHeaderBytes), true);
+	br.ReadUe(); // first_mb_in_slice
+	uint32_t slice_type = br.ReadUe() % 5;
+	if (br.Overrun())
+		return;
+
+	FrameType slice;
+	if (type == 5)
+		slice = FrameKey;
+	else if (slice_type == 1)
+		slice = FrameB;
+	else if (slice_type == 0 || slice_type == 3)
+		slice = FrameP; // P or SP
+	else
+		slice = FrameIntra; // I or SI
+
+	frame.type = CombineTypes(frame.type, slice);
+}
+
+void BitstreamAnalyzer::ParseHevcNal(const uint8_t *nal, size_t size,
+				     Frame &frame, bool &vcl)
+{
+	if (size < 2)
+		return;
+
+	const int type = (nal[0] >> 1) & 0x3f;
+	const int temporal_id = (nal[1] & 7) - 1;
+
+	BitReader br(nal + 2, std::min(size - 2, kHeaderBytes), true);
+
+	if (type == 34) {
+		/* PPS, only the start is needed for slice headers */
+		uint32_t id = br.ReadUe();
+		br.ReadUe(); // pps_seq_parameter_set_id
+		bool dependent = br.ReadFlag();
+		br.ReadFlag(); // output_flag_present_flag
+		int extra_bits = (int)br.Read(3);
+
+		if (id < hevcPps.size() && !br.Overrun())
+			hevcPps[id] = {true, dependent, extra_bits};
+		return;
+	}
+
+	const bool irap = type >= 16 && type <= 23;
+	if (type > 9 && !irap)
+		return;
+	if (type > 21)
+		return; // Reserved IRAP types
+
+	vcl = true;
+
+	bool first_segment = br.ReadFlag();
+	if (irap)
+		br.ReadFlag(); // no_output_of_prior_pics_flag
+	uint32_t pps_id = br.ReadUe();
+	if (br.Overrun() || pps_id >= hevcPps.size())
+		return;
+
+	const HevcPps &pps = hevcPps[pps_id];
+
+	if (!first_segment) {
+		/* Dependent slice segments continue the preceding slice */
+		if (!pps.valid || !pps.dependentSlices || !br.ReadFlag())
+			frame.slices++;
+		return;
+	}
+
+	frame.slices++;
+	frame.layer = (uint8_t)std::max(temporal_id, 0);
+	/* Even types up to 14 are sub-layer non-reference pictures */
+	frame.reference = !(type <= 14 && type % 2 == 0);
+
+	if (irap) {
+		frame.type = FrameKey;
+		return;
+	}
+
+	if (!pps.valid)
+		return;
+
+	br.Read(pps.extraSliceHeaderBits); // slice_reserved_flag
+	uint32_t slice_type = br.ReadUe();
+	if (br.Overrun())
+		return;
+
+	if (slice_type == 0)
+		frame.type = FrameB;
+	else if (slice_type == 1)
+		frame.type = FrameP;
+	else if (slice_type == 2)
+		frame.type = FrameIntra;
+}
+
+/*
+ * AV1
+ */
+
+static bool ReadLeb128(const uint8_t *data, size_t size, uint64_t &value,
+		       size_t &length)
+{
+	value = 0;
+
+	for (length = 0; length < 8 && length < size; length++) {
+		value |= (uint64_t)(data[length] & 0x7f) << (length * 7);
+		if (!(data[length] & 0x80)) {
+			length++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void BitstreamAnalyzer::ParseObus(const uint8_t *data, size_t size,
+				  vector<Frame> &out)
+{
+	/* Bytes of OBUs not belonging to a frame, such as sequence headers
+	 * and metadata, count towards the frame following them. */
+	uint64_t pending = 0;
+	size_t pos = 0;
+
+	while (pos < size) {
+		const uint8_t header = data[pos];
+		const int type = (header >> 3) & 0xf;
+		const bool extension = (header & 4) != 0;
+		const bool has_size = (header & 2) != 0;
+
+		size_t header_size = extension ? 2 : 1;
+		if (pos + header_size > size)
+			break;
+
+		int temporal_id = 0, spatial_id = 0;
+		if (extension) {
+			temporal_id = data[pos + 1] >> 5;
+			spatial_id = (data[pos + 1] >> 3) & 3;
+		}
+
+		uint64_t obu_size = size - pos - header_size;
+		if (has_size) {
+			size_t length;
+			if (!ReadLeb128(data + pos + header_size,
+					size - pos - header_size, obu_size,
+					length))
+				break;
+			header_size += length;
+		}
+
+		if (header_size > size - pos ||
+		    obu_size > size - pos - header_size)
+			break;
+
+		const uint8_t *payload = data + pos + header_size;
+		const uint64_t total = header_size + obu_size;
+
+		switch (type) {
+		case 1: // OBU_SEQUENCE_HEADER
+			ParseAv1Sequence(payload, obu_size);
+			pending += total;
+			break;
+		case 3:   // OBU_FRAME_HEADER
+		case 6: { // OBU_FRAME
+			Frame frame;
+			if (!ParseAv1Frame(payload, obu_size, temporal_id,
+					   spatial_id, frame)) {
+				pending += total;
+				break;
+			}
+
+			/* A frame OBU carries its single tile group */
+			frame.slices = type == 6 ? 1 : 0;
+			frame.size = (uint32_t)(pending + total);
+			pending = 0;
+			out.push_back(frame);
+			break;
+		}
+		case 4: // OBU_TILE_GROUP
+			if (out.empty()) {
+				pending += total;
+				break;
+			}
+			out.back().slices++;
+			out.back().size += (uint32_t)total;
+			break;
+		default:
+			pending += total;
+			break;
+		}
+
+		pos += total;
+	}
+
+	if (!out.empty())
+		out.back().size += (uint32_t)pending;
+}
+
+void BitstreamAnalyzer::ParseAv1Sequence(const uint8_t *data, size_t size)
+{
+	Av1Sequence seq;
+	BitReader br(data, size);
+
+	br.Read(3); // seq_profile
+	br.ReadFlag(); // still_picture
+	seq.reducedStillPicture = br.ReadFlag();
+
+	if (seq.reducedStillPicture) {
+		br.Read(5); // seq_level_idx[0]
+		seq.operatingPoints = 1;
+	} else {
+		int buffer_delay_length = 0;
+
+		if (br.ReadFlag()) { // timing_info_present_flag
+			br.Read(32); // num_units_in_display_tick
+			br.Read(32); // time_scale
+			seq.equalPictureInterval = br.ReadFlag();
+			if (seq.equalPictureInterval)
+				br.ReadUe(); // num_ticks_per_picture_minus_1
+
+			seq.decoderModelInfo = br.ReadFlag();
+			if (seq.decoderModelInfo) {
+				buffer_delay_length = (int)br.Read(5) + 1;
+				br.Read(32); // num_units_in_decoding_tick
+				seq.bufferRemovalTimeLength =
+					(int)br.Read(5) + 1;
+				seq.presentationTimeLength =
+					(int)br.Read(5) + 1;
+			}
+		}
+
+		bool initial_display_delay = br.ReadFlag();
+		seq.operatingPoints = (int)br.Read(5) + 1;
+
+		for (int op = 0; op < seq.operatingPoints; op++) {
+			seq.operatingPointIdc[op] = br.Read(12);
+			if (br.Read(5) > 7) // seq_level_idx
+				br.ReadFlag(); // seq_tier
+
+			if (seq.decoderModelInfo) {
+				seq.decoderModelPresent[op] = br.ReadFlag();
+				if (seq.decoderModelPresent[op]) {
+					br.Read(buffer_delay_length);
+					br.Read(buffer_delay_length);
+					br.ReadFlag(); // low_delay_mode_flag
+				}
+			}
+
+			if (initial_display_delay && br.ReadFlag())
+				br.Read(4);
+		}
+	}
+
+	int width_bits = (int)br.Read(4) + 1;
+	int height_bits = (int)br.Read(4) + 1;
+	br.Read(width_bits); // max_frame_width_minus_1
+	br.Read(height_bits); // max_frame_height_minus_1
+
+	if (!seq.reducedStillPicture)
+		seq.frameIdNumbers = br.ReadFlag();
+	if (seq.frameIdNumbers) {
+		int delta_length = (int)br.Read(4) + 2;
+		int additional_length = (int)br.Read(3) + 1;
+		seq.frameIdLength = delta_length + additional_length;
+	}
+
+	br.ReadFlag(); // use_128x128_superblock
+	br.ReadFlag(); // enable_filter_intra
+	br.ReadFlag(); // enable_intra_edge_filter
+
+	seq.screenContentTools = kAv1Select;
+	seq.integerMv = kAv1Select;
+
+	if (!seq.reducedStillPicture) {
+		br.ReadFlag(); // enable_interintra_compound
+		br.ReadFlag(); // enable_masked_compound
+		br.ReadFlag(); // enable_warped_motion
+		br.ReadFlag(); // enable_dual_filter
+		bool order_hint = br.ReadFlag();
+		if (order_hint) {
+			br.ReadFlag(); // enable_jnt_comp
+			br.ReadFlag(); // enable_ref_frame_mvs
+		}
+
+		if (!br.ReadFlag()) // seq_choose_screen_content_tools
+			seq.screenContentTools = (int)br.Read(1);
+
+		if (seq.screenContentTools > 0) {
+			if (!br.ReadFlag()) // seq_choose_integer_mv
+				seq.integerMv = (int)br.Read(1);
+		}
+
+		if (order_hint)
+			seq.orderHintBits = (int)br.Read(3) + 1;
+	}
+
+	if (br.Overrun())
+		return;
+
+	seq.valid = true;
+	av1Sequence = seq;
+}
+
+bool BitstreamAnalyzer::ParseAv1Frame(const uint8_t *data, size_t size,
+				      int temporal_id, int spatial_id,
+				      Frame &frame)
+{
+	const Av1Sequence &seq = av1Sequence;
+	if (!seq.valid)
+		return false;
+
+	BitReader br(data, std::min<size_t>(size, kHeaderBytes));
+	frame.layer = (uint8_t)temporal_id;
+
+	int frame_type = kAv1Key;
+	bool show_frame = true;
+	bool error_resilient = true;
+
+	if (!seq.reducedStillPicture) {
+		if (br.ReadFlag()) { // show_existing_frame
+			int idx = (int)br.Read(3);
+			frame.type = FrameShowExisting;
+
+			/* Showing a key frame refreshes every reference */
+			if (av1RefTypes[idx] == kAv1Key) {
+				frame.reference = true;
+				av1RefTypes.fill(kAv1Key);
+			}
+			return !br.Overrun();
+		}
+
+		frame_type = (int)br.Read(2);
+		show_frame = br.ReadFlag();
+
+		if (show_frame && seq.decoderModelInfo &&
+		    !seq.equalPictureInterval)
+			br.Read(seq.presentationTimeLength);
+		if (!show_frame)
+			br.ReadFlag(); // showable_frame
+
+		if (frame_type != kAv1Switch &&
+		    !(frame_type == kAv1Key && show_frame))
+			error_resilient = br.ReadFlag();
+	}
+
+	const bool intra = frame_type == kAv1Key ||
+			   frame_type == kAv1IntraOnly;
+
+	br.ReadFlag(); // disable_cdf_update
+
+	int screen_content = seq.screenContentTools;
+	if (screen_content == kAv1Select)
+		screen_content = br.ReadFlag();
+	if (screen_content && seq.integerMv == kAv1Select)
+		br.ReadFlag(); // force_integer_mv
+
+	if (seq.frameIdNumbers)
+		br.Read(seq.frameIdLength); // current_frame_id
+
+	if (frame_type != kAv1Switch && !seq.reducedStillPicture)
+		br.ReadFlag(); // frame_size_override_flag
+
+	br.Read(seq.orderHintBits); // order_hint
+
+	if (!intra && !error_resilient)
+		br.Read(3); // primary_ref_frame
+
+	if (seq.decoderModelInfo && br.ReadFlag()) {
+		for (int op = 0; op < seq.operatingPoints; op++) {
+			if (!seq.decoderModelPresent[op])
+				continue;
+
+			uint32_t idc = seq.operatingPointIdc[op];
+			bool in_temporal = (idc >> temporal_id) & 1;
+			bool in_spatial = (idc >> (spatial_id + 8)) & 1;
+			if (idc == 0 || (in_temporal && in_spatial))
+				br.Read(seq.bufferRemovalTimeLength);
+		}
+	}
+
+	uint32_t refresh = 0xff;
+	if (frame_type != kAv1Switch && !(frame_type == kAv1Key && show_frame))
+		refresh = br.Read(8);
+
+	if (br.Overrun())
+		return false;
+
+	switch (frame_type) {
+	case kAv1Key:
+		frame.type = FrameKey;
+		break;
+	case kAv1Inter:
+		frame.type = FrameInter;
+		break;
+	case kAv1IntraOnly:
+		frame.type = FrameIntra;
+		break;
+	default:
+		frame.type = FrameSwitch;
+		break;
+	}
+
+	frame.reference = refresh != 0;
+	for (size_t idx = 0; idx < av1RefTypes.size(); idx++) {
+		if (refresh & (1u << idx))
+			av1RefTypes[idx] = frame_type;
+	}
+
+	return true;
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "encoder-preview-capture.hpp"
+#include "encoder-preview-stats.hpp"
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Reads the bit fields of H.264/HEVC RBSPs and AV1 OBUs. Reading past the
+ * end yields zeros and sets the overrun flag instead of failing. */
+class BitReader {
+public:
+	/* With rbsp set emulation prevention bytes are skipped */
+	BitReader(const uint8_t *data, size_t size, bool rbsp = false);
+
+	uint32_t Read(int bits);
+	bool ReadFlag() { return ReadBit() != 0; }
+	/* Exp-Golomb ue(v), AV1's uvlc() uses the same code */
+	uint32_t ReadUe();
+
+	bool Overrun() const { return overrun; }
+
+private:
+	int ReadBit();
+	bool LoadByte();
+
+	const uint8_t *data;
+	size_t size;
+	size_t pos = 0;
+	bool rbsp;
+	int zeros = 0;
+
+	uint8_t current = 0;
+	int bit = 0;
+	bool overrun = false;
+};
+
+/* Walks the NAL units or OBUs of the packets reaching the preview output
+ * on a thread of its own, without decoding. Only headers are parsed, so
+ * this stays cheap even while decoding is disabled. */
+class BitstreamAnalyzer {
+public:
+	enum Codec { CodecUnknown, CodecH264, CodecHEVC, CodecAV1 };
+
+	enum FrameType {
+		/* IDR/IRAP pictures and AV1 key frames */
+		FrameKey,
+		/* Other intra pictures, AV1 intra-only frames */
+		FrameIntra,
+		FrameP,
+		FrameB,
+		/* AV1 inter frames do not tell P and B apart */
+		FrameInter,
+		FrameSwitch,
+		FrameShowExisting,
+		FrameUnknown,
+		FrameTypeCount,
+	};
+
+	struct TypeStats {
+		uint64_t frames = 0;
+		uint64_t bytes = 0;
+		uint64_t maxSize = 0;
+		uint64_t references = 0;
+	};
+
+	/* Covers the most recent frames, not just those since the last call */
+	struct Stats {
+		Codec codec = CodecUnknown;
+		uint64_t frames = 0;
+		uint64_t references = 0;
+		std::array<TypeStats, FrameTypeCount> types;
+
+		/* Slices per picture, tile groups for AV1 */
+		uint64_t slices = 0;
+		uint32_t maxSlices = 0;
+		uint32_t temporalLayers = 0;
+
+		/* Mean distance between recent keyframes, 0 without two */
+		double keyframeFrames = 0.0;
+		double keyframeSeconds = 0.0;
+
+		/* Frame sizes in bytes per FrameType, with the same buckets */
+		std::vector<Histogram> sizes;
+
+		/* Packets skipped because parsing fell behind, since the last
+		 * call */
+		uint64_t dropped = 0;
+	};
+
+	~BitstreamAnalyzer() { Stop(); }
+
+	/* Codec as returned by obs_encoder_get_codec() */
+	bool Start(const char *codec);
+	void Stop();
+
+	/* Encoder thread, the packet data is shared, not copied */
+	void Push(const packet &pkt);
+
+	Stats TakeStats();
+
+private:
+	struct Frame {
+		FrameType type = FrameUnknown;
+		uint32_t size = 0;
+		uint32_t slices = 0;
+		uint8_t layer = 0;
+		bool reference = false;
+	};
+
+	struct Keyframe {
+		uint64_t packet;
+		int64_t pts;
+	};
+
+	struct Interval {
+		uint64_t frames;
+		double seconds;
+	};
+
+	/* Parts of the sequence header the frame header depends on */
+	struct Av1Sequence {
+		bool valid = false;
+		bool reducedStillPicture = false;
+		bool decoderModelInfo = false;
+		bool equalPictureInterval = false;
+		int bufferRemovalTimeLength = 0;
+		int presentationTimeLength = 0;
+		int operatingPoints = 0;
+		std::array<uint32_t, 32> operatingPointIdc = {};
+		std::array<bool, 32> decoderModelPresent = {};
+		bool frameIdNumbers = false;
+		int frameIdLength = 0;
+		int screenContentTools = 0;
+		int integerMv = 0;
+		int orderHintBits = 0;
+	};
+
+	/* Slice header fields that depend on the PPS */
+	struct HevcPps {
+		bool valid = false;
+		bool dependentSlices = false;
+		int extraSliceHeaderBits = 0;
+	};
+
+	void Thread();
+	void Analyze(const packet &pkt);
+	void AddFrame(const Frame &frame);
+
+	void ParseAnnexB(const uint8_t *data, size_t size,
+			 std::vector<Frame> &out);
+	void ParseH264Nal(const uint8_t *nal, size_t size, Frame &frame,
+			  bool &vcl);
+	void ParseHevcNal(const uint8_t *nal, size_t size, Frame &frame,
+			  bool &vcl);
+	void ParseObus(const uint8_t *data, size_t size,
+		       std::vector<Frame> &out);
+	void ParseAv1Sequence(const uint8_t *data, size_t size);
+	bool ParseAv1Frame(const uint8_t *data, size_t size, int temporal_id,
+			   int spatial_id, Frame &frame);
+
+	Codec codec = CodecUnknown;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<packet> queue;
+	/* Packets are only accepted while the thread runs */
+	bool stopping = true;
+	uint64_t dropped = 0;
+
+	/* Rolling window of parsed frames, guarded by the mutex */
+	std::deque<Frame> frames;
+	std::deque<Interval> intervals;
+
+	/* Parser state, only touched by the thread */
+	std::array<HevcPps, 64> hevcPps;
+	Av1Sequence av1Sequence;
+	std::array<int, 8> av1RefTypes = {};
+	uint64_t packetCount = 0;
+	bool haveKeyframe = false;
+	Keyframe lastKeyframe = {};
+};
@@ -0,0 +1,262 @@
+#include "encoder-preview-capture.hpp"
+#include "encoder-preview-ff-glue.hpp"
+
+#include <util/platform.h>
+
+#include <cinttypes>
+#include <cstring>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+using namespace std;
+
+/* About ten seconds of a high bitrate stream */
+static constexpr size_t kMaxQueuedBytes = 64 * 1024 * 1024;
+
+bool PacketCapture::Start(const string &file, obs_encoder_t *enc,
+			  Container type)
+{
+	Stop();
+
+	bool opened = type == ContainerPacketTrace ? OpenTrace(file, enc)
+						   : OpenMatroska(file, enc);
+	if (!opened)
+		return false;
+
+	container = type;
+	path = file;
+	stopping = false;
+	waitForKeyframe = true;
+	gotKeyframe = false;
+	queuedBytes = 0;
+	stats = {};
+
+	thread = std::thread(&PacketCapture::Thread, this);
+
+	blog(LOG_INFO, "Capturing packets of %s to '%s'",
+	     obs_encoder_get_name(enc), file.c_str());
+	return true;
+}
+
+bool PacketCapture::OpenMatroska(const string &file, obs_encoder_t *enc)
+{
+	const AVCodecDescriptor *desc =
+		avcodec_descriptor_get_by_name(obs_encoder_get_codec(enc));
+	if (!desc) {
+		blog(LOG_WARNING, "Cannot capture codec %s",
+		     obs_encoder_get_codec(enc));
+		return false;
+	}
+
+	int ret = avformat_alloc_output_context2(&format, nullptr, "matroska",
+						 file.c_str());
+	if (ret < 0) {
+		log_av_error("avformat_alloc_output_context2", ret);
+		return false;
+	}
+
+	stream = avformat_new_stream(format, nullptr);
+	if (!stream) {
+		Close();
+		return false;
+	}
+
+	AVCodecParameters *par = stream->codecpar;
+	par->codec_type = AVMEDIA_TYPE_VIDEO;
+	par->codec_id = desc->id;
+	par->width = (int)obs_encoder_get_width(enc);
+	par->height = (int)obs_encoder_get_height(enc);
+
+	uint8_t *extra_data;
+	size_t extra_size;
+	if (obs_encoder_get_extra_data(enc, &extra_data, &extra_size)) {
+		par->extradata = (uint8_t *)av_mallocz(
+			extra_size + AV_INPUT_BUFFER_PADDING_SIZE);
+		memcpy(par->extradata, extra_data, extra_size);
+		par->extradata_size = (int)extra_size;
+	}
+
+	ret = avio_open(&format->pb, file.c_str(), AVIO_FLAG_WRITE);
+	if (ret < 0) {
+		log_av_error("avio_open", ret);
+		Close();
+		return false;
+	}
+
+	ret = avformat_write_header(format, nullptr);
+	if (ret < 0) {
+		log_av_error("avformat_write_header", ret);
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+/* Timestamps are kept as the encoder produced them, the replay tool deals
+ * with the offset itself. */
+bool PacketCapture::OpenTrace(const string &file, obs_encoder_t *enc)
+{
+	PacketTraceInfo info;
+	info.codec = obs_encoder_get_codec(enc);
+	info.width = obs_encoder_get_width(enc);
+	info.height = obs_encoder_get_height(enc);
+
+	info.format = obs_encoder_get_preferred_video_format(enc);
+	if (info.format == VIDEO_FORMAT_NONE)
+		info.format = video_output_get_format(obs_encoder_video(enc));
+
+	uint8_t *extra_data;
+	size_t extra_size;
+	if (obs_encoder_get_extra_data(enc, &extra_data, &extra_size))
+		info.extra_data.assign(extra_data, extra_data + extra_size);
+
+	return trace.Open(file, info);
+}
+
+void PacketCapture::Stop()
+{
+	if (!thread.joinable())
+		return;
+
+	{
+		lock_guard lock(mutex);
+		stopping = true;
+	}
+
+	cond.notify_one();
+	thread.join();
+
+	if (container == ContainerMatroska)
+		av_write_trailer(format);
+	Close();
+
+	blog(LOG_INFO,
+	     "Capture to '%s' finished, %" PRIu64 " packets written, %" PRIu64
+	     " dropped",
+	     path.c_str(), stats.written, stats.dropped);
+}
+
+void PacketCapture::Close()
+{
+	trace.Close();
+
+	if (format && format->pb)
+		avio_closep(&format->pb);
+
+	avformat_free_context(format);
+	format = nullptr;
+	stream = nullptr;
+}
+
+PacketCapture::Stats PacketCapture::GetStats()
+{
+	lock_guard lock(mutex);
+	return stats;
+}
+
+void PacketCapture::Push(const packet &pkt)
+{
+	{
+		lock_guard lock(mutex);
+
+		/* A gap in the middle of a GOP would leave the rest of it
+		 * undecodable, so once something is dropped everything up to
+		 * the next keyframe goes. */
+		if (queuedBytes + pkt.m_pkt.size > kMaxQueuedBytes)
+			waitForKeyframe = true;
+
+		if (waitForKeyframe && !pkt.m_pkt.keyframe) {
+			stats.dropped++;
+			return;
+		}
+		if (queuedBytes + pkt.m_pkt.size > kMaxQueuedBytes) {
+			stats.dropped++;
+			return;
+		}
+
+		waitForKeyframe = false;
+		queuedBytes += pkt.m_pkt.size;
+		queue.push_back(pkt);
+	}
+
+	cond.notify_one();
+}
+
+void PacketCapture::Thread()
+{
+	os_set_thread_name("encoder-preview: capture");
+
+	unique_lock lock(mutex);
+
+	for (;;) {
+		cond.wait(lock, [&] { return stopping || !queue.empty(); });
+
+		/* Whatever is queued when stopping still goes into the file */
+		if (queue.empty())
+			break;
+
+		packet pkt = std::move(queue.front());
+		queue.pop_front();
+		queuedBytes -= pkt.m_pkt.size;
+
+		lock.unlock();
+		Write(&pkt.m_pkt);
+		lock.lock();
+	}
+}
+
+void PacketCapture::Write(const encoder_packet *pkt)
+{
+	/* Start the file at zero, packets from an encoder that has been
+	 * running for a while have large timestamps. */
+	if (!gotKeyframe) {
+		if (!pkt->keyframe)
+			return;
+
+		gotKeyframe = true;
+		dtsOffset = pkt->dts;
+	}
+
+	bool written = container == ContainerPacketTrace ? trace.Write(*pkt)
+							 : WriteMatroska(pkt);
+
+	lock_guard lock(mutex);
+
+	if (!written) {
+		stats.dropped++;
+		return;
+	}
+
+	stats.written++;
+	stats.bytes += pkt->size;
+}
+
+bool PacketCapture::WriteMatroska(const encoder_packet *pkt)
+{
+	AVPacket *av_pkt = av_packet_alloc();
+	const AVRational time_base = {pkt->timebase_num, pkt->timebase_den};
+
+	av_pkt->data = pkt->data;
+	av_pkt->size = (int)pkt->size;
+	av_pkt->pts = av_rescale_q(pkt->pts - dtsOffset, time_base,
+				   stream->time_base);
+	av_pkt->dts = av_rescale_q(pkt->dts - dtsOffset, time_base,
+				   stream->time_base);
+	av_pkt->stream_index = stream->index;
+	if (pkt->keyframe)
+		av_pkt->flags |= AV_PKT_FLAG_KEY;
+
+	int ret = av_write_frame(format, av_pkt);
+	av_packet_free(&av_pkt);
+
+	if (ret < 0) {
+		log_av_error("av_write_frame", ret);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "encoder-preview-packet-trace.hpp"
+
+#include <obs.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct AVFormatContext;
+struct AVStream;
+
+/* non-interleaved video packets are not ref-counted, so this has to do as
+ * our own RAII copy mechanism. The data is shared between copies, so the
+ * decoder and the capture writer can hold the same packet. */
+struct packet {
+	encoder_packet m_pkt;
+	std::shared_ptr<const std::vector<uint8_t>> data;
+
+	packet(encoder_packet *pkt)
+		: data(std::make_shared<const std::vector<uint8_t>>(
+			  pkt->data, pkt->data + pkt->size))
+	{
+		m_pkt = *pkt;
+		m_pkt.data = const_cast<uint8_t *>(data->data());
+	}
+};
+
+/* Muxes encoder packets into a Matroska file or a packet trace as they
+ * are, on a writer thread of its own. Pushing never blocks, if the writer
+ * falls behind packets are dropped until the next keyframe. */
+class PacketCapture {
+public:
+	enum Container { ContainerMatroska, ContainerPacketTrace };
+
+	struct Stats {
+		uint64_t written = 0;
+		uint64_t bytes = 0;
+		uint64_t dropped = 0;
+	};
+
+	PacketCapture() = default;
+	~PacketCapture() { Stop(); }
+
+	PacketCapture(const PacketCapture &) = delete;
+	PacketCapture &operator=(const PacketCapture &) = delete;
+
+	/* Encoder must be initialized, its extra data becomes the codec
+	 * private data of the file. */
+	bool Start(const std::string &path, obs_encoder_t *enc,
+		   Container container = ContainerMatroska);
+	/* Writes everything still queued and finalizes the file */
+	void Stop();
+
+	bool Active() const { return thread.joinable(); }
+	const std::string &Path() const { return path; }
+
+	void Push(const packet &pkt);
+	Stats GetStats();
+
+private:
+	bool OpenMatroska(const std::string &file, obs_encoder_t *enc);
+	bool OpenTrace(const std::string &file, obs_encoder_t *enc);
+	void Thread();
+	void Write(const encoder_packet *pkt);
+	bool WriteMatroska(const encoder_packet *pkt);
+	void Close();
+
+	std::string path;
+	Container container = ContainerMatroska;
+	AVFormatContext *format = nullptr;
+	AVStream *stream = nullptr;
+	PacketTraceWriter trace;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool stopping = false;
+
+	std::deque<packet> queue;
+	size_t queuedBytes = 0;
+	bool waitForKeyframe = true;
+
+	/* Writer thread only */
+	int64_t dtsOffset = 0;
+	bool gotKeyframe = false;
+
+	Stats stats;
+};
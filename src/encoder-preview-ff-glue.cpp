@@ -1,7 +1,25 @@
 #include "encoder-preview-ff-glue.hpp"
+#include "encoder-preview-overlay.hpp"
 
+#include <algorithm>
 #include <string_view>
 
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/video_enc_params.h>
+}
+
+using namespace std;
+
+/* Plane line sizes and buffer sizes are aligned to this, which satisfies
+ * every SIMD path FFmpeg and libobs may use on the planes. */
+static constexpr int kPoolAlign = 64;
+/* Decoders may over-read/-write the end of a plane by a few bytes. */
+static constexpr size_t kPoolPadding = 64;
+/* Roughly a DPB worth of frames plus whatever is in flight */
+static constexpr int kPoolPrewarm = 8;
+
 static AVCodecID NameToAVCodecID(const std::string_view &str)
 {
 	if (str == "hevc")
@@ -15,7 +33,7 @@ static AVCodecID NameToAVCodecID(const std::string_view &str)
 }
 
 // Copied mostly from media-playback/media.c
-static video_format AVPixelFormatToOBSFormat(int f)
+video_format AVPixelFormatToOBSFormat(int f)
 {
 	switch (f) {
 	case AV_PIX_FMT_NONE:
@@ -64,6 +82,29 @@ static video_format AVPixelFormatToOBSFormat(int f)
 	return VIDEO_FORMAT_NONE;
 }
 
+/* Format the decoder will most likely output for a given encoder format */
+static AVPixelFormat OBSFormatToDecodedFormat(video_format f)
+{
+	switch (f) {
+	case VIDEO_FORMAT_I420:
+	case VIDEO_FORMAT_NV12:
+		return AV_PIX_FMT_YUV420P;
+	case VIDEO_FORMAT_I010:
+	case VIDEO_FORMAT_P010:
+		return AV_PIX_FMT_YUV420P10LE;
+	case VIDEO_FORMAT_I444:
+		return AV_PIX_FMT_YUV444P;
+	case VIDEO_FORMAT_I412:
+		return AV_PIX_FMT_YUV444P12LE;
+	case VIDEO_FORMAT_P216:
+		return AV_PIX_FMT_YUV422P10LE;
+	case VIDEO_FORMAT_P416:
+		return AV_PIX_FMT_YUV444P10LE;
+	default:
+		return AV_PIX_FMT_NONE;
+	}
+}
+
 static video_colorspace
 AVColorSpaceToOBSSpace(AVColorSpace s, AVColorTransferCharacteristic trc,
 		       AVColorPrimaries color_primaries)
@@ -94,34 +135,206 @@ static video_range_type AVRangeToOBSRange(AVColorRange r)
 	return r == AVCOL_RANGE_JPEG ? VIDEO_RANGE_FULL : VIDEO_RANGE_DEFAULT;
 }
 
-static void log_av_error(const char *method, int ret)
+void log_av_error(const char *method, int ret)
 {
 	char err[512];
 	av_strerror(ret, err, sizeof(err));
 	blog(LOG_ERROR, "%s failed with: %s", method, err);
 }
 
-bool CreateCodecContext(AVCodecContext **ctx, obs_encoder_t *enc)
+/*
+ * Frame buffer pool
+ */
+
+AVBufferRef *FramePool::Alloc(void *opaque, size_t size)
+{
+	static_cast<FramePool *>(opaque)->allocations++;
+	return av_buffer_alloc(size);
+}
+
+bool FramePool::Init(AVPixelFormat fmt, int w, int h)
+{
+	Reset();
+
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+	if (!desc || w <= 0 || h <= 0)
+		return false;
+	if (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))
+		return false;
+
+	int lines[4];
+	if (av_image_fill_linesizes(lines, fmt, FFALIGN(w, kPoolAlign)) < 0)
+		return false;
+
+	ptrdiff_t strides[4];
+	for (size_t i = 0; i < 4; i++) {
+		linesize[i] = FFALIGN(lines[i], kPoolAlign);
+		strides[i] = linesize[i];
+	}
+
+	size_t sizes[4];
+	if (av_image_fill_plane_sizes(sizes, fmt, h, strides) < 0)
+		return false;
+
+	for (size_t i = 0; i < 4 && sizes[i]; i++) {
+		pools[i] = av_buffer_pool_init2(sizes[i] + kPoolPadding, this,
+						Alloc, nullptr);
+		if (!pools[i]) {
+			Reset();
+			return false;
+		}
+	}
+
+	format = fmt;
+	width = w;
+	height = h;
+	return true;
+}
+
+bool FramePool::Get(AVFrame *frame, AVCodecContext *ctx)
+{
+	int w = frame->width;
+	int h = frame->height;
+
+	if (ctx) {
+		int align[AV_NUM_DATA_POINTERS];
+		avcodec_align_dimensions2(ctx, &w, &h, align);
+	}
+
+	lock_guard lock(mutex);
+
+	if (frame->format != format || w != width || h != height) {
+		if (!Init((AVPixelFormat)frame->format, w, h))
+			return false;
+	}
+
+	for (size_t i = 0; i < 4 && pools[i]; i++) {
+		frame->buf[i] = av_buffer_pool_get(pools[i]);
+		if (!frame->buf[i]) {
+			for (size_t j = 0; j < i; j++)
+				av_buffer_unref(&frame->buf[j]);
+			return false;
+		}
+
+		frame->data[i] = frame->buf[i]->data;
+		frame->linesize[i] = linesize[i];
+	}
+
+	frame->extended_data = frame->data;
+	return true;
+}
+
+void FramePool::Prewarm(AVPixelFormat fmt, int w, int h, int count)
+{
+	vector<AVFrame *> frames;
+
+	/* Buffers returned to the pool stay allocated for later use */
+	for (int i = 0; i < count; i++) {
+		AVFrame *frame = av_frame_alloc();
+		frame->format = fmt;
+		frame->width = w;
+		frame->height = h;
+
+		if (!Get(frame)) {
+			av_frame_free(&frame);
+			break;
+		}
+
+		frames.push_back(frame);
+	}
+
+	for (AVFrame *frame : frames)
+		av_frame_free(&frame);
+}
+
+void FramePool::Reset()
 {
-	AVCodecID codec_id = NameToAVCodecID(obs_encoder_get_codec(enc));
+	/* Outstanding buffers keep their pool alive until released */
+	for (AVBufferPool *&pool : pools)
+		av_buffer_pool_uninit(&pool);
+
+	format = AV_PIX_FMT_NONE;
+	width = 0;
+	height = 0;
+}
+
+static int GetPooledBuffer(AVCodecContext *ctx, AVFrame *frame, int flags)
+{
+	auto pool = static_cast<FramePool *>(ctx->opaque);
+
+	if (!pool || ctx->hw_frames_ctx ||
+	    !(ctx->codec->capabilities & AV_CODEC_CAP_DR1))
+		return avcodec_default_get_buffer2(ctx, frame, flags);
+
+	if (!pool->Get(frame, ctx))
+		return avcodec_default_get_buffer2(ctx, frame, flags);
+
+	return 0;
+}
+
+/*
+ * Decoding
+ */
+
+bool CreateCodecContext(AVCodecContext **ctx, const char *codec_name,
+			int width, int height, video_format format)
+{
+	AVCodecID codec_id = NameToAVCodecID(codec_name);
 	const AVCodec *codec = avcodec_find_decoder(codec_id);
 	if (!codec)
 		return false;
 
 	*ctx = avcodec_alloc_context3(codec);
 
-	(*ctx)->width = obs_encoder_get_width(enc);
-	(*ctx)->height = obs_encoder_get_height(enc);
+	(*ctx)->width = width;
+	(*ctx)->height = height;
+
+	FramePool *pool = new FramePool();
+	(*ctx)->opaque = pool;
+	(*ctx)->get_buffer2 = GetPooledBuffer;
+
+	/* Per-block QPs for the heatmap overlay, if the decoder supports it */
+	(*ctx)->export_side_data |= AV_CODEC_EXPORT_DATA_VIDEO_ENC_PARAMS;
 
 	if (int ret = avcodec_open2(*ctx, codec, nullptr)) {
 		log_av_error("avcodec_open2", ret);
-		avcodec_free_context(ctx);
+		DestroyCodecContext(ctx);
 		return false;
 	}
 
+	/* Allocate planes up front if we can guess what the decoder outputs */
+	AVPixelFormat decoded = OBSFormatToDecodedFormat(format);
+	if (decoded != AV_PIX_FMT_NONE) {
+		int align[AV_NUM_DATA_POINTERS];
+		(*ctx)->pix_fmt = decoded;
+		avcodec_align_dimensions2(*ctx, &width, &height, align);
+		pool->Prewarm(decoded, width, height, kPoolPrewarm);
+	}
+
 	return true;
 }
 
+bool CreateCodecContext(AVCodecContext **ctx, obs_encoder_t *enc)
+{
+	video_format format = obs_encoder_get_preferred_video_format(enc);
+	if (format == VIDEO_FORMAT_NONE)
+		format = video_output_get_format(obs_encoder_video(enc));
+
+	return CreateCodecContext(ctx, obs_encoder_get_codec(enc),
+				  (int)obs_encoder_get_width(enc),
+				  (int)obs_encoder_get_height(enc), format);
+}
+
+void DestroyCodecContext(AVCodecContext **ctx)
+{
+	if (!*ctx)
+		return;
+
+	auto pool = static_cast<FramePool *>((*ctx)->opaque);
+	avcodec_free_context(ctx);
+	delete pool;
+}
+
 bool SendExtraData(AVCodecContext *ctx, obs_encoder_t *enc)
 {
 	encoder_packet packet = {};
@@ -130,19 +343,27 @@ bool SendExtraData(AVCodecContext *ctx, obs_encoder_t *enc)
 		return true;
 	}
 
+	return SendExtraData(ctx, packet.data, packet.size);
+}
+
+bool SendExtraData(AVCodecContext *ctx, uint8_t *data, size_t size)
+{
+	if (!size)
+		return true;
+
 	AVPacket av_packet = {};
-	av_packet.size = static_cast<int>(packet.size);
-	av_packet.data = packet.data;
+	av_packet.size = static_cast<int>(size);
+	av_packet.data = data;
 
-	return avcodec_send_packet(ctx, &av_packet) != 0;
+	return avcodec_send_packet(ctx, &av_packet) == 0;
 }
 
 bool SendPacket(AVCodecContext *ctx, const encoder_packet *pkt)
 {
 	AVPacket av_packet = {};
 	av_packet.size = static_cast<int>(pkt->size);
-	av_packet.pts = static_cast<int>(pkt->pts);
-	av_packet.dts = static_cast<int>(pkt->dts);
+	av_packet.pts = pkt->pts;
+	av_packet.dts = pkt->dts;
 	av_packet.data = pkt->data;
 
 	if (int ret = avcodec_send_packet(ctx, &av_packet)) {
@@ -153,6 +374,16 @@ bool SendPacket(AVCodecContext *ctx, const encoder_packet *pkt)
 	return true;
 }
 
+bool DrainDecoder(AVCodecContext *ctx)
+{
+	if (int ret = avcodec_send_packet(ctx, nullptr)) {
+		log_av_error("avcodec_send_packet", ret);
+		return false;
+	}
+
+	return true;
+}
+
 bool ReceiveFrame(AVCodecContext *ctx, AVFrame *frame)
 {
 	int ret = avcodec_receive_frame(ctx, frame);
@@ -160,8 +391,8 @@ bool ReceiveFrame(AVCodecContext *ctx, AVFrame *frame)
 	if (!ret)
 		return true;
 
-	// EAGAIN isn't a failure, just needs more data
-	if (ret != AVERROR(EAGAIN)) {
+	// EAGAIN isn't a failure, just needs more data, EOF means drained
+	if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
 		log_av_error("avcodec_receive_frame", ret);
 		return false;
 	}
@@ -217,3 +448,53 @@ void AVFrameToSourceFrame(obs_source_frame *dst, AVFrame *src,
 		dst->linesize[i] = abs(src->linesize[i]);
 	}
 }
+
+int ExtractQpMap(const AVFrame *frame, BlockMap &map)
+{
+	const AVFrameSideData *sd =
+		av_frame_get_side_data(frame, AV_FRAME_DATA_VIDEO_ENC_PARAMS);
+	if (!sd)
+		return 0;
+
+	auto par = reinterpret_cast<AVVideoEncParams *>(sd->data);
+	const int max_qp = par->type == AV_VIDEO_ENC_PARAMS_H264 ? 51 : 255;
+
+	/* Some decoders only export a frame-level QP */
+	if (!par->nb_blocks) {
+		uint32_t block = std::max(frame->width, frame->height);
+		map.Reset(frame->width, frame->height, block);
+		map.values.assign(map.values.size(), (float)par->qp);
+		return max_qp;
+	}
+
+	/* Use the smallest block as the grid so every block maps onto
+	 * whole cells, for H.264 this is simply the macroblock grid. */
+	uint32_t block = UINT32_MAX;
+	for (unsigned int i = 0; i < par->nb_blocks; i++) {
+		AVVideoBlockParams *b = av_video_enc_params_block(par, i);
+		block = std::min({block, (uint32_t)b->w, (uint32_t)b->h});
+	}
+
+	map.Reset(frame->width, frame->height, std::max(block, 4U));
+
+	for (unsigned int i = 0; i < par->nb_blocks; i++) {
+		AVVideoBlockParams *b = av_video_enc_params_block(par, i);
+		float qp = (float)(par->qp + b->delta_qp);
+
+		uint32_t col_end = std::min(
+			(b->src_x + b->w + map.block_size - 1) / map.block_size,
+			map.cols);
+		uint32_t row_end = std::min(
+			(b->src_y + b->h + map.block_size - 1) / map.block_size,
+			map.rows);
+
+		for (uint32_t row = b->src_y / map.block_size; row < row_end;
+		     row++) {
+			for (uint32_t col = b->src_x / map.block_size;
+			     col < col_end; col++)
+				map.At(col, row) = qp;
+		}
+	}
+
+	return max_qp;
+}
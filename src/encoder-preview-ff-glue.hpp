@@ -2,14 +2,68 @@
 
 #include <obs-module.h>
 
+#include <atomic>
+#include <mutex>
+
 extern "C" {
 #include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
 }
 
+/* Pool of aligned, reusable plane buffers. Installed as the decoder's
+ * get_buffer2 callback so that steady-state decoding does not allocate. */
+class FramePool {
+public:
+	FramePool() = default;
+	~FramePool() { Reset(); }
+
+	FramePool(const FramePool &) = delete;
+	FramePool &operator=(const FramePool &) = delete;
+
+	/* Attach pooled buffers to frame, format/width/height must be set.
+	 * If ctx is set its alignment requirements are respected. */
+	bool Get(AVFrame *frame, AVCodecContext *ctx = nullptr);
+	void Prewarm(AVPixelFormat format, int width, int height, int count);
+	void Reset();
+
+	uint64_t Allocations() const { return allocations; }
+
+private:
+	bool Init(AVPixelFormat format, int width, int height);
+	static AVBufferRef *Alloc(void *opaque, size_t size);
+
+	std::mutex mutex;
+	AVBufferPool *pools[4] = {};
+	int linesize[4] = {};
+
+	AVPixelFormat format = AV_PIX_FMT_NONE;
+	int width = 0;
+	int height = 0;
+
+	std::atomic<uint64_t> allocations = 0;
+};
+
+video_format AVPixelFormatToOBSFormat(int f);
+void log_av_error(const char *method, int ret);
+
 bool CreateCodecContext(AVCodecContext **ctx, obs_encoder_t *enc);
+/* Without an encoder, format is what the encoder was fed if known */
+bool CreateCodecContext(AVCodecContext **ctx, const char *codec, int width,
+			int height, video_format format);
+void DestroyCodecContext(AVCodecContext **ctx);
 bool SendExtraData(AVCodecContext *ctx, obs_encoder_t *enc);
+bool SendExtraData(AVCodecContext *ctx, uint8_t *data, size_t size);
 bool SendPacket(AVCodecContext *ctx, const encoder_packet *pkt);
+/* Makes the decoder output everything it holds back, it has to be flushed
+ * before taking new packets afterwards. */
+bool DrainDecoder(AVCodecContext *ctx);
 bool ReceiveFrame(AVCodecContext *ctx, AVFrame *frame);
 
 void AVFrameToSourceFrame(obs_source_frame *dst, AVFrame *src,
 			  AVRational time_base);
+
+struct BlockMap;
+
+/* Fills map with per-block QPs exported by the decoder, returns the
+ * largest QP the codec can signal or 0 if the frame has none. */
+int ExtractQpMap(const AVFrame *frame, BlockMap &map);
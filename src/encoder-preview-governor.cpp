@@ -0,0 +1,334 @@
+#include "encoder-preview-governor.hpp"
+
+#include <obs.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#include <pthread/qos.h>
+#include <time.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static constexpr uint64_t kInterval = 1000000000;
+/* Calm intervals before stepping back up, doubled up to the maximum
+ * whenever that had to be undone right away */
+static constexpr uint32_t kCalmIntervals = 5;
+static constexpr uint32_t kMaxCalmIntervals = 80;
+/* Below this share of the budget decoding is considered relaxed */
+static constexpr double kHeadroom = 0.7;
+
+static const char *LevelName(DecodeGovernor::Level level)
+{
+	switch (level) {
+	case DecodeGovernor::LevelFull:
+		return "full";
+	case DecodeGovernor::LevelReferenceOnly:
+		return "reference frames only";
+	case DecodeGovernor::LevelKeyframesOnly:
+		return "keyframes only";
+	}
+	return "unknown";
+}
+
+/*
+ * Thread policy
+ */
+
+#if defined(_WIN32)
+
+bool ApplyThreadPolicy(const ThreadPolicy &policy)
+{
+	static const int priorities[] = {
+		THREAD_PRIORITY_NORMAL,
+		THREAD_PRIORITY_BELOW_NORMAL,
+		THREAD_PRIORITY_LOWEST,
+		THREAD_PRIORITY_IDLE,
+	};
+
+	HANDLE thread = GetCurrentThread();
+	bool success = !!SetThreadPriority(thread, priorities[policy.priority]);
+
+	DWORD_PTR process_mask, system_mask;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask,
+				    &system_mask))
+		return false;
+
+	DWORD_PTR mask = process_mask;
+	if (policy.affinity)
+		mask &= (DWORD_PTR)policy.affinity;
+
+	return SetThreadAffinityMask(thread, mask) != 0 && success;
+}
+
+uint64_t ThreadCpuTimeNs()
+{
+	FILETIME creation, exit, kernel, user;
+	if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel,
+			    &user))
+		return 0;
+
+	auto ticks = [](const FILETIME &time) {
+		return ((uint64_t)time.dwHighDateTime << 32) |
+		       time.dwLowDateTime;
+	};
+	return (ticks(kernel) + ticks(user)) * 100;
+}
+
+#elif defined(__APPLE__)
+
+/* There is no way to pin threads, quality of service classes take the
+ * place of priorities. */
+bool ApplyThreadPolicy(const ThreadPolicy &policy)
+{
+	static const qos_class_t classes[] = {
+		QOS_CLASS_DEFAULT,
+		QOS_CLASS_UTILITY,
+		QOS_CLASS_UTILITY,
+		QOS_CLASS_BACKGROUND,
+	};
+
+	bool success = pthread_set_qos_class_self_np(
+			       classes[policy.priority], 0) == 0;
+	return success && !policy.affinity;
+}
+
+uint64_t ThreadCpuTimeNs()
+{
+	timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+#else
+
+bool ApplyThreadPolicy(const ThreadPolicy &policy)
+{
+	static const int nice_levels[] = {0, 5, 10, 19};
+
+	bool success = true;
+
+	/* SCHED_IDLE only runs the thread when nothing else wants the CPU,
+	 * the nice value still applies once it is left again. */
+	sched_param param = {};
+	int sched = SCHED_OTHER;
+	if (policy.priority == ThreadPolicy::PriorityIdle)
+		sched = SCHED_IDLE;
+
+	if (pthread_setschedparam(pthread_self(), sched, &param) != 0)
+		success = false;
+
+	/* Nice values are per thread on Linux */
+	auto tid = (id_t)syscall(SYS_gettid);
+	if (setpriority(PRIO_PROCESS, tid, nice_levels[policy.priority]) != 0)
+		success = false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!policy.affinity ||
+		    (cpu < 64 && (policy.affinity >> cpu) & 1))
+			CPU_SET(cpu, &set);
+	}
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		success = false;
+
+	return success;
+}
+
+uint64_t ThreadCpuTimeNs()
+{
+	timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+#endif
+
+bool ParseCpuList(const string &text, uint64_t &mask)
+{
+	uint64_t result = 0;
+	const char *pos = text.c_str();
+
+	auto skip_spaces = [&]() {
+		while (*pos == ' ')
+			pos++;
+	};
+
+	auto number = [&](long &value) {
+		skip_spaces();
+		char *end;
+		errno = 0;
+		value = strtol(pos, &end, 10);
+		if (end == pos || errno || value < 0 || value > 63)
+			return false;
+		pos = end;
+		skip_spaces();
+		return true;
+	};
+
+	skip_spaces();
+	while (*pos) {
+		long first, last;
+		if (!number(first))
+			return false;
+
+		last = first;
+		if (*pos == '-') {
+			pos++;
+			if (!number(last) || last < first)
+				return false;
+		}
+
+		for (long cpu = first; cpu <= last; cpu++)
+			result |= 1ULL << cpu;
+
+		if (*pos == ',')
+			pos++;
+		else if (*pos)
+			return false;
+	}
+
+	mask = result;
+	return true;
+}
+
+/*
+ * Governor
+ */
+
+/* Frames OBS could not render in time or its encoders had to skip */
+static uint32_t LaggedFrames()
+{
+	uint32_t lagged = obs_get_lagged_frames();
+	if (video_t *video = obs_get_video())
+		lagged += video_output_get_skipped_frames(video);
+	return lagged;
+}
+
+DecodeGovernor::DecodeGovernor()
+{
+	Reset();
+}
+
+void DecodeGovernor::Reset()
+{
+	lock_guard lock(mutex);
+
+	level = LevelFull;
+	intervalStart = 0;
+	cpuTime = 0;
+	calm = 0;
+	calmNeeded = kCalmIntervals;
+	lastStepUp = 0;
+	stats = {};
+}
+
+void DecodeGovernor::AddCpuTime(uint64_t cpu_ns)
+{
+	lock_guard lock(mutex);
+	cpuTime += cpu_ns;
+}
+
+DecodeGovernor::Level DecodeGovernor::Update(uint64_t now)
+{
+	lock_guard lock(mutex);
+
+	if (!intervalStart) {
+		intervalStart = now;
+		lastLagged = LaggedFrames();
+		return level;
+	}
+
+	uint64_t elapsed = now - intervalStart;
+	if (elapsed < kInterval)
+		return level;
+
+	uint32_t lagged_total = LaggedFrames();
+	uint32_t lagged = lagged_total - lastLagged;
+	double cpu = (double)cpuTime * 100.0 / (double)elapsed;
+
+	lastLagged = lagged_total;
+	intervalStart = now;
+	cpuTime = 0;
+
+	stats.cpuPercent = cpu;
+	stats.laggedFrames = lagged;
+
+	if (!adaptive) {
+		level = LevelFull;
+		calm = 0;
+		return level;
+	}
+
+	double limit = budget;
+	bool over = (limit > 0.0 && cpu > limit) || lagged;
+	bool relaxed = !lagged && (limit <= 0.0 || cpu < limit * kHeadroom);
+
+	if (over) {
+		if (StepDown(now))
+			blog(LOG_INFO,
+			     "Decoding at %.0f%% CPU with %u lagged frames, "
+			     "now decoding %s",
+			     cpu, lagged, LevelName(level));
+	} else if (!relaxed) {
+		calm = 0;
+	} else if (++calm >= calmNeeded && level != LevelFull) {
+		StepUp(now);
+		blog(LOG_INFO, "Decoding calmed down, now decoding %s",
+		     LevelName(level));
+	}
+
+	return level;
+}
+
+bool DecodeGovernor::StepDown(uint64_t now)
+{
+	calm = 0;
+
+	if (level == LevelKeyframesOnly)
+		return false;
+
+	/* Stepping up did not pay off, wait longer before the next try */
+	if (lastStepUp && now - lastStepUp <= 2 * kInterval)
+		calmNeeded = min(calmNeeded * 2, kMaxCalmIntervals);
+	else
+		calmNeeded = kCalmIntervals;
+
+	level = (Level)(level + 1);
+	stats.stepsDown++;
+	return true;
+}
+
+void DecodeGovernor::StepUp(uint64_t now)
+{
+	calm = 0;
+	level = (Level)(level - 1);
+	lastStepUp = now;
+}
+
+DecodeGovernor::Stats DecodeGovernor::GetStats()
+{
+	lock_guard lock(mutex);
+
+	Stats ret = stats;
+	ret.level = level;
+	return ret;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/* How the OS should schedule the decode workers */
+struct ThreadPolicy {
+	enum Priority {
+		PriorityNormal,
+		PriorityLow,
+		PriorityLowest,
+		PriorityIdle,
+	};
+
+	Priority priority = PriorityNormal;
+	/* Bit n allows CPU n, 0 for no restriction */
+	uint64_t affinity = 0;
+
+	bool operator==(const ThreadPolicy &other) const
+	{
+		return priority == other.priority && affinity == other.affinity;
+	}
+	bool operator!=(const ThreadPolicy &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+/* Applies the policy to the calling thread. Going back to a higher
+ * priority may need privileges we do not have, false if any part of the
+ * policy could not be applied. */
+bool ApplyThreadPolicy(const ThreadPolicy &policy);
+
+/* Parses CPU lists like "0-3,6", an empty list means no restriction */
+bool ParseCpuList(const std::string &text, uint64_t &mask);
+
+/* CPU time the calling thread has used so far */
+uint64_t ThreadCpuTimeNs();
+
+/* Keeps a decoder within a CPU budget. While the decoder uses more than
+ * its budget, or OBS starts lagging behind on rendering or encoding, it
+ * steps down to cheaper decoding and later back up once things stayed calm
+ * for a while. Fed and queried by the decoding thread only, configuration
+ * and stats may be accessed from anywhere. */
+class DecodeGovernor {
+public:
+	enum Level {
+		/* Everything is decoded and presented */
+		LevelFull,
+		/* Frames nothing refers to are dropped, the loop filter is
+		 * skipped */
+		LevelReferenceOnly,
+		/* Only keyframes are sent to the decoder */
+		LevelKeyframesOnly,
+	};
+
+	struct Stats {
+		/* Of one core, during the last interval */
+		double cpuPercent = 0.0;
+		Level level = LevelFull;
+		/* Frames OBS lagged or skipped during the last interval */
+		uint32_t laggedFrames = 0;
+		uint64_t stepsDown = 0;
+	};
+
+	DecodeGovernor();
+
+	/* Percent of one core, 0 for no limit */
+	void SetBudget(double percent) { budget = percent; }
+	/* Without adaptation everything is decoded, usage is still measured */
+	void SetAdaptive(bool enable) { adaptive = enable; }
+
+	/* Forgets the history, for a new stream */
+	void Reset();
+
+	void AddCpuTime(uint64_t cpu_ns);
+	/* Evaluates the last interval once it is over */
+	Level Update(uint64_t now);
+	Level GetLevel() const { return level; }
+
+	Stats GetStats();
+
+private:
+	bool StepDown(uint64_t now);
+	void StepUp(uint64_t now);
+
+	std::atomic<double> budget = 0.0;
+	std::atomic_bool adaptive = false;
+
+	std::mutex mutex;
+	std::atomic<Level> level = LevelFull;
+	uint64_t intervalStart = 0;
+	uint64_t cpuTime = 0;
+	uint32_t lastLagged = 0;
+	/* Intervals in a row without pressure */
+	uint32_t calm = 0;
+	/* Grows when stepping up had to be undone right away */
+	uint32_t calmNeeded = 0;
+	uint64_t lastStepUp = 0;
+	Stats stats;
+};
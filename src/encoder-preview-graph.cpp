@@ -0,0 +1,202 @@
+#include "encoder-preview-graph.hpp"
+
+#include <QPainter>
+#include <QPainterPath>
+
+#include <algorithm>
+#include <cmath>
+
+StatsGraph::StatsGraph(QWidget *parent, Mode mode)
+	: QWidget(parent),
+	  mode(mode)
+{
+	setMinimumHeight(80);
+	setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Preferred);
+}
+
+int StatsGraph::AddSeries(const QString &name, const QColor &color)
+{
+	series.push_back({name, color, {}});
+	return (int)series.size() - 1;
+}
+
+void StatsGraph::AddSample(int idx, double value)
+{
+	auto &values = series[idx].values;
+	values.push_back(value);
+	while (values.size() > capacity)
+		values.pop_front();
+
+	update();
+}
+
+void StatsGraph::SetBars(int idx, const std::vector<double> &values)
+{
+	series[idx].values.assign(values.begin(), values.end());
+	update();
+}
+
+void StatsGraph::SetBarLabels(const QStringList &labels)
+{
+	barLabels = labels;
+	update();
+}
+
+void StatsGraph::SetRange(double min, double max)
+{
+	rangeMin = min;
+	rangeMax = max;
+	update();
+}
+
+void StatsGraph::SetCapacity(size_t samples)
+{
+	capacity = std::max<size_t>(samples, 2);
+}
+
+void StatsGraph::SetUnit(const QString &text)
+{
+	unit = text;
+}
+
+void StatsGraph::Clear()
+{
+	for (Series &s : series)
+		s.values.clear();
+
+	update();
+}
+
+void StatsGraph::GetRange(double &min, double &max) const
+{
+	if (rangeMin != rangeMax) {
+		min = rangeMin;
+		max = rangeMax;
+		return;
+	}
+
+	min = mode == Bars ? 0.0 : INFINITY;
+	max = -INFINITY;
+
+	for (const Series &s : series) {
+		for (double value : s.values) {
+			if (!std::isfinite(value))
+				continue;
+			min = std::min(min, value);
+			max = std::max(max, value);
+		}
+	}
+
+	if (!std::isfinite(min) || !std::isfinite(max)) {
+		min = 0.0;
+		max = 1.0;
+	} else if (max - min < 1e-9) {
+		max = min + 1.0;
+	}
+}
+
+void StatsGraph::paintEvent(QPaintEvent *)
+{
+	QPainter painter(this);
+	painter.setRenderHint(QPainter::Antialiasing);
+
+	const QPalette &pal = palette();
+	painter.fillRect(rect(), pal.color(QPalette::Base));
+
+	const QFontMetrics fm = painter.fontMetrics();
+	const int labelHeight = fm.height();
+	const QRectF area = QRectF(rect()).adjusted(
+		4, labelHeight + 2, -4, mode == Bars ? -labelHeight - 2 : -4);
+
+	double min, max;
+	GetRange(min, max);
+
+	auto toY = [&](double value) {
+		double t = std::clamp((value - min) / (max - min), 0.0, 1.0);
+		return area.bottom() - t * area.height();
+	};
+
+	/* Legend and range */
+	int x = 4;
+	for (const Series &s : series) {
+		QString text = s.name;
+		if (mode == Lines && !s.values.empty())
+			text += QString(": %1%2")
+					.arg(s.values.back(), 0, 'f', 2)
+					.arg(unit);
+
+		painter.setPen(s.color);
+		painter.drawText(x, fm.ascent() + 1, text);
+		x += fm.horizontalAdvance(text) + 12;
+	}
+
+	painter.setPen(pal.color(QPalette::Mid));
+	painter.drawRect(area);
+
+	QString maxText = QString("%1%2").arg(max, 0, 'g', 4).arg(unit);
+	painter.drawText(QPointF(area.right() - fm.horizontalAdvance(maxText) - 2,
+				 area.top() + fm.ascent()),
+			 maxText);
+
+	if (mode == Lines) {
+		const double step = area.width() / (double)(capacity - 1);
+
+		for (const Series &s : series) {
+			QPainterPath path;
+			bool started = false;
+			double px = area.right() -
+				    step * (double)(s.values.size() - 1);
+
+			for (double value : s.values) {
+				if (std::isfinite(value)) {
+					QPointF pt(px, toY(value));
+					if (started)
+						path.lineTo(pt);
+					else
+						path.moveTo(pt);
+					started = true;
+				}
+				px += step;
+			}
+
+			painter.setPen(QPen(s.color, 1.5));
+			painter.drawPath(path);
+		}
+
+		return;
+	}
+
+	/* Bars, series are drawn next to each other within a slot */
+	size_t slots = 0;
+	for (const Series &s : series)
+		slots = std::max(slots, s.values.size());
+	if (!slots || series.empty())
+		return;
+
+	const double slotWidth = area.width() / (double)slots;
+	const double barWidth = slotWidth / (double)series.size();
+
+	for (size_t si = 0; si < series.size(); si++) {
+		const Series &s = series[si];
+
+		for (size_t idx = 0; idx < s.values.size(); idx++) {
+			double top = toY(s.values[idx]);
+			QRectF bar(area.left() + slotWidth * (double)idx +
+					   barWidth * (double)si,
+				   top, std::max(barWidth - 1.0, 1.0),
+				   area.bottom() - top);
+			painter.fillRect(bar, s.color);
+		}
+	}
+
+	painter.setPen(pal.color(QPalette::Text));
+	const int labelStep = std::max(
+		1, (int)std::ceil(fm.horizontalAdvance("0000") / slotWidth));
+
+	for (int idx = 0; idx < barLabels.size() && idx < (int)slots;
+	     idx += labelStep) {
+		painter.drawText(QPointF(area.left() + slotWidth * idx,
+					 area.bottom() + fm.ascent() + 1),
+				 barLabels[idx]);
+	}
+}
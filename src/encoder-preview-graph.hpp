@@ -0,0 +1,55 @@
+#pragma once
+
+#include <QColor>
+#include <QStringList>
+#include <QWidget>
+
+#include <deque>
+#include <vector>
+
+/* Minimal graph widget for the preview statistics, either as a running
+ * line graph or as bars (e.g. histograms). */
+class StatsGraph : public QWidget {
+	Q_OBJECT
+
+public:
+	enum Mode { Lines, Bars };
+
+	explicit StatsGraph(QWidget *parent = nullptr, Mode mode = Lines);
+
+	int AddSeries(const QString &name, const QColor &color);
+	/* Lines: append a sample, dropping the oldest beyond the capacity */
+	void AddSample(int series, double value);
+	/* Bars: replace all values of a series */
+	void SetBars(int series, const std::vector<double> &values);
+	void SetBarLabels(const QStringList &labels);
+
+	/* Fixed value range, automatic if min == max */
+	void SetRange(double min, double max);
+	void SetCapacity(size_t samples);
+	void SetUnit(const QString &unit);
+	void Clear();
+
+	QSize sizeHint() const override { return QSize(320, 120); }
+
+protected:
+	void paintEvent(QPaintEvent *event) override;
+
+private:
+	struct Series {
+		QString name;
+		QColor color;
+		std::deque<double> values;
+	};
+
+	void GetRange(double &min, double &max) const;
+
+	Mode mode;
+	std::vector<Series> series;
+	QStringList barLabels;
+	QString unit;
+
+	double rangeMin = 0.0;
+	double rangeMax = 0.0;
+	size_t capacity = 300;
+};
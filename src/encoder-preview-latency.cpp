@@ -0,0 +1,196 @@
+#include "encoder-preview-latency.hpp"
+
+#include <util/base.h>
+#include <util/platform.h>
+
+#include <cinttypes>
+#include <cstdio>
+
+using namespace std;
+
+/* Well beyond any encoder's lookahead plus the decoder queue */
+static constexpr size_t kMaxPending = 600;
+/* Five minutes at 60 fps for the export */
+static constexpr size_t kMaxSamples = 18000;
+
+static const char *kStageNames[] = {"encode_ms", "queue_ms", "decode_ms",
+				    "present_ms", "total_ms"};
+
+template<typename Key, typename Value>
+static void Trim(map<Key, Value> &pending)
+{
+	while (pending.size() > kMaxPending)
+		pending.erase(pending.begin());
+}
+
+static int64_t Elapsed(uint64_t from, uint64_t to)
+{
+	return ((int64_t)to - (int64_t)from) / 1000;
+}
+
+LatencyTracker::LatencyTracker()
+{
+	for (int stage = 0; stage < StageCount; stage++)
+		stats.stages.push_back(MakeHistogram((Stage)stage));
+}
+
+Histogram LatencyTracker::MakeHistogram(Stage stage)
+{
+	/* 1 ms buckets for our own stages, encoders may take a second */
+	switch (stage) {
+	case StageEncode:
+		return Histogram(0, 1000000, 200);
+	case StageTotal:
+		return Histogram(0, 2000000, 200);
+	default:
+		return Histogram(0, 100000, 100);
+	}
+}
+
+void LatencyTracker::Reset()
+{
+	lock_guard lock(mutex);
+
+	arrivals.clear();
+	decoding.clear();
+	presenting.clear();
+	lastOutput = 0;
+
+	for (Histogram &histogram : stats.stages)
+		histogram.Clear();
+	samples.clear();
+}
+
+void LatencyTracker::PacketArrived(int64_t pts, uint64_t time)
+{
+	lock_guard lock(mutex);
+	arrivals[pts] = time;
+	Trim(arrivals);
+}
+
+void LatencyTracker::DecodeStarted(int64_t pts, uint64_t capture_ts,
+				   uint64_t time)
+{
+	lock_guard lock(mutex);
+
+	auto arrival = arrivals.find(pts);
+	if (arrival == arrivals.end())
+		return;
+
+	Pending &pending = decoding[pts];
+	pending.capture = capture_ts;
+	pending.arrival = arrival->second;
+	pending.decodeStart = time;
+
+	/* Decode order is not PTS order, only this one is done */
+	arrivals.erase(arrival);
+	Trim(decoding);
+}
+
+void LatencyTracker::FrameDecoded(int64_t pts, uint64_t capture_ts,
+				  uint64_t time)
+{
+	lock_guard lock(mutex);
+
+	auto it = decoding.find(pts);
+	if (it == decoding.end())
+		return;
+
+	Pending pending = it->second;
+	pending.decoded = time;
+	decoding.erase(it);
+
+	/* The decoder's idea of the capture time wins, it is what the
+	 * scheduler and the source see. */
+	presenting[capture_ts] = pending;
+	Trim(presenting);
+}
+
+void LatencyTracker::FrameDrawn(uint64_t time)
+{
+	uint64_t capture_ts = lastOutput;
+	if (capture_ts == lastDrawn)
+		return;
+
+	lastDrawn = capture_ts;
+
+	lock_guard lock(mutex);
+
+	auto it = presenting.find(capture_ts);
+	if (it == presenting.end())
+		return;
+
+	const Pending &pending = it->second;
+
+	Sample sample;
+	sample.capture = pending.capture;
+	sample.stages[StageEncode] = Elapsed(pending.capture, pending.arrival);
+	sample.stages[StageQueue] =
+		Elapsed(pending.arrival, pending.decodeStart);
+	sample.stages[StageDecode] =
+		Elapsed(pending.decodeStart, pending.decoded);
+	sample.stages[StagePresent] = Elapsed(pending.decoded, time);
+	sample.stages[StageTotal] = Elapsed(pending.capture, time);
+
+	/* Frames leave the decoder in order, older ones were dropped before
+	 * they could be shown. */
+	presenting.erase(presenting.begin(), ++it);
+
+	AddSample(sample);
+}
+
+void LatencyTracker::AddSample(const Sample &sample)
+{
+	for (int stage = 0; stage < StageCount; stage++)
+		stats.stages[stage].Add(sample.stages[stage]);
+
+	if (samples.size() >= kMaxSamples)
+		samples.pop_front();
+	samples.push_back(sample);
+}
+
+LatencyTracker::Stats LatencyTracker::TakeStats()
+{
+	lock_guard lock(mutex);
+
+	Stats ret = stats;
+	for (Histogram &histogram : stats.stages)
+		histogram.Clear();
+
+	return ret;
+}
+
+bool LatencyTracker::ExportCsv(const string &path)
+{
+	deque<Sample> copy;
+
+	mutex.lock();
+	copy = samples;
+	mutex.unlock();
+
+	FILE *file = os_fopen(path.c_str(), "w");
+	if (!file) {
+		blog(LOG_WARNING, "Failed to open '%s' for writing",
+		     path.c_str());
+		return false;
+	}
+
+	fprintf(file, "capture_ns");
+	for (const char *name : kStageNames)
+		fprintf(file, ",%s", name);
+	fprintf(file, "\n");
+
+	for (const Sample &sample : copy) {
+		fprintf(file, "%" PRIu64, sample.capture);
+		for (int64_t duration : sample.stages)
+			fprintf(file, ",%.3f", (double)duration / 1000.0);
+		fprintf(file, "\n");
+	}
+
+	bool success = !ferror(file);
+	fclose(file);
+
+	blog(LOG_INFO, "Exported latency of %zu frames to '%s'", copy.size(),
+	     path.c_str());
+	return success;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "encoder-preview-stats.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Follows frames from capture to the display and splits the time they
+ * took into stages:
+ *
+ *  - encode:  raw frame capture until its packet reached the output,
+ *             including the encoder's lookahead and reordering delay
+ *  - queue:   packet arrival until the decoder got to it
+ *  - decode:  packet sent to the decoder until its frame came out
+ *  - present: frame decoded until it was first drawn by the preview
+ *
+ * All times are in os_gettime_ns() time, packets are matched to frames by
+ * PTS and frames to draws by their capture time. */
+class LatencyTracker {
+public:
+	enum Stage {
+		StageEncode,
+		StageQueue,
+		StageDecode,
+		StagePresent,
+		StageTotal,
+		StageCount
+	};
+
+	/* One frame that made it to the display, durations in µs */
+	struct Sample {
+		uint64_t capture = 0;
+		int64_t stages[StageCount] = {};
+	};
+
+	struct Stats {
+		/* Durations in µs since the last call, one per stage */
+		std::vector<Histogram> stages;
+	};
+
+	LatencyTracker();
+
+	void Reset();
+
+	/* Output thread */
+	void PacketArrived(int64_t pts, uint64_t time);
+	/* Decoder, capture_ts is the raw frame's timestamp */
+	void DecodeStarted(int64_t pts, uint64_t capture_ts, uint64_t time);
+	void FrameDecoded(int64_t pts, uint64_t capture_ts, uint64_t time);
+	/* Frame handed to the source, shown by the next draw */
+	void FrameOutput(uint64_t capture_ts) { lastOutput = capture_ts; }
+	/* Graphics thread, after drawing the source */
+	void FrameDrawn(uint64_t time);
+
+	Stats TakeStats();
+
+	/* Writes the most recent frames, one per line */
+	bool ExportCsv(const std::string &path);
+
+private:
+	struct Pending {
+		uint64_t capture = 0;
+		uint64_t arrival = 0;
+		uint64_t decodeStart = 0;
+		uint64_t decoded = 0;
+	};
+
+	static Histogram MakeHistogram(Stage stage);
+	void AddSample(const Sample &sample);
+
+	std::mutex mutex;
+
+	/* Keyed by PTS until decoded, by capture time afterwards. Frames
+	 * that never make it are pushed out by newer ones. */
+	std::map<int64_t, uint64_t> arrivals;
+	std::map<int64_t, Pending> decoding;
+	std::map<uint64_t, Pending> presenting;
+
+	std::atomic<uint64_t> lastOutput = 0;
+	/* Graphics thread only */
+	uint64_t lastDrawn = 0;
+
+	Stats stats;
+	std::deque<Sample> samples;
+};
@@ -0,0 +1,455 @@
+#include "encoder-preview-metrics.hpp"
+
+#include <util/platform.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define METRICS_SSE2
+#endif
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+using namespace std;
+
+/* Only every n-th canvas frame is analysed, comparing every frame at 4K
+ * would cost more than the decode itself. */
+static constexpr uint64_t kAnalysisInterval = 6;
+/* Raw frames have to be held until the encoded version is decoded, this
+ * covers ~2.4 s of encoder latency at 60 FPS. */
+static constexpr size_t kRawSlots = 24;
+static constexpr size_t kMaxPendingJobs = 4;
+static constexpr uint32_t kBlockSize = 16;
+static constexpr int kSsimWindow = 8;
+static constexpr size_t kMaxResults = 1024;
+
+/*
+ * Kernels
+ */
+
+uint64_t BlockSSE(const uint8_t *a, int stride_a, const uint8_t *b,
+		  int stride_b, int w, int h)
+{
+	uint64_t sse = 0;
+
+	for (int y = 0; y < h; y++) {
+		const uint8_t *row_a = a + (ptrdiff_t)y * stride_a;
+		const uint8_t *row_b = b + (ptrdiff_t)y * stride_b;
+		int x = 0;
+
+#ifdef METRICS_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		__m128i acc = _mm_setzero_si128();
+
+		for (; x + 16 <= w; x += 16) {
+			__m128i va = _mm_loadu_si128((const __m128i *)(row_a + x));
+			__m128i vb = _mm_loadu_si128((const __m128i *)(row_b + x));
+
+			__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero),
+						   _mm_unpacklo_epi8(vb, zero));
+			__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero),
+						   _mm_unpackhi_epi8(vb, zero));
+
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+		}
+
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4E));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xB1));
+		sse += (uint32_t)_mm_cvtsi128_si32(acc);
+#endif
+
+		for (; x < w; x++) {
+			int d = (int)row_a[x] - (int)row_b[x];
+			sse += (uint64_t)(d * d);
+		}
+	}
+
+	return sse;
+}
+
+SsimStats WindowSsimStats(const uint8_t *a, int stride_a, const uint8_t *b,
+			  int stride_b)
+{
+	SsimStats stats;
+
+#ifdef METRICS_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sums = _mm_setzero_si128();
+	__m128i aa = _mm_setzero_si128();
+	__m128i bb = _mm_setzero_si128();
+	__m128i ab = _mm_setzero_si128();
+
+	for (int y = 0; y < kSsimWindow; y++) {
+		__m128i va = _mm_loadl_epi64(
+			(const __m128i *)(a + (ptrdiff_t)y * stride_a));
+		__m128i vb = _mm_loadl_epi64(
+			(const __m128i *)(b + (ptrdiff_t)y * stride_b));
+
+		/* Low half sums a, high half sums b */
+		sums = _mm_add_epi64(
+			sums, _mm_sad_epu8(_mm_unpacklo_epi64(va, vb), zero));
+
+		__m128i a16 = _mm_unpacklo_epi8(va, zero);
+		__m128i b16 = _mm_unpacklo_epi8(vb, zero);
+
+		aa = _mm_add_epi32(aa, _mm_madd_epi16(a16, a16));
+		bb = _mm_add_epi32(bb, _mm_madd_epi16(b16, b16));
+		ab = _mm_add_epi32(ab, _mm_madd_epi16(a16, b16));
+	}
+
+	auto hsum = [](__m128i v) -> uint32_t {
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4E));
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xB1));
+		return (uint32_t)_mm_cvtsi128_si32(v);
+	};
+
+	stats.a = (uint32_t)_mm_cvtsi128_si32(sums);
+	stats.b = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+	stats.aa = hsum(aa);
+	stats.bb = hsum(bb);
+	stats.ab = hsum(ab);
+#else
+	for (int y = 0; y < kSsimWindow; y++) {
+		const uint8_t *row_a = a + (ptrdiff_t)y * stride_a;
+		const uint8_t *row_b = b + (ptrdiff_t)y * stride_b;
+
+		for (int x = 0; x < kSsimWindow; x++) {
+			uint32_t va = row_a[x];
+			uint32_t vb = row_b[x];
+
+			stats.a += va;
+			stats.b += vb;
+			stats.aa += va * va;
+			stats.bb += vb * vb;
+			stats.ab += va * vb;
+		}
+	}
+#endif
+
+	return stats;
+}
+
+double SsimFromStats(const SsimStats &stats, int samples)
+{
+	static constexpr double c1 = (0.01 * 255.0) * (0.01 * 255.0);
+	static constexpr double c2 = (0.03 * 255.0) * (0.03 * 255.0);
+
+	const double n = (double)samples;
+	const double mu_a = (double)stats.a / n;
+	const double mu_b = (double)stats.b / n;
+	const double var_a = (double)stats.aa / n - mu_a * mu_a;
+	const double var_b = (double)stats.bb / n - mu_b * mu_b;
+	const double covar = (double)stats.ab / n - mu_a * mu_b;
+
+	return ((2.0 * mu_a * mu_b + c1) * (2.0 * covar + c2)) /
+	       ((mu_a * mu_a + mu_b * mu_b + c1) * (var_a + var_b + c2));
+}
+
+double PsnrFromSSE(uint64_t sse, uint64_t samples)
+{
+	/* Identical blocks, cap instead of returning infinity */
+	if (!sse)
+		return 100.0;
+
+	return 10.0 * log10(255.0 * 255.0 * (double)samples / (double)sse);
+}
+
+/*
+ * Analyzer
+ */
+
+bool QualityAnalyzer::Start(obs_encoder_t *enc)
+{
+	Stop();
+
+	video_t *video = obs_encoder_video(enc);
+	const video_output_info *voi = video ? video_output_get_info(video)
+					     : nullptr;
+	if (!voi)
+		return false;
+
+	encoder = enc;
+	width = obs_encoder_get_width(enc);
+	height = obs_encoder_get_height(enc);
+	frameInterval = obs_get_frame_interval_ns();
+	rawFrames = 0;
+	regionsValid = false;
+
+	rawSlots.assign(kRawSlots, RawSlot());
+	rawNext = 0;
+
+	jobs.clear();
+	stopping = false;
+	thread = std::thread(&QualityAnalyzer::Thread, this);
+
+	/* Let libobs scale the canvas to the encoder size on the GPU */
+	video_scale_info conversion = {};
+	conversion.format = VIDEO_FORMAT_NV12;
+	conversion.width = width;
+	conversion.height = height;
+	conversion.range = voi->range;
+	conversion.colorspace = voi->colorspace;
+
+	active = true;
+	obs_add_raw_video_callback(&conversion, RawVideo, this);
+	return true;
+}
+
+void QualityAnalyzer::Stop()
+{
+	if (!active)
+		return;
+
+	obs_remove_raw_video_callback(RawVideo, this);
+	active = false;
+
+	{
+		lock_guard lock(jobMutex);
+		stopping = true;
+	}
+
+	jobCond.notify_one();
+	thread.join();
+
+	rawMutex.lock();
+	rawSlots.clear();
+	rawMutex.unlock();
+
+	encoder = nullptr;
+}
+
+void QualityAnalyzer::RawVideo(void *param, video_data *frame)
+{
+	auto analyzer = static_cast<QualityAnalyzer *>(param);
+
+	if (analyzer->rawFrames++ % kAnalysisInterval)
+		return;
+
+	lock_guard lock(analyzer->rawMutex);
+
+	RawSlot &slot = analyzer->rawSlots[analyzer->rawNext];
+	analyzer->rawNext = (analyzer->rawNext + 1) % kRawSlots;
+
+	const uint32_t cx = analyzer->width;
+	const uint32_t cy = analyzer->height;
+
+	slot.timestamp = frame->timestamp;
+	slot.luma.resize((size_t)cx * cy);
+
+	for (uint32_t y = 0; y < cy; y++)
+		memcpy(&slot.luma[(size_t)y * cx],
+		       frame->data[0] + (size_t)y * frame->linesize[0], cx);
+}
+
+void QualityAnalyzer::PushDecoded(const AVFrame *frame, uint64_t capture_ts)
+{
+	if (!active || (uint32_t)frame->width != width ||
+	    (uint32_t)frame->height != height)
+		return;
+
+	Job job;
+	job.timestamp = capture_ts;
+
+	{
+		lock_guard lock(rawMutex);
+
+		auto it = std::find_if(
+			rawSlots.begin(), rawSlots.end(),
+			[&](const RawSlot &slot) {
+				uint64_t diff = slot.timestamp > capture_ts
+							? slot.timestamp - capture_ts
+							: capture_ts - slot.timestamp;
+				return slot.timestamp &&
+				       diff < frameInterval / 2;
+			});
+
+		if (it == rawSlots.end())
+			return;
+
+		job.raw = std::move(it->luma);
+		it->timestamp = 0;
+	}
+
+	const AVPixFmtDescriptor *desc =
+		av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+	if (!desc || desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_BE))
+		return;
+
+	const int depth = desc->comp[0].depth;
+	job.decoded.resize((size_t)width * height);
+
+	for (uint32_t y = 0; y < height; y++) {
+		const uint8_t *src =
+			frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+		uint8_t *dst = &job.decoded[(size_t)y * width];
+
+		if (depth == 8) {
+			memcpy(dst, src, width);
+			continue;
+		}
+
+		auto src16 = reinterpret_cast<const uint16_t *>(src);
+		for (uint32_t x = 0; x < width; x++)
+			dst[x] = (uint8_t)std::min(src16[x] >> (depth - 8),
+						   255);
+	}
+
+	lock_guard lock(jobMutex);
+	if (stopping || jobs.size() >= kMaxPendingJobs)
+		return;
+
+	jobs.push_back(std::move(job));
+	jobCond.notify_one();
+}
+
+void QualityAnalyzer::Thread()
+{
+	os_set_thread_name("encoder-preview: quality analysis");
+
+	unique_lock lock(jobMutex);
+
+	while (!stopping) {
+		if (jobs.empty()) {
+			jobCond.wait(lock);
+			continue;
+		}
+
+		Job job = std::move(jobs.front());
+		jobs.pop_front();
+
+		lock.unlock();
+		Analyze(job);
+		lock.lock();
+	}
+}
+
+void QualityAnalyzer::Analyze(Job &job)
+{
+	const uint32_t cols = (width + kBlockSize - 1) / kBlockSize;
+	const uint32_t rows = (height + kBlockSize - 1) / kBlockSize;
+
+	uint32_t increment = obs_encoder_get_roi_increment(encoder);
+	if (!regionsValid || increment != roiIncrement) {
+		/* In the order they were added, so overlapping regions
+		 * count like the encoder applies them */
+		GetEncoderRegions(encoder, regions);
+		roiIncrement = increment;
+		regionsValid = true;
+
+		RegionMask(regions, cols, rows, kBlockSize, roiMask);
+	}
+
+	BlockMap psnr, ssim;
+	psnr.Reset(width, height, kBlockSize);
+	ssim.Reset(width, height, kBlockSize);
+
+	uint64_t sse[2] = {}, samples[2] = {};
+	double ssim_sum[2] = {};
+	uint64_t windows[2] = {};
+
+	const uint8_t *raw = job.raw.data();
+	const uint8_t *decoded = job.decoded.data();
+	const int stride = (int)width;
+
+	for (uint32_t row = 0; row < rows; row++) {
+		for (uint32_t col = 0; col < cols; col++) {
+			const uint32_t x = col * kBlockSize;
+			const uint32_t y = row * kBlockSize;
+			const int bw = (int)std::min(kBlockSize, width - x);
+			const int bh = (int)std::min(kBlockSize, height - y);
+			const size_t offset = (size_t)y * width + x;
+			const int inside = roiMask[row * cols + col];
+
+			uint64_t block_sse = BlockSSE(raw + offset, stride,
+						      decoded + offset, stride,
+						      bw, bh);
+			sse[inside] += block_sse;
+			samples[inside] += (uint64_t)(bw * bh);
+			psnr.At(col, row) = (float)PsnrFromSSE(
+				block_sse, (uint64_t)(bw * bh));
+
+			double block_ssim = 0.0;
+			int block_windows = 0;
+
+			for (int wy = 0; wy + kSsimWindow <= bh;
+			     wy += kSsimWindow) {
+				for (int wx = 0; wx + kSsimWindow <= bw;
+				     wx += kSsimWindow) {
+					size_t window = offset +
+							(size_t)wy * width + wx;
+					SsimStats stats = WindowSsimStats(
+						raw + window, stride,
+						decoded + window, stride);
+					block_ssim += SsimFromStats(
+						stats,
+						kSsimWindow * kSsimWindow);
+					block_windows++;
+				}
+			}
+
+			if (block_windows) {
+				ssim_sum[inside] += block_ssim;
+				windows[inside] += block_windows;
+				ssim.At(col, row) =
+					(float)(block_ssim / block_windows);
+			}
+		}
+	}
+
+	Result result = {};
+	result.timestamp = job.timestamp;
+	result.psnr = PsnrFromSSE(sse[0] + sse[1], samples[0] + samples[1]);
+	result.ssim = windows[0] + windows[1]
+			      ? (ssim_sum[0] + ssim_sum[1]) /
+					(double)(windows[0] + windows[1])
+			      : 0.0;
+	result.hasInside = samples[1] != 0;
+	result.hasOutside = samples[0] != 0;
+	result.psnrInside = result.hasInside ? PsnrFromSSE(sse[1], samples[1])
+					     : 0.0;
+	result.psnrOutside = result.hasOutside
+				     ? PsnrFromSSE(sse[0], samples[0])
+				     : 0.0;
+	result.ssimInside = windows[1] ? ssim_sum[1] / (double)windows[1]
+				       : 0.0;
+	result.ssimOutside = windows[0] ? ssim_sum[0] / (double)windows[0]
+					: 0.0;
+
+	lock_guard lock(resultMutex);
+
+	if (results.size() < kMaxResults)
+		results.push_back(result);
+
+	psnrMap = std::move(psnr);
+	ssimMap = std::move(ssim);
+	mapGeneration++;
+}
+
+vector<QualityAnalyzer::Result> QualityAnalyzer::TakeResults()
+{
+	lock_guard lock(resultMutex);
+
+	vector<Result> ret;
+	ret.swap(results);
+	return ret;
+}
+
+bool QualityAnalyzer::GetBlockMap(BlockMap &map, bool ssim,
+				  uint64_t &generation)
+{
+	lock_guard lock(resultMutex);
+
+	const BlockMap &src = ssim ? ssimMap : psnrMap;
+	if (src.values.empty() || generation == mapGeneration)
+		return false;
+
+	map = src;
+	generation = mapGeneration;
+	return true;
+}
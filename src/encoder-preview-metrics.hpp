@@ -0,0 +1,110 @@
+#pragma once
+
+#include "encoder-preview-overlay.hpp"
+
+#include <obs.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+/* Sums needed to compute SSIM over a window */
+struct SsimStats {
+	uint32_t a = 0;
+	uint32_t b = 0;
+	uint32_t aa = 0;
+	uint32_t bb = 0;
+	uint32_t ab = 0;
+};
+
+/* Sum of squared differences over a w x h block of 8-bit samples */
+uint64_t BlockSSE(const uint8_t *a, int stride_a, const uint8_t *b,
+		  int stride_b, int w, int h);
+/* SSIM sums over an 8x8 window of 8-bit samples */
+SsimStats WindowSsimStats(const uint8_t *a, int stride_a, const uint8_t *b,
+			  int stride_b);
+double SsimFromStats(const SsimStats &stats, int samples);
+double PsnrFromSSE(uint64_t sse, uint64_t samples);
+
+/* Compares raw canvas frames against the decoded preview on a worker
+ * thread. Only luma is compared, at the encoder's output resolution. */
+class QualityAnalyzer {
+public:
+	struct Result {
+		uint64_t timestamp;
+		double psnr;
+		double ssim;
+		double psnrInside;
+		double psnrOutside;
+		double ssimInside;
+		double ssimOutside;
+		bool hasInside;
+		bool hasOutside;
+	};
+
+	~QualityAnalyzer() { Stop(); }
+
+	bool Start(obs_encoder_t *encoder);
+	void Stop();
+	bool Active() const { return active; }
+
+	/* Called from the decoder, capture_ts in os_gettime_ns() time */
+	void PushDecoded(const AVFrame *frame, uint64_t capture_ts);
+
+	std::vector<Result> TakeResults();
+	/* Per-block map of the most recently analysed frame, only copied if
+	 * it changed since the generation passed in. */
+	bool GetBlockMap(BlockMap &map, bool ssim, uint64_t &generation);
+
+private:
+	struct RawSlot {
+		uint64_t timestamp = 0;
+		std::vector<uint8_t> luma;
+	};
+
+	struct Job {
+		uint64_t timestamp;
+		std::vector<uint8_t> raw;
+		std::vector<uint8_t> decoded;
+	};
+
+	static void RawVideo(void *param, video_data *frame);
+	void Thread();
+	void Analyze(Job &job);
+
+	std::atomic_bool active = false;
+	obs_encoder_t *encoder = nullptr;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint64_t frameInterval = 0;
+	uint64_t rawFrames = 0;
+
+	std::mutex rawMutex;
+	std::vector<RawSlot> rawSlots;
+	size_t rawNext = 0;
+
+	std::thread thread;
+	std::mutex jobMutex;
+	std::condition_variable jobCond;
+	std::deque<Job> jobs;
+	bool stopping = false;
+
+	/* Worker thread state */
+	std::vector<obs_encoder_roi> regions;
+	std::vector<uint8_t> roiMask;
+	uint32_t roiIncrement = 0;
+	bool regionsValid = false;
+
+	std::mutex resultMutex;
+	std::vector<Result> results;
+	BlockMap psnrMap;
+	BlockMap ssimMap;
+	uint64_t mapGeneration = 0;
+};
@@ -0,0 +1,318 @@
+#include "encoder-preview-monitor.hpp"
+#include "plugin-encoders.hpp"
+#include "plugin-profiler.hpp"
+
+#ifdef BUILD_STANDALONE
+#include "external/display-helpers.hpp"
+#include "external/qt-display.hpp"
+#include "external/qt-wrappers.hpp"
+#else
+#include "display-helpers.hpp"
+#include "qt-display.hpp"
+#include "qt-wrappers.hpp"
+#endif
+
+#include <obs-module.h>
+#include <util/platform.h>
+
+#include <QGridLayout>
+#include <QLabel>
+#include <QVBoxLayout>
+
+#include <algorithm>
+
+using namespace std;
+
+static constexpr int kColumns = 3;
+static constexpr int kThumbWidth = 256;
+static constexpr int kThumbHeight = 144;
+/* Pictures only change once per GOP, a few missing ones are suspicious */
+static constexpr double kStaleKeyframes = 3.0;
+static constexpr double kMinStaleSeconds = 10.0;
+
+EncoderMonitor::EncoderMonitor(QWidget *parent)
+	: QWidget(parent),
+	  grid(new QGridLayout),
+	  emptyLbl(new QLabel(obs_module_text("EncoderPreview.Monitor.None"))),
+	  timer(this)
+{
+	auto layout = new QVBoxLayout(this);
+	layout->setContentsMargins(0, 0, 0, 0);
+	layout->addWidget(emptyLbl);
+	layout->addLayout(grid);
+	layout->addStretch();
+
+	connect(&timer, &QTimer::timeout, this, [&]() {
+		Refresh();
+		UpdateStats();
+	});
+	timer.setInterval(2000);
+}
+
+EncoderMonitor::~EncoderMonitor()
+{
+	while (!tiles.empty())
+		RemoveTile(tiles.size() - 1);
+}
+
+void EncoderMonitor::SetMonitoring(bool enable)
+{
+	if (enable == monitoring)
+		return;
+
+	monitoring = enable;
+
+	if (enable) {
+		Refresh();
+		timer.start();
+		return;
+	}
+
+	timer.stop();
+	while (!tiles.empty())
+		RemoveTile(tiles.size() - 1);
+	Relayout();
+}
+
+void EncoderMonitor::RecreateDisplays()
+{
+	for (auto &tile : tiles) {
+		if (tile->display->GetDisplay())
+			continue;
+
+		DestroyDisplay(tile.get());
+		CreateDisplay(tile.get());
+	}
+}
+
+void EncoderMonitor::showEvent(QShowEvent *event)
+{
+	for (auto &tile : tiles)
+		tile->pipeline->SetViewerVisible(true);
+
+	QWidget::showEvent(event);
+}
+
+void EncoderMonitor::hideEvent(QHideEvent *event)
+{
+	for (auto &tile : tiles)
+		tile->pipeline->SetViewerVisible(false);
+
+	QWidget::hideEvent(event);
+}
+
+/*
+ * Tiles
+ */
+
+void EncoderMonitor::Refresh()
+{
+	/* Only what is actually running, our own outputs would otherwise keep
+	 * encoders alive after streaming or recording stopped. */
+	vector<OBSEncoder> encoders = FindRoiEncoders(RoiEncodersRecordings |
+						      RoiEncodersActiveOnly);
+
+	bool changed = false;
+
+	for (size_t idx = tiles.size(); idx > 0; idx--) {
+		const string &name = tiles[idx - 1]->encoder;
+		auto found = find_if(encoders.begin(), encoders.end(),
+				     [&](obs_encoder_t *enc) {
+					     return name ==
+						    obs_encoder_get_name(enc);
+				     });
+
+		if (found == encoders.end() ||
+		    tiles[idx - 1]->pipeline->GetStatus() ==
+			    PreviewPipeline::INACTIVE) {
+			RemoveTile(idx - 1);
+			changed = true;
+		}
+	}
+
+	for (obs_encoder_t *enc : encoders) {
+		const char *name = obs_encoder_get_name(enc);
+		auto found = find_if(tiles.begin(), tiles.end(),
+				     [&](const unique_ptr<Tile> &tile) {
+					     return tile->encoder == name;
+				     });
+
+		if (found == tiles.end()) {
+			AddTile(enc);
+			changed = true;
+		}
+	}
+
+	if (changed)
+		Relayout();
+}
+
+void EncoderMonitor::UpdateStats()
+{
+	uint64_t now = os_gettime_ns();
+
+	for (auto &tile : tiles) {
+		PreviewPipeline::Stats stats = tile->pipeline->TakeStats();
+
+		if (stats.presentation.presented)
+			tile->lastPicture = now;
+
+		QString text = QT_UTF8(tile->encoder.c_str());
+		text += "\n";
+
+		if (tile->pipeline->GetStatus() != PreviewPipeline::PLAYING) {
+			text += obs_module_text(
+				"EncoderPreview.Monitor.Waiting");
+			tile->label->setText(text);
+			continue;
+		}
+
+		double keyframe = stats.bitstream.keyframeSeconds;
+		double stale =
+			max(keyframe * kStaleKeyframes, kMinStaleSeconds);
+		double age = tile->lastPicture
+				     ? (double)(now - tile->lastPicture) / 1e9
+				     : 0.0;
+
+		if (!stats.packets) {
+			text += obs_module_text(
+				"EncoderPreview.Monitor.NoData");
+		} else if (tile->lastPicture && age > stale) {
+			text += QString(obs_module_text(
+						"EncoderPreview.Monitor.Stale"))
+					.arg(loc.toString(age, 'f', 0));
+		} else {
+			text += QString(obs_module_text(
+						"EncoderPreview.Monitor.Stats"))
+					.arg(loc.toString(stats.kbps, 'f', 0))
+					.arg(loc.toString(keyframe, 'f', 1));
+		}
+
+		tile->label->setText(text);
+	}
+}
+
+void EncoderMonitor::AddTile(obs_encoder_t *enc)
+{
+	/* Names only have to be unique among the monitor's own pipelines */
+	static int instances = 0;
+	instances++;
+
+	string output_name = "encoder_preview_monitor_" + to_string(instances);
+	string source_name = "Encoder Monitor " + to_string(instances);
+
+	auto tile = make_unique<Tile>();
+	tile->encoder = obs_encoder_get_name(enc);
+	tile->pipeline = make_unique<PreviewPipeline>(output_name.c_str(),
+						      source_name.c_str());
+
+	PreviewPipeline *pipeline = tile->pipeline.get();
+	pipeline->SetKeyframesOnly(true);
+	pipeline->SetScaleToPreview(true);
+	pipeline->SetPreviewSize(kThumbWidth, kThumbHeight);
+	pipeline->SetDecodeOnDemand(true);
+	pipeline->SetViewerVisible(isVisible());
+
+	if (!pipeline->Start(enc)) {
+		blog(LOG_WARNING, "Failed to monitor encoder '%s'",
+		     tile->encoder.c_str());
+		return;
+	}
+
+	tile->box = new QWidget(this);
+	auto layout = new QVBoxLayout(tile->box);
+	layout->setContentsMargins(0, 0, 0, 0);
+
+	tile->label = new QLabel(QT_UTF8(tile->encoder.c_str()), tile->box);
+	layout->addWidget(tile->label);
+
+	CreateDisplay(tile.get());
+	tiles.push_back(std::move(tile));
+}
+
+void EncoderMonitor::RemoveTile(size_t idx)
+{
+	Tile *tile = tiles[idx].get();
+
+	/* Nothing may draw the pipeline once it is gone */
+	DestroyDisplay(tile);
+	delete tile->box;
+
+	tiles.erase(tiles.begin() + idx);
+}
+
+void EncoderMonitor::CreateDisplay(Tile *tile)
+{
+	tile->display = new OBSQTDisplay(tile->box);
+	tile->display->setFixedSize(kThumbWidth, kThumbHeight);
+
+	auto layout = static_cast<QVBoxLayout *>(tile->box->layout());
+	layout->insertWidget(0, tile->display);
+
+	connect(tile->display, &OBSQTDisplay::DisplayCreated, this,
+		[tile](OBSQTDisplay *display) {
+			obs_display_add_draw_callback(display->GetDisplay(),
+						      EncoderMonitor::DrawTile,
+						      tile);
+		});
+}
+
+void EncoderMonitor::DestroyDisplay(Tile *tile)
+{
+	if (tile->display->GetDisplay())
+		obs_display_remove_draw_callback(tile->display->GetDisplay(),
+						 EncoderMonitor::DrawTile,
+						 tile);
+
+	delete tile->display;
+	tile->display = nullptr;
+}
+
+void EncoderMonitor::Relayout()
+{
+	for (size_t idx = 0; idx < tiles.size(); idx++) {
+		int row = (int)idx / kColumns;
+		int column = (int)idx % kColumns;
+		grid->addWidget(tiles[idx]->box, row, column);
+	}
+
+	emptyLbl->setVisible(tiles.empty());
+}
+
+void EncoderMonitor::DrawTile(void *data, uint32_t cx, uint32_t cy)
+{
+	PERF_SCOPE("DrawMonitorTile");
+
+	auto tile = static_cast<Tile *>(data);
+	PreviewPipeline *pipeline = tile->pipeline.get();
+
+	/* Keyframes are scaled down to the thumbnail when converted */
+	pipeline->SetPreviewSize(cx, cy);
+
+	if (pipeline->GetStatus() != PreviewPipeline::PLAYING)
+		return;
+
+	obs_source_t *source = pipeline->GetSource();
+	uint32_t width = obs_source_get_width(source);
+	uint32_t height = obs_source_get_height(source);
+	if (!width || !height)
+		return;
+
+	int viewport_x, viewport_y;
+	float scale;
+
+	GetScaleAndCenterPos(width, height, cx, cy, viewport_x, viewport_y,
+			     scale);
+
+	gs_viewport_push();
+	gs_projection_push();
+
+	gs_ortho(0.0f, float(width), 0.0f, float(height), -100.0f, 100.0f);
+	gs_set_viewport(viewport_x, viewport_y, int(scale * float(width)),
+			int(scale * float(height)));
+
+	pipeline->Render(width, height);
+
+	gs_projection_pop();
+	gs_viewport_pop();
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "encoder-preview-pipeline.hpp"
+
+#include <QLocale>
+#include <QTimer>
+#include <QWidget>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class OBSQTDisplay;
+class QGridLayout;
+class QLabel;
+
+/* Thumbnails of every ROI capable encoder in use, each only decoding
+ * keyframes. Shows at a glance whether all encoders still produce sensible
+ * pictures, at a small fraction of what previewing them would cost. */
+class EncoderMonitor : public QWidget {
+	Q_OBJECT
+
+public:
+	explicit EncoderMonitor(QWidget *parent = nullptr);
+	~EncoderMonitor();
+
+	/* Keeps running while hidden, thumbnails are only decoded while the
+	 * monitor is visible. */
+	void SetMonitoring(bool enable);
+	bool Monitoring() const { return monitoring; }
+
+	/* Displays cannot be reused once their window was closed */
+	void RecreateDisplays();
+
+protected:
+	void showEvent(QShowEvent *event) override;
+	void hideEvent(QHideEvent *event) override;
+
+private:
+	struct Tile {
+		std::string encoder;
+		std::unique_ptr<PreviewPipeline> pipeline;
+		QWidget *box = nullptr;
+		OBSQTDisplay *display = nullptr;
+		QLabel *label = nullptr;
+		/* When the last picture was presented */
+		uint64_t lastPicture = 0;
+	};
+
+	/* Follows encoders starting and stopping */
+	void Refresh();
+	void UpdateStats();
+
+	void AddTile(obs_encoder_t *enc);
+	void RemoveTile(size_t idx);
+	void CreateDisplay(Tile *tile);
+	void DestroyDisplay(Tile *tile);
+	void Relayout();
+	static void DrawTile(void *data, uint32_t cx, uint32_t cy);
+
+	std::vector<std::unique_ptr<Tile>> tiles;
+	QGridLayout *grid;
+	QLabel *emptyLbl;
+	QTimer timer;
+	QLocale loc = QLocale::system();
+	bool monitoring = false;
+};
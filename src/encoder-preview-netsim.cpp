@@ -0,0 +1,318 @@
+#include "encoder-preview-netsim.hpp"
+
+#include <obs-avc.h>
+#include <obs-hevc.h>
+#include <obs-nal.h>
+#include <util/platform.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+/* Same defaults as the RTMP output */
+static constexpr int64_t kDropThresholdUsec = 700000;
+static constexpr int64_t kPFrameDropThresholdUsec = 900000;
+/* The RTMP output only starts dropping with a few packets queued */
+static constexpr size_t kMinDropPackets = 5;
+
+/* Lost segments are retransmitted one round trip later */
+static constexpr size_t kSegmentSize = 1460;
+static constexpr int kMaxRetransmissions = 8;
+
+/* Depth of the token bucket, lets short bursts go out at once */
+static constexpr int64_t kBurstNs = 10000000;
+
+NetworkSimulator::NetworkSimulator(OutputCallback callback)
+	: callback(std::move(callback))
+{
+}
+
+void NetworkSimulator::SetConfig(const Config &new_config)
+{
+	lock_guard lock(mutex);
+	config = new_config;
+	config.bandwidth = std::max<uint32_t>(config.bandwidth, 1);
+}
+
+void NetworkSimulator::Start(const char *codec_name)
+{
+	Stop();
+
+	{
+		lock_guard lock(mutex);
+
+		codec = codec_name ? codec_name : "";
+		rng.seed(config.seed);
+		haveBase = false;
+		linkTime = 0;
+		tokens = 0.0;
+		sending = false;
+		minPriority = 0;
+		lastArrival = 0;
+
+		delivered = 0;
+		dropped = 0;
+		retransmissions = 0;
+		latencySum = 0.0;
+		maxLatency = 0.0;
+		maxBuffer = 0.0;
+
+		stopping = false;
+	}
+
+	thread = std::thread(&NetworkSimulator::Thread, this);
+}
+
+void NetworkSimulator::Stop()
+{
+	if (!thread.joinable())
+		return;
+
+	{
+		lock_guard lock(mutex);
+		stopping = true;
+	}
+
+	cond.notify_one();
+	thread.join();
+
+	lock_guard lock(mutex);
+	queue.clear();
+	arrived.clear();
+}
+
+NetworkSimulator::Stats NetworkSimulator::TakeStats()
+{
+	Stats ret;
+
+	lock_guard lock(mutex);
+
+	ret.delivered = delivered;
+	ret.dropped = dropped;
+	ret.retransmissions = retransmissions;
+	ret.meanLatency = delivered ? latencySum / (double)delivered : 0.0;
+	ret.maxLatency = maxLatency;
+	ret.maxBuffer = maxBuffer;
+
+	delivered = 0;
+	dropped = 0;
+	retransmissions = 0;
+	latencySum = 0.0;
+	maxLatency = 0.0;
+	maxBuffer = 0.0;
+
+	return ret;
+}
+
+/* Uniform in [0, 1), unlike the standard distributions this gives the same
+ * sequence with every standard library. */
+double NetworkSimulator::Random()
+{
+	return (double)(rng() >> 11) * 0x1.0p-53;
+}
+
+/*
+ * Sender
+ */
+
+/* The encoders leave the priorities of raw packets at zero, the RTMP output
+ * assigns them while packaging, the same way as here. */
+static int DropPriority(const string &codec, const encoder_packet &info)
+{
+	if (codec == "h264")
+		return obs_parse_avc_packet_priority(&info);
+	if (codec == "hevc")
+		return obs_parse_hevc_packet_priority(&info);
+
+	/* AV1 has no NAL header, everything but keyframes ranks like the
+	 * reference frames of the other codecs */
+	return info.keyframe ? OBS_NAL_PRIORITY_HIGHEST
+			     : OBS_NAL_PRIORITY_HIGH;
+}
+
+void NetworkSimulator::Push(const packet &pkt)
+{
+	const encoder_packet &info = pkt.m_pkt;
+
+	{
+		lock_guard lock(mutex);
+		if (stopping)
+			return;
+
+		if (!haveBase) {
+			base = info.dts_usec * 1000;
+			haveBase = true;
+		}
+
+		const int64_t now = info.dts_usec * 1000 - base;
+
+		/* Packets are only sent between arrivals, so stream time only
+		 * depends on the packets and not on when we get to run. */
+		Advance(now);
+
+		CheckToDropFrames(false);
+		CheckToDropFrames(true);
+
+		/* Once dropping, everything below that priority goes until
+		 * a packet important enough comes along. */
+		const int priority = DropPriority(codec, info);
+		if (priority < minPriority) {
+			dropped++;
+			return;
+		}
+
+		minPriority = 0;
+		lastDtsUsec = info.dts_usec;
+
+		Queued &queued = queue.emplace_back(Queued{pkt, now});
+		queued.pkt.m_pkt.priority = priority;
+		queued.pkt.m_pkt.drop_priority = priority;
+	}
+
+	cond.notify_one();
+}
+
+void NetworkSimulator::Advance(int64_t now)
+{
+	const double rate = (double)config.bandwidth * 1000.0 / 1e9;
+	const double depth =
+		std::max((double)kBurstNs * rate, (double)kSegmentSize * 8.0);
+
+	sending = false;
+
+	while (!queue.empty()) {
+		Queued &front = queue.front();
+		const double bits = (double)front.pkt.m_pkt.size * 8.0;
+
+		int64_t start = std::max(front.arrival, linkTime);
+		double available = std::min(
+			depth, tokens + (double)(start - linkTime) * rate);
+
+		/* Larger packets go out as the bucket refills */
+		int64_t departure = start;
+		double left = available - bits;
+		if (left < 0.0) {
+			departure += (int64_t)std::ceil(-left / rate);
+			left = 0.0;
+		}
+
+		if (departure > now) {
+			sending = start <= now;
+			break;
+		}
+
+		linkTime = departure;
+		tokens = left;
+
+		Queued sent = std::move(front);
+		queue.pop_front();
+		Deliver(std::move(sent), departure);
+	}
+}
+
+void NetworkSimulator::CheckToDropFrames(bool pframes)
+{
+	if (queue.size() < kMinDropPackets)
+		return;
+
+	int64_t buffer = lastDtsUsec - queue.front().pkt.m_pkt.dts_usec;
+	maxBuffer = std::max(maxBuffer, (double)buffer / 1000.0);
+
+	int64_t threshold = pframes ? kPFrameDropThresholdUsec
+				    : kDropThresholdUsec;
+	if (buffer <= threshold)
+		return;
+
+	DropFrames(pframes ? OBS_NAL_PRIORITY_HIGHEST : OBS_NAL_PRIORITY_HIGH);
+}
+
+void NetworkSimulator::DropFrames(int priority)
+{
+	auto first = queue.begin();
+	if (sending)
+		++first;
+
+	auto end = std::remove_if(first, queue.end(), [&](const Queued &q) {
+		return q.pkt.m_pkt.drop_priority < priority;
+	});
+
+	dropped += (uint64_t)(queue.end() - end);
+	queue.erase(end, queue.end());
+
+	if (minPriority < priority)
+		minPriority = priority;
+}
+
+/*
+ * Network and receiver
+ */
+
+void NetworkSimulator::Deliver(Queued &&queued, int64_t departure)
+{
+	const int64_t rtt = (int64_t)config.rtt * 1000000;
+	const double loss = config.loss / 100.0;
+
+	/* Every lost segment costs a round trip, the packet is complete once
+	 * its unluckiest segment made it. */
+	int rounds = 0;
+	if (loss > 0.0) {
+		size_t segments = (queued.pkt.m_pkt.size + kSegmentSize - 1) /
+				  kSegmentSize;
+
+		for (size_t idx = 0; idx < segments; idx++) {
+			int lost = 0;
+			while (lost < kMaxRetransmissions && Random() < loss)
+				lost++;
+
+			retransmissions += lost;
+			rounds = std::max(rounds, lost);
+		}
+	}
+
+	int64_t jitter = (int64_t)(Random() * (double)config.jitter * 1e6);
+	int64_t arrival = departure + rtt / 2 + jitter + rounds * rtt;
+
+	/* The stream is a single TCP connection, nothing overtakes */
+	arrival = std::max(arrival, lastArrival);
+	lastArrival = arrival;
+
+	double latency = (double)(arrival - queued.arrival) / 1e6;
+	latencySum += latency;
+	maxLatency = std::max(maxLatency, latency);
+	delivered++;
+
+	arrived.push_back({std::move(queued.pkt), (uint64_t)(base + arrival)});
+}
+
+void NetworkSimulator::Thread()
+{
+	os_set_thread_name("encoder-preview: network simulation");
+
+	unique_lock lock(mutex);
+
+	for (;;) {
+		if (stopping)
+			break;
+
+		if (arrived.empty()) {
+			cond.wait(lock);
+			continue;
+		}
+
+		uint64_t now = os_gettime_ns();
+		uint64_t release = arrived.front().release;
+		if (release > now) {
+			cond.wait_for(lock, chrono::nanoseconds(release - now));
+			continue;
+		}
+
+		packet pkt = std::move(arrived.front().pkt);
+		arrived.pop_front();
+
+		lock.unlock();
+		callback(std::move(pkt));
+		lock.lock();
+	}
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "encoder-preview-capture.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+/* Delays and drops packets on their way to the decoder as if they had
+ * been streamed over a constrained link: a token bucket limits the
+ * bandwidth, the sender drops frames like OBS's RTMP output does once its
+ * buffer grows, and the network adds latency, jitter and retransmissions
+ * for lost segments.
+ *
+ * The link runs in stream time derived from the packet timestamps and all
+ * randomness comes from a seeded generator, so the same packets with the
+ * same settings always give the same result. */
+class NetworkSimulator {
+public:
+	/* Called on the simulator thread once a packet has arrived */
+	using OutputCallback = std::function<void(packet &&pkt)>;
+
+	struct Config {
+		uint32_t bandwidth = 6000; // kbps
+		uint32_t rtt = 50;         // ms
+		uint32_t jitter = 10;      // ms
+		double loss = 0.0;         // percent of segments
+		uint32_t seed = 1;
+	};
+
+	struct Stats {
+		uint64_t delivered = 0;
+		uint64_t dropped = 0;
+		uint64_t retransmissions = 0;
+		/* From leaving the encoder to arriving, in ms */
+		double meanLatency = 0.0;
+		double maxLatency = 0.0;
+		/* Largest sender buffer seen, in ms */
+		double maxBuffer = 0.0;
+	};
+
+	explicit NetworkSimulator(OutputCallback callback);
+	~NetworkSimulator() { Stop(); }
+
+	NetworkSimulator(const NetworkSimulator &) = delete;
+	NetworkSimulator &operator=(const NetworkSimulator &) = delete;
+
+	/* Takes effect immediately, the generator is only seeded on start */
+	void SetConfig(const Config &config);
+
+	/* Codec as returned by obs_encoder_get_codec(), decides how the
+	 * packets are ranked for dropping */
+	void Start(const char *codec);
+	/* Packets still on the link are discarded */
+	void Stop();
+	bool Active() const { return thread.joinable(); }
+
+	/* Encoder thread, the packet data is shared, not copied */
+	void Push(const packet &pkt);
+
+	Stats TakeStats();
+
+private:
+	struct Queued {
+		packet pkt;
+		int64_t arrival;
+	};
+
+	struct Arrived {
+		packet pkt;
+		/* In os_gettime_ns() time */
+		uint64_t release;
+	};
+
+	void Thread();
+
+	void Advance(int64_t now);
+	void Deliver(Queued &&queued, int64_t departure);
+	void CheckToDropFrames(bool pframes);
+	void DropFrames(int priority);
+	double Random();
+
+	OutputCallback callback;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+	/* Packets are only accepted while the thread runs */
+	bool stopping = true;
+
+	Config config;
+	std::string codec;
+	std::mt19937_64 rng;
+
+	/* Stream time is relative to the first packet's DTS */
+	bool haveBase = false;
+	int64_t base = 0;
+	int64_t lastDtsUsec = 0;
+
+	/* Sender side, packets waiting for the link */
+	std::deque<Queued> queue;
+	int64_t linkTime = 0;
+	double tokens = 0.0;
+	/* The front packet started going out and can no longer be dropped */
+	bool sending = false;
+	int minPriority = 0;
+
+	/* Receiver side, in arrival order */
+	std::deque<Arrived> arrived;
+	int64_t lastArrival = 0;
+
+	uint64_t delivered = 0;
+	uint64_t dropped = 0;
+	uint64_t retransmissions = 0;
+	double latencySum = 0.0;
+	double maxLatency = 0.0;
+	double maxBuffer = 0.0;
+};
@@ -0,0 +1,166 @@
+#include "encoder-preview-overlay.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+static constexpr uint8_t kOverlayAlpha = 160;
+
+void BlockMap::Reset(uint32_t cx, uint32_t cy, uint32_t block)
+{
+	width = cx;
+	height = cy;
+	block_size = std::max(block, 1U);
+	cols = (cx + block_size - 1) / block_size;
+	rows = (cy + block_size - 1) / block_size;
+	values.assign((size_t)cols * rows, NAN);
+}
+
+void GetEncoderRegions(obs_encoder_t *encoder, vector<obs_encoder_roi> &regions)
+{
+	regions.clear();
+	obs_encoder_enum_roi(
+		encoder,
+		[](void *param, obs_encoder_roi *roi) {
+			auto vec = static_cast<vector<obs_encoder_roi> *>(param);
+			vec->push_back(*roi);
+		},
+		&regions);
+
+	/* libobs enumerates the newest region first */
+	reverse(regions.begin(), regions.end());
+}
+
+bool InsideRegions(const vector<obs_encoder_roi> &regions, uint32_t x,
+		   uint32_t y)
+{
+	for (const obs_encoder_roi &roi : regions) {
+		if (x < roi.left || x >= roi.right || y < roi.top ||
+		    y >= roi.bottom)
+			continue;
+
+		return roi.priority != 0.0f;
+	}
+
+	return false;
+}
+
+void RegionMask(const vector<obs_encoder_roi> &regions, uint32_t cols,
+		uint32_t rows, uint32_t block_size, vector<uint8_t> &mask)
+{
+	mask.resize((size_t)cols * rows);
+
+	for (uint32_t row = 0; row < rows; row++) {
+		for (uint32_t col = 0; col < cols; col++) {
+			mask[row * cols + col] = InsideRegions(
+				regions, col * block_size + block_size / 2,
+				row * block_size + block_size / 2);
+		}
+	}
+}
+
+static void ValueToColor(float t, uint8_t *rgba)
+{
+	t = std::clamp(t, 0.0f, 1.0f);
+
+	float red = std::clamp(2.0f * t - 1.0f, 0.0f, 1.0f);
+	float green = 1.0f - std::abs(2.0f * t - 1.0f);
+	float blue = std::clamp(1.0f - 2.0f * t, 0.0f, 1.0f);
+
+	rgba[0] = (uint8_t)(red * 255.0f);
+	rgba[1] = (uint8_t)(green * 255.0f);
+	rgba[2] = (uint8_t)(blue * 255.0f);
+	rgba[3] = kOverlayAlpha;
+}
+
+BlockOverlay::~BlockOverlay()
+{
+	if (!tex && !sampler)
+		return;
+
+	obs_enter_graphics();
+	gs_texture_destroy(tex);
+	gs_samplerstate_destroy(sampler);
+	obs_leave_graphics();
+}
+
+void BlockOverlay::Clear()
+{
+	gs_texture_destroy(tex);
+	tex = nullptr;
+}
+
+void BlockOverlay::Update(const BlockMap &map, float min, float max)
+{
+	if (!map.cols || !map.rows) {
+		Clear();
+		return;
+	}
+
+	if (!tex || cols != map.cols || rows != map.rows) {
+		gs_texture_destroy(tex);
+		tex = gs_texture_create(map.cols, map.rows, GS_RGBA, 1, nullptr,
+					GS_DYNAMIC);
+	}
+
+	mapWidth = map.width;
+	mapHeight = map.height;
+	blockSize = map.block_size;
+	cols = map.cols;
+	rows = map.rows;
+
+	/* max < min inverts the ramp */
+	const float range = max != min ? max - min : 1.0f;
+	pixels.resize((size_t)cols * rows * 4);
+
+	for (size_t idx = 0; idx < map.values.size(); idx++) {
+		float value = map.values[idx];
+		uint8_t *rgba = &pixels[idx * 4];
+
+		if (std::isnan(value)) {
+			memset(rgba, 0, 4);
+			continue;
+		}
+
+		ValueToColor((value - min) / range, rgba);
+	}
+
+	gs_texture_set_image(tex, pixels.data(), cols * 4, false);
+}
+
+void BlockOverlay::Draw(uint32_t width, uint32_t height)
+{
+	if (!tex || !mapWidth || !mapHeight)
+		return;
+
+	if (!sampler) {
+		gs_sampler_info point_sampler = {};
+		point_sampler.max_anisotropy = 1;
+		sampler = gs_samplerstate_create(&point_sampler);
+	}
+
+	gs_effect_t *effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
+	gs_eparam_t *param = gs_effect_get_param_by_name(effect, "image");
+
+	gs_effect_set_next_sampler(param, sampler);
+	gs_effect_set_texture(param, tex);
+
+	/* The frame may have been downscaled after decoding */
+	const float scaleX = (float)width / (float)mapWidth;
+	const float scaleY = (float)height / (float)mapHeight;
+
+	gs_blend_state_push();
+	gs_enable_blending(true);
+	gs_blend_function(GS_BLEND_SRCALPHA, GS_BLEND_INVSRCALPHA);
+
+	gs_matrix_push();
+	gs_matrix_scale3f(scaleX * (float)blockSize, scaleY * (float)blockSize,
+			  1.0f);
+
+	while (gs_effect_loop(effect, "Draw"))
+		gs_draw_sprite(tex, 0, 0, 0);
+
+	gs_matrix_pop();
+	gs_blend_state_pop();
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <obs.h>
+
+#include <cmath>
+#include <vector>
+
+/* Per-block values covering a frame, e.g. QP or a quality metric */
+struct BlockMap {
+	/* Size of the frame the map covers */
+	uint32_t width = 0;
+	uint32_t height = 0;
+
+	/* Edge length of a single cell in pixels */
+	uint32_t block_size = 0;
+	uint32_t cols = 0;
+	uint32_t rows = 0;
+
+	/* Row-major, NaN for cells without a value */
+	std::vector<float> values;
+
+	void Reset(uint32_t width, uint32_t height, uint32_t block_size);
+	float &At(uint32_t col, uint32_t row) { return values[row * cols + col]; }
+	float At(uint32_t col, uint32_t row) const
+	{
+		return values[row * cols + col];
+	}
+};
+
+/* Copies the regions currently set on an encoder, in the order they were
+ * added. The encoders give the first one containing a block precedence. */
+void GetEncoderRegions(obs_encoder_t *encoder,
+		       std::vector<obs_encoder_roi> &regions);
+
+/* Checks whether a point lies in a region with non-zero effective priority.
+ * Like the encoders, the first region containing the point wins. */
+bool InsideRegions(const std::vector<obs_encoder_roi> &regions, uint32_t x,
+		   uint32_t y);
+/* InsideRegions() for the center of every block of a grid */
+void RegionMask(const std::vector<obs_encoder_roi> &regions, uint32_t cols,
+		uint32_t rows, uint32_t block_size, std::vector<uint8_t> &mask);
+
+/* Block texture drawn on top of the preview, must only be used in the
+ * graphics thread. */
+class BlockOverlay {
+public:
+	~BlockOverlay();
+
+	/* Values are mapped from [min, max] onto a blue -> green -> red ramp */
+	void Update(const BlockMap &map, float min, float max);
+	/* Draws the overlay into a frame of the given size (ortho units) */
+	void Draw(uint32_t width, uint32_t height);
+	void Clear();
+
+	bool Empty() const { return !tex; }
+
+private:
+	gs_texture_t *tex = nullptr;
+	gs_samplerstate_t *sampler = nullptr;
+
+	uint32_t mapWidth = 0;
+	uint32_t mapHeight = 0;
+	uint32_t blockSize = 0;
+	uint32_t cols = 0;
+	uint32_t rows = 0;
+
+	std::vector<uint8_t> pixels;
+};
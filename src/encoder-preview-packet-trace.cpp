@@ -0,0 +1,331 @@
+#include "encoder-preview-packet-trace.hpp"
+
+#include <util/platform.h>
+
+#include <cinttypes>
+#include <cstring>
+
+using namespace std;
+
+static constexpr char kMagic[8] = {'O', 'B', 'S', 'P', 'K', 'T', 'T', 'R'};
+static constexpr char kIndexMagic[8] = {'O', 'B', 'S', 'P',
+					'K', 'I', 'D', 'X'};
+static constexpr uint32_t kVersion = 1;
+static constexpr size_t kCodecSize = 16;
+static constexpr size_t kRecordSize = 48;
+static constexpr size_t kTrailerSize = 24;
+/* Decoders may read past the end of a packet */
+static constexpr size_t kPayloadPadding = 64;
+/* Sanity limit against garbage in damaged traces */
+static constexpr uint32_t kMaxPayload = 256 * 1024 * 1024;
+
+/*
+ * Little endian fields
+ */
+
+namespace {
+
+class Fields {
+public:
+	void PutInt(uint64_t val, size_t size)
+	{
+		for (size_t i = 0; i < size; i++)
+			data.push_back((uint8_t)(val >> (i * 8)));
+	}
+	void PutBytes(const void *src, size_t size)
+	{
+		auto bytes = static_cast<const uint8_t *>(src);
+		data.insert(data.end(), bytes, bytes + size);
+	}
+
+	bool WriteTo(FILE *file) const
+	{
+		size_t size = data.size();
+		return fwrite(data.data(), 1, size, file) == size;
+	}
+
+	vector<uint8_t> data;
+};
+
+class Reader {
+public:
+	Reader(const uint8_t *data, size_t size) : data(data), size(size) {}
+
+	uint64_t Get(size_t bytes)
+	{
+		uint64_t val = 0;
+		for (size_t i = 0; i < bytes && pos + i < size; i++)
+			val |= (uint64_t)data[pos + i] << (i * 8);
+		pos += bytes;
+		return val;
+	}
+
+	void Skip(size_t bytes) { pos += bytes; }
+
+private:
+	const uint8_t *data;
+	size_t size;
+	size_t pos = 0;
+};
+
+} // namespace
+
+static bool ReadExact(FILE *file, void *dst, size_t size)
+{
+	return fread(dst, 1, size, file) == size;
+}
+
+/*
+ * Writer
+ */
+
+bool PacketTraceWriter::Open(const string &path, const PacketTraceInfo &info)
+{
+	Close();
+
+	file = os_fopen(path.c_str(), "wb");
+	if (!file) {
+		blog(LOG_WARNING, "Failed to open '%s' for writing",
+		     path.c_str());
+		return false;
+	}
+
+	char codec[kCodecSize] = {};
+	strncpy(codec, info.codec.c_str(), kCodecSize - 1);
+
+	Fields header;
+	header.PutBytes(kMagic, sizeof(kMagic));
+	header.PutInt(kVersion, 4);
+	header.PutBytes(codec, kCodecSize);
+	header.PutInt(info.width, 4);
+	header.PutInt(info.height, 4);
+	header.PutInt((uint32_t)info.format, 4);
+	header.PutInt(info.extra_data.size(), 4);
+	header.PutBytes(info.extra_data.data(), info.extra_data.size());
+
+	if (!header.WriteTo(file)) {
+		blog(LOG_WARNING, "Failed to write trace header to '%s'",
+		     path.c_str());
+		fclose(file);
+		file = nullptr;
+		return false;
+	}
+
+	index.clear();
+	return true;
+}
+
+bool PacketTraceWriter::Write(const encoder_packet &pkt)
+{
+	if (!file)
+		return false;
+
+	int64_t offset = os_ftelli64(file);
+
+	Fields record;
+	record.PutInt((uint64_t)pkt.pts, 8);
+	record.PutInt((uint64_t)pkt.dts, 8);
+	record.PutInt((uint64_t)pkt.dts_usec, 8);
+	record.PutInt((uint64_t)pkt.sys_dts_usec, 8);
+	record.PutInt((uint32_t)pkt.timebase_num, 4);
+	record.PutInt((uint32_t)pkt.timebase_den, 4);
+	record.PutInt(pkt.keyframe ? 1 : 0, 1);
+	record.PutInt((uint8_t)pkt.drop_priority, 1);
+	record.PutInt(0, 2);
+	record.PutInt(pkt.size, 4);
+	record.PutBytes(pkt.data, pkt.size);
+
+	if (offset < 0 || !record.WriteTo(file)) {
+		blog(LOG_WARNING, "Failed to write packet to trace");
+		return false;
+	}
+
+	index.push_back((uint64_t)offset);
+	return true;
+}
+
+void PacketTraceWriter::Close()
+{
+	if (!file)
+		return;
+
+	int64_t offset = os_ftelli64(file);
+
+	Fields trailer;
+	for (uint64_t record : index)
+		trailer.PutInt(record, 8);
+	trailer.PutInt((uint64_t)offset, 8);
+	trailer.PutInt(index.size(), 8);
+	trailer.PutBytes(kIndexMagic, sizeof(kIndexMagic));
+
+	if (offset < 0 || !trailer.WriteTo(file))
+		blog(LOG_WARNING, "Failed to write trace index");
+
+	fclose(file);
+	file = nullptr;
+	index.clear();
+}
+
+/*
+ * Reader
+ */
+
+bool PacketTraceReader::Open(const string &path)
+{
+	Close();
+
+	file = os_fopen(path.c_str(), "rb");
+	if (!file) {
+		blog(LOG_WARNING, "Failed to open '%s'", path.c_str());
+		return false;
+	}
+
+	uint8_t fixed[sizeof(kMagic) + 4 + kCodecSize + 16];
+	if (!ReadExact(file, fixed, sizeof(fixed)) ||
+	    memcmp(fixed, kMagic, sizeof(kMagic)) != 0) {
+		blog(LOG_WARNING, "'%s' is not a packet trace", path.c_str());
+		Close();
+		return false;
+	}
+
+	Reader header(fixed + sizeof(kMagic), sizeof(fixed) - sizeof(kMagic));
+	uint32_t version = (uint32_t)header.Get(4);
+	if (version != kVersion) {
+		blog(LOG_WARNING, "Unsupported packet trace version %" PRIu32,
+		     version);
+		Close();
+		return false;
+	}
+
+	const char *codec = (const char *)fixed + sizeof(kMagic) + 4;
+	info.codec.assign(codec, strnlen(codec, kCodecSize));
+	header.Skip(kCodecSize);
+	info.width = (uint32_t)header.Get(4);
+	info.height = (uint32_t)header.Get(4);
+	info.format = (video_format)header.Get(4);
+
+	uint32_t extra_size = (uint32_t)header.Get(4);
+	if (extra_size <= kMaxPayload)
+		info.extra_data.resize(extra_size);
+	if (extra_size > kMaxPayload ||
+	    !ReadExact(file, info.extra_data.data(), extra_size)) {
+		blog(LOG_WARNING, "Packet trace '%s' is truncated",
+		     path.c_str());
+		Close();
+		return false;
+	}
+
+	os_fseeki64(file, 0, SEEK_END);
+	uint64_t file_size = (uint64_t)os_ftelli64(file);
+
+	if (!ReadIndex(file_size)) {
+		blog(LOG_INFO, "Packet trace '%s' has no index, scanning it",
+		     path.c_str());
+		ScanIndex(file_size);
+	}
+
+	return true;
+}
+
+void PacketTraceReader::Close()
+{
+	if (file)
+		fclose(file);
+
+	file = nullptr;
+	info = {};
+	index.clear();
+	payload.clear();
+}
+
+bool PacketTraceReader::ReadIndex(uint64_t file_size)
+{
+	uint8_t raw[kTrailerSize];
+
+	if (file_size < kTrailerSize ||
+	    os_fseeki64(file, (int64_t)(file_size - kTrailerSize), SEEK_SET) ||
+	    !ReadExact(file, raw, sizeof(raw)) ||
+	    memcmp(raw + 16, kIndexMagic, sizeof(kIndexMagic)) != 0)
+		return false;
+
+	Reader trailer(raw, sizeof(raw));
+	uint64_t offset = trailer.Get(8);
+	uint64_t count = trailer.Get(8);
+
+	if (count > file_size / 8 ||
+	    offset + count * 8 + kTrailerSize != file_size)
+		return false;
+
+	vector<uint8_t> entries(count * 8);
+	if (os_fseeki64(file, (int64_t)offset, SEEK_SET) ||
+	    !ReadExact(file, entries.data(), entries.size()))
+		return false;
+
+	Reader reader(entries.data(), entries.size());
+	index.resize(count);
+	for (uint64_t &record : index)
+		record = reader.Get(8);
+
+	return true;
+}
+
+/* Walks the records one by one, a partially written last one is ignored */
+void PacketTraceReader::ScanIndex(uint64_t file_size)
+{
+	index.clear();
+
+	uint64_t pos = (uint64_t)sizeof(kMagic) + 4 + kCodecSize + 16 +
+		       info.extra_data.size();
+
+	while (pos + kRecordSize <= file_size) {
+		uint8_t raw[kRecordSize];
+		if (os_fseeki64(file, (int64_t)pos, SEEK_SET) ||
+		    !ReadExact(file, raw, sizeof(raw)))
+			break;
+
+		uint32_t size = (uint32_t)Reader(raw + 44, 4).Get(4);
+		if (size > kMaxPayload || pos + kRecordSize + size > file_size)
+			break;
+
+		index.push_back(pos);
+		pos += kRecordSize + size;
+	}
+}
+
+bool PacketTraceReader::Read(size_t idx, encoder_packet &pkt)
+{
+	if (!file || idx >= index.size())
+		return false;
+
+	uint8_t raw[kRecordSize];
+	if (os_fseeki64(file, (int64_t)index[idx], SEEK_SET) ||
+	    !ReadExact(file, raw, sizeof(raw)))
+		return false;
+
+	Reader record(raw, sizeof(raw));
+
+	pkt = {};
+	pkt.type = OBS_ENCODER_VIDEO;
+	pkt.pts = (int64_t)record.Get(8);
+	pkt.dts = (int64_t)record.Get(8);
+	pkt.dts_usec = (int64_t)record.Get(8);
+	pkt.sys_dts_usec = (int64_t)record.Get(8);
+	pkt.timebase_num = (int32_t)record.Get(4);
+	pkt.timebase_den = (int32_t)record.Get(4);
+	pkt.keyframe = record.Get(1) != 0;
+	pkt.drop_priority = (int)record.Get(1);
+	record.Skip(2);
+	pkt.size = (size_t)record.Get(4);
+
+	if (pkt.size > kMaxPayload)
+		return false;
+
+	/* Zeroed padding, like FFmpeg expects of packet buffers */
+	payload.resize(pkt.size + kPayloadPadding);
+	memset(payload.data() + pkt.size, 0, kPayloadPadding);
+	if (!ReadExact(file, payload.data(), pkt.size))
+		return false;
+
+	pkt.data = payload.data();
+	return true;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <obs.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* Compact dump of encoder packets exactly as the preview receives them,
+ * for replaying the decode pipeline without OBS (see tools/preview-replay).
+ *
+ * Layout, all integers little endian:
+ *   header   "OBSPKTTR", version, codec, size, format, extra data
+ *   records  timestamps, timebase, flags, payload size and payload
+ *   index    offset of every record
+ *   trailer  offset of the index, record count, "OBSPKIDX"
+ *
+ * The index is only written when a trace is closed, traces that were cut
+ * short are still readable by scanning the records. */
+
+struct PacketTraceInfo {
+	std::string codec;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	/* What the encoder was fed, decides how the decoder pool is set up */
+	video_format format = VIDEO_FORMAT_NONE;
+	std::vector<uint8_t> extra_data;
+};
+
+class PacketTraceWriter {
+public:
+	PacketTraceWriter() = default;
+	~PacketTraceWriter() { Close(); }
+
+	PacketTraceWriter(const PacketTraceWriter &) = delete;
+	PacketTraceWriter &operator=(const PacketTraceWriter &) = delete;
+
+	bool Open(const std::string &path, const PacketTraceInfo &info);
+	bool Write(const encoder_packet &pkt);
+	/* Writes the index and trailer */
+	void Close();
+
+	bool IsOpen() const { return file != nullptr; }
+
+private:
+	FILE *file = nullptr;
+	std::vector<uint64_t> index;
+};
+
+class PacketTraceReader {
+public:
+	PacketTraceReader() = default;
+	~PacketTraceReader() { Close(); }
+
+	PacketTraceReader(const PacketTraceReader &) = delete;
+	PacketTraceReader &operator=(const PacketTraceReader &) = delete;
+
+	bool Open(const std::string &path);
+	void Close();
+
+	const PacketTraceInfo &Info() const { return info; }
+	size_t Count() const { return index.size(); }
+
+	/* Packet data stays valid until the next call */
+	bool Read(size_t idx, encoder_packet &pkt);
+
+private:
+	bool ReadIndex(uint64_t file_size);
+	void ScanIndex(uint64_t file_size);
+
+	FILE *file = nullptr;
+	PacketTraceInfo info;
+	std::vector<uint64_t> index;
+	std::vector<uint8_t> payload;
+};
@@ -0,0 +1,1212 @@
+#include "encoder-preview-pipeline.hpp"
+#include "plugin-profiler.hpp"
+#include "roi-history.hpp"
+#include "roi-regions.hpp"
+
+#include <util/platform.h>
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+using namespace std;
+
+/* Roughly five seconds of video at 60 fps */
+static constexpr size_t kMaxPendingPackets = 300;
+/* Macroblock size of H.264, fine enough to show the region edges */
+static constexpr uint32_t kRoiOverlayBlock = 16;
+/* QP maps of frames the scheduler has yet to present, it holds fewer */
+static constexpr size_t kMaxPendingQpMaps = 32;
+
+/* Per-instance data of the "encoder_preview" output type. The pipeline is
+ * attached right after the output has been created. */
+struct OutputContext {
+	PreviewPipeline *pipeline = nullptr;
+};
+
+PreviewPipeline::PreviewPipeline(const char *output_name,
+				 const char *source_name)
+	: strand([this]() { Decode(); }),
+	  network([this](packet &&pkt) { QueuePacket(std::move(pkt)); }),
+	  scheduler([this](AVFrame *frame, uint64_t capture_ts) {
+		  PresentFrame(frame, capture_ts);
+	  }),
+	  replay([this](AVFrame *frame, uint64_t capture_ts) {
+		  PresentReplayFrame(frame, capture_ts);
+	  })
+{
+	RegisterTypes();
+
+	previewOut = obs_output_create("encoder_preview", output_name, nullptr,
+				       nullptr);
+	if (previewOut) {
+		auto ctx = static_cast<OutputContext *>(
+			obs_obj_get_data(previewOut));
+		ctx->pipeline = this;
+	}
+
+	previewSource = obs_source_create_private("encoder_preview_source",
+						  source_name, nullptr);
+	/* Frames are paced by our own scheduler */
+	obs_source_set_async_unbuffered(previewSource, true);
+
+	signal_handler_t *signals = obs_source_get_signal_handler(previewSource);
+	showSignal.Connect(signals, "show", SourceShown, this);
+	hideSignal.Connect(signals, "hide", SourceHidden, this);
+
+	if (previewOut)
+		deactivateSignal.Connect(
+			obs_output_get_signal_handler(previewOut), "deactivate",
+			OutputDeactivated, this);
+
+	controlThread = std::thread(&PreviewPipeline::ControlThread, this);
+}
+
+PreviewPipeline::~PreviewPipeline()
+{
+	/* Carries out everything still queued, including this stop */
+	Stop();
+
+	{
+		lock_guard lock(controlMutex);
+		controlStopping = true;
+	}
+
+	controlCond.notify_all();
+	controlThread.join();
+
+	deactivateSignal.Disconnect();
+	showSignal.Disconnect();
+	hideSignal.Disconnect();
+
+	if (previewOut) {
+		auto ctx = static_cast<OutputContext *>(
+			obs_obj_get_data(previewOut));
+		ctx->pipeline = nullptr;
+	}
+}
+
+void PreviewPipeline::RegisterTypes()
+{
+	static once_flag once;
+
+	call_once(once, []() {
+		obs_output_info info = {};
+		info.id = "encoder_preview";
+		info.flags = OBS_OUTPUT_VIDEO | OBS_OUTPUT_ENCODED;
+		info.get_name = [](void *) {
+			return "Encoder Preview";
+		};
+		info.encoded_video_codecs = "h264;hevc;av1";
+
+		info.create = [](obs_data_t *, obs_output_t *) {
+			return static_cast<void *>(new OutputContext);
+		};
+		info.destroy = [](void *data) {
+			delete static_cast<OutputContext *>(data);
+		};
+		info.start = [](void *data) -> bool {
+			auto ctx = static_cast<OutputContext *>(data);
+			return ctx->pipeline && ctx->pipeline->StartOutput();
+		};
+		info.stop = [](void *data, uint64_t) {
+			auto ctx = static_cast<OutputContext *>(data);
+			if (ctx->pipeline)
+				ctx->pipeline->StopOutput();
+		};
+		info.encoded_packet = [](void *data, encoder_packet *pkt) {
+			auto ctx = static_cast<OutputContext *>(data);
+			if (ctx->pipeline)
+				ctx->pipeline->ReceivePacket(pkt);
+		};
+
+		obs_register_output(&info);
+
+		obs_source_info src = {};
+		src.id = "encoder_preview_source";
+		src.type = OBS_SOURCE_TYPE_INPUT;
+		src.output_flags = OBS_SOURCE_ASYNC_VIDEO |
+				   OBS_SOURCE_DO_NOT_DUPLICATE |
+				   OBS_SOURCE_CAP_DISABLED;
+		src.get_name = [](void *) {
+			return "Encoder Preview Source";
+		};
+		// Required, even though they do nothing
+		src.create = [](obs_data_t *, obs_source_t *) {
+			auto placeholder = new std::array<char, 0>;
+			return static_cast<void *>(placeholder);
+		};
+		src.destroy = [](void *data) {
+			auto placeholder =
+				static_cast<std::array<char, 0> *>(data);
+			delete placeholder;
+		};
+
+		obs_register_source(&src);
+	});
+}
+
+/*
+ * Control
+ */
+
+bool PreviewPipeline::Start(obs_encoder_t *enc)
+{
+	if (!previewOut || !enc)
+		return false;
+
+	Status expected = INACTIVE;
+	if (!state.compare_exchange_strong(expected, WAITING))
+		return false;
+
+	QueueRequest(RequestStart, enc);
+	return true;
+}
+
+void PreviewPipeline::Stop()
+{
+	if (!previewOut || state == INACTIVE || state == STOPPING)
+		return;
+
+	state = STOPPING;
+	QueueRequest(RequestStop, nullptr);
+}
+
+bool PreviewPipeline::Switch(obs_encoder_t *enc)
+{
+	if (!previewOut || !enc || state == INACTIVE || state == STOPPING)
+		return false;
+
+	QueueRequest(RequestSwitch, enc);
+	return true;
+}
+
+void PreviewPipeline::SetStatus(Status status)
+{
+	state = status;
+	NotifyStatus();
+}
+
+void PreviewPipeline::NotifyStatus()
+{
+	if (statusCallback)
+		statusCallback(state);
+}
+
+void PreviewPipeline::SetPreviewSize(uint32_t cx, uint32_t cy)
+{
+	previewCx = cx;
+	previewCy = cy;
+}
+
+void PreviewPipeline::SetTargetDelay(uint64_t delay_ns)
+{
+	scheduler.SetTargetDelay(delay_ns);
+}
+
+void PreviewPipeline::SetDelayGroup(shared_ptr<DelayGroup> group)
+{
+	scheduler.SetDelayGroup(std::move(group));
+}
+
+void PreviewPipeline::SetOverlay(int mode)
+{
+	lock_guard lock(overlayMutex);
+	overlayMode = mode;
+	overlayMap.Reset(0, 0, 1);
+	overlayDirty = true;
+	pendingQpMaps.clear();
+	qualityGeneration = 0;
+}
+
+void PreviewPipeline::SetQualityAnalysis(bool enable)
+{
+	qualityAnalysis = enable;
+
+	if (state == INACTIVE)
+		return;
+
+	if (enable)
+		analyzer.Start(obs_output_get_video_encoder(previewOut));
+	else
+		analyzer.Stop();
+}
+
+void PreviewPipeline::SetRoiAbTest(bool enable)
+{
+	roiAbTest = enable;
+
+	if (state == INACTIVE)
+		return;
+
+	if (enable)
+		abTest.Start(obs_output_get_video_encoder(previewOut));
+	else
+		abTest.Stop();
+}
+
+void PreviewPipeline::SetNetworkSimulation(bool enable)
+{
+	if (enable == simulateNetwork)
+		return;
+
+	if (enable) {
+		if (state != INACTIVE)
+			network.Start(obs_encoder_get_codec(
+				obs_output_get_video_encoder(previewOut)));
+		simulateNetwork = true;
+		return;
+	}
+
+	simulateNetwork = false;
+	network.Stop();
+
+	/* Packets still on the link are gone */
+	lock_guard lock(packetMutex);
+	packets.clear();
+	waitForKeyframe = true;
+	resync = true;
+}
+
+void PreviewPipeline::SetNetworkConfig(const NetworkSimulator::Config &config)
+{
+	network.SetConfig(config);
+}
+
+void PreviewPipeline::Render(uint32_t width, uint32_t height)
+{
+	obs_source_video_render(previewSource);
+	latency.FrameDrawn(os_gettime_ns());
+
+	if (overlayMode == OverlayNone)
+		return;
+
+	overlayMutex.lock();
+	if (overlayDirty) {
+		overlay.Update(overlayMap, overlayMin, overlayMax);
+		overlayDirty = false;
+	}
+	overlayMutex.unlock();
+
+	overlay.Draw(width, height);
+}
+
+PreviewPipeline::Stats PreviewPipeline::TakeStats()
+{
+	Stats ret;
+
+	{
+		lock_guard lock(packetMutex);
+
+		uint64_t now = os_gettime_ns();
+
+		uint64_t bitsBetween = bytes * 8;
+		long double timePassed =
+			(long double)(now - lastStatsTime) / 1000000000.0l;
+		ret.kbps = (long double)bitsBetween / timePassed / 1000.0l;
+		ret.packets = packetCount;
+		ret.meanPacket = packetCount ? bytes / packetCount : 0;
+		ret.maxPacket = maxPacket;
+		ret.droppedPackets = droppedPackets;
+
+		bytes = 0;
+		packetCount = 0;
+		maxPacket = 0;
+		droppedPackets = 0;
+		lastStatsTime = now;
+	}
+
+	ret.convertFrames = convertFrames.exchange(0);
+	uint64_t convertNs = convertTime.exchange(0);
+	if (ret.convertFrames)
+		ret.convertMs = (double)convertNs / (double)ret.convertFrames /
+				1e6;
+
+	ret.presentation = scheduler.GetStats(true);
+	ret.bitstream = bitstream.TakeStats();
+
+	/* Bitrate can change while encoding */
+	obs_encoder_t *enc = obs_output_get_video_encoder(previewOut);
+	VbvModel::Config rate_control;
+	if (enc && VbvModel::ReadConfig(enc, rate_control))
+		vbv.Update(rate_control);
+
+	ret.vbv = vbv.TakeStats();
+	ret.network = network.TakeStats();
+	ret.latency = latency.TakeStats();
+	ret.governor = governor.GetStats();
+	ret.abTest = abTest.GetStats();
+
+	if (!firstFramePending)
+		ret.firstFrameMs = (double)firstFrameTime / 1e6;
+	ret.decoderReused = decoderReused;
+	ret.suspended = suspended && state != INACTIVE;
+
+	lock_guard lock(overlayMutex);
+	ret.qp = qpStats;
+	qpStats = {};
+
+	return ret;
+}
+
+vector<QualityAnalyzer::Result> PreviewPipeline::TakeQualityResults()
+{
+	vector<QualityAnalyzer::Result> results = analyzer.TakeResults();
+
+	for (const QualityAnalyzer::Result &res : results)
+		abTest.PushPsnr(res.timestamp, res.psnr);
+
+	return results;
+}
+
+bool PreviewPipeline::StartCapture(const string &path,
+				   PacketCapture::Container container)
+{
+	StopCapture();
+
+	obs_encoder_t *enc = obs_output_get_video_encoder(previewOut);
+	if (state == INACTIVE || !enc)
+		return false;
+
+	auto new_capture = make_shared<PacketCapture>();
+	if (!new_capture->Start(path, enc, container))
+		return false;
+
+	lock_guard lock(captureMutex);
+	capture = std::move(new_capture);
+	return true;
+}
+
+string PreviewPipeline::EncoderName()
+{
+	lock_guard lock(captureMutex);
+	return encoderName;
+}
+
+shared_ptr<PacketCapture> PreviewPipeline::TakeCapture()
+{
+	shared_ptr<PacketCapture> old_capture;
+
+	captureMutex.lock();
+	old_capture.swap(capture);
+	captureMutex.unlock();
+
+	return old_capture;
+}
+
+void PreviewPipeline::StopCapture()
+{
+	shared_ptr<PacketCapture> old_capture = TakeCapture();
+	if (!old_capture)
+		return;
+
+	/* The writer may still have plenty of packets queued, waiting for it
+	 * to flush them would freeze the UI. */
+	QueueRequest({RequestFinishCapture, nullptr, os_gettime_ns(),
+		      std::move(old_capture)});
+}
+
+bool PreviewPipeline::Capturing()
+{
+	lock_guard lock(captureMutex);
+	return capture != nullptr;
+}
+
+bool PreviewPipeline::GetCaptureStats(string &path,
+				      PacketCapture::Stats &stats)
+{
+	captureMutex.lock();
+	shared_ptr<PacketCapture> current = capture;
+	captureMutex.unlock();
+
+	if (!current)
+		return false;
+
+	path = current->Path();
+	stats = current->GetStats();
+	return true;
+}
+
+/*
+ * Control thread
+ */
+
+void PreviewPipeline::QueueRequest(RequestType type, obs_encoder_t *enc)
+{
+	QueueRequest({type, OBSEncoder(enc), os_gettime_ns(), nullptr});
+}
+
+void PreviewPipeline::QueueRequest(Request &&request)
+{
+	{
+		lock_guard lock(controlMutex);
+		requests.push_back(std::move(request));
+	}
+
+	controlCond.notify_all();
+}
+
+void PreviewPipeline::ControlThread()
+{
+	os_set_thread_name("encoder-preview: control");
+
+	unique_lock lock(controlMutex);
+
+	for (;;) {
+		controlCond.wait(lock, [&]() {
+			return controlStopping || !requests.empty();
+		});
+
+		/* Stopping only once everything queued has been done */
+		if (requests.empty())
+			break;
+
+		Request request = std::move(requests.front());
+		requests.pop_front();
+
+		lock.unlock();
+
+		switch (request.type) {
+		case RequestStart:
+			StartRequested(request.encoder, request.time);
+			break;
+		case RequestStop:
+			StopRequested();
+			break;
+		case RequestSwitch:
+			SwitchRequested(request.encoder, request.time);
+			break;
+		case RequestFinishCapture:
+			request.capture->Stop();
+			break;
+		}
+
+		lock.lock();
+	}
+}
+
+void PreviewPipeline::StartRequested(obs_encoder_t *enc, uint64_t time)
+{
+	/* Stopped again before we got to it */
+	if (state != WAITING)
+		return;
+
+	requestTime = time;
+	firstFramePending = true;
+
+	obs_encoder_set_video(enc, obs_get_video());
+	obs_output_set_video_encoder(previewOut, enc);
+
+	if (!StartOutputAndWait()) {
+		obs_output_set_video_encoder(previewOut, nullptr);
+		SetStatus(INACTIVE);
+		return;
+	}
+
+	NotifyStatus();
+}
+
+void PreviewPipeline::StopRequested()
+{
+	StopOutputAndWait();
+	obs_output_set_video_encoder(previewOut, nullptr);
+	SetStatus(INACTIVE);
+}
+
+void PreviewPipeline::SwitchRequested(obs_encoder_t *enc, uint64_t time)
+{
+	if (state == INACTIVE || state == STOPPING)
+		return;
+	if (obs_output_get_video_encoder(previewOut) == enc)
+		return;
+
+	/* The decoder and the last frame stay around, the preview freezes
+	 * until the new encoder's first keyframe has been decoded. */
+	switching = true;
+	StopOutputAndWait();
+
+	requestTime = time;
+	firstFramePending = true;
+
+	obs_encoder_set_video(enc, obs_get_video());
+	obs_output_set_video_encoder(previewOut, enc);
+
+	bool success = StartOutputAndWait();
+	switching = false;
+
+	if (!success) {
+		ReleaseDecoder();
+		obs_output_set_video_encoder(previewOut, nullptr);
+		SetStatus(INACTIVE);
+		return;
+	}
+
+	/* Status is unchanged, but whoever listens may want to know */
+	NotifyStatus();
+}
+
+bool PreviewPipeline::StartOutputAndWait()
+{
+	{
+		lock_guard lock(controlMutex);
+		outputRunning = true;
+	}
+
+	if (obs_output_start(previewOut))
+		return true;
+
+	lock_guard lock(controlMutex);
+	outputRunning = false;
+	return false;
+}
+
+void PreviewPipeline::StopOutputAndWait()
+{
+	controlMutex.lock();
+	bool running = outputRunning;
+	controlMutex.unlock();
+
+	/* Otherwise it failed to start or has already stopped by itself */
+	if (running)
+		obs_output_stop(previewOut);
+
+	{
+		unique_lock lock(controlMutex);
+		controlCond.wait(lock, [&]() { return !outputRunning; });
+	}
+
+	/* libobs only marks the output as inactive after the "deactivate"
+	 * handlers returned, the encoder cannot be changed until then. */
+	while (obs_output_active(previewOut))
+		os_sleep_ms(1);
+}
+
+void PreviewPipeline::OutputDeactivated(void *param, calldata_t *)
+{
+	auto pipeline = static_cast<PreviewPipeline *>(param);
+	pipeline->EndOutput();
+}
+
+/*
+ * Output implementation
+ */
+
+bool PreviewPipeline::StartOutput()
+{
+	if (!obs_output_can_begin_data_capture(previewOut, 0))
+		return false;
+	if (!obs_output_initialize_encoders(previewOut, 0))
+		return false;
+
+	OBSEncoder enc = obs_output_get_video_encoder(previewOut);
+	if (!enc)
+		return false;
+
+	if (!OpenDecoder(enc))
+		return false;
+
+	{
+		const char *name = obs_encoder_get_name(enc);
+		lock_guard lock(captureMutex);
+		encoderName = name ? name : "";
+	}
+
+	{
+		lock_guard lock(packetMutex);
+		packets.clear();
+		waitForKeyframe = false;
+		resync = false;
+	}
+
+	latency.Reset();
+	bitstream.Start(obs_encoder_get_codec(enc));
+
+	VbvModel::Config rate_control;
+	if (!VbvModel::ReadConfig(enc, rate_control))
+		blog(LOG_DEBUG, "Encoder is not rate controlled, not modelling "
+				"its buffer.");
+	vbv.Start(rate_control);
+
+	if (simulateNetwork)
+		network.Start(obs_encoder_get_codec(enc));
+
+	if (qualityAnalysis)
+		analyzer.Start(enc);
+	if (roiAbTest)
+		abTest.Start(enc);
+
+	replay.Start(enc);
+	scheduler.Start();
+	strand.Open();
+
+	if (!obs_output_begin_data_capture(previewOut, 0)) {
+		EndSession();
+		ReleaseDecoder();
+		return false;
+	}
+
+	return true;
+}
+
+void PreviewPipeline::StopOutput()
+{
+	/* The rest happens in EndOutput() once the encoder is disconnected */
+	obs_output_end_data_capture(previewOut);
+}
+
+bool PreviewPipeline::OpenDecoder(obs_encoder_t *enc)
+{
+	const char *codec = obs_encoder_get_codec(enc);
+
+	/* When switching between encoders of the same codec the decoder only
+	 * has to forget about the old stream. */
+	decoderReused = codecContext && decoderCodec == codec;
+
+	if (decoderReused) {
+		avcodec_flush_buffers(codecContext);
+	} else {
+		DestroyCodecContext(&codecContext);
+		if (!CreateCodecContext(&codecContext, enc))
+			return false;
+		decoderCodec = codec;
+	}
+
+	if (!SendExtraData(codecContext, enc)) {
+		// Can fail, but doesn't seem to actually be necessary
+		blog(LOG_DEBUG, "Sending extra data failed.");
+	}
+
+	if (!decoded)
+		decoded = av_frame_alloc();
+	if (!converted)
+		converted = av_frame_alloc();
+	gotKeyframe = false;
+
+	governor.Reset();
+	SetDecodeLevel(DecodeGovernor::LevelFull);
+
+	return true;
+}
+
+void PreviewPipeline::ReleaseDecoder()
+{
+	obs_source_output_video(previewSource, nullptr);
+
+	DestroyCodecContext(&codecContext);
+	decoderCodec.clear();
+	av_frame_free(&converted);
+	av_frame_free(&decoded);
+	converter.Reset();
+}
+
+void PreviewPipeline::EndOutput()
+{
+	EndSession();
+
+	/* A switch starts the output again right away */
+	if (switching) {
+		lock_guard lock(controlMutex);
+		outputRunning = false;
+		controlCond.notify_all();
+		return;
+	}
+
+	ReleaseDecoder();
+
+	bool requested;
+
+	{
+		lock_guard lock(controlMutex);
+		outputRunning = false;
+		requested = state == STOPPING;
+		controlCond.notify_all();
+	}
+
+	/* The output stopped by itself, e.g. because the encoder failed */
+	if (!requested)
+		SetStatus(INACTIVE);
+}
+
+void PreviewPipeline::EndSession()
+{
+	/* Already off the UI thread, the capture ends with the session */
+	if (shared_ptr<PacketCapture> old_capture = TakeCapture())
+		old_capture->Stop();
+	bitstream.Stop();
+	vbv.Stop();
+	network.Stop();
+	strand.Close();
+	replay.Stop();
+
+	analyzer.Stop();
+	abTest.Stop();
+	/* Frames of the old stream must not be shown after a switch */
+	scheduler.Stop();
+
+	regionsValid = false;
+
+	overlayMutex.lock();
+	overlayMap.Reset(0, 0, 1);
+	overlayDirty = true;
+	pendingQpMaps.clear();
+	overlayMutex.unlock();
+
+	lock_guard lock(packetMutex);
+	packets.clear();
+}
+
+void PreviewPipeline::ReceivePacket(encoder_packet *pkt)
+{
+	PERF_SCOPE("ReceivePacket");
+
+	/* Due to a bug in libobs only encoder packets from the interleaved
+	 * callback are ref-counted, and since we don't need interleaving we
+	 * get the raw data from the encoder, meaning we have to make our own
+	 * copy (using some RAII sugar). The copy is shared by the decoder and
+	 * the capture. */
+	latency.PacketArrived(pkt->pts, os_gettime_ns());
+	TraceRecorder::Instant("Packet arrived", "pts", pkt->pts);
+	packet copy(pkt);
+
+	captureMutex.lock();
+	shared_ptr<PacketCapture> current = capture;
+	captureMutex.unlock();
+
+	if (current)
+		current->Push(copy);
+
+	replay.Push(copy);
+	bitstream.Push(copy);
+	vbv.Push(pkt);
+	abTest.PushPacket(pkt);
+
+	{
+		lock_guard lock(packetMutex);
+		bytes += pkt->size;
+		packetCount++;
+		if (pkt->size > maxPacket)
+			maxPacket = pkt->size;
+	}
+
+	if (simulateNetwork)
+		network.Push(copy);
+	else
+		QueuePacket(std::move(copy));
+}
+
+void PreviewPipeline::QueuePacket(packet &&pkt)
+{
+	{
+		lock_guard lock(packetMutex);
+
+		/* The decoder is not keeping up, rather than letting the delay
+		 * grow without bounds skip ahead to the next keyframe. */
+		if (packets.size() >= kMaxPendingPackets) {
+			droppedPackets += packets.size();
+			packets.clear();
+			waitForKeyframe = true;
+			resync = true;
+		}
+
+		suspended = decoding && !Watched();
+
+		if (!decoding || suspended) {
+			packets.clear();
+			waitForKeyframe = true;
+			resync = true;
+			return;
+		}
+
+		if (waitForKeyframe && !pkt.m_pkt.keyframe) {
+			droppedPackets++;
+			return;
+		}
+
+		if (keyframesOnly && !pkt.m_pkt.keyframe)
+			return;
+
+		waitForKeyframe = false;
+		packets.push_back(std::move(pkt));
+	}
+
+	strand.Schedule();
+}
+
+void PreviewPipeline::Decode()
+{
+	vector<packet> pkts;
+	bool flush;
+
+	packetMutex.lock();
+	pkts.swap(packets);
+	flush = resync;
+	resync = false;
+	packetMutex.unlock();
+
+	/* Frames held back for reordering belong to before the gap */
+	if (flush)
+		avcodec_flush_buffers(codecContext);
+
+	/* A batch runs on one worker from start to end */
+	uint64_t cpu_start = ThreadCpuTimeNs();
+
+	for (const packet &ctn : pkts)
+		DecodePacket(&ctn.m_pkt);
+
+	governor.AddCpuTime(ThreadCpuTimeNs() - cpu_start);
+	governor.Update(os_gettime_ns());
+}
+
+void PreviewPipeline::SetDecodeLevel(DecodeGovernor::Level level)
+{
+	/* Keyframes only is handled by not sending anything else */
+	bool reduced = level == DecodeGovernor::LevelReferenceOnly;
+
+	codecContext->skip_frame = reduced ? AVDISCARD_NONREF
+					   : AVDISCARD_DEFAULT;
+	codecContext->skip_loop_filter = reduced ? AVDISCARD_ALL
+						 : AVDISCARD_DEFAULT;
+	decodeLevel = level;
+}
+
+void PreviewPipeline::DecodePacket(const encoder_packet *pkt)
+{
+	const AVRational time_base = {pkt->timebase_num, pkt->timebase_den};
+
+	/* libobs gives us the system time of each packet's DTS, which is
+	 * offset from the capture time by the encoder's reordering delay.
+	 * The first keyframe tells us how large that delay is. */
+	if (!gotKeyframe && pkt->keyframe)
+		dtsShift = pkt->pts - pkt->dts;
+
+	// Wait for keyframe to start decoding
+	gotKeyframe = gotKeyframe || pkt->keyframe;
+	if (!gotKeyframe)
+		return;
+
+	/* Decoding can get cheaper right away, leaving keyframes only needs
+	 * a keyframe to start from. */
+	DecodeGovernor::Level level =
+		keyframesOnly ? DecodeGovernor::LevelKeyframesOnly
+			      : governor.GetLevel();
+	if (level > decodeLevel ||
+	    (level < decodeLevel &&
+	     (decodeLevel != DecodeGovernor::LevelKeyframesOnly ||
+	      pkt->keyframe)))
+		SetDecodeLevel(level);
+
+	bool keyframes_only = decodeLevel == DecodeGovernor::LevelKeyframesOnly;
+	if (keyframes_only && !pkt->keyframe)
+		return;
+
+	captureOffset = pkt->dts_usec * 1000 -
+			av_rescale_q(pkt->dts + dtsShift, time_base,
+				     {1, 1000000000});
+
+	latency.DecodeStarted(pkt->pts,
+			      captureOffset + av_rescale_q(pkt->pts, time_base,
+							   {1, 1000000000}),
+			      os_gettime_ns());
+
+	bool sent;
+	{
+		PERF_SCOPE("avcodec_send_packet");
+		sent = SendPacket(codecContext, pkt);
+	}
+
+	// ToDo: FFmpeg error handling
+	if (!sent)
+		return;
+
+	/* Nothing follows to reorder the keyframe with, get it out now */
+	if (keyframes_only)
+		DrainDecoder(codecContext);
+
+	auto receive = [this]() {
+		PERF_SCOPE("avcodec_receive_frame");
+		return ReceiveFrame(codecContext, decoded);
+	};
+
+	while (receive()) {
+		int64_t capture_ts =
+			captureOffset +
+			av_rescale_q(decoded->best_effort_timestamp, time_base,
+				     {1, 1000000000});
+
+		latency.FrameDecoded(decoded->pts, (uint64_t)capture_ts,
+				     os_gettime_ns());
+
+		if (analyzer.Active())
+			analyzer.PushDecoded(decoded, (uint64_t)capture_ts);
+
+		/* Block positions are those of the decoded size, a scaled
+		 * copy only carries them over. */
+		UpdateQpStats(decoded, (uint64_t)capture_ts);
+
+		uint32_t max_cx = scaleToPreview ? previewCx.load() : 0;
+		uint32_t max_cy = scaleToPreview ? previewCy.load() : 0;
+
+		AVFrame *out =
+			converter.Convert(decoded, converted, max_cx, max_cy);
+		if (!out) {
+			av_frame_unref(decoded);
+			continue;
+		}
+
+		if (out != decoded) {
+			convertTime += converter.LastCost();
+			convertFrames++;
+		}
+
+		scheduler.Push(out, (uint64_t)capture_ts);
+
+		/* The scheduler holds its own reference */
+		av_frame_unref(converted);
+		av_frame_unref(decoded);
+	}
+
+	if (keyframes_only)
+		avcodec_flush_buffers(codecContext);
+}
+
+/* Showing counts scenes, projectors and the multiview, not our dialog */
+void PreviewPipeline::SourceShown(void *param, calldata_t *)
+{
+	static_cast<PreviewPipeline *>(param)->sourceShowing = true;
+}
+
+void PreviewPipeline::SourceHidden(void *param, calldata_t *)
+{
+	static_cast<PreviewPipeline *>(param)->sourceShowing = false;
+}
+
+/*
+ * Presentation
+ */
+
+void PreviewPipeline::RefreshRegions()
+{
+	obs_encoder_t *enc = obs_output_get_video_encoder(previewOut);
+	if (!enc)
+		return;
+
+	uint32_t increment = obs_encoder_get_roi_increment(enc);
+	if (regionsValid && increment == roiIncrement)
+		return;
+
+	GetEncoderRegions(enc, regions);
+
+	roiIncrement = increment;
+	regionsValid = true;
+	roiMask.clear();
+}
+
+void PreviewPipeline::UpdateQpStats(const AVFrame *av_frame,
+				    uint64_t capture_ts)
+{
+	int max_qp = ExtractQpMap(av_frame, qpMap);
+	if (!max_qp)
+		return;
+
+	RefreshRegions();
+
+	/* Which cells are covered by regions only changes with the regions */
+	const size_t cells = qpMap.values.size();
+	if (roiMask.size() != cells || roiMaskBlock != qpMap.block_size) {
+		roiMaskBlock = qpMap.block_size;
+		RegionMask(regions, qpMap.cols, qpMap.rows, qpMap.block_size,
+			   roiMask);
+	}
+
+	double sum = 0.0, inside = 0.0, outside = 0.0;
+	uint64_t count = 0, inside_count = 0, outside_count = 0;
+
+	for (size_t idx = 0; idx < cells; idx++) {
+		float value = qpMap.values[idx];
+		if (std::isnan(value))
+			continue;
+
+		sum += value;
+		count++;
+
+		if (roiMask[idx]) {
+			inside += value;
+			inside_count++;
+		} else {
+			outside += value;
+			outside_count++;
+		}
+	}
+
+	if (!count)
+		return;
+
+	abTest.PushQp(capture_ts, sum / (double)count);
+
+	lock_guard lock(overlayMutex);
+
+	qpStats.sum += sum / (double)count;
+	qpStats.frames++;
+
+	if (inside_count) {
+		qpStats.insideSum += inside / (double)inside_count;
+		qpStats.insideFrames++;
+	}
+	if (outside_count) {
+		qpStats.outsideSum += outside / (double)outside_count;
+		qpStats.outsideFrames++;
+	}
+
+	/* Shown once the scheduler presents the frame */
+	if (overlayMode == OverlayQp) {
+		pendingQpMaps.push_back({capture_ts, qpMap, max_qp});
+		if (pendingQpMaps.size() > kMaxPendingQpMaps)
+			pendingQpMaps.pop_front();
+	}
+}
+
+void PreviewPipeline::UpdateQpOverlay(uint64_t capture_ts)
+{
+	if (overlayMode != OverlayQp)
+		return;
+
+	lock_guard lock(overlayMutex);
+
+	/* Frames the scheduler dropped are skipped along with their maps */
+	bool found = false;
+	while (!pendingQpMaps.empty() &&
+	       pendingQpMaps.front().captureTs <= capture_ts) {
+		PendingQpMap &pending = pendingQpMaps.front();
+		overlayMap = std::move(pending.map);
+		overlayMin = (float)(pending.maxQp / 5);
+		overlayMax = (float)pending.maxQp;
+		pendingQpMaps.pop_front();
+		found = true;
+	}
+
+	overlayDirty = overlayDirty || found;
+}
+
+void PreviewPipeline::UpdateQualityOverlay()
+{
+	const int mode = overlayMode;
+	if (mode != OverlayPsnr && mode != OverlaySsim)
+		return;
+
+	lock_guard lock(overlayMutex);
+
+	BlockMap map;
+	if (!analyzer.GetBlockMap(map, mode == OverlaySsim, qualityGeneration))
+		return;
+
+	overlayMap = std::move(map);
+	/* Inverted ramp, low quality is red */
+	overlayMin = mode == OverlaySsim ? 1.0f : 50.0f;
+	overlayMax = mode == OverlaySsim ? 0.8f : 20.0f;
+	overlayDirty = true;
+}
+
+void PreviewPipeline::UpdateRoiOverlay(uint64_t capture_ts)
+{
+	if (overlayMode != OverlayRoi)
+		return;
+
+	obs_encoder_t *enc = obs_output_get_video_encoder(previewOut);
+	if (!enc)
+		return;
+
+	/* Regions that were not set by the editor, or were set before the
+	 * history reaches back, can only be shown as they are now. Both are
+	 * in the order the regions were added. */
+	uint64_t sequence = overlayRegionsSequence;
+	if (!RoiHistory::Shared().GetRegionsAt(enc, capture_ts, overlayRegions,
+					       sequence)) {
+		GetEncoderRegions(enc, overlayRegions);
+		sequence = 0;
+	}
+
+	uint32_t width = obs_encoder_get_width(enc);
+	uint32_t height = obs_encoder_get_height(enc);
+
+	lock_guard lock(overlayMutex);
+
+	if (sequence && sequence == overlayRegionsSequence &&
+	    overlayMap.width == width && overlayMap.height == height)
+		return;
+
+	overlayRegionsSequence = sequence;
+	overlayMap.Reset(width, height, kRoiOverlayBlock);
+
+	/* Like in the encoders the first region containing a block wins,
+	 * painted last. Regions without priority cover blocks with NAN, the
+	 * encoders reset their offset to zero as well. */
+	for (auto roi = overlayRegions.rbegin(); roi != overlayRegions.rend();
+	     ++roi) {
+		RoiBlockRect rect = RegionToBlocks(*roi, kRoiOverlayBlock);
+		float value = roi->priority != 0.0f ? roi->priority : NAN;
+
+		for (uint32_t row = rect.top;
+		     row < std::min(rect.bottom, overlayMap.rows); row++) {
+			for (uint32_t col = rect.left;
+			     col < std::min(rect.right, overlayMap.cols); col++)
+				overlayMap.At(col, row) = value;
+		}
+	}
+
+	overlayMin = -1.0f;
+	overlayMax = 1.0f;
+	overlayDirty = true;
+}
+
+void PreviewPipeline::PresentFrame(AVFrame *av_frame, uint64_t capture_ts)
+{
+	UpdateQpOverlay(capture_ts);
+	UpdateQualityOverlay();
+
+	lock_guard lock(presentMutex);
+
+	/* Live frames keep being decoded for the stats while paused */
+	if (replay.Paused())
+		return;
+
+	UpdateRoiOverlay(capture_ts);
+	latency.FrameOutput(capture_ts);
+	OutputFrame(av_frame, capture_ts);
+}
+
+void PreviewPipeline::PresentReplayFrame(AVFrame *av_frame,
+					 uint64_t capture_ts)
+{
+	lock_guard lock(presentMutex);
+	UpdateRoiOverlay(capture_ts);
+	OutputFrame(av_frame, capture_ts);
+}
+
+void PreviewPipeline::OutputFrame(AVFrame *av_frame, uint64_t capture_ts)
+{
+	TraceRecorder::Instant("Frame output", "capture_ts",
+			       (int64_t)capture_ts);
+
+	obs_source_frame frame;
+
+	// Timestamp is replaced with the capture time
+	AVFrameToSourceFrame(&frame, av_frame, {1, 1000000000});
+	frame.timestamp = capture_ts;
+
+	/* libobs copies the planes into its own frame cache, the buffers go
+	 * back to the pool as soon as the scheduler drops its reference. */
+	obs_source_output_video(previewSource, &frame);
+
+	if (firstFramePending.exchange(false)) {
+		firstFrameTime = os_gettime_ns() - requestTime;
+		blog(LOG_INFO, "First frame of %s after %.1f ms%s",
+		     obs_output_get_name(previewOut),
+		     (double)firstFrameTime / 1e6,
+		     decoderReused ? " (decoder reused)" : "");
+	}
+
+	Status expected = WAITING;
+	if (state.compare_exchange_strong(expected, PLAYING))
+		NotifyStatus();
+}
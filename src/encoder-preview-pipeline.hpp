@@ -0,0 +1,342 @@
+#pragma once
+
+#include "encoder-preview-abtest.hpp"
+#include "encoder-preview-bitstream.hpp"
+#include "encoder-preview-capture.hpp"
+#include "encoder-preview-ff-glue.hpp"
+#include "encoder-preview-latency.hpp"
+#include "encoder-preview-metrics.hpp"
+#include "encoder-preview-netsim.hpp"
+#include "encoder-preview-overlay.hpp"
+#include "encoder-preview-replay.hpp"
+#include "encoder-preview-scaler.hpp"
+#include "encoder-preview-scheduler.hpp"
+#include "encoder-preview-vbv.hpp"
+#include "encoder-preview-workers.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <obs.hpp>
+
+/* One encoder being previewed: an "encoder_preview" output receiving the
+ * encoder's packets, a decoder running on the shared worker pool, and a
+ * private async source the decoded frames are presented on. */
+class PreviewPipeline {
+public:
+	enum Status { INACTIVE, WAITING, PLAYING, STOPPING };
+	enum Overlay {
+		OverlayNone,
+		OverlayQp,
+		OverlayPsnr,
+		OverlaySsim,
+		/* Regions in effect when each frame was encoded */
+		OverlayRoi,
+	};
+
+	struct QpStats {
+		double sum = 0.0;
+		uint64_t frames = 0;
+		double insideSum = 0.0;
+		uint64_t insideFrames = 0;
+		double outsideSum = 0.0;
+		uint64_t outsideFrames = 0;
+	};
+
+	struct Stats {
+		double kbps = 0.0;
+		/* Sizes of the packets received, in bytes */
+		uint64_t packets = 0;
+		uint64_t meanPacket = 0;
+		uint64_t maxPacket = 0;
+		/* Mean conversion cost, only valid if convertFrames != 0 */
+		double convertMs = 0.0;
+		uint64_t convertFrames = 0;
+		uint64_t droppedPackets = 0;
+		FrameScheduler::Stats presentation;
+		QpStats qp;
+		BitstreamAnalyzer::Stats bitstream;
+		VbvModel::Stats vbv;
+		NetworkSimulator::Stats network;
+		LatencyTracker::Stats latency;
+		DecodeGovernor::Stats governor;
+		RoiAbTest::Stats abTest;
+		/* From the last start or switch to its first frame, 0 until
+		 * there is one */
+		double firstFrameMs = 0.0;
+		bool decoderReused = false;
+		/* Nobody watched, packets were not decoded */
+		bool suspended = false;
+	};
+
+	/* Called on whichever thread changed the status, also once a start
+	 * or switch has been carried out. Set before starting. */
+	using StatusCallback = std::function<void(Status status)>;
+
+	PreviewPipeline(const char *output_name, const char *source_name);
+	~PreviewPipeline();
+
+	PreviewPipeline(const PreviewPipeline &) = delete;
+	PreviewPipeline &operator=(const PreviewPipeline &) = delete;
+
+	/* Starting, stopping and switching happen on a control thread, these
+	 * only queue the request. The status changes to WAITING or STOPPING
+	 * right away and to INACTIVE once stopped or if starting failed. */
+	bool Start(obs_encoder_t *enc);
+	void Stop();
+	/* Previews another encoder on the running pipeline, the decoder is
+	 * kept if both encoders use the same codec. */
+	bool Switch(obs_encoder_t *enc);
+
+	void SetStatusCallback(StatusCallback callback)
+	{
+		statusCallback = std::move(callback);
+	}
+
+	Status GetStatus() const { return state; }
+	obs_output_t *GetOutput() const { return previewOut; }
+	obs_source_t *GetSource() const { return previewSource; }
+
+	/* Graphics thread only */
+	void Render(uint32_t width, uint32_t height);
+
+	void SetPreviewSize(uint32_t cx, uint32_t cy);
+	void SetScaleToPreview(bool enable) { scaleToPreview = enable; }
+	void SetTargetDelay(uint64_t delay_ns);
+	void SetDelayGroup(std::shared_ptr<DelayGroup> group);
+	void SetOverlay(int mode);
+	void SetQualityAnalysis(bool enable);
+	/* Turns the regions on the previewed encoder off and on again every
+	 * few GOPs to measure what they do, see RoiAbTest. This changes what
+	 * is streamed or recorded for as long as it runs. */
+	void SetRoiAbTest(bool enable);
+	void SetRoiAbTestGops(uint32_t gops) { abTest.SetGopsPerPhase(gops); }
+	/* Without decoding only the bitstream is analysed, decoding resumes
+	 * at the next keyframe once enabled again. */
+	void SetDecoding(bool enable) { decoding = enable; }
+	/* Only decodes while the preview is visible somewhere, either in the
+	 * dialog or as a source in a scene, projector or multiview. Packets
+	 * keep being analysed, decoding resumes at the next keyframe. */
+	void SetDecodeOnDemand(bool enable) { decodeOnDemand = enable; }
+	void SetViewerVisible(bool visible) { viewerVisible = visible; }
+	bool Watched() const
+	{
+		return !decodeOnDemand || viewerVisible || sourceShowing;
+	}
+	/* Only keyframes are decoded, everything else is dropped as it
+	 * arrives. Turns the preview into a still updated once per GOP at a
+	 * small fraction of the cost, e.g. for monitoring many encoders. */
+	void SetKeyframesOnly(bool enable) { keyframesOnly = enable; }
+	/* Percent of one core the decoder may use, 0 for no limit. Decoding
+	 * only steps down to cheaper modes if adaptive decoding is on. */
+	void SetDecodeBudget(double percent) { governor.SetBudget(percent); }
+	void SetAdaptiveDecoding(bool enable) { governor.SetAdaptive(enable); }
+	/* Sends the packets to the decoder through a simulated network link */
+	void SetNetworkSimulation(bool enable);
+	void SetNetworkConfig(const NetworkSimulator::Config &config);
+
+	Stats TakeStats();
+	std::vector<QualityAnalyzer::Result> TakeQualityResults();
+
+	/* Pausing the replay buffer freezes the preview on its frames */
+	ReplayBuffer &Replay() { return replay; }
+	LatencyTracker &Latency() { return latency; }
+
+	/* Dumps the packets reaching the output into a Matroska file */
+	bool StartCapture(const std::string &path,
+			  PacketCapture::Container container);
+	/* Returns right away, the file is finished on the control thread */
+	void StopCapture();
+	bool Capturing();
+	/* Path and stats of the current capture, false if there is none */
+	bool GetCaptureStats(std::string &path, PacketCapture::Stats &stats);
+	/* Name of the encoder the output last started with, for naming
+	 * captures without going through the output */
+	std::string EncoderName();
+
+private:
+	enum RequestType {
+		RequestStart,
+		RequestStop,
+		RequestSwitch,
+		RequestFinishCapture,
+	};
+
+	struct Request {
+		RequestType type;
+		OBSEncoder encoder;
+		uint64_t time;
+		/* Capture to finish */
+		std::shared_ptr<PacketCapture> capture;
+	};
+
+	static void RegisterTypes();
+
+	void SetStatus(Status status);
+	void NotifyStatus();
+
+	void QueueRequest(RequestType type, obs_encoder_t *enc);
+	void QueueRequest(Request &&request);
+	std::shared_ptr<PacketCapture> TakeCapture();
+	void ControlThread();
+	void StartRequested(obs_encoder_t *enc, uint64_t time);
+	void StopRequested();
+	void SwitchRequested(obs_encoder_t *enc, uint64_t time);
+	bool StartOutputAndWait();
+	void StopOutputAndWait();
+	static void OutputDeactivated(void *param, calldata_t *);
+
+	bool StartOutput();
+	void StopOutput();
+	void EndOutput();
+	void EndSession();
+	bool OpenDecoder(obs_encoder_t *enc);
+	void ReleaseDecoder();
+	void ReceivePacket(encoder_packet *pkt);
+	void QueuePacket(packet &&pkt);
+	static void SourceShown(void *param, calldata_t *);
+	static void SourceHidden(void *param, calldata_t *);
+
+	void Decode();
+	void DecodePacket(const encoder_packet *pkt);
+	void SetDecodeLevel(DecodeGovernor::Level level);
+	void PresentFrame(AVFrame *frame, uint64_t capture_ts);
+	void PresentReplayFrame(AVFrame *frame, uint64_t capture_ts);
+	void OutputFrame(AVFrame *frame, uint64_t capture_ts);
+	void RefreshRegions();
+	void UpdateQpStats(const AVFrame *frame, uint64_t capture_ts);
+	void UpdateQpOverlay(uint64_t capture_ts);
+	void UpdateQualityOverlay();
+	void UpdateRoiOverlay(uint64_t capture_ts);
+
+	OBSOutputAutoRelease previewOut;
+	OBSSourceAutoRelease previewSource;
+	OBSSignal deactivateSignal;
+
+	std::atomic<Status> state = INACTIVE;
+	StatusCallback statusCallback;
+
+	/* Requests are carried out in order, blocking on libobs there does
+	 * not hold up the UI. */
+	std::thread controlThread;
+	std::mutex controlMutex;
+	std::condition_variable controlCond;
+	std::deque<Request> requests;
+	bool controlStopping = false;
+	/* Set while the output runs, until its encoder is disconnected */
+	bool outputRunning = false;
+	std::atomic_bool switching = false;
+
+	/* Time to first frame, requestTime is only written by the control
+	 * thread before the flag is raised. */
+	uint64_t requestTime = 0;
+	std::atomic_bool firstFramePending = false;
+	std::atomic<uint64_t> firstFrameTime = 0;
+	std::atomic_bool decoderReused = false;
+
+	/* Packets are queued by the output, drained by the strand */
+	std::mutex packetMutex;
+	std::vector<packet> packets;
+	bool waitForKeyframe = false;
+	/* Packets were skipped, the decoder has to be flushed */
+	bool resync = false;
+	uint64_t bytes = 0;
+	uint64_t packetCount = 0;
+	uint64_t maxPacket = 0;
+	uint64_t droppedPackets = 0;
+	uint64_t lastStatsTime = 0;
+
+	WorkStrand strand;
+	std::atomic_bool decoding = true;
+	std::atomic_bool decodeOnDemand = false;
+	std::atomic_bool viewerVisible = false;
+	std::atomic_bool sourceShowing = false;
+	std::atomic_bool suspended = false;
+	std::atomic_bool keyframesOnly = false;
+	OBSSignal showSignal;
+	OBSSignal hideSignal;
+	BitstreamAnalyzer bitstream;
+	VbvModel vbv;
+	std::atomic_bool simulateNetwork = false;
+	NetworkSimulator network;
+
+	/* Swapped under the mutex, the packet callback only holds a
+	 * reference while pushing. */
+	std::mutex captureMutex;
+	std::shared_ptr<PacketCapture> capture;
+	std::string encoderName;
+
+	/* Decoder state, only touched by the strand while it is open */
+	AVCodecContext *codecContext = nullptr;
+	std::string decoderCodec;
+	AVFrame *decoded = nullptr;
+	AVFrame *converted = nullptr;
+	bool gotKeyframe = false;
+	int64_t dtsShift = 0;
+	int64_t captureOffset = 0;
+	FrameConverter converter;
+	DecodeGovernor::Level decodeLevel = DecodeGovernor::LevelFull;
+
+	DecodeGovernor governor;
+
+	FrameScheduler scheduler;
+	ReplayBuffer replay;
+	LatencyTracker latency;
+
+	/* Orders live and replayed frames going to the source */
+	std::mutex presentMutex;
+
+	/* Size of the preview display, used as the downscaling target */
+	std::atomic_bool scaleToPreview = false;
+	std::atomic<uint32_t> previewCx = 0;
+	std::atomic<uint32_t> previewCy = 0;
+
+	std::atomic<uint64_t> convertTime = 0;
+	std::atomic<uint64_t> convertFrames = 0;
+
+	/* Regions currently set on the encoder, only used by the strand */
+	std::vector<obs_encoder_roi> regions;
+	uint32_t roiIncrement = 0;
+	bool regionsValid = false;
+	std::vector<uint8_t> roiMask;
+	uint32_t roiMaskBlock = 0;
+	BlockMap qpMap;
+
+	/* Overlay data is produced by the strand and the scheduler, drawn by
+	 * the graphics thread */
+	std::atomic<int> overlayMode = OverlayNone;
+	std::mutex overlayMutex;
+	BlockMap overlayMap;
+	float overlayMin = 0.0f;
+	float overlayMax = 0.0f;
+	bool overlayDirty = false;
+	BlockOverlay overlay;
+
+	/* QP maps are taken from the decoded frames, before scaling, and
+	 * wait here for the scheduler to present their frame. */
+	struct PendingQpMap {
+		uint64_t captureTs;
+		BlockMap map;
+		int maxQp;
+	};
+	std::deque<PendingQpMap> pendingQpMaps;
+	QpStats qpStats;
+
+	/* Set the ROI overlay was built from, guarded by presentMutex */
+	std::vector<obs_encoder_roi> overlayRegions;
+	uint64_t overlayRegionsSequence = 0;
+
+	std::atomic_bool qualityAnalysis = false;
+	QualityAnalyzer analyzer;
+	uint64_t qualityGeneration = 0;
+
+	std::atomic_bool roiAbTest = false;
+	RoiAbTest abTest;
+};
@@ -0,0 +1,414 @@
+#include "encoder-preview-replay.hpp"
+#include "encoder-preview-ff-glue.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+/* Decoded frames kept around the cursor, enough to step through a short
+ * GOP in both directions without decoding it again. */
+static constexpr size_t kCacheFrames = 32;
+/* Part of the memory limit that goes to decoded frames rather than
+ * packets, a 4K frame alone takes 12 MB. */
+static constexpr size_t kCacheShare = 4;
+
+static size_t FrameBytes(const AVFrame *frame)
+{
+	size_t bytes = 0;
+	for (AVBufferRef *buf : frame->buf) {
+		if (buf)
+			bytes += buf->size;
+	}
+	return bytes;
+}
+
+ReplayBuffer::ReplayBuffer(OutputCallback callback)
+	: callback(std::move(callback)),
+	  strand([this]() { Decode(); })
+{
+}
+
+void ReplayBuffer::SetLimits(uint64_t duration_ns, size_t max_bytes)
+{
+	lock_guard lock(mutex);
+	maxDuration = duration_ns;
+	maxBytes = max_bytes - max_bytes / kCacheShare;
+	cacheLimit = max_bytes / kCacheShare;
+	Evict();
+}
+
+void ReplayBuffer::Start(obs_encoder_t *enc)
+{
+	Stop();
+
+	encoder = enc;
+	decoded = av_frame_alloc();
+	converted = av_frame_alloc();
+}
+
+void ReplayBuffer::Stop()
+{
+	strand.Close();
+
+	Clear();
+	CacheClear();
+
+	DestroyCodecContext(&codecContext);
+	av_frame_free(&converted);
+	av_frame_free(&decoded);
+	converter.Reset();
+	encoder = nullptr;
+}
+
+void ReplayBuffer::Clear()
+{
+	lock_guard lock(mutex);
+
+	ring.clear();
+	ringBytes = 0;
+	snapshot.clear();
+	frames.clear();
+	haveShift = false;
+	paused = false;
+}
+
+/*
+ * Ring
+ */
+
+void ReplayBuffer::Push(const packet &pkt)
+{
+	const encoder_packet &info = pkt.m_pkt;
+
+	lock_guard lock(mutex);
+
+	/* While paused the snapshot is the ring, live packets are not kept
+	 * so memory stays within the limit. */
+	if (paused || !maxDuration)
+		return;
+
+	/* The ring always starts at a keyframe */
+	if (ring.empty() && !info.keyframe)
+		return;
+
+	/* Same mapping to capture time as the live decoder uses */
+	if (!haveShift) {
+		dtsShift = info.pts - info.dts;
+		haveShift = true;
+	}
+
+	const AVRational time_base = {info.timebase_num, info.timebase_den};
+	uint64_t ts = info.dts_usec * 1000 +
+		      av_rescale_q(info.pts - info.dts - dtsShift, time_base,
+				   {1, 1000000000});
+
+	ring.push_back({pkt, ts});
+	ringBytes += info.size;
+
+	Evict();
+}
+
+void ReplayBuffer::Evict()
+{
+	while (!ring.empty()) {
+		bool over_bytes = ringBytes > maxBytes;
+		uint64_t duration = (uint64_t)(ring.back().pkt.m_pkt.dts_usec -
+					       ring.front().pkt.m_pkt.dts_usec) *
+				    1000;
+		bool over_time = !maxDuration || duration > maxDuration;
+
+		if (!over_bytes && !over_time)
+			break;
+
+		/* Drop whole GOPs so the ring stays decodable. A single GOP
+		 * longer than the duration is kept, one larger than the memory
+		 * limit is not. */
+		size_t next = 1;
+		while (next < ring.size() && !ring[next].pkt.m_pkt.keyframe)
+			next++;
+
+		if (next == ring.size() && !over_bytes && maxDuration)
+			break;
+
+		for (size_t idx = 0; idx < next; idx++) {
+			ringBytes -= ring.front().pkt.m_pkt.size;
+			ring.pop_front();
+		}
+	}
+}
+
+void ReplayBuffer::GetUsage(uint64_t &duration_ns, size_t &bytes)
+{
+	lock_guard lock(mutex);
+
+	duration_ns = 0;
+	bytes = 0;
+
+	if (paused) {
+		for (const Entry &entry : snapshot)
+			bytes += entry.pkt.m_pkt.size;
+		if (!snapshot.empty())
+			duration_ns =
+				(uint64_t)(snapshot.back().pkt.m_pkt.dts_usec -
+					   snapshot.front().pkt.m_pkt.dts_usec) *
+				1000;
+	} else if (!ring.empty()) {
+		bytes = ringBytes;
+		duration_ns = (uint64_t)(ring.back().pkt.m_pkt.dts_usec -
+					 ring.front().pkt.m_pkt.dts_usec) *
+			      1000;
+	}
+}
+
+/*
+ * Cursor
+ */
+
+bool ReplayBuffer::Pause()
+{
+	if (paused)
+		return true;
+
+	strand.Close();
+
+	{
+		lock_guard lock(mutex);
+		if (ring.empty() || !encoder)
+			return false;
+
+		snapshot.assign(make_move_iterator(ring.begin()),
+				make_move_iterator(ring.end()));
+		ring.clear();
+		ringBytes = 0;
+		paused = true;
+
+		frames.clear();
+		frames.reserve(snapshot.size());
+
+		size_t gop = 0;
+		for (size_t idx = 0; idx < snapshot.size(); idx++) {
+			const encoder_packet &info = snapshot[idx].pkt.m_pkt;
+			if (info.keyframe)
+				gop = idx;
+
+			frames.push_back(
+				{info.pts, snapshot[idx].ts, idx, gop});
+		}
+
+		std::stable_sort(frames.begin(), frames.end(),
+				 [](const Frame &a, const Frame &b) {
+					 return a.pts < b.pts;
+				 });
+	}
+
+	if (!codecContext) {
+		if (!CreateCodecContext(&codecContext, encoder)) {
+			Resume();
+			return false;
+		}
+
+		if (!SendExtraData(codecContext, encoder))
+			blog(LOG_DEBUG, "Sending extra data failed.");
+	}
+
+	CacheClear();
+	nextPacket = SIZE_MAX;
+	currentGop = SIZE_MAX;
+	lastPts = INT64_MIN;
+	shown = SIZE_MAX;
+
+	strand.Open();
+	/* Clamped to the newest frame */
+	Seek(SIZE_MAX);
+	return true;
+}
+
+void ReplayBuffer::Resume()
+{
+	strand.Close();
+	CacheClear();
+
+	/* Buffering starts over at the next keyframe */
+	lock_guard lock(mutex);
+	snapshot.clear();
+	frames.clear();
+	paused = false;
+}
+
+/* The frames are cleared from the output's threads when it stops, the
+ * UI only looks at them under the lock. */
+size_t ReplayBuffer::FrameCount()
+{
+	lock_guard lock(mutex);
+	return paused ? frames.size() : 0;
+}
+
+void ReplayBuffer::Seek(size_t frame)
+{
+	lock_guard lock(mutex);
+	SeekLocked(frame);
+}
+
+void ReplayBuffer::SeekLocked(size_t frame)
+{
+	if (!paused || frames.empty())
+		return;
+
+	requested = std::min(frame, frames.size() - 1);
+	strand.Schedule();
+}
+
+void ReplayBuffer::Step(int delta)
+{
+	lock_guard lock(mutex);
+
+	if (!paused || frames.empty())
+		return;
+
+	int64_t target = (int64_t)requested + delta;
+	SeekLocked((size_t)std::clamp<int64_t>(target, 0,
+					       (int64_t)frames.size() - 1));
+}
+
+int64_t ReplayBuffer::FrameOffset(size_t frame)
+{
+	lock_guard lock(mutex);
+
+	if (!paused || frame >= frames.size())
+		return 0;
+
+	return (int64_t)frames[frame].ts - (int64_t)frames.back().ts;
+}
+
+/*
+ * Decoding, on the strand
+ */
+
+void ReplayBuffer::Decode()
+{
+	size_t target = requested;
+	if (target >= frames.size() || target == shown)
+		return;
+
+	const Frame &frame = frames[target];
+
+	AVFrame *cached = CacheFind(frame.pts);
+	if (!cached && DecodeUntil(frame))
+		cached = CacheFind(frame.pts);
+
+	if (!cached)
+		return;
+
+	Present(cached, frame.ts);
+	shown = target;
+}
+
+bool ReplayBuffer::DecodeUntil(const Frame &target)
+{
+	/* Frames come out in presentation order, so stepping forward within
+	 * the GOP being decoded continues where the last step stopped. */
+	bool resume = nextPacket != SIZE_MAX &&
+		      currentGop == target.keyframe && lastPts < target.pts;
+
+	if (!resume) {
+		avcodec_flush_buffers(codecContext);
+		nextPacket = target.keyframe;
+		currentGop = target.keyframe;
+		lastPts = INT64_MIN;
+	}
+
+	bool draining = false;
+
+	for (;;) {
+		while (ReceiveFrame(codecContext, decoded)) {
+			int64_t pts = decoded->pts;
+			lastPts = pts;
+
+			CacheInsert(pts, av_frame_clone(decoded));
+			av_frame_unref(decoded);
+
+			if (pts >= target.pts)
+				return pts == target.pts;
+		}
+
+		if (nextPacket < snapshot.size()) {
+			const encoder_packet &pkt =
+				snapshot[nextPacket].pkt.m_pkt;
+			if (pkt.keyframe)
+				currentGop = nextPacket;
+
+			nextPacket++;
+			SendPacket(codecContext, &pkt);
+		} else if (!draining) {
+			/* The newest frames are only returned once drained */
+			avcodec_send_packet(codecContext, nullptr);
+			draining = true;
+		} else {
+			/* A drained decoder has to be flushed before reuse */
+			nextPacket = SIZE_MAX;
+			return false;
+		}
+	}
+}
+
+void ReplayBuffer::Present(AVFrame *frame, uint64_t capture_ts)
+{
+	AVFrame *out = converter.Convert(frame, converted);
+	if (!out)
+		return;
+
+	callback(out, capture_ts);
+	av_frame_unref(converted);
+}
+
+/*
+ * Frame cache
+ */
+
+AVFrame *ReplayBuffer::CacheFind(int64_t pts)
+{
+	auto it = cacheIndex.find(pts);
+	if (it == cacheIndex.end())
+		return nullptr;
+
+	cache.splice(cache.begin(), cache, it->second);
+	return it->second->second;
+}
+
+void ReplayBuffer::CacheInsert(int64_t pts, AVFrame *frame)
+{
+	if (!frame)
+		return;
+
+	auto it = cacheIndex.find(pts);
+	if (it != cacheIndex.end()) {
+		cacheBytes -= FrameBytes(it->second->second);
+		av_frame_free(&it->second->second);
+		cache.erase(it->second);
+		cacheIndex.erase(it);
+	}
+
+	cache.emplace_front(pts, frame);
+	cacheIndex[pts] = cache.begin();
+	cacheBytes += FrameBytes(frame);
+
+	/* The newest frame is the one about to be shown and always stays */
+	while (cache.size() > 1 &&
+	       (cache.size() > kCacheFrames || cacheBytes > cacheLimit)) {
+		auto &oldest = cache.back();
+		cacheBytes -= FrameBytes(oldest.second);
+		cacheIndex.erase(oldest.first);
+		av_frame_free(&oldest.second);
+		cache.pop_back();
+	}
+}
+
+void ReplayBuffer::CacheClear()
+{
+	for (auto &entry : cache)
+		av_frame_free(&entry.second);
+
+	cache.clear();
+	cacheIndex.clear();
+	cacheBytes = 0;
+}
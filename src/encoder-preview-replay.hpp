@@ -0,0 +1,126 @@
+#pragma once
+
+#include "encoder-preview-capture.hpp"
+#include "encoder-preview-scaler.hpp"
+#include "encoder-preview-workers.hpp"
+
+#include <obs.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/* Keeps the last few seconds of packets, always starting at a keyframe.
+ * While paused the ring is frozen into a snapshot that can be scrubbed
+ * frame by frame, each frame is decoded on demand from the nearest
+ * keyframe before it. */
+class ReplayBuffer {
+public:
+	/* Called on a worker thread, frame is unreferenced afterwards */
+	using OutputCallback = std::function<void(AVFrame *frame,
+						  uint64_t capture_ts)>;
+
+	explicit ReplayBuffer(OutputCallback callback);
+	~ReplayBuffer() { Stop(); }
+
+	ReplayBuffer(const ReplayBuffer &) = delete;
+	ReplayBuffer &operator=(const ReplayBuffer &) = delete;
+
+	/* A duration of 0 disables buffering. The memory limit covers the
+	 * packets and the frames decoded while scrubbing. */
+	void SetLimits(uint64_t duration_ns, size_t max_bytes);
+
+	void Start(obs_encoder_t *enc);
+	void Stop();
+
+	/* Encoder thread, the packet data is shared, not copied */
+	void Push(const packet &pkt);
+
+	/* Freezes the buffer and shows its newest frame, false if empty */
+	bool Pause();
+	void Resume();
+	bool Paused() const { return paused; }
+
+	/* Frames are in presentation order, only valid while paused */
+	size_t FrameCount();
+	size_t Position() const { return requested; }
+	void Seek(size_t frame);
+	void Step(int delta);
+	/* Capture time of a frame relative to the newest one, <= 0 */
+	int64_t FrameOffset(size_t frame);
+
+	/* Packets only, decoded frames are bounded separately */
+	void GetUsage(uint64_t &duration_ns, size_t &bytes);
+
+private:
+	struct Entry {
+		packet pkt;
+		/* Capture time in os_gettime_ns() time */
+		uint64_t ts;
+	};
+
+	struct Frame {
+		int64_t pts;
+		uint64_t ts;
+		/* Index of the packet and of the keyframe starting its GOP */
+		size_t packet;
+		size_t keyframe;
+	};
+
+	void Evict();
+	void Clear();
+
+	void SeekLocked(size_t frame);
+
+	void Decode();
+	bool DecodeUntil(const Frame &target);
+	void Present(AVFrame *frame, uint64_t capture_ts);
+
+	AVFrame *CacheFind(int64_t pts);
+	void CacheInsert(int64_t pts, AVFrame *frame);
+	void CacheClear();
+
+	OutputCallback callback;
+
+	/* Live ring, written by the encoder thread */
+	std::mutex mutex;
+	std::deque<Entry> ring;
+	size_t ringBytes = 0;
+	uint64_t maxDuration = 0;
+	size_t maxBytes = 0;
+	bool haveShift = false;
+	int64_t dtsShift = 0;
+	std::atomic_bool paused = false;
+
+	/* Snapshot taken when pausing, in decode order */
+	std::vector<Entry> snapshot;
+	std::vector<Frame> frames;
+
+	std::atomic<size_t> requested = 0;
+	WorkStrand strand;
+
+	/* Decoder state, only touched by the strand */
+	OBSEncoder encoder;
+	AVCodecContext *codecContext = nullptr;
+	AVFrame *decoded = nullptr;
+	AVFrame *converted = nullptr;
+	FrameConverter converter;
+	size_t nextPacket = SIZE_MAX;
+	size_t currentGop = SIZE_MAX;
+	int64_t lastPts = INT64_MIN;
+	size_t shown = SIZE_MAX;
+
+	std::list<std::pair<int64_t, AVFrame *>> cache;
+	std::unordered_map<int64_t, decltype(cache)::iterator> cacheIndex;
+	size_t cacheBytes = 0;
+	std::atomic<size_t> cacheLimit = 0;
+};
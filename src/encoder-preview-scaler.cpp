@@ -0,0 +1,138 @@
+#include "encoder-preview-scaler.hpp"
+
+#include <util/platform.h>
+
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+using namespace std;
+
+/* Switching between a handful of sizes (e.g. resizing the dialog) should
+ * not thrash, but there is no point in keeping every size ever used. */
+static constexpr size_t kMaxCachedScalers = 4;
+
+/// Find the closest format libobs can render natively
+static AVPixelFormat NearestNativeFormat(AVPixelFormat format)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+	if (!desc || desc->flags & AV_PIX_FMT_FLAG_HWACCEL)
+		return AV_PIX_FMT_NONE;
+
+	if (desc->flags & AV_PIX_FMT_FLAG_RGB)
+		return AV_PIX_FMT_BGRA;
+
+	const bool high_depth = desc->comp[0].depth > 8;
+
+	// Grayscale just gets neutral chroma planes
+	if (desc->nb_components < 3)
+		return high_depth ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P;
+
+	if (!desc->log2_chroma_w && !desc->log2_chroma_h)
+		return high_depth ? AV_PIX_FMT_YUV444P12LE : AV_PIX_FMT_YUV444P;
+	if (desc->log2_chroma_w == 1 && !desc->log2_chroma_h)
+		return high_depth ? AV_PIX_FMT_YUV422P10LE : AV_PIX_FMT_YUV422P;
+
+	return high_depth ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P;
+}
+
+SwsContext *FrameConverter::GetScaler(AVPixelFormat src_format, int src_cx,
+				      int src_cy, AVPixelFormat dst_format,
+				      int dst_cx, int dst_cy)
+{
+	for (auto it = scalers.begin(); it != scalers.end(); ++it) {
+		if (it->src_format != src_format || it->src_cx != src_cx ||
+		    it->src_cy != src_cy || it->dst_format != dst_format ||
+		    it->dst_cx != dst_cx || it->dst_cy != dst_cy)
+			continue;
+
+		scalers.splice(scalers.begin(), scalers, it);
+		return it->ctx;
+	}
+
+	const bool scaling = src_cx != dst_cx || src_cy != dst_cy;
+	SwsContext *ctx = sws_getContext(src_cx, src_cy, src_format, dst_cx,
+					 dst_cy, dst_format,
+					 scaling ? SWS_FAST_BILINEAR : SWS_POINT,
+					 nullptr, nullptr, nullptr);
+	if (!ctx) {
+		blog(LOG_WARNING, "Failed to create scaler for %s -> %s",
+		     av_get_pix_fmt_name(src_format),
+		     av_get_pix_fmt_name(dst_format));
+		return nullptr;
+	}
+
+	if (scalers.size() >= kMaxCachedScalers) {
+		sws_freeContext(scalers.back().ctx);
+		scalers.pop_back();
+	}
+
+	scalers.push_front(
+		{src_format, src_cx, src_cy, dst_format, dst_cx, dst_cy, ctx});
+	return ctx;
+}
+
+AVFrame *FrameConverter::Convert(AVFrame *src, AVFrame *dst, uint32_t max_cx,
+				 uint32_t max_cy)
+{
+	auto src_format = static_cast<AVPixelFormat>(src->format);
+	AVPixelFormat dst_format = src_format;
+
+	if (AVPixelFormatToOBSFormat(src_format) == VIDEO_FORMAT_NONE)
+		dst_format = NearestNativeFormat(src_format);
+	if (dst_format == AV_PIX_FMT_NONE)
+		return nullptr;
+
+	int dst_cx = src->width;
+	int dst_cy = src->height;
+
+	// Only ever downscale, keeping the aspect ratio
+	if (max_cx && max_cy) {
+		double scale = std::min((double)max_cx / (double)src->width,
+					(double)max_cy / (double)src->height);
+		if (scale < 1.0) {
+			dst_cx = std::max((int)(src->width * scale) & ~1, 2);
+			dst_cy = std::max((int)(src->height * scale) & ~1, 2);
+		}
+	}
+
+	if (dst_format == src_format && dst_cx == src->width &&
+	    dst_cy == src->height) {
+		lastCost = 0;
+		return src;
+	}
+
+	uint64_t start = os_gettime_ns();
+
+	SwsContext *ctx = GetScaler(src_format, src->width, src->height,
+				    dst_format, dst_cx, dst_cy);
+	if (!ctx)
+		return nullptr;
+
+	av_frame_unref(dst);
+	dst->format = dst_format;
+	dst->width = dst_cx;
+	dst->height = dst_cy;
+
+	if (!pool.Get(dst))
+		return nullptr;
+
+	sws_scale(ctx, src->data, src->linesize, 0, src->height, dst->data,
+		  dst->linesize);
+	av_frame_copy_props(dst, src);
+
+	lastCost = os_gettime_ns() - start;
+	return dst;
+}
+
+void FrameConverter::Reset()
+{
+	for (Scaler &scaler : scalers)
+		sws_freeContext(scaler.ctx);
+
+	scalers.clear();
+	pool.Reset();
+}
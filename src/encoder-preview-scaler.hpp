@@ -0,0 +1,45 @@
+#pragma once
+
+#include "encoder-preview-ff-glue.hpp"
+
+#include <list>
+
+struct SwsContext;
+
+/* Converts decoded frames libobs cannot display into the nearest native
+ * format, optionally downscaling them to a maximum size on the way. */
+class FrameConverter {
+public:
+	FrameConverter() = default;
+	~FrameConverter() { Reset(); }
+
+	FrameConverter(const FrameConverter &) = delete;
+	FrameConverter &operator=(const FrameConverter &) = delete;
+
+	/* Returns src if nothing needs to be done, otherwise dst filled with
+	 * pooled buffers, or nullptr on failure. Max size of 0 means unlimited. */
+	AVFrame *Convert(AVFrame *src, AVFrame *dst, uint32_t max_cx = 0,
+			 uint32_t max_cy = 0);
+	void Reset();
+
+	/* Time spent converting the last frame, in nanoseconds */
+	uint64_t LastCost() const { return lastCost; }
+
+private:
+	struct Scaler {
+		AVPixelFormat src_format;
+		int src_cx, src_cy;
+		AVPixelFormat dst_format;
+		int dst_cx, dst_cy;
+		SwsContext *ctx;
+	};
+
+	SwsContext *GetScaler(AVPixelFormat src_format, int src_cx, int src_cy,
+			      AVPixelFormat dst_format, int dst_cx, int dst_cy);
+
+	/* Most recently used first */
+	std::list<Scaler> scalers;
+	FramePool pool;
+
+	uint64_t lastCost = 0;
+};
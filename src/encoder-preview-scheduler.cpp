@@ -0,0 +1,236 @@
+#include "encoder-preview-scheduler.hpp"
+
+#include <obs.h>
+#include <util/platform.h>
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+/* Hand frames to libobs slightly ahead of the tick they are meant for */
+static constexpr uint64_t kTickMargin = 2000000;
+/* Anything scheduled further out than this is a timestamp discontinuity */
+static constexpr uint64_t kMaxDelay = 2000000000;
+/* Automatic delay falls back towards the current transit time slowly */
+static constexpr uint64_t kAutoDelayDecay = 100000;
+
+/*
+ * Delay group
+ */
+
+uint64_t DelayGroup::Update(const void *member, uint64_t delay)
+{
+	lock_guard lock(mutex);
+
+	uint64_t max_delay = delay;
+	bool found = false;
+
+	for (auto &[other, other_delay] : delays) {
+		if (other == member) {
+			other_delay = delay;
+			found = true;
+		} else if (other_delay > max_delay) {
+			max_delay = other_delay;
+		}
+	}
+
+	if (!found)
+		delays.emplace_back(member, delay);
+
+	return max_delay;
+}
+
+void DelayGroup::Remove(const void *member)
+{
+	lock_guard lock(mutex);
+
+	delays.erase(std::remove_if(delays.begin(), delays.end(),
+				    [&](const auto &entry) {
+					    return entry.first == member;
+				    }),
+		     delays.end());
+}
+
+/*
+ * Scheduler
+ */
+
+FrameScheduler::FrameScheduler(OutputCallback callback)
+	: callback(std::move(callback))
+{
+}
+
+void FrameScheduler::Start()
+{
+	Stop();
+
+	stopping = false;
+	autoDelay = 0;
+	delay = 0;
+	lastTransit = INT64_MIN;
+	thread = std::thread(&FrameScheduler::Thread, this);
+}
+
+void FrameScheduler::Stop()
+{
+	if (!thread.joinable())
+		return;
+
+	{
+		lock_guard lock(mutex);
+		stopping = true;
+	}
+
+	cond.notify_one();
+	thread.join();
+
+	lock_guard lock(mutex);
+	ClearQueue();
+
+	if (delayGroup)
+		delayGroup->Remove(this);
+}
+
+void FrameScheduler::ClearQueue()
+{
+	for (Entry &entry : queue)
+		av_frame_free(&entry.frame);
+	queue.clear();
+}
+
+void FrameScheduler::SetTargetDelay(uint64_t delay_ns)
+{
+	lock_guard lock(mutex);
+	targetDelay = delay_ns;
+}
+
+void FrameScheduler::SetDelayGroup(shared_ptr<DelayGroup> group)
+{
+	lock_guard lock(mutex);
+
+	if (delayGroup)
+		delayGroup->Remove(this);
+	delayGroup = std::move(group);
+}
+
+FrameScheduler::Stats FrameScheduler::GetStats(bool reset)
+{
+	lock_guard lock(mutex);
+
+	Stats ret = stats;
+	ret.delay = delay;
+
+	if (reset) {
+		stats.presented = 0;
+		stats.dropped = 0;
+		stats.lateness.Clear();
+	}
+
+	return ret;
+}
+
+uint64_t FrameScheduler::ReleaseTime(uint64_t due)
+{
+	uint64_t now = os_gettime_ns();
+
+	/* Late or broken timestamps are shown as soon as possible */
+	if (due <= now || due - now > kMaxDelay)
+		return now;
+
+	/* Snap to the first render tick at or after the due time */
+	uint64_t interval = obs_get_frame_interval_ns();
+	uint64_t last_tick = obs_get_video_frame_time();
+	if (interval && last_tick && due > last_tick) {
+		uint64_t ticks = (due - last_tick + interval - 1) / interval;
+		due = last_tick + ticks * interval;
+	}
+
+	return due > now + kTickMargin ? due - kTickMargin : now;
+}
+
+void FrameScheduler::Push(AVFrame *frame, uint64_t capture_ts)
+{
+	AVFrame *ref = av_frame_clone(frame);
+	if (!ref)
+		return;
+
+	unique_lock lock(mutex);
+
+	/* RFC 3550 style interarrival jitter of capture -> arrival transit */
+	int64_t transit = (int64_t)(os_gettime_ns() - capture_ts);
+	if (lastTransit != INT64_MIN) {
+		double d = (double)std::abs(transit - lastTransit);
+		stats.jitter += (d - stats.jitter) / 16.0;
+	}
+	lastTransit = transit;
+
+	if (transit > 0 && (uint64_t)transit < kMaxDelay) {
+		uint64_t wanted = (uint64_t)transit + obs_get_frame_interval_ns();
+		if (wanted > autoDelay)
+			autoDelay = wanted;
+		else if (autoDelay > kAutoDelayDecay)
+			autoDelay -= kAutoDelayDecay;
+	}
+
+	delay = targetDelay ? targetDelay : autoDelay;
+	if (delayGroup)
+		delay = delayGroup->Update(this, delay);
+
+	uint64_t due = capture_ts + delay;
+	Entry entry = {ref, capture_ts, due, ReleaseTime(due)};
+
+	auto it = std::upper_bound(queue.begin(), queue.end(), entry,
+				   [](const Entry &a, const Entry &b) {
+					   return a.release < b.release;
+				   });
+	bool wake = it == queue.begin();
+	queue.insert(it, entry);
+
+	lock.unlock();
+
+	if (wake)
+		cond.notify_one();
+}
+
+void FrameScheduler::Thread()
+{
+	os_set_thread_name("encoder-preview: presentation");
+
+	unique_lock lock(mutex);
+
+	while (!stopping) {
+		if (queue.empty()) {
+			cond.wait(lock);
+			continue;
+		}
+
+		uint64_t now = os_gettime_ns();
+		uint64_t release = queue.front().release;
+
+		if (release > now) {
+			cond.wait_for(lock, chrono::nanoseconds(release - now));
+			continue;
+		}
+
+		Entry entry = queue.front();
+		queue.pop_front();
+
+		/* If the next frame is due as well this one would only be
+		 * visible for a fraction of a tick, skip it. */
+		if (!queue.empty() && queue.front().release <= now) {
+			av_frame_free(&entry.frame);
+			stats.dropped++;
+			continue;
+		}
+
+		stats.lateness.Add(((int64_t)now - (int64_t)entry.due) /
+				   1000000);
+		stats.presented++;
+
+		lock.unlock();
+		callback(entry.frame, entry.capture_ts);
+		av_frame_free(&entry.frame);
+		lock.lock();
+	}
+}
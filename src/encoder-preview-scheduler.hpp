@@ -0,0 +1,95 @@
+#pragma once
+
+#include "encoder-preview-stats.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+/* Lets several schedulers present with the same delay, so that frames
+ * with equal capture times become visible on the same render tick. */
+class DelayGroup {
+public:
+	/* Publishes a member's own delay, returns the largest in the group */
+	uint64_t Update(const void *member, uint64_t delay);
+	void Remove(const void *member);
+
+private:
+	std::mutex mutex;
+	std::vector<std::pair<const void *, uint64_t>> delays;
+};
+
+/* Holds decoded frames back until their capture time plus a target delay
+ * has passed, so bursty packet arrival does not turn into judder. Release
+ * times are snapped to the OBS video clock so every frame has a full
+ * render tick to become visible. */
+class FrameScheduler {
+public:
+	/* Called on the scheduler thread, frame is unreferenced afterwards */
+	using OutputCallback = std::function<void(AVFrame *frame,
+						  uint64_t capture_ts)>;
+
+	struct Stats {
+		uint64_t delay = 0;
+		double jitter = 0.0;
+		uint64_t presented = 0;
+		uint64_t dropped = 0;
+		/* Release time relative to capture time + delay, in ms.
+		 * Negative values are early, positive ones late. */
+		Histogram lateness{-10, 40, 50};
+	};
+
+	explicit FrameScheduler(OutputCallback callback);
+	~FrameScheduler() { Stop(); }
+
+	void Start();
+	void Stop();
+
+	/* Takes a new reference to frame, capture_ts is in os_gettime_ns() time */
+	void Push(AVFrame *frame, uint64_t capture_ts);
+
+	/* Delay between capture and presentation, 0 adapts to the pipeline */
+	void SetTargetDelay(uint64_t delay_ns);
+	/* Shares the delay with other schedulers, nullptr to leave the group */
+	void SetDelayGroup(std::shared_ptr<DelayGroup> group);
+	Stats GetStats(bool reset);
+
+private:
+	struct Entry {
+		AVFrame *frame;
+		uint64_t capture_ts;
+		uint64_t due;
+		uint64_t release;
+	};
+
+	void Thread();
+	uint64_t ReleaseTime(uint64_t due);
+	void ClearQueue();
+
+	OutputCallback callback;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool stopping = false;
+
+	/* Ordered by release time */
+	std::deque<Entry> queue;
+
+	uint64_t targetDelay = 0;
+	uint64_t autoDelay = 0;
+	uint64_t delay = 0;
+	std::shared_ptr<DelayGroup> delayGroup;
+	int64_t lastTransit = INT64_MIN;
+
+	Stats stats;
+};
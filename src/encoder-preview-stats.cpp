@@ -0,0 +1,57 @@
+#include "encoder-preview-stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+Histogram::Histogram(int64_t min, int64_t max, size_t buckets)
+	: min(min),
+	  width(std::max<int64_t>((max - min) / (int64_t)buckets, 1)),
+	  buckets(buckets, 0)
+{
+}
+
+void Histogram::Add(int64_t value)
+{
+	int64_t idx = (value - min) / width;
+	if (value < min)
+		idx = 0;
+
+	idx = std::clamp<int64_t>(idx, 0, (int64_t)buckets.size() - 1);
+	buckets[idx]++;
+
+	minSeen = count ? std::min(minSeen, value) : value;
+	maxSeen = count ? std::max(maxSeen, value) : value;
+	sum += value;
+	count++;
+}
+
+void Histogram::Clear()
+{
+	std::fill(buckets.begin(), buckets.end(), 0);
+	count = 0;
+	sum = 0;
+	minSeen = 0;
+	maxSeen = 0;
+}
+
+int64_t Histogram::Percentile(double fraction) const
+{
+	if (!count)
+		return 0;
+
+	auto target = (uint64_t)std::ceil(fraction * (double)count);
+	uint64_t seen = 0;
+
+	for (size_t idx = 0; idx < buckets.size(); idx++) {
+		seen += buckets[idx];
+		if (seen >= target)
+			return std::min(BucketLowerBound(idx) + width, maxSeen);
+	}
+
+	return maxSeen;
+}
+
+int64_t Histogram::BucketLowerBound(size_t idx) const
+{
+	return min + (int64_t)idx * width;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Fixed bucket histogram, values outside of [min, max) are clamped into
+ * the first/last bucket. Not thread-safe. */
+class Histogram {
+public:
+	Histogram(int64_t min, int64_t max, size_t buckets);
+
+	void Add(int64_t value);
+	void Clear();
+
+	/* Value below which the given fraction (0.0 - 1.0) of samples fall,
+	 * approximated to the upper bound of the containing bucket. */
+	int64_t Percentile(double fraction) const;
+
+	uint64_t Count() const { return count; }
+	int64_t Min() const { return count ? minSeen : 0; }
+	int64_t Max() const { return count ? maxSeen : 0; }
+	double Mean() const { return count ? (double)sum / (double)count : 0.0; }
+
+	size_t BucketCount() const { return buckets.size(); }
+	uint64_t Bucket(size_t idx) const { return buckets[idx]; }
+	int64_t BucketLowerBound(size_t idx) const;
+	int64_t BucketWidth() const { return width; }
+
+private:
+	int64_t min;
+	int64_t width;
+	std::vector<uint64_t> buckets;
+
+	uint64_t count = 0;
+	int64_t sum = 0;
+	int64_t minSeen = 0;
+	int64_t maxSeen = 0;
+};
@@ -0,0 +1,210 @@
+#include "encoder-preview-vbv.hpp"
+
+#include <util/dstr.h>
+
+#include <algorithm>
+
+using namespace std;
+
+/* Enough samples for the graph if the stats are not taken for a while */
+static constexpr size_t kMaxSamples = 600;
+/* Running dry for a moment is expected, timestamps are not that exact.
+ * Relative to the buffer size, so 50 ms for a one second buffer. */
+static constexpr double kUnderflowTolerance = 0.05;
+
+bool VbvModel::ReadConfig(obs_encoder_t *encoder, Config &config)
+{
+	config = {};
+
+	obs_data_t *settings = obs_encoder_get_settings(encoder);
+	if (!settings)
+		return false;
+
+	config.rateControl = obs_data_get_string(settings, "rate_control");
+	int64_t bitrate = obs_data_get_int(settings, "bitrate");
+	int64_t max_bitrate = obs_data_get_int(settings, "max_bitrate");
+	int64_t buffer_size = 0;
+	if (obs_data_get_bool(settings, "use_bufsize"))
+		buffer_size = obs_data_get_int(settings, "buffer_size");
+
+	obs_data_release(settings);
+
+	/* Constant quality modes have no bitrate to model */
+	static const char *quality_modes[] = {"CRF", "CQP", "ICQ", "CQ",
+					      "lossless"};
+	for (const char *mode : quality_modes) {
+		if (astrcmpi(config.rateControl.c_str(), mode) == 0)
+			return false;
+	}
+
+	/* VBR may burst up to the maximum bitrate */
+	if (astrcmpi(config.rateControl.c_str(), "VBR") == 0 &&
+	    max_bitrate > bitrate)
+		bitrate = max_bitrate;
+
+	if (bitrate <= 0)
+		return false;
+
+	/* Without an explicit size encoders use one second worth */
+	if (buffer_size <= 0)
+		buffer_size = bitrate;
+
+	config.bitrate = (uint64_t)bitrate * 1000;
+	config.bufferSize = (uint64_t)buffer_size * 1000;
+	config.cbr = astrcmpi(config.rateControl.c_str(), "CBR") == 0;
+	return true;
+}
+
+void VbvModel::Start(const Config &new_config)
+{
+	lock_guard lock(mutex);
+
+	config = new_config;
+	active = config.bitrate && config.bufferSize;
+
+	haveLast = false;
+	fullness = 0.0;
+	idle = 0.0;
+	overflowing = false;
+	underflowing = false;
+	second.Clear();
+	shortWindow.Clear();
+
+	occupancy.clear();
+	maxOccupancy = 0.0;
+	overflows = 0;
+	underflows = 0;
+	totalOverflows = 0;
+	totalUnderflows = 0;
+}
+
+void VbvModel::Update(const Config &new_config)
+{
+	lock_guard lock(mutex);
+	if (!active)
+		return;
+
+	config = new_config;
+	active = config.bitrate && config.bufferSize;
+}
+
+void VbvModel::Stop()
+{
+	lock_guard lock(mutex);
+	active = false;
+}
+
+void VbvModel::Push(const encoder_packet *pkt)
+{
+	lock_guard lock(mutex);
+	if (!active)
+		return;
+
+	/* DTS is when the encoder hands the packet over */
+	int64_t ts = (int64_t)((long double)pkt->dts * 1e9l *
+			       (long double)pkt->timebase_num /
+			       (long double)pkt->timebase_den);
+
+	const double buffer = (double)config.bufferSize;
+
+	if (haveLast && ts > lastTs)
+		fullness -= (double)(ts - lastTs) / 1e9 *
+			    (double)config.bitrate;
+
+	haveLast = true;
+	lastTs = ts;
+
+	/* The link sits idle for as long as the bucket stays empty */
+	if (fullness < 0.0) {
+		idle -= fullness;
+		if (idle > buffer * kUnderflowTolerance && !underflowing) {
+			if (config.cbr) {
+				underflows++;
+				totalUnderflows++;
+			}
+			underflowing = true;
+		}
+	} else {
+		idle = 0.0;
+		underflowing = false;
+	}
+
+	fullness = std::max(fullness, 0.0) + (double)pkt->size * 8.0;
+
+	if (fullness > buffer) {
+		if (!overflowing) {
+			overflows++;
+			totalOverflows++;
+		}
+		overflowing = true;
+	} else {
+		overflowing = false;
+	}
+
+	double percent = fullness / buffer * 100.0;
+	maxOccupancy = std::max(maxOccupancy, percent);
+
+	if (occupancy.size() >= kMaxSamples)
+		occupancy.erase(occupancy.begin());
+	occupancy.push_back(percent);
+
+	second.Add(ts, pkt->size);
+	shortWindow.Add(ts, pkt->size);
+}
+
+VbvModel::Stats VbvModel::TakeStats()
+{
+	Stats ret;
+
+	lock_guard lock(mutex);
+
+	ret.active = active;
+	ret.config = config;
+
+	ret.occupancy.swap(occupancy);
+	ret.maxOccupancy = maxOccupancy;
+	ret.overflows = overflows;
+	ret.underflows = underflows;
+	ret.totalOverflows = totalOverflows;
+	ret.totalUnderflows = totalUnderflows;
+
+	ret.peakSecond = second.peak;
+	ret.peakShort = shortWindow.peak;
+	ret.totalPeakSecond = second.totalPeak;
+	ret.totalPeakShort = shortWindow.totalPeak;
+
+	maxOccupancy = 0.0;
+	overflows = 0;
+	underflows = 0;
+	second.peak = 0.0;
+	shortWindow.peak = 0.0;
+
+	return ret;
+}
+
+/*
+ * Peak windows
+ */
+
+void VbvModel::Window::Add(int64_t ts, uint64_t size)
+{
+	packets.emplace_back(ts, size);
+	bytes += size;
+
+	while (!packets.empty() && packets.front().first <= ts - duration) {
+		bytes -= packets.front().second;
+		packets.pop_front();
+	}
+
+	double kbps = (double)bytes * 8.0 / ((double)duration / 1e9) / 1000.0;
+	peak = std::max(peak, kbps);
+	totalPeak = std::max(totalPeak, kbps);
+}
+
+void VbvModel::Window::Clear()
+{
+	packets.clear();
+	bytes = 0;
+	peak = 0.0;
+	totalPeak = 0.0;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <obs.h>
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Leaky bucket model of the encoder's rate control buffer. Every packet
+ * fills the bucket by its size, which drains at the configured bitrate.
+ * Running over the buffer size means the stream bursts above what a link
+ * of that bitrate can carry. */
+class VbvModel {
+public:
+	struct Config {
+		/* Rate the bucket drains at and its size, in bits */
+		uint64_t bitrate = 0;
+		uint64_t bufferSize = 0;
+		/* With CBR an empty bucket is an underflow, the encoder should
+		 * have padded the stream. */
+		bool cbr = false;
+		std::string rateControl;
+	};
+
+	struct Stats {
+		bool active = false;
+		Config config;
+
+		/* Occupancy after every packet since the last call, in percent
+		 * of the buffer size */
+		std::vector<double> occupancy;
+		double maxOccupancy = 0.0;
+
+		/* Events are counted when the bucket first leaves its bounds */
+		uint64_t overflows = 0;
+		uint64_t underflows = 0;
+		uint64_t totalOverflows = 0;
+		uint64_t totalUnderflows = 0;
+
+		/* Highest bitrate within any window, in kbps, since the last
+		 * call and since the start. */
+		double peakSecond = 0.0;
+		double peakShort = 0.0;
+		double totalPeakSecond = 0.0;
+		double totalPeakShort = 0.0;
+	};
+
+	/* False if the encoder is not rate controlled (e.g. CRF or CQP) */
+	static bool ReadConfig(obs_encoder_t *encoder, Config &config);
+
+	void Start(const Config &config);
+	void Stop();
+	/* Applies changed settings (e.g. dynamic bitrate) without starting
+	 * over, the bucket keeps its fill. Ignored while stopped. */
+	void Update(const Config &config);
+
+	/* Encoder thread */
+	void Push(const encoder_packet *pkt);
+
+	Stats TakeStats();
+
+private:
+	struct Window {
+		explicit Window(int64_t duration) : duration(duration) {}
+
+		int64_t duration;
+		std::deque<std::pair<int64_t, uint64_t>> packets;
+		uint64_t bytes = 0;
+		double peak = 0.0;
+		double totalPeak = 0.0;
+
+		void Add(int64_t ts, uint64_t size);
+		void Clear();
+	};
+
+	std::mutex mutex;
+	bool active = false;
+	Config config;
+
+	bool haveLast = false;
+	int64_t lastTs = 0;
+	double fullness = 0.0;
+	/* Bits the link could have carried while the bucket was empty */
+	double idle = 0.0;
+	bool overflowing = false;
+	bool underflowing = false;
+
+	Window second{1000000000};
+	Window shortWindow{100000000};
+
+	std::vector<double> occupancy;
+	double maxOccupancy = 0.0;
+	uint64_t overflows = 0;
+	uint64_t underflows = 0;
+	uint64_t totalOverflows = 0;
+	uint64_t totalUnderflows = 0;
+};
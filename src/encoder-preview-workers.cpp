@@ -0,0 +1,200 @@
+#include "encoder-preview-workers.hpp"
+
+#include <util/base.h>
+#include <util/platform.h>
+
+#include <algorithm>
+#include <string>
+
+using namespace std;
+
+/* Decoders run single threaded, a few of them are plenty for previews */
+static constexpr size_t kMaxWorkers = 4;
+
+WorkStrand::WorkStrand(function<void()> work) : work(std::move(work)) {}
+
+void WorkStrand::Open()
+{
+	WorkerPool::Shared().Open(this);
+}
+
+void WorkStrand::Close()
+{
+	WorkerPool::Shared().Close(this);
+}
+
+void WorkStrand::Schedule()
+{
+	WorkerPool::Shared().Schedule(this);
+}
+
+/*
+ * Pool
+ */
+
+/* Never destroyed, joining the workers from a static destructor would
+ * happen under the loader lock on Windows. Shutdown() stops them instead. */
+WorkerPool &WorkerPool::Shared()
+{
+	static WorkerPool *pool = new WorkerPool(std::clamp<size_t>(
+		thread::hardware_concurrency() / 2, 1, kMaxWorkers));
+	return *pool;
+}
+
+WorkerPool::WorkerPool(size_t count)
+{
+	for (size_t idx = 0; idx < count; idx++)
+		threads.emplace_back(&WorkerPool::Thread, this, idx);
+}
+
+void WorkerPool::Shutdown()
+{
+	{
+		lock_guard lock(mutex);
+		stopping = true;
+	}
+
+	cond.notify_all();
+	for (std::thread &thread : threads) {
+		if (thread.joinable())
+			thread.join();
+	}
+}
+
+void WorkerPool::Open(WorkStrand *strand)
+{
+	lock_guard lock(mutex);
+	strand->open = true;
+}
+
+void WorkerPool::Close(WorkStrand *strand)
+{
+	unique_lock lock(mutex);
+
+	strand->open = false;
+	strand->rerun = false;
+
+	if (strand->queued) {
+		queue.erase(std::find(queue.begin(), queue.end(), strand));
+		strand->queued = false;
+	}
+
+	idleCond.wait(lock, [&] { return !strand->running; });
+}
+
+void WorkerPool::Schedule(WorkStrand *strand)
+{
+	{
+		lock_guard lock(mutex);
+
+		if (!strand->open || strand->queued)
+			return;
+
+		if (strand->running) {
+			strand->rerun = true;
+			return;
+		}
+
+		strand->queued = true;
+		queue.push_back(strand);
+	}
+
+	cond.notify_one();
+}
+
+uint64_t WorkerPool::SetThreadPolicy(const ThreadPolicy &new_policy)
+{
+	uint64_t generation;
+
+	{
+		lock_guard lock(mutex);
+
+		if (new_policy == policy)
+			return policyGeneration;
+
+		policy = new_policy;
+		generation = ++policyGeneration;
+		policyApplied = 0;
+		policyFailed = false;
+	}
+
+	cond.notify_all();
+	return generation;
+}
+
+bool WorkerPool::GetPolicyResult(uint64_t generation, bool &failed)
+{
+	lock_guard lock(mutex);
+
+	/* A newer policy replaced it, whoever set that one checks it */
+	if (generation != policyGeneration) {
+		failed = false;
+		return true;
+	}
+
+	if (policyApplied < threads.size())
+		return false;
+
+	failed = policyFailed;
+	return true;
+}
+
+void WorkerPool::Thread(size_t idx)
+{
+	string name = "encoder-preview: decode " + to_string(idx);
+	os_set_thread_name(name.c_str());
+
+	uint64_t applied = 0;
+
+	unique_lock lock(mutex);
+
+	for (;;) {
+		cond.wait(lock, [&] {
+			return stopping || !queue.empty() ||
+			       applied != policyGeneration;
+		});
+		if (stopping)
+			break;
+
+		if (applied != policyGeneration) {
+			ThreadPolicy current = policy;
+			applied = policyGeneration;
+
+			lock.unlock();
+			bool success = ApplyThreadPolicy(current);
+			if (!success)
+				blog(LOG_WARNING,
+				     "Could not fully apply the thread policy "
+				     "to %s",
+				     name.c_str());
+			lock.lock();
+
+			if (applied == policyGeneration) {
+				policyApplied++;
+				policyFailed = policyFailed || !success;
+			}
+			continue;
+		}
+
+		WorkStrand *strand = queue.front();
+		queue.pop_front();
+		strand->queued = false;
+		strand->running = true;
+
+		lock.unlock();
+		strand->work();
+		lock.lock();
+
+		strand->running = false;
+
+		/* Requeue at the back so other strands get their turn */
+		if (strand->rerun && strand->open) {
+			strand->rerun = false;
+			strand->queued = true;
+			queue.push_back(strand);
+			cond.notify_one();
+		}
+
+		idleCond.notify_all();
+	}
+}
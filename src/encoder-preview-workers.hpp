@@ -0,0 +1,82 @@
+#pragma once
+
+#include "encoder-preview-governor.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A serial queue of work on the shared worker pool. A strand is queued at
+ * most once and never runs on two workers at the same time, so everything
+ * its work function touches (e.g. a decoder context) needs no locking. */
+class WorkStrand {
+public:
+	explicit WorkStrand(std::function<void()> work);
+	~WorkStrand() { Close(); }
+
+	WorkStrand(const WorkStrand &) = delete;
+	WorkStrand &operator=(const WorkStrand &) = delete;
+
+	/* Allows the strand to be scheduled */
+	void Open();
+	/* Removes the strand from the queue and waits for a running batch */
+	void Close();
+
+	/* Runs work once more on a worker, calls while it is already queued
+	 * are merged, calls while it is running queue it again afterwards. */
+	void Schedule();
+
+private:
+	friend class WorkerPool;
+
+	std::function<void()> work;
+
+	/* Protected by the pool mutex */
+	bool open = false;
+	bool queued = false;
+	bool running = false;
+	bool rerun = false;
+};
+
+class WorkerPool {
+public:
+	static WorkerPool &Shared();
+
+	size_t ThreadCount() const { return threads.size(); }
+
+	/* Every worker applies it before picking up more work, returns the
+	 * generation to check the outcome with */
+	uint64_t SetThreadPolicy(const ThreadPolicy &policy);
+	/* False while workers are still applying it, failed if any of them
+	 * could not, e.g. when raising the priority needs privileges. */
+	bool GetPolicyResult(uint64_t generation, bool &failed);
+
+	/* Joins the workers, all strands must be closed by then. Called
+	 * when the module unloads. */
+	void Shutdown();
+
+private:
+	friend class WorkStrand;
+
+	explicit WorkerPool(size_t count);
+
+	void Open(WorkStrand *strand);
+	void Close(WorkStrand *strand);
+	void Schedule(WorkStrand *strand);
+
+	void Thread(size_t idx);
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::condition_variable idleCond;
+	std::deque<WorkStrand *> queue;
+	std::vector<std::thread> threads;
+	bool stopping = false;
+	ThreadPolicy policy;
+	uint64_t policyGeneration = 0;
+	size_t policyApplied = 0;
+	bool policyFailed = false;
+};
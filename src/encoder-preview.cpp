@@ -1,4 +1,5 @@
 #include "encoder-preview.hpp"
+#include "plugin-profiler.hpp"
 
 #ifdef BUILD_STANDALONE
 #include "external/display-helpers.hpp"
@@ -15,9 +16,14 @@
 #include <util/platform.h>
 
 #include <QAction>
+#include <QFileDialog>
 #include <QMainWindow>
+#include <QMouseEvent>
 #include <QObject>
 #include <QMenu>
+#include <QMessageBox>
+#include <algorithm>
+#include <cmath>
 #include <random>
 
 #include "util/util.hpp"
@@ -26,39 +32,344 @@ using namespace std;
 
 EncoderPreview *enc_preview;
 
-EncoderPreview::EncoderPreview(QWidget *parent)
+EncoderPreview::EncoderPreview(QWidget *parent, bool primary)
 	: QDialog(parent),
 	  ui(new Ui_EncoderPreview),
+	  primary(primary),
 	  timer(this)
 {
 	ui->setupUi(this);
 	setWindowFlags(windowFlags() & ~Qt::WindowContextHelpButtonHint);
 
+	/* Every window previews through its own output and source */
+	static int instances = 0;
+	instances++;
+
+	string output_name = "encoder_preview";
+	string source_name = "Encoder Output Preview";
+	if (instances > 1) {
+		output_name += "_" + to_string(instances);
+		source_name += " " + to_string(instances);
+		setWindowTitle(windowTitle() + " " + QString::number(instances));
+	}
+
+	pipeline = make_unique<PreviewPipeline>(output_name.c_str(),
+						source_name.c_str());
+	comparePipeline = make_unique<PreviewPipeline>(
+		(output_name + "_compare").c_str(),
+		(source_name + " (Compare)").c_str());
+	delayGroup = make_shared<DelayGroup>();
+
 	ui->hwdecodeCb->hide();
+	ui->conversionLbl->hide();
+	ui->qpLbl->hide();
+	ui->compareLbl->hide();
+	ui->captureLbl->hide();
+
+	/* Secondary windows are gone once closed, so they cannot run hidden */
+	if (!primary) {
+		setAttribute(Qt::WA_DeleteOnClose);
+		ui->runInBackGroundCb->hide();
+	}
 
 	ui->startStopBtn->setEnabled(false);
 
 	connect(ui->close, &QPushButton::clicked, this, &EncoderPreview::close);
 
 	connect(ui->encoderCombo, &QComboBox::currentIndexChanged, this,
-		[&](int idx) { ui->startStopBtn->setEnabled(idx != -1); });
+		&EncoderPreview::UpdateStatus);
+
+	/* Only picking an encoder switches, not refreshing the list */
+	connect(ui->encoderCombo, &QComboBox::activated, this,
+		[&](int) { SwitchEncoder(pipeline.get(), ui->encoderCombo); });
+	connect(ui->compareCombo, &QComboBox::activated, this, [&](int) {
+		if (comparing)
+			SwitchEncoder(comparePipeline.get(), ui->compareCombo);
+	});
+
+	/* Starting and stopping finish in the background */
+	for (PreviewPipeline *side : Pipelines())
+		side->SetStatusCallback([this](PreviewPipeline::Status) {
+			QMetaObject::invokeMethod(this, "UpdateStatus",
+						  Qt::QueuedConnection);
+		});
 
 	connect(ui->startStopBtn, &QPushButton::clicked, this,
 		&EncoderPreview::StartStopPreview);
 
 	connect(ui->addToSceneBtn, &QPushButton::clicked, this, [&]() {
 		OBSSourceAutoRelease scene = obs_frontend_get_current_scene();
-		obs_scene_add(obs_scene_from_source(scene), previewSource);
+		obs_scene_add(obs_scene_from_source(scene),
+			      pipeline->GetSource());
 	});
 
 	connect(ui->refreshBtn, &QPushButton::clicked, this,
 		&EncoderPreview::RefreshEncoders);
 
+	connect(ui->newWindowBtn, &QPushButton::clicked, this,
+		&EncoderPreview::OpenNewWindow);
+
+	connect(ui->scaleToPreviewCb, &QCheckBox::toggled, this,
+		[&](bool checked) {
+			for (PreviewPipeline *side : Pipelines())
+				side->SetScaleToPreview(checked);
+		});
+
+	connect(ui->delaySb, &QSpinBox::valueChanged, this, [&](int value) {
+		for (PreviewPipeline *side : Pipelines())
+			side->SetTargetDelay((uint64_t)value * 1000000);
+	});
+
+	ui->compareModeCombo->addItem(
+		obs_module_text("EncoderPreview.Compare.SideBySide"),
+		CompareSideBySide);
+	ui->compareModeCombo->addItem(
+		obs_module_text("EncoderPreview.Compare.Wipe"), CompareWipe);
+
+	connect(ui->compareModeCombo, &QComboBox::currentIndexChanged, this,
+		[&](int) {
+			compareMode =
+				ui->compareModeCombo->currentData().toInt();
+		});
+
+	ui->captureFormatCombo->addItem(
+		obs_module_text("EncoderPreview.Capture.Matroska"),
+		PacketCapture::ContainerMatroska);
+	ui->captureFormatCombo->addItem(
+		obs_module_text("EncoderPreview.Capture.PacketTrace"),
+		PacketCapture::ContainerPacketTrace);
+
+	ui->preview->installEventFilter(this);
+
+	ui->overlayCombo->addItem(obs_module_text("EncoderPreview.Overlay.None"),
+				  PreviewPipeline::OverlayNone);
+	ui->overlayCombo->addItem(obs_module_text("EncoderPreview.Overlay.QP"),
+				  PreviewPipeline::OverlayQp);
+	ui->overlayCombo->addItem(
+		obs_module_text("EncoderPreview.Overlay.PSNR"),
+		PreviewPipeline::OverlayPsnr);
+	ui->overlayCombo->addItem(
+		obs_module_text("EncoderPreview.Overlay.SSIM"),
+		PreviewPipeline::OverlaySsim);
+	ui->overlayCombo->addItem(obs_module_text("EncoderPreview.Overlay.ROI"),
+				  PreviewPipeline::OverlayRoi);
+
+	connect(ui->overlayCombo, &QComboBox::currentIndexChanged, this,
+		[&](int) {
+			int mode = ui->overlayCombo->currentData().toInt();
+			for (PreviewPipeline *side : Pipelines())
+				side->SetOverlay(mode);
+		});
+
+	psnrGraph = new StatsGraph(this);
+	psnrGraph->SetUnit(" dB");
+	psnrGraph->AddSeries(obs_module_text("EncoderPreview.Quality.Frame"),
+			     QColor(220, 220, 220));
+	psnrGraph->AddSeries(obs_module_text("EncoderPreview.Quality.Inside"),
+			     QColor(80, 200, 80));
+	psnrGraph->AddSeries(obs_module_text("EncoderPreview.Quality.Outside"),
+			     QColor(220, 80, 80));
+
+	ssimGraph = new StatsGraph(this);
+	ssimGraph->AddSeries(obs_module_text("EncoderPreview.Quality.Frame"),
+			     QColor(220, 220, 220));
+	ssimGraph->AddSeries(obs_module_text("EncoderPreview.Quality.Inside"),
+			     QColor(80, 200, 80));
+	ssimGraph->AddSeries(obs_module_text("EncoderPreview.Quality.Outside"),
+			     QColor(220, 80, 80));
+
+	ui->qualityLayout->addWidget(psnrGraph);
+	ui->qualityLayout->addWidget(ssimGraph);
+
+	sizeGraph = new StatsGraph(this, StatsGraph::Bars);
+	sizeGraph->AddSeries(
+		obs_module_text("EncoderPreview.Bitstream.Graph.Intra"),
+		QColor(220, 80, 80));
+	sizeGraph->AddSeries(
+		obs_module_text("EncoderPreview.Bitstream.Graph.Inter"),
+		QColor(80, 160, 220));
+	sizeGraph->AddSeries(
+		obs_module_text("EncoderPreview.Bitstream.Graph.B"),
+		QColor(80, 200, 80));
+
+	ui->bitstreamLayout->addWidget(sizeGraph);
+
+	bufferGraph = new StatsGraph(this);
+	bufferGraph->SetUnit("%");
+	bufferGraph->SetCapacity(600);
+	bufferGraph->AddSeries(
+		obs_module_text("EncoderPreview.RateControl.Occupancy"),
+		QColor(80, 160, 220));
+	bufferGraph->AddSeries(
+		obs_module_text("EncoderPreview.RateControl.Limit"),
+		QColor(220, 80, 80));
+
+	ui->rateControlLayout->addWidget(bufferGraph);
+
+	latencyGraph = new StatsGraph(this);
+	latencyGraph->SetUnit(" ms");
+	latencyGraph->AddSeries(obs_module_text("EncoderPreview.Latency.Encode"),
+				QColor(220, 80, 80));
+	latencyGraph->AddSeries(obs_module_text("EncoderPreview.Latency.Queue"),
+				QColor(220, 180, 60));
+	latencyGraph->AddSeries(obs_module_text("EncoderPreview.Latency.Decode"),
+				QColor(80, 160, 220));
+	latencyGraph->AddSeries(
+		obs_module_text("EncoderPreview.Latency.Present"),
+		QColor(80, 200, 80));
+
+	/* Above the export button */
+	ui->latencyLayout->insertWidget(1, latencyGraph);
+
+	connect(ui->latencyExportBtn, &QPushButton::clicked, this,
+		&EncoderPreview::ExportLatency);
+	connect(ui->traceBtn, &QPushButton::toggled, this,
+		&EncoderPreview::RecordTrace);
+	/* There is one recorder for the whole process, it records all
+	 * windows. Only the primary one controls it. */
+	ui->traceBtn->setVisible(primary);
+
+	connect(ui->decodeCb, &QCheckBox::toggled, this, [&](bool checked) {
+		for (PreviewPipeline *side : Pipelines())
+			side->SetDecoding(checked);
+	});
+
+	connect(ui->decodeOnDemandCb, &QCheckBox::toggled, this,
+		[&](bool checked) {
+			for (PreviewPipeline *side : Pipelines())
+				side->SetDecodeOnDemand(checked);
+		});
+
+	for (PreviewPipeline *side : Pipelines())
+		side->SetDecodeOnDemand(ui->decodeOnDemandCb->isChecked());
+
+	connect(ui->captureCb, &QCheckBox::toggled, this,
+		&EncoderPreview::StartStopCapture);
+
+	connect(ui->pauseBtn, &QPushButton::toggled, this,
+		&EncoderPreview::PauseResume);
+
+	connect(ui->replaySlider, &QSlider::valueChanged, this, [&](int value) {
+		pipeline->Replay().Seek((size_t)value);
+		UpdateReplayControls();
+	});
+
+	connect(ui->stepBackBtn, &QPushButton::clicked, this, [&]() {
+		pipeline->Replay().Step(-1);
+		UpdateReplayControls();
+	});
+
+	connect(ui->stepForwardBtn, &QPushButton::clicked, this, [&]() {
+		pipeline->Replay().Step(1);
+		UpdateReplayControls();
+	});
+
+	connect(ui->replaySecondsSb, &QSpinBox::valueChanged, this,
+		&EncoderPreview::UpdateReplayLimits);
+	connect(ui->replayMemorySb, &QSpinBox::valueChanged, this,
+		&EncoderPreview::UpdateReplayLimits);
+
+	UpdateReplayLimits();
+	UpdateReplayControls();
+
+	connect(ui->qualityCb, &QCheckBox::toggled, this,
+		[&](bool checked) { pipeline->SetQualityAnalysis(checked); });
+
+	/* Only the main preview, the regions are changed on its encoder */
+	connect(ui->abTestCb, &QCheckBox::toggled, this,
+		[&](bool checked) { pipeline->SetRoiAbTest(checked); });
+	connect(ui->abTestGopsSb, &QSpinBox::valueChanged, this,
+		[&](int value) { pipeline->SetRoiAbTestGops(value); });
+	pipeline->SetRoiAbTestGops(ui->abTestGopsSb->value());
+
+	connect(ui->netEnableCb, &QCheckBox::toggled, this, [&](bool checked) {
+		for (PreviewPipeline *side : Pipelines())
+			side->SetNetworkSimulation(checked);
+	});
+
+	for (QSpinBox *sb : {ui->netBandwidthSb, ui->netRttSb, ui->netJitterSb,
+			     ui->netSeedSb})
+		connect(sb, &QSpinBox::valueChanged, this,
+			&EncoderPreview::UpdateNetworkConfig);
+	connect(ui->netLossSb, &QDoubleSpinBox::valueChanged, this,
+		&EncoderPreview::UpdateNetworkConfig);
+
+	UpdateNetworkConfig();
+
+	ui->decoderPriorityCombo->addItem(
+		obs_module_text("EncoderPreview.Decoder.Priority.Normal"),
+		ThreadPolicy::PriorityNormal);
+	ui->decoderPriorityCombo->addItem(
+		obs_module_text("EncoderPreview.Decoder.Priority.Low"),
+		ThreadPolicy::PriorityLow);
+	ui->decoderPriorityCombo->addItem(
+		obs_module_text("EncoderPreview.Decoder.Priority.Lowest"),
+		ThreadPolicy::PriorityLowest);
+	ui->decoderPriorityCombo->addItem(
+		obs_module_text("EncoderPreview.Decoder.Priority.Idle"),
+		ThreadPolicy::PriorityIdle);
+
+	connect(ui->decoderPriorityCombo, &QComboBox::currentIndexChanged,
+		this, [&](int) { UpdateThreadPolicy(); });
+	connect(ui->decoderAffinityEdit, &QLineEdit::editingFinished, this,
+		&EncoderPreview::UpdateThreadPolicy);
+
+	/* The workers are shared by every window, only the persisted one
+	 * decides how they are scheduled. */
+	ui->decoderPriorityLbl->setVisible(primary);
+	ui->decoderPriorityCombo->setVisible(primary);
+	ui->decoderAffinityLbl->setVisible(primary);
+	ui->decoderAffinityEdit->setVisible(primary);
+
+	connect(ui->decoderBudgetSb, &QSpinBox::valueChanged, this,
+		[&](int value) {
+			for (PreviewPipeline *side : Pipelines())
+				side->SetDecodeBudget(value);
+		});
+
+	connect(ui->adaptiveDecodeCb, &QCheckBox::toggled, this,
+		[&](bool checked) {
+			for (PreviewPipeline *side : Pipelines())
+				side->SetAdaptiveDecoding(checked);
+		});
+
+	/* One set of thumbnails is plenty, it may keep running hidden */
+	if (primary) {
+		monitor = new EncoderMonitor(this);
+		ui->monitorLayout->addWidget(monitor);
+		ui->monitorLayout->addStretch();
+
+		connect(ui->monitorCb, &QCheckBox::toggled, monitor,
+			&EncoderMonitor::SetMonitoring);
+	} else {
+		ui->statsTabs->removeTab(
+			ui->statsTabs->indexOf(ui->monitorTab));
+	}
+
 	connect(&timer, &QTimer::timeout, this, &EncoderPreview::UpdateStats);
 	timer.setInterval(2000);
 
-	CreatePreviewOutput();
-	CreatePreviewSource();
+	/* The primary window is created before text sources are available */
+	if (!primary)
+		CreateLabelSource();
+}
+
+EncoderPreview::~EncoderPreview()
+{
+	StopPreview();
+
+	if (primary && ui->traceBtn->isChecked())
+		TraceRecorder::Stop();
+
+	/* The display outlives us, it is owned by the base class */
+	if (ui->preview->GetDisplay())
+		obs_display_remove_draw_callback(ui->preview->GetDisplay(),
+						 EncoderPreview::DrawPreview,
+						 this);
+
+	obs_enter_graphics();
+	gs_texrender_destroy(wipeRender);
+	obs_leave_graphics();
 }
 
 /*
@@ -67,21 +378,107 @@ EncoderPreview::EncoderPreview(QWidget *parent)
 
 void EncoderPreview::StartStopPreview(bool)
 {
-	if (state == INACTIVE)
+	if (!running)
 		StartPreview();
 	else
 		StopPreview();
 }
 
+void EncoderPreview::UpdateStatus()
+{
+	/* Failed to start, or the encoder stopped by itself */
+	if (running && pipeline->GetStatus() == PreviewPipeline::INACTIVE) {
+		StopPreview();
+		return;
+	}
+
+	if (!running) {
+		const bool stopped =
+			pipeline->GetStatus() == PreviewPipeline::INACTIVE &&
+			comparePipeline->GetStatus() ==
+				PreviewPipeline::INACTIVE;
+
+		ui->startStopBtn->setText(obs_module_text(
+			stopped ? "EncoderPreview.Start"
+				: "EncoderPreview.Stopping"));
+		ui->startStopBtn->setEnabled(
+			stopped && ui->encoderCombo->currentIndex() != -1);
+		return;
+	}
+
+	/* Captures end with the encoder, after a switch as well */
+	if (ui->captureCb->isChecked() && !pipeline->Capturing() &&
+	    pipeline->GetStatus() != PreviewPipeline::STOPPING)
+		StartStopCapture(true);
+}
+
+void EncoderPreview::SwitchEncoder(PreviewPipeline *side, QComboBox *combo)
+{
+	if (!running || combo->currentIndex() == -1)
+		return;
+
+	OBSEncoderAutoRelease enc = obs_get_encoder_by_name(
+		QT_TO_UTF8(combo->currentData().toString()));
+	if (enc)
+		side->Switch(enc);
+}
+
+void EncoderPreview::OpenNewWindow()
+{
+	obs_frontend_push_ui_translation(obs_module_get_string);
+	auto window = new EncoderPreview(parentWidget(), false);
+	obs_frontend_pop_ui_translation();
+
+	window->ShowHideDialog();
+}
+
 void EncoderPreview::closeEvent(QCloseEvent *event)
 {
 	timer.stop();
-	if (!ui->runInBackGroundCb->isChecked())
+	if (!primary || !ui->runInBackGroundCb->isChecked())
 		StopPreview();
 
 	QDialog::closeEvent(event);
 }
 
+/* Minimising hides the dialog as well */
+void EncoderPreview::showEvent(QShowEvent *event)
+{
+	for (PreviewPipeline *side : Pipelines())
+		side->SetViewerVisible(true);
+
+	QDialog::showEvent(event);
+}
+
+void EncoderPreview::hideEvent(QHideEvent *event)
+{
+	for (PreviewPipeline *side : Pipelines())
+		side->SetViewerVisible(false);
+
+	QDialog::hideEvent(event);
+}
+
+bool EncoderPreview::eventFilter(QObject *obj, QEvent *event)
+{
+	if (obj != ui->preview || !comparing || compareMode != CompareWipe)
+		return QDialog::eventFilter(obj, event);
+
+	if (event->type() != QEvent::MouseButtonPress &&
+	    event->type() != QEvent::MouseMove)
+		return QDialog::eventFilter(obj, event);
+
+	auto mouse = static_cast<QMouseEvent *>(event);
+	if (!(mouse->buttons() & Qt::LeftButton) || frameCx <= 0)
+		return QDialog::eventFilter(obj, event);
+
+	/* The display is drawn in device pixels */
+	float x = float(mouse->position().x() * devicePixelRatioF());
+	wipePos = std::clamp((x - float(frameX)) / float(frameCx), 0.0f,
+			     1.0f);
+
+	return true;
+}
+
 static void SetLabelText(obs_source_t *source, const char *text)
 {
 	if (!source)
@@ -102,28 +499,213 @@ void EncoderPreview::StartPreview()
 		return;
 	}
 
-	ui->encoderCombo->setEnabled(false);
+	OBSEncoderAutoRelease compareEnc;
+	if (ui->compareCb->isChecked() &&
+	    ui->compareCombo->currentIndex() != -1)
+		compareEnc = obs_get_encoder_by_name(QT_TO_UTF8(
+			ui->compareCombo->currentData().toString()));
+
+	running = true;
+	ui->compareCb->setEnabled(false);
+	ui->compareCombo->setEnabled(compareEnc != nullptr);
 	ui->startStopBtn->setText(obs_module_text("EncoderPreview.Stop"));
 	SetLabelText(waitingText, obs_module_text("EncoderPreview.Waiting"));
 
-	state = WAITING;
-	obs_encoder_set_video(enc, obs_get_video());
-	obs_output_set_video_encoder(previewOut, enc);
-	obs_output_start(previewOut);
+	/* Both sides present frames with the same delay, so frames captured
+	 * together are shown together. */
+	comparing = compareEnc != nullptr;
+	for (PreviewPipeline *side : Pipelines())
+		side->SetDelayGroup(comparing ? delayGroup : nullptr);
+
+	bool success = pipeline->Start(enc);
+	if (success && comparing)
+		success = comparePipeline->Start(compareEnc);
+
+	if (!success) {
+		StopPreview();
+		ui->startStopBtn->setChecked(false);
+	}
+}
+
+void EncoderPreview::PauseResume(bool pause)
+{
+	ReplayBuffer &replay = pipeline->Replay();
+
+	if (!pause) {
+		replay.Resume();
+	} else if (pipeline->GetStatus() == PreviewPipeline::INACTIVE ||
+		   !replay.Pause()) {
+		QSignalBlocker blocker(ui->pauseBtn);
+		ui->pauseBtn->setChecked(false);
+	}
+
+	UpdateReplayControls();
 }
 
-void EncoderPreview::StopPreview()
+void EncoderPreview::UpdateReplayControls()
+{
+	ReplayBuffer &replay = pipeline->Replay();
+
+	const bool paused = replay.Paused();
+	const size_t count = replay.FrameCount();
+	const size_t position = replay.Position();
+
+	ui->replaySlider->setEnabled(paused);
+	ui->stepBackBtn->setEnabled(paused && position > 0);
+	ui->stepForwardBtn->setEnabled(paused && position + 1 < count);
+
+	{
+		QSignalBlocker blocker(ui->replaySlider);
+		ui->replaySlider->setRange(0, count ? int(count - 1) : 0);
+		ui->replaySlider->setValue(paused ? int(position) : 0);
+	}
+
+	if (!paused) {
+		ui->replayLbl->clear();
+		return;
+	}
+
+	double offset = (double)replay.FrameOffset(position) / 1e9;
+	ui->replayLbl->setText(
+		QString(obs_module_text("EncoderPreview.Replay.Position"))
+			.arg(position + 1)
+			.arg(count)
+			.arg(loc.toString(offset, 'f', 2)));
+}
+
+void EncoderPreview::UpdateReplayLimits()
 {
-	obs_output_stop(previewOut);
-	while (obs_output_active(previewOut))
-		this_thread::sleep_for(10ms);
+	pipeline->Replay().SetLimits(
+		(uint64_t)ui->replaySecondsSb->value() * 1000000000,
+		(size_t)ui->replayMemorySb->value() * 1024 * 1024);
+}
 
-	obs_output_set_video_encoder(previewOut, nullptr);
+void EncoderPreview::UpdateNetworkConfig()
+{
+	NetworkSimulator::Config config;
+	config.bandwidth = (uint32_t)ui->netBandwidthSb->value();
+	config.rtt = (uint32_t)ui->netRttSb->value();
+	config.jitter = (uint32_t)ui->netJitterSb->value();
+	config.loss = ui->netLossSb->value();
+	config.seed = (uint32_t)ui->netSeedSb->value();
+
+	for (PreviewPipeline *side : Pipelines())
+		side->SetNetworkConfig(config);
+}
 
-	state = INACTIVE;
-	ui->encoderCombo->setEnabled(true);
-	ui->startStopBtn->setText(obs_module_text("EncoderPreview.Start"));
+void EncoderPreview::UpdateThreadPolicy()
+{
+	ThreadPolicy policy;
+	policy.priority = (ThreadPolicy::Priority)ui->decoderPriorityCombo
+				  ->currentData()
+				  .toInt();
+
+	QString cpus = ui->decoderAffinityEdit->text().trimmed();
+	if (!ParseCpuList(QT_TO_UTF8(cpus), policy.affinity)) {
+		ui->decoderAffinityEdit->setText(decoderAffinity);
+		return;
+	}
+
+	decoderAffinity = cpus;
+	CheckThreadPolicy(WorkerPool::Shared().SetThreadPolicy(policy));
+}
+
+/* Unprivileged processes may lower the priority of their threads but not
+ * raise it again, on Linux neither the nice value nor SCHED_IDLE. */
+void EncoderPreview::CheckThreadPolicy(uint64_t generation)
+{
+	bool failed;
+	if (!WorkerPool::Shared().GetPolicyResult(generation, failed)) {
+		QTimer::singleShot(100, this, [this, generation]() {
+			CheckThreadPolicy(generation);
+		});
+		return;
+	}
+
+	if (!failed) {
+		appliedPriority = ui->decoderPriorityCombo->currentIndex();
+		return;
+	}
+
+	{
+		QSignalBlocker blocker(ui->decoderPriorityCombo);
+		ui->decoderPriorityCombo->setCurrentIndex(appliedPriority);
+	}
+
+	/* Keeps what is saved in line with what the workers run at */
+	ThreadPolicy policy;
+	policy.priority = (ThreadPolicy::Priority)ui->decoderPriorityCombo
+				  ->currentData()
+				  .toInt();
+	ParseCpuList(QT_TO_UTF8(decoderAffinity), policy.affinity);
+	WorkerPool::Shared().SetThreadPolicy(policy);
+
+	QMessageBox::warning(
+		this, obs_module_text("EncoderPreview.Decoder.Priority"),
+		obs_module_text("EncoderPreview.Decoder.Priority.Failed"));
+}
+
+void EncoderPreview::StartStopCapture(bool enable)
+{
+	if (!enable) {
+		pipeline->StopCapture();
+		return;
+	}
+
+	/* Empty until the output has started */
+	string encoder = pipeline->EncoderName();
+	if (pipeline->GetStatus() == PreviewPipeline::INACTIVE ||
+	    encoder.empty()) {
+		QSignalBlocker blocker(ui->captureCb);
+		ui->captureCb->setChecked(false);
+		return;
+	}
+
+	int format = ui->captureFormatCombo->currentData().toInt();
+	auto container = (PacketCapture::Container)format;
+	const char *ext = container == PacketCapture::ContainerPacketTrace
+				  ? "obspkt"
+				  : "mkv";
+
+	/* Goes next to regular recordings */
+	char *dir = obs_frontend_get_current_record_output_path();
+	char *name = os_generate_formatted_filename(ext, true,
+						    "%CCYY-%MM-%DD %hh-%mm-%ss");
+
+	string path = dir ? dir : ".";
+	path += "/Encoder Preview ";
+	path += encoder;
+	path += " ";
+	path += name;
+
+	bfree(name);
+	bfree(dir);
+
+	if (!pipeline->StartCapture(path, container)) {
+		QSignalBlocker blocker(ui->captureCb);
+		ui->captureCb->setChecked(false);
+	}
+}
+
+void EncoderPreview::StopPreview()
+{
+	running = false;
+	pipeline->Stop();
+	comparePipeline->Stop();
+	comparing = false;
+
+	{
+		QSignalBlocker blocker(ui->pauseBtn);
+		ui->pauseBtn->setChecked(false);
+	}
+	UpdateReplayControls();
+
+	ui->compareCb->setEnabled(true);
+	ui->compareCombo->setEnabled(true);
 	SetLabelText(waitingText, obs_module_text("EncoderPreview.Inactive"));
+
+	/* Can only be started again once both have stopped */
+	UpdateStatus();
 }
 
 void EncoderPreview::RefreshEncoders()
@@ -131,6 +713,7 @@ void EncoderPreview::RefreshEncoders()
 	static QString itemNameTemplate("%1 (%2)");
 
 	ui->encoderCombo->clear();
+	ui->compareCombo->clear();
 	// Find all video encoders that could reasonably be in use
 
 	auto cb = [](void *param, obs_encoder_t *enc) {
@@ -150,6 +733,7 @@ void EncoderPreview::RefreshEncoders()
 	};
 
 	obs_enum_encoders(cb, ui->encoderCombo);
+	obs_enum_encoders(cb, ui->compareCombo);
 }
 
 void EncoderPreview::CreateDisplay(bool recreate)
@@ -167,6 +751,7 @@ void EncoderPreview::CreateDisplay(bool recreate)
 		ui->preview->setMinimumSize(minimum);
 
 		ui->verticalLayout->insertWidget(idx, ui->preview);
+		ui->preview->installEventFilter(this);
 	}
 
 	auto addDrawCallback = [this]() {
@@ -179,18 +764,25 @@ void EncoderPreview::CreateDisplay(bool recreate)
 
 void EncoderPreview::DrawPreview(void *data, uint32_t cx, uint32_t cy)
 {
-	EncoderPreview *editor = static_cast<EncoderPreview *>(data);
+	PERF_SCOPE("DrawPreview");
 
-	uint32_t width, height;
+	EncoderPreview *editor = static_cast<EncoderPreview *>(data);
+	PreviewPipeline *pipeline = editor->pipeline.get();
 
-	if (editor->state == PLAYING) {
-		width = obs_source_get_width(editor->previewSource);
-		height = obs_source_get_height(editor->previewSource);
-	} else {
-		width = obs_source_get_width(editor->waitingText);
-		height = obs_source_get_height(editor->waitingText);
+	if (editor->comparing) {
+		editor->DrawCompare(cx, cy);
+		return;
 	}
 
+	pipeline->SetPreviewSize(cx, cy);
+
+	const bool playing = pipeline->GetStatus() == PreviewPipeline::PLAYING;
+	obs_source_t *source = playing ? pipeline->GetSource()
+				       : editor->waitingText.Get();
+
+	uint32_t width = obs_source_get_width(source);
+	uint32_t height = obs_source_get_height(source);
+
 	int viewport_x, viewport_y;
 	float scale;
 
@@ -207,98 +799,722 @@ void EncoderPreview::DrawPreview(void *data, uint32_t cx, uint32_t cy)
 	gs_set_viewport(viewport_x, viewport_y, viewport_width,
 			viewport_height);
 
-	/* Draw map texture if we have it */
-	if (editor->state == PLAYING) {
-		obs_source_video_render(editor->previewSource);
-	} else {
-		obs_source_video_render(editor->waitingText);
-	}
+	/* Decoded frames come with the overlay, if any */
+	if (playing)
+		pipeline->Render(width, height);
+	else
+		obs_source_video_render(source);
 
 	gs_projection_pop();
 	gs_viewport_pop();
 }
 
-void EncoderPreview::CreatePreviewOutput()
+void EncoderPreview::RenderSide(PreviewPipeline *side, uint32_t width,
+				uint32_t height)
 {
-	obs_output_info info = {};
-	info.id = "encoder_preview";
-	info.flags = OBS_OUTPUT_VIDEO | OBS_OUTPUT_ENCODED;
-	info.get_name = [](void *) {
-		return "Encoder Preview";
-	};
-	info.encoded_video_codecs = "h264;hevc;av1";
+	if (side->GetStatus() == PreviewPipeline::PLAYING)
+		side->Render(width, height);
+	else
+		obs_source_video_render(waitingText);
+}
 
-	info.create = [](obs_data_t *, obs_output_t *) {
-		// Apparently this is valid, lol
-		auto placeholder = new std::array<char, 0>;
-		return static_cast<void *>(placeholder);
-	};
-	info.destroy = [](void *data) {
-		auto placeholder = static_cast<std::array<char, 0> *>(data);
-		delete placeholder;
+void EncoderPreview::DrawCompare(uint32_t cx, uint32_t cy)
+{
+	PreviewPipeline *first = pipeline.get();
+	PreviewPipeline *second = comparePipeline.get();
+
+	auto sourceOf = [&](PreviewPipeline *side) {
+		return side->GetStatus() == PreviewPipeline::PLAYING
+			       ? side->GetSource()
+			       : waitingText.Get();
 	};
-	info.start = [](void *) -> bool {
-		return enc_preview->StartOutput();
+
+	/* The second side is stretched to the first one's size */
+	uint32_t width = obs_source_get_width(sourceOf(first));
+	uint32_t height = obs_source_get_height(sourceOf(first));
+	uint32_t second_width = obs_source_get_width(sourceOf(second));
+	uint32_t second_height = obs_source_get_height(sourceOf(second));
+
+	if (!width || !height || !second_width || !second_height)
+		return;
+
+	const bool side_by_side = compareMode == CompareSideBySide;
+	const uint32_t total_width = side_by_side ? width * 2 : width;
+
+	for (PreviewPipeline *side : Pipelines())
+		side->SetPreviewSize(side_by_side ? cx / 2 : cx, cy);
+
+	int viewport_x, viewport_y;
+	float scale;
+
+	GetScaleAndCenterPos(total_width, height, cx, cy, viewport_x,
+			     viewport_y, scale);
+
+	int viewport_width = int(scale * float(total_width));
+	int viewport_height = int(scale * float(height));
+
+	frameX = viewport_x;
+	frameCx = int(scale * float(width));
+
+	const float second_scale_x = float(width) / float(second_width);
+	const float second_scale_y = float(height) / float(second_height);
+
+	/* The wipe only shows part of the second side, render it into a
+	 * texture first so that part can be cut out. */
+	if (!side_by_side) {
+		if (!wipeRender)
+			wipeRender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
+
+		gs_texrender_reset(wipeRender);
+		if (gs_texrender_begin(wipeRender, second_width,
+				       second_height)) {
+			vec4 clear_color;
+			vec4_zero(&clear_color);
+			gs_clear(GS_CLEAR_COLOR, &clear_color, 0.0f, 0);
+			gs_ortho(0.0f, float(second_width), 0.0f,
+				 float(second_height), -100.0f, 100.0f);
+
+			RenderSide(second, second_width, second_height);
+			gs_texrender_end(wipeRender);
+		}
+	}
+
+	gs_viewport_push();
+	gs_projection_push();
+
+	gs_ortho(0.0f, float(total_width), 0.0f, float(height), -100.0f,
+		 100.0f);
+	gs_set_viewport(viewport_x, viewport_y, viewport_width,
+			viewport_height);
+
+	RenderSide(first, width, height);
+
+	if (side_by_side) {
+		gs_matrix_push();
+		gs_matrix_translate3f(float(width), 0.0f, 0.0f);
+		gs_matrix_scale3f(second_scale_x, second_scale_y, 1.0f);
+		RenderSide(second, second_width, second_height);
+		gs_matrix_pop();
+	} else if (gs_texture_t *tex = gs_texrender_get_texture(wipeRender)) {
+		const float pos = wipePos;
+		const uint32_t split = uint32_t(pos * float(second_width));
+
+		gs_effect_t *effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
+		gs_eparam_t *image = gs_effect_get_param_by_name(effect,
+								 "image");
+
+		gs_matrix_push();
+		gs_matrix_scale3f(second_scale_x, second_scale_y, 1.0f);
+		gs_matrix_translate3f(float(split), 0.0f, 0.0f);
+
+		gs_effect_set_texture(image, tex);
+		while (gs_effect_loop(effect, "Draw"))
+			gs_draw_sprite_subregion(tex, 0, split, 0,
+						 second_width - split,
+						 second_height);
+		gs_matrix_pop();
+
+		/* Divider, two device pixels wide */
+		gs_effect_t *solid = obs_get_base_effect(OBS_EFFECT_SOLID);
+		gs_eparam_t *color = gs_effect_get_param_by_name(solid,
+								 "color");
+		vec4 white;
+		vec4_set(&white, 1.0f, 1.0f, 1.0f, 1.0f);
+
+		const float line_width = 2.0f / scale;
+
+		gs_matrix_push();
+		gs_matrix_translate3f(pos * float(width) - line_width / 2.0f,
+				      0.0f, 0.0f);
+		gs_matrix_scale3f(line_width, float(height), 1.0f);
+
+		gs_effect_set_vec4(color, &white);
+		while (gs_effect_loop(solid, "Solid"))
+			gs_draw_sprite(nullptr, 0, 1, 1);
+		gs_matrix_pop();
+	}
+
+	gs_projection_pop();
+	gs_viewport_pop();
+}
+
+QString EncoderPreview::FormatStreamStats(const PreviewPipeline::Stats &stats)
+{
+	QString text = QString(obs_module_text("EncoderPreview.StreamStats"))
+			       .arg(loc.toString(stats.kbps, 'f', 0))
+			       .arg(loc.toString(stats.meanPacket / 1024.0,
+						 'f', 1))
+			       .arg(loc.toString(stats.maxPacket / 1024.0, 'f',
+						 1));
+
+	if (stats.droppedPackets)
+		text += " " + QString(obs_module_text(
+					      "EncoderPreview.DroppedPackets"))
+				      .arg(stats.droppedPackets);
+
+	if (stats.suspended)
+		text += " " +
+			QString(obs_module_text("EncoderPreview.Suspended"));
+
+	if (stats.firstFrameMs > 0.0) {
+		const char *key = stats.decoderReused
+					  ? "EncoderPreview.FirstFrame.Reused"
+					  : "EncoderPreview.FirstFrame";
+		text += " " + QString(obs_module_text(key))
+				      .arg(loc.toString(stats.firstFrameMs, 'f',
+							0));
+	}
+
+	return text;
+}
+
+void EncoderPreview::UpdateStats()
+{
+	PreviewPipeline::Stats stats = pipeline->TakeStats();
+	PreviewPipeline::Stats compareStats = comparePipeline->TakeStats();
+
+	QString text = obs_module_text("EncoderPreview.Bitrate");
+	text += " ";
+	text += FormatStreamStats(stats);
+
+	ui->bitrateLbl->setText(text);
+
+	text = obs_module_text("EncoderPreview.Compare.Bitrate");
+	text += " ";
+	text += FormatStreamStats(compareStats);
+
+	ui->compareLbl->setText(text);
+	ui->compareLbl->setVisible(comparing);
+
+	string capturePath;
+	PacketCapture::Stats capture;
+	bool capturing = pipeline->GetCaptureStats(capturePath, capture);
+
+	if (capturing) {
+		text = QString(obs_module_text("EncoderPreview.Capture.Stats"))
+			       .arg(loc.toString(capture.bytes / 1048576.0, 'f',
+						 1))
+			       .arg(capture.written)
+			       .arg(capture.dropped);
+		ui->captureLbl->setText(text);
+		ui->captureLbl->setToolTip(QT_UTF8(capturePath.c_str()));
+	}
+
+	ui->captureLbl->setVisible(capturing);
+	ui->captureFormatCombo->setEnabled(!capturing);
+
+	uint64_t replayDuration;
+	size_t replayBytes;
+	pipeline->Replay().GetUsage(replayDuration, replayBytes);
+
+	text = QString(obs_module_text("EncoderPreview.Replay.Usage"))
+		       .arg(loc.toString((double)replayDuration / 1e9, 'f', 1))
+		       .arg(loc.toString((double)replayBytes / 1048576.0, 'f',
+					 1));
+	ui->replayUsageLbl->setText(text);
+
+	text = obs_module_text("EncoderPreview.Conversion");
+	text += " ";
+	text += loc.toString(stats.convertMs, 'f', 2);
+	text += " ms";
+
+	ui->conversionLbl->setVisible(stats.convertFrames != 0);
+	ui->conversionLbl->setText(text);
+
+	const Histogram &lateness = stats.presentation.lateness;
+
+	uint64_t late = 0;
+	QString histogram;
+	for (size_t idx = 0; idx < lateness.BucketCount(); idx++) {
+		uint64_t count = lateness.Bucket(idx);
+		int64_t bound = lateness.BucketLowerBound(idx);
+		if (bound > 0)
+			late += count;
+		if (!count)
+			continue;
+
+		if (!histogram.isEmpty())
+			histogram += "\n";
+		histogram += QString("%1 ms: %2").arg(bound).arg(count);
+	}
+
+	double latePct = lateness.Count() ? 100.0 * (double)late /
+						    (double)lateness.Count()
+					  : 0.0;
+
+	text = QString(obs_module_text("EncoderPreview.Presentation"))
+		       .arg(loc.toString((double)stats.presentation.delay / 1e6,
+					 'f', 0))
+		       .arg(loc.toString(stats.presentation.jitter / 1e6, 'f',
+					 1))
+		       .arg(loc.toString(latePct, 'f', 1))
+		       .arg(stats.presentation.dropped);
+
+	ui->presentationLbl->setText(text);
+	ui->presentationLbl->setToolTip(histogram);
+
+	const PreviewPipeline::QpStats &qp = stats.qp;
+
+	if (qp.frames) {
+		auto mean = [&](double sum, uint64_t count) {
+			return count ? loc.toString(sum / (double)count, 'f', 1)
+				     : QString("-");
+		};
+
+		text = QString(obs_module_text("EncoderPreview.QP"))
+			       .arg(mean(qp.sum, qp.frames))
+			       .arg(mean(qp.insideSum, qp.insideFrames))
+			       .arg(mean(qp.outsideSum, qp.outsideFrames));
+		ui->qpLbl->setText(text);
+	}
+
+	ui->qpLbl->setVisible(qp.frames != 0);
+
+	UpdateQualityStats();
+	UpdateBitstreamStats(stats.bitstream);
+	UpdateRateControlStats(stats.vbv);
+	UpdateAbTestStats(stats.abTest);
+	UpdateNetworkStats(stats.network);
+	UpdateLatencyStats(stats.latency);
+	UpdateDecoderStats(stats.governor);
+	UpdatePerformanceStats();
+}
+
+void EncoderPreview::UpdateQualityStats()
+{
+	vector<QualityAnalyzer::Result> results =
+		pipeline->TakeQualityResults();
+	if (results.empty())
+		return;
+
+	double psnr[3] = {}, ssim[3] = {};
+	size_t inside = 0, outside = 0;
+
+	for (const QualityAnalyzer::Result &res : results) {
+		psnrGraph->AddSample(0, res.psnr);
+		psnrGraph->AddSample(1, res.hasInside ? res.psnrInside : NAN);
+		psnrGraph->AddSample(2, res.hasOutside ? res.psnrOutside : NAN);
+		ssimGraph->AddSample(0, res.ssim);
+		ssimGraph->AddSample(1, res.hasInside ? res.ssimInside : NAN);
+		ssimGraph->AddSample(2, res.hasOutside ? res.ssimOutside : NAN);
+
+		psnr[0] += res.psnr;
+		ssim[0] += res.ssim;
+
+		if (res.hasInside) {
+			psnr[1] += res.psnrInside;
+			ssim[1] += res.ssimInside;
+			inside++;
+		}
+		if (res.hasOutside) {
+			psnr[2] += res.psnrOutside;
+			ssim[2] += res.ssimOutside;
+			outside++;
+		}
+	}
+
+	auto mean = [&](double sum, size_t count, int precision) {
+		return count ? loc.toString(sum / (double)count, 'f', precision)
+			     : QString("-");
 	};
-	info.stop = [](void *, uint64_t) {
-		enc_preview->StopOutput();
+
+	QString text = QString(obs_module_text("EncoderPreview.Quality"))
+			       .arg(mean(psnr[0], results.size(), 2))
+			       .arg(mean(psnr[1], inside, 2))
+			       .arg(mean(psnr[2], outside, 2))
+			       .arg(mean(ssim[0], results.size(), 4))
+			       .arg(mean(ssim[1], inside, 4))
+			       .arg(mean(ssim[2], outside, 4));
+	ui->qualityLbl->setText(text);
+}
+
+void EncoderPreview::UpdateBitstreamStats(const BitstreamAnalyzer::Stats &stats)
+{
+	using Analyzer = BitstreamAnalyzer;
+
+	static const char *typeNames[Analyzer::FrameTypeCount] = {
+		"EncoderPreview.Bitstream.Type.Key",
+		"EncoderPreview.Bitstream.Type.Intra",
+		"EncoderPreview.Bitstream.Type.P",
+		"EncoderPreview.Bitstream.Type.B",
+		"EncoderPreview.Bitstream.Type.Inter",
+		"EncoderPreview.Bitstream.Type.Switch",
+		"EncoderPreview.Bitstream.Type.ShowExisting",
+		"EncoderPreview.Bitstream.Type.Unknown",
 	};
-	info.encoded_packet = [](void *, encoder_packet *pkt) {
-		enc_preview->ReceivePacket(pkt);
+
+	if (!stats.frames || stats.sizes.size() != Analyzer::FrameTypeCount) {
+		ui->bitstreamLbl->clear();
+		sizeGraph->Clear();
+		return;
+	}
+
+	auto percent = [&](uint64_t part, uint64_t total) {
+		double value = total ? 100.0 * (double)part / (double)total
+				     : 0.0;
+		return loc.toString(value, 'f', 1);
 	};
 
-	obs_register_output(&info);
+	QStringList lines;
+	lines << QString(obs_module_text("EncoderPreview.Bitstream.Summary"))
+			 .arg(stats.frames)
+			 .arg(percent(stats.references, stats.frames));
+
+	/* Frames shown again carry no slices of their own */
+	uint64_t pictures = 0;
+
+	for (int type = 0; type < Analyzer::FrameTypeCount; type++) {
+		const Analyzer::TypeStats &ts = stats.types[type];
+		if (!ts.frames)
+			continue;
+
+		if (type != Analyzer::FrameShowExisting)
+			pictures += ts.frames;
+
+		double mean = (double)ts.bytes / (double)ts.frames / 1024.0;
+		double max = (double)ts.maxSize / 1024.0;
 
-	previewOut = obs_output_create("encoder_preview", "encoder_preview",
-				       nullptr, nullptr);
+		QString text = obs_module_text("EncoderPreview.Bitstream.Type");
+		lines << text.arg(obs_module_text(typeNames[type]))
+				 .arg(ts.frames)
+				 .arg(loc.toString(mean, 'f', 1))
+				 .arg(loc.toString(max, 'f', 1))
+				 .arg(percent(ts.references, ts.frames));
+	}
+
+	if (stats.keyframeFrames > 0.0) {
+		QString text = obs_module_text(
+			"EncoderPreview.Bitstream.KeyframeInterval");
+		lines << text.arg(loc.toString(stats.keyframeFrames, 'f', 1))
+				 .arg(loc.toString(stats.keyframeSeconds, 'f',
+						   2));
+	}
+
+	if (pictures) {
+		const char *slices =
+			stats.codec == Analyzer::CodecAV1
+				? "EncoderPreview.Bitstream.TileGroups"
+				: "EncoderPreview.Bitstream.Slices";
+		double mean = (double)stats.slices / (double)pictures;
+
+		lines << QString(obs_module_text(slices))
+				 .arg(loc.toString(mean, 'f', 2))
+				 .arg(stats.maxSlices);
+	}
+
+	lines << QString(obs_module_text("EncoderPreview.Bitstream.Layers"))
+			 .arg(stats.temporalLayers);
+
+	if (stats.dropped)
+		lines << QString(obs_module_text(
+				 "EncoderPreview.Bitstream.Dropped"))
+				 .arg(stats.dropped);
+
+	ui->bitstreamLbl->setText(lines.join("\n"));
+
+	/* Frame size distribution, in KiB, of intra, inter and B frames */
+	const size_t buckets = stats.sizes[0].BucketCount();
+	vector<double> intra(buckets), inter(buckets), bidir(buckets);
+	QStringList labels;
+
+	for (size_t idx = 0; idx < buckets; idx++) {
+		auto count = [&](Analyzer::FrameType type) {
+			return (double)stats.sizes[type].Bucket(idx);
+		};
+
+		intra[idx] = count(Analyzer::FrameKey) +
+			     count(Analyzer::FrameIntra);
+		inter[idx] = count(Analyzer::FrameP) +
+			     count(Analyzer::FrameInter) +
+			     count(Analyzer::FrameSwitch);
+		bidir[idx] = count(Analyzer::FrameB);
+
+		labels << QString::number(
+			stats.sizes[0].BucketLowerBound(idx) / 1024);
+	}
+
+	sizeGraph->SetBars(0, intra);
+	sizeGraph->SetBars(1, inter);
+	sizeGraph->SetBars(2, bidir);
+	sizeGraph->SetBarLabels(labels);
 }
 
-void EncoderPreview::CreatePreviewSource()
+void EncoderPreview::UpdateRateControlStats(const VbvModel::Stats &stats)
 {
-	obs_source_info info = {};
-	info.id = "encoder_preview_source";
-	info.type = OBS_SOURCE_TYPE_INPUT;
-	info.output_flags = OBS_SOURCE_ASYNC_VIDEO |
-			    OBS_SOURCE_DO_NOT_DUPLICATE |
-			    OBS_SOURCE_CAP_DISABLED;
-	info.get_name = [](void *) {
-		return "Encoder Preview Source";
+	if (!stats.active) {
+		ui->rateControlLbl->setText(obs_module_text(
+			"EncoderPreview.RateControl.Unavailable"));
+		return;
+	}
+
+	const VbvModel::Config &config = stats.config;
+
+	QString model = obs_module_text("EncoderPreview.RateControl.Model");
+	model = model.arg(config.bitrate / 1000)
+			.arg(config.bufferSize / 1000)
+			.arg(QT_UTF8(config.rateControl.c_str()));
+
+	QString buffer = obs_module_text("EncoderPreview.RateControl.Buffer");
+	buffer = buffer.arg(loc.toString(stats.maxOccupancy, 'f', 0))
+			 .arg(stats.overflows)
+			 .arg(stats.underflows)
+			 .arg(stats.totalOverflows)
+			 .arg(stats.totalUnderflows);
+
+	QString peaks = obs_module_text("EncoderPreview.RateControl.Peaks");
+	peaks = peaks.arg(loc.toString(stats.peakSecond, 'f', 0))
+			.arg(loc.toString(stats.peakShort, 'f', 0))
+			.arg(loc.toString(stats.totalPeakSecond, 'f', 0))
+			.arg(loc.toString(stats.totalPeakShort, 'f', 0));
+
+	ui->rateControlLbl->setText(model + "\n" + buffer + "\n" + peaks);
+
+	for (double occupancy : stats.occupancy) {
+		bufferGraph->AddSample(0, occupancy);
+		bufferGraph->AddSample(1, 100.0);
+	}
+}
+
+void EncoderPreview::UpdateAbTestStats(const RoiAbTest::Stats &stats)
+{
+	if (!stats.active) {
+		ui->abTestLbl->clear();
+		return;
+	}
+
+	if (stats.idle) {
+		ui->abTestLbl->setText(
+			obs_module_text("EncoderPreview.AbTest.Idle"));
+		return;
+	}
+
+	const char *collecting =
+		obs_module_text("EncoderPreview.AbTest.Collecting");
+	const char *yes = obs_module_text("EncoderPreview.AbTest.Significant");
+	const char *no = obs_module_text("EncoderPreview.AbTest.NotSignificant");
+
+	auto compare = [&](const char *name,
+			   const RoiAbTest::Comparison &comparison,
+			   int precision) {
+		auto number = [&](double value) {
+			return loc.toString(value, 'f', precision);
+		};
+
+		const int on = RoiAbTest::ArmOn;
+		const int off = RoiAbTest::ArmOff;
+
+		QString text = obs_module_text("EncoderPreview.AbTest.Metric");
+		text = text.arg(obs_module_text(name))
+			       .arg(number(comparison.mean[on]))
+			       .arg(number(comparison.stddev[on]))
+			       .arg(number(comparison.mean[off]))
+			       .arg(number(comparison.stddev[off]))
+			       .arg(comparison.gops[on])
+			       .arg(comparison.gops[off]);
+
+		text += "\n";
+
+		if (!comparison.valid)
+			return text + collecting;
+
+		double relative = comparison.mean[off] != 0.0
+					  ? 100.0 * comparison.difference /
+						    comparison.mean[off]
+					  : 0.0;
+		bool significant =
+			fabs(comparison.difference) > comparison.interval;
+
+		QString difference =
+			obs_module_text("EncoderPreview.AbTest.Difference");
+		difference = difference.arg(number(comparison.difference))
+				     .arg(number(comparison.interval))
+				     .arg(loc.toString(relative, 'f', 1))
+				     .arg(significant ? yes : no);
+
+		return text + difference;
 	};
-	// Required, even though they do nothing
-	info.create = [](obs_data_t *, obs_source_t *) {
-		auto placeholder = new std::array<char, 0>;
-		return static_cast<void *>(placeholder);
+
+	QStringList lines;
+
+	const char *phase = stats.arm == RoiAbTest::ArmOn
+				    ? "EncoderPreview.AbTest.PhaseOn"
+				    : "EncoderPreview.AbTest.PhaseOff";
+	lines << QString(obs_module_text(phase)).arg(stats.remaining);
+
+	if (stats.restarts)
+		lines << QString(obs_module_text(
+					 "EncoderPreview.AbTest.Restarts"))
+				 .arg(stats.restarts);
+
+	lines << compare("EncoderPreview.AbTest.Bitrate", stats.kbps, 0);
+	lines << compare("EncoderPreview.AbTest.QP", stats.qp, 2);
+
+	if (stats.psnr.gops[RoiAbTest::ArmOn] ||
+	    stats.psnr.gops[RoiAbTest::ArmOff])
+		lines << compare("EncoderPreview.AbTest.PSNR", stats.psnr, 2);
+	else
+		lines << obs_module_text("EncoderPreview.AbTest.NoPsnr");
+
+	ui->abTestLbl->setText(lines.join("\n"));
+}
+
+void EncoderPreview::UpdateNetworkStats(const NetworkSimulator::Stats &stats)
+{
+	if (!ui->netEnableCb->isChecked()) {
+		ui->netStatsLbl->clear();
+		return;
+	}
+
+	QString delivered = obs_module_text("EncoderPreview.Network.Delivered");
+	delivered = delivered.arg(stats.delivered)
+			    .arg(stats.dropped)
+			    .arg(stats.retransmissions);
+
+	QString latency = obs_module_text("EncoderPreview.Network.Latency");
+	latency = latency.arg(loc.toString(stats.meanLatency, 'f', 0))
+			  .arg(loc.toString(stats.maxLatency, 'f', 0))
+			  .arg(loc.toString(stats.maxBuffer, 'f', 0));
+
+	ui->netStatsLbl->setText(delivered + "\n" + latency);
+}
+
+void EncoderPreview::UpdateLatencyStats(const LatencyTracker::Stats &stats)
+{
+	static const char *names[] = {
+		"EncoderPreview.Latency.Encode",
+		"EncoderPreview.Latency.Queue",
+		"EncoderPreview.Latency.Decode",
+		"EncoderPreview.Latency.Present",
+		"EncoderPreview.Latency.Total",
 	};
-	info.destroy = [](void *data) {
-		auto placeholder = static_cast<std::array<char, 0> *>(data);
-		delete placeholder;
+
+	if (!stats.stages[LatencyTracker::StageTotal].Count()) {
+		ui->latencyLbl->setText(
+			obs_module_text("EncoderPreview.Latency.None"));
+		return;
+	}
+
+	auto ms = [&](double us) { return loc.toString(us / 1000.0, 'f', 1); };
+
+	QStringList lines;
+	for (int stage = 0; stage < LatencyTracker::StageCount; stage++) {
+		const Histogram &histogram = stats.stages[stage];
+
+		lines << QString(obs_module_text("EncoderPreview.Latency.Stage"))
+				 .arg(obs_module_text(names[stage]))
+				 .arg(ms(histogram.Mean()))
+				 .arg(ms((double)histogram.Percentile(0.95)))
+				 .arg(ms((double)histogram.Max()));
+
+		if (stage != LatencyTracker::StageTotal)
+			latencyGraph->AddSample(stage,
+						histogram.Mean() / 1000.0);
+	}
+
+	ui->latencyLbl->setText(lines.join("\n"));
+}
+
+void EncoderPreview::UpdateDecoderStats(const DecodeGovernor::Stats &stats)
+{
+	static const char *levels[] = {
+		"EncoderPreview.Decoder.Level.Full",
+		"EncoderPreview.Decoder.Level.ReferenceOnly",
+		"EncoderPreview.Decoder.Level.KeyframesOnly",
 	};
 
-	obs_register_source(&info);
+	if (pipeline->GetStatus() != PreviewPipeline::PLAYING) {
+		ui->decoderStatusLbl->clear();
+		return;
+	}
+
+	QString text = obs_module_text("EncoderPreview.Decoder.Status");
+	text = text.arg(loc.toString(stats.cpuPercent, 'f', 0))
+		       .arg(obs_module_text(levels[stats.level]))
+		       .arg(stats.laggedFrames);
+
+	if (stats.stepsDown) {
+		text += "\n";
+		text += QString(obs_module_text(
+					"EncoderPreview.Decoder.StepsDown"))
+				.arg(stats.stepsDown);
+	}
 
-	previewSource = obs_source_create_private(
-		info.id, "Encoder Output Preview", nullptr);
+	ui->decoderStatusLbl->setText(text);
 }
 
-void EncoderPreview::UpdateStats()
+void EncoderPreview::UpdatePerformanceStats()
 {
-	lock_guard lock(packetMutex);
+	PerfMonitor::Stats stats = PerfMonitor::Collect();
 
-	uint64_t now = os_gettime_ns();
+	if (stats.scopes.empty()) {
+		ui->performanceLbl->setText(
+			obs_module_text("EncoderPreview.Performance.None"));
+		return;
+	}
 
-	uint64_t bitsBetween = bytes * 8;
-	long double timePassed =
-		(long double)(now - lastStatsTime) / 1000000000.0l;
-	double kbps = (long double)bitsBetween / timePassed / 1000.0l;
+	auto ms = [&](double value) { return loc.toString(value, 'f', 2); };
+
+	QStringList lines;
+	for (const PerfMonitor::ScopeStats &scope : stats.scopes) {
+		lines << QString(obs_module_text(
+				 "EncoderPreview.Performance.Scope"))
+				 .arg(scope.name)
+				 .arg(loc.toString(scope.rate, 'f', 1))
+				 .arg(ms(scope.p50))
+				 .arg(ms(scope.p99))
+				 .arg(ms(scope.max));
+	}
 
-	QString text = obs_module_text("EncoderPreview.Bitrate");
-	text += " ";
-	text += loc.toString(kbps, 'f', 0);
-	text += " kbps";
+	if (stats.dropped) {
+		lines << QString(obs_module_text(
+				 "EncoderPreview.Performance.Dropped"))
+				 .arg(stats.dropped);
+	}
 
-	ui->bitrateLbl->setText(text);
-	bytes = 0;
-	lastStatsTime = now;
+	ui->performanceLbl->setText(lines.join("\n"));
+}
+
+void EncoderPreview::ExportLatency()
+{
+	QString path = QFileDialog::getSaveFileName(
+		this, obs_module_text("EncoderPreview.Latency.Export"),
+		QString(), "CSV (*.csv)");
+	if (path.isEmpty())
+		return;
+
+	if (!pipeline->Latency().ExportCsv(QT_TO_UTF8(path)))
+		QMessageBox::warning(
+			this, obs_module_text("EncoderPreview.Latency.Export"),
+			obs_module_text("EncoderPreview.Latency.ExportFailed"));
+}
+
+void EncoderPreview::RecordTrace(bool record)
+{
+	if (!record) {
+		TraceRecorder::Stop();
+		return;
+	}
+
+	const char *title = obs_module_text("EncoderPreview.Performance.Trace");
+
+	auto cancel = [&]() {
+		QSignalBlocker blocker(ui->traceBtn);
+		ui->traceBtn->setChecked(false);
+	};
+
+	QString path = QFileDialog::getSaveFileName(this, title, QString(),
+						    "Trace (*.json)");
+	if (path.isEmpty()) {
+		cancel();
+		return;
+	}
+
+	if (!TraceRecorder::Start(QT_TO_UTF8(path))) {
+		const char *failed = obs_module_text(
+			"EncoderPreview.Performance.TraceFailed");
+		QMessageBox::warning(this, title, failed);
+		cancel();
+	}
 }
 
 /*
@@ -310,7 +1526,9 @@ void EncoderPreview::ShowHideDialog()
 	if (!isVisible()) {
 		setVisible(true);
 		CreateDisplay(true);
-		if (state == INACTIVE)
+		if (monitor)
+			monitor->RecreateDisplays();
+		if (pipeline->GetStatus() == PreviewPipeline::INACTIVE)
 			RefreshEncoders();
 		timer.start();
 
@@ -325,6 +1543,40 @@ void EncoderPreview::SaveSettings(obs_data_t *data)
 {
 	obs_data_set_bool(data, "run_in_background",
 			  ui->runInBackGroundCb->isChecked());
+	obs_data_set_bool(data, "scale_to_preview",
+			  ui->scaleToPreviewCb->isChecked());
+	obs_data_set_int(data, "target_delay", ui->delaySb->value());
+	obs_data_set_int(data, "overlay",
+			 ui->overlayCombo->currentData().toInt());
+	obs_data_set_bool(data, "quality_analysis",
+			  ui->qualityCb->isChecked());
+	obs_data_set_bool(data, "compare", ui->compareCb->isChecked());
+	obs_data_set_bool(data, "decode_frames", ui->decodeCb->isChecked());
+	obs_data_set_bool(data, "decode_on_demand",
+			  ui->decodeOnDemandCb->isChecked());
+	obs_data_set_int(data, "replay_seconds", ui->replaySecondsSb->value());
+	obs_data_set_int(data, "replay_memory", ui->replayMemorySb->value());
+	obs_data_set_bool(data, "network_simulation",
+			  ui->netEnableCb->isChecked());
+	obs_data_set_int(data, "network_bandwidth", ui->netBandwidthSb->value());
+	obs_data_set_int(data, "network_rtt", ui->netRttSb->value());
+	obs_data_set_int(data, "network_jitter", ui->netJitterSb->value());
+	obs_data_set_double(data, "network_loss", ui->netLossSb->value());
+	obs_data_set_int(data, "network_seed", ui->netSeedSb->value());
+	obs_data_set_int(data, "compare_mode",
+			 ui->compareModeCombo->currentData().toInt());
+	obs_data_set_int(data, "capture_format",
+			 ui->captureFormatCombo->currentData().toInt());
+	obs_data_set_int(data, "decoder_priority",
+			 ui->decoderPriorityCombo->currentData().toInt());
+	obs_data_set_string(data, "decoder_affinity",
+			    QT_TO_UTF8(decoderAffinity));
+	obs_data_set_int(data, "decoder_budget", ui->decoderBudgetSb->value());
+	obs_data_set_bool(data, "adaptive_decoding",
+			  ui->adaptiveDecodeCb->isChecked());
+	obs_data_set_bool(data, "monitor_encoders", ui->monitorCb->isChecked());
+	/* The test itself is not restored, it changes what gets streamed */
+	obs_data_set_int(data, "ab_test_gops", ui->abTestGopsSb->value());
 	obs_data_set_string(data, "window_geometry",
 			    saveGeometry().toBase64().constData());
 }
@@ -333,6 +1585,74 @@ void EncoderPreview::LoadSettings(obs_data_t *data)
 {
 	ui->runInBackGroundCb->setChecked(
 		obs_data_get_bool(data, "run_in_background"));
+	ui->scaleToPreviewCb->setChecked(
+		obs_data_get_bool(data, "scale_to_preview"));
+	ui->delaySb->setValue(obs_data_get_int(data, "target_delay"));
+
+	ui->qualityCb->setChecked(obs_data_get_bool(data, "quality_analysis"));
+	ui->compareCb->setChecked(obs_data_get_bool(data, "compare"));
+
+	if (obs_data_has_user_value(data, "decode_frames"))
+		ui->decodeCb->setChecked(
+			obs_data_get_bool(data, "decode_frames"));
+	if (obs_data_has_user_value(data, "decode_on_demand"))
+		ui->decodeOnDemandCb->setChecked(
+			obs_data_get_bool(data, "decode_on_demand"));
+	if (obs_data_has_user_value(data, "replay_seconds"))
+		ui->replaySecondsSb->setValue(
+			(int)obs_data_get_int(data, "replay_seconds"));
+	if (obs_data_has_user_value(data, "replay_memory"))
+		ui->replayMemorySb->setValue(
+			(int)obs_data_get_int(data, "replay_memory"));
+
+	ui->netEnableCb->setChecked(
+		obs_data_get_bool(data, "network_simulation"));
+	if (obs_data_has_user_value(data, "network_bandwidth"))
+		ui->netBandwidthSb->setValue(
+			(int)obs_data_get_int(data, "network_bandwidth"));
+	if (obs_data_has_user_value(data, "network_rtt"))
+		ui->netRttSb->setValue(
+			(int)obs_data_get_int(data, "network_rtt"));
+	if (obs_data_has_user_value(data, "network_jitter"))
+		ui->netJitterSb->setValue(
+			(int)obs_data_get_int(data, "network_jitter"));
+	ui->netLossSb->setValue(obs_data_get_double(data, "network_loss"));
+	if (obs_data_has_user_value(data, "network_seed"))
+		ui->netSeedSb->setValue(
+			(int)obs_data_get_int(data, "network_seed"));
+
+	int mode = ui->compareModeCombo->findData(
+		(int)obs_data_get_int(data, "compare_mode"));
+	if (mode != -1)
+		ui->compareModeCombo->setCurrentIndex(mode);
+
+	int format = ui->captureFormatCombo->findData(
+		(int)obs_data_get_int(data, "capture_format"));
+	if (format != -1)
+		ui->captureFormatCombo->setCurrentIndex(format);
+
+	int priority = ui->decoderPriorityCombo->findData(
+		(int)obs_data_get_int(data, "decoder_priority"));
+	if (priority != -1)
+		ui->decoderPriorityCombo->setCurrentIndex(priority);
+
+	ui->decoderAffinityEdit->setText(
+		obs_data_get_string(data, "decoder_affinity"));
+	UpdateThreadPolicy();
+
+	ui->decoderBudgetSb->setValue(
+		(int)obs_data_get_int(data, "decoder_budget"));
+	ui->adaptiveDecodeCb->setChecked(
+		obs_data_get_bool(data, "adaptive_decoding"));
+	ui->monitorCb->setChecked(obs_data_get_bool(data, "monitor_encoders"));
+	if (obs_data_has_user_value(data, "ab_test_gops"))
+		ui->abTestGopsSb->setValue(
+			(int)obs_data_get_int(data, "ab_test_gops"));
+
+	int idx = ui->overlayCombo->findData(
+		(int)obs_data_get_int(data, "overlay"));
+	if (idx != -1)
+		ui->overlayCombo->setCurrentIndex(idx);
 
 	if (const char *geo = obs_data_get_string(data, "window_geometry"))
 		geometry = QByteArray::fromBase64(geo);
@@ -374,112 +1694,6 @@ void EncoderPreview::CreateLabelSource()
 		obs_source_create_private(text_source_id, nullptr, settings);
 }
 
-/*
- * Output implementation
- */
-
-bool EncoderPreview::StartOutput()
-{
-	if (!obs_output_can_begin_data_capture(previewOut, 0))
-		return false;
-	if (!obs_output_initialize_encoders(previewOut, 0))
-		return false;
-
-	OBSEncoder enc = obs_output_get_video_encoder(previewOut);
-	if (!enc)
-		return false;
-
-	if (!CreateCodecContext(&codecContext, enc))
-		return false;
-
-	decoder = std::thread(&EncoderPreview::DecodeThread, this);
-
-	return obs_output_begin_data_capture(previewOut, 0);
-}
-
-void EncoderPreview::StopOutput()
-{
-	obs_output_end_data_capture(previewOut);
-
-	while (obs_output_active(previewOut))
-		;
-
-	threadKill = true;
-	packetCond.notify_one();
-	decoder.join();
-
-	avcodec_free_context(&codecContext);
-	video_scaler_destroy(scaler);
-	scaler = nullptr;
-
-	threadKill = false;
-}
-
-void EncoderPreview::DecodeThread()
-{
-	unique_lock lock(packetMutex);
-
-	vector<packet> pkts;
-	obs_source_frame frame = {};
-	AVFrame *av_frame = av_frame_alloc();
-
-	if (!SendExtraData(codecContext,
-			   obs_output_get_video_encoder(previewOut))) {
-		// Can fail, but doesn't seem to actually be necessary
-		blog(LOG_DEBUG, "Sending extra data failed.");
-	}
-
-	bool got_first_keyframe = false;
-
-	while (!threadKill) {
-		packetCond.wait(lock);
-		pkts = std::move(packets);
-		lock.unlock();
-
-		for (const packet &ctn : pkts) {
-			const encoder_packet *pkt = &ctn.m_pkt;
-
-			// Wait for keyframe to start decoding
-			got_first_keyframe = got_first_keyframe ||
-					     pkt->keyframe;
-			if (!got_first_keyframe)
-				continue;
-
-			// ToDo: FFmpeg error handling
-			if (!SendPacket(codecContext, pkt))
-				continue;
-
-			while (ReceiveFrame(codecContext, av_frame)) {
-				AVFrameToSourceFrame(&frame, av_frame,
-						     {pkt->timebase_num,
-						      pkt->timebase_den});
-				obs_source_output_video(previewSource, &frame);
-
-				if (state != PLAYING)
-					state = PLAYING;
-			}
-		}
-
-		pkts.clear();
-		lock.lock();
-	}
-
-	obs_source_output_video(previewSource, nullptr);
-	av_frame_free(&av_frame);
-}
-
-void EncoderPreview::ReceivePacket(encoder_packet *pkt)
-{
-	/* Due to a bug in libobs only encoder packets from the interleaved
-	 * callback are ref-counted, and since we don't need interleaving we
-	 * get the raw data from the encoder, meaning we have to make our own
-	 * copy (using some RAII sugar). */
-	lock_guard lock(packetMutex);
-	packets.emplace_back(pkt);
-	packetCond.notify_one();
-	bytes += pkt->size;
-}
-
 /*
  * Frontend Event Handlers
  */
@@ -532,3 +1746,8 @@ extern "C" void InitEncoderPreview()
 	QAction::connect(action, &QAction::triggered, enc_preview,
 			 &EncoderPreview::ShowHideDialog);
 }
+
+extern "C" void FreeEncoderPreview()
+{
+	WorkerPool::Shared().Shutdown();
+}
@@ -2,42 +2,26 @@
 
 #include "ui_encoder-preview.h"
 
-#include "encoder-preview-ff-glue.hpp"
+#include "encoder-preview-graph.hpp"
+#include "encoder-preview-monitor.hpp"
+#include "encoder-preview-pipeline.hpp"
 
 #include <QTimer>
 
-#include <mutex>
-
-#include <obs.hpp>
-#include <media-io/video-scaler.h>
-
-/* non-interleaved video packets are not ref-counted,
- * so this has to do as our own RAII copy mechanism. */
-struct packet {
-	encoder_packet m_pkt;
-	std::vector<uint8_t> data;
-
-	packet(encoder_packet *pkt)
-	{
-		m_pkt = *pkt;
-		data.assign(pkt->data, pkt->data + pkt->size);
-		m_pkt.data = data.data();
-	}
-};
+#include <array>
+#include <atomic>
+#include <memory>
 
 class EncoderPreview : public QDialog {
 	Q_OBJECT
 
-	enum Status { INACTIVE, WAITING, PLAYING };
+	enum CompareMode { CompareSideBySide, CompareWipe };
 
 public:
 	std::unique_ptr<Ui_EncoderPreview> ui;
-	EncoderPreview(QWidget *parent);
-	~EncoderPreview() { StopPreview(); }
-
-	bool StartOutput();
-	void StopOutput();
-	void ReceivePacket(encoder_packet *pkt);
+	/* Only the primary window is persisted and may keep running hidden */
+	EncoderPreview(QWidget *parent, bool primary = true);
+	~EncoderPreview();
 
 	void SaveSettings(obs_data_t *data);
 	void LoadSettings(obs_data_t *data);
@@ -49,44 +33,86 @@ public slots:
 
 protected:
 	void closeEvent(QCloseEvent *event) override;
+	void showEvent(QShowEvent *event) override;
+	void hideEvent(QHideEvent *event) override;
+	bool eventFilter(QObject *obj, QEvent *event) override;
 
 private slots:
 	void StartStopPreview(bool checked);
+	void UpdateStatus();
 	void UpdateStats();
 
 private:
-	void CreatePreviewOutput();
-	void CreatePreviewSource();
+	void OpenNewWindow();
 
 	void StartPreview();
 	void StopPreview();
+	void SwitchEncoder(PreviewPipeline *side, QComboBox *combo);
+	void StartStopCapture(bool enable);
+
+	void PauseResume(bool pause);
+	void UpdateReplayControls();
+	void UpdateReplayLimits();
+	void UpdateNetworkConfig();
+	void UpdateThreadPolicy();
+	void CheckThreadPolicy(uint64_t generation);
 
 	void RefreshEncoders();
 	void CreateDisplay(bool recreate = false);
 
 	static void DrawPreview(void *data, uint32_t cx, uint32_t cy);
+	void DrawCompare(uint32_t cx, uint32_t cy);
+	void RenderSide(PreviewPipeline *side, uint32_t width, uint32_t height);
+
+	QString FormatStreamStats(const PreviewPipeline::Stats &stats);
+	void UpdateQualityStats();
+	void UpdateBitstreamStats(const BitstreamAnalyzer::Stats &stats);
+	void UpdateRateControlStats(const VbvModel::Stats &stats);
+	void UpdateAbTestStats(const RoiAbTest::Stats &stats);
+	void UpdateNetworkStats(const NetworkSimulator::Stats &stats);
+	void UpdateLatencyStats(const LatencyTracker::Stats &stats);
+	void UpdateDecoderStats(const DecodeGovernor::Stats &stats);
+	void ExportLatency();
+	void UpdatePerformanceStats();
+	void RecordTrace(bool record);
+
+	std::array<PreviewPipeline *, 2> Pipelines() const
+	{
+		return {pipeline.get(), comparePipeline.get()};
+	}
 
-	OBSOutputAutoRelease previewOut;
+	bool primary;
+	/* Started by the user, the pipelines may still be getting there */
+	bool running = false;
+	std::unique_ptr<PreviewPipeline> pipeline;
 	OBSSourceAutoRelease waitingText;
-	OBSSourceAutoRelease previewSource;
-
-	std::atomic<Status> state = INACTIVE;
-
-	/* Output implementation related stuff */
-	void DecodeThread();
-
-	std::thread decoder;
-	std::atomic_bool threadKill = false;
-
-	std::mutex packetMutex;
-	std::condition_variable packetCond;
-	std::vector<packet> packets;
-
-	uint64_t bytes = 0;
-	uint64_t lastStatsTime = 0;
 
-	AVCodecContext *codecContext = nullptr;
-	video_scaler_t *scaler = nullptr;
+	/* Second encoder shown next to, or wiped over, the first one */
+	std::unique_ptr<PreviewPipeline> comparePipeline;
+	std::shared_ptr<DelayGroup> delayGroup;
+	std::atomic_bool comparing = false;
+	std::atomic<int> compareMode = CompareSideBySide;
+
+	/* Wipe position as a fraction of the frame width, and where the
+	 * first frame was last drawn, to map mouse positions onto it */
+	std::atomic<float> wipePos = 0.5f;
+	std::atomic<int> frameX = 0;
+	std::atomic<int> frameCx = 0;
+	gs_texrender_t *wipeRender = nullptr;
+
+	StatsGraph *psnrGraph = nullptr;
+	StatsGraph *ssimGraph = nullptr;
+	StatsGraph *sizeGraph = nullptr;
+	StatsGraph *bufferGraph = nullptr;
+	StatsGraph *latencyGraph = nullptr;
+
+	/* Primary window only, nullptr otherwise */
+	EncoderMonitor *monitor = nullptr;
+
+	/* Last CPU list that could be parsed */
+	QString decoderAffinity;
+	/* Priority the workers last switched to successfully */
+	int appliedPriority = 0;
 
 	QTimer timer;
 	QLocale loc = QLocale::system();
@@ -0,0 +1,64 @@
+#include "plugin-encoders.hpp"
+
+#include <obs-frontend-api.h>
+
+#include <cstring>
+
+using namespace std;
+
+vector<OBSEncoder> FindRoiEncoders(uint32_t flags)
+{
+	vector<OBSEncoder> encoders;
+	vector<OBSOutputAutoRelease> outputs;
+
+	outputs.push_back(obs_frontend_get_streaming_output());
+	if (flags & RoiEncodersRecordings) {
+		outputs.push_back(obs_frontend_get_recording_output());
+		outputs.push_back(obs_frontend_get_replay_buffer_output());
+	}
+
+	// Every open preview window has its own output
+	auto preview_cb = [](void *param, obs_output_t *output) {
+		auto vec = static_cast<vector<OBSOutputAutoRelease> *>(param);
+
+		if (strcmp(obs_output_get_id(output), "encoder_preview") == 0)
+			vec->emplace_back(obs_output_get_ref(output));
+
+		return true;
+	};
+	if (flags & RoiEncodersPreviews)
+		obs_enum_outputs(preview_cb, &outputs);
+
+	// Find all video encoders that could reasonably be in use
+	for (obs_output_t *output : outputs) {
+		if (!output)
+			continue;
+		if ((flags & RoiEncodersActiveOnly) &&
+		    !obs_output_active(output))
+			continue;
+
+		for (size_t idx = 0; idx < MAX_OUTPUT_VIDEO_ENCODERS; idx++) {
+			obs_encoder_t *enc =
+				obs_output_get_video_encoder2(output, idx);
+			if (!enc)
+				continue;
+			if (!(obs_encoder_get_caps(enc) & OBS_ENCODER_CAP_ROI))
+				continue;
+
+			/* Shared by streaming and recording */
+			bool known = false;
+			for (obs_encoder_t *other : encoders)
+				known = known || other == enc;
+			if (!known)
+				encoders.emplace_back(enc);
+		}
+	}
+
+	return encoders;
+}
+
+std::mutex &RoiEncoderMutex()
+{
+	static std::mutex mutex;
+	return mutex;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <obs.hpp>
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+enum RoiEncoderFlags {
+	/* Recording and replay buffer besides streaming */
+	RoiEncodersRecordings = 1 << 0,
+	/* Whatever the encoder preview windows are attached to, these
+	 * encoders may not be used by anything else */
+	RoiEncodersPreviews = 1 << 1,
+	/* Skips outputs that are not running */
+	RoiEncodersActiveOnly = 1 << 2,
+};
+
+/* Video encoders with ROI support used by the frontend's outputs, each
+ * listed once even if shared by several outputs. */
+std::vector<OBSEncoder> FindRoiEncoders(uint32_t flags);
+
+/* Held while clearing and adding the regions of encoders, or reading them
+ * back, so nobody sees or interleaves with a half applied set. */
+std::mutex &RoiEncoderMutex();
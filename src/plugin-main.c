@@ -24,6 +24,7 @@ OBS_MODULE_USE_DEFAULT_LOCALE(PLUGIN_NAME, "en-US")
 
 void InitRoiEditor(void);
 void InitEncoderPreview(void);
+void FreeEncoderPreview(void);
 
 bool obs_module_load(void)
 {
@@ -36,5 +37,6 @@ bool obs_module_load(void)
 
 void obs_module_unload(void)
 {
+	FreeEncoderPreview();
 	obs_log(LOG_INFO, "plugin unloaded");
 }
@@ -0,0 +1,185 @@
+#include "plugin-profiler.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+/* A second of a few hot scopes at high frame rates */
+static constexpr size_t kRingSize = 4096;
+static constexpr uint64_t kIntervalNs = 1000000000;
+
+/*
+ * Per-thread rings
+ */
+
+namespace {
+
+/* Single producer (the owning thread), single consumer (Collect) */
+class PerfRing {
+public:
+	void Push(const char *name, uint64_t duration)
+	{
+		uint64_t pos = head.load(memory_order_relaxed);
+		if (pos - tail.load(memory_order_acquire) >= kRingSize) {
+			dropped.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+
+		entries[pos % kRingSize] = {name, duration};
+		head.store(pos + 1, memory_order_release);
+	}
+
+	template<typename Func> void Drain(Func func)
+	{
+		uint64_t end = head.load(memory_order_acquire);
+		uint64_t pos = tail.load(memory_order_relaxed);
+
+		for (; pos != end; pos++) {
+			const Entry &entry = entries[pos % kRingSize];
+			func(entry.name, entry.duration);
+		}
+
+		tail.store(end, memory_order_release);
+	}
+
+	uint64_t TakeDropped() { return dropped.exchange(0); }
+
+	/* The thread is gone once drained */
+	atomic_bool finished = false;
+
+private:
+	struct Entry {
+		const char *name;
+		uint64_t duration;
+	};
+
+	array<Entry, kRingSize> entries;
+	atomic<uint64_t> head = 0;
+	atomic<uint64_t> tail = 0;
+	atomic<uint64_t> dropped = 0;
+};
+
+struct Registry {
+	mutex lock;
+	vector<shared_ptr<PerfRing>> rings;
+
+	/* Only touched by Collect(), under the lock */
+	unordered_map<const char *, vector<uint64_t>> current;
+	uint64_t currentDropped = 0;
+	uint64_t intervalStart = 0;
+	PerfMonitor::Stats last;
+};
+
+/* Never destroyed, threads may still record while the module unloads */
+Registry &GetRegistry()
+{
+	static Registry *registry = new Registry;
+	return *registry;
+}
+
+struct RingOwner {
+	shared_ptr<PerfRing> ring = make_shared<PerfRing>();
+
+	RingOwner()
+	{
+		Registry &registry = GetRegistry();
+		lock_guard guard(registry.lock);
+		registry.rings.push_back(ring);
+	}
+
+	~RingOwner() { ring->finished = true; }
+};
+
+} // namespace
+
+void PerfScope::Record(const char *name, uint64_t duration)
+{
+	thread_local RingOwner owner;
+	owner.ring->Push(name, duration);
+}
+
+/*
+ * Aggregation
+ */
+
+static PerfMonitor::ScopeStats Summarize(const char *name,
+					 vector<uint64_t> &durations,
+					 uint64_t interval)
+{
+	PerfMonitor::ScopeStats stats;
+	stats.name = name;
+	stats.calls = durations.size();
+	stats.rate = (double)durations.size() / ((double)interval / 1e9);
+
+	auto percentile = [&](double fraction) {
+		double last = (double)(durations.size() - 1);
+		size_t idx = (size_t)(fraction * last);
+		nth_element(durations.begin(), durations.begin() + idx,
+			    durations.end());
+		return (double)durations[idx] / 1e6;
+	};
+
+	stats.p50 = percentile(0.5);
+	stats.p99 = percentile(0.99);
+	stats.max = (double)*max_element(durations.begin(), durations.end()) /
+		    1e6;
+
+	return stats;
+}
+
+PerfMonitor::Stats PerfMonitor::Collect()
+{
+	Registry &registry = GetRegistry();
+	lock_guard guard(registry.lock);
+
+	for (auto &ring : registry.rings) {
+		ring->Drain([&](const char *name, uint64_t duration) {
+			registry.current[name].push_back(duration);
+		});
+		registry.currentDropped += ring->TakeDropped();
+	}
+
+	/* Anything a finished thread recorded has been drained above */
+	auto finished = [](const shared_ptr<PerfRing> &ring) {
+		return ring->finished.load();
+	};
+	registry.rings.erase(remove_if(registry.rings.begin(),
+				       registry.rings.end(), finished),
+			     registry.rings.end());
+
+	uint64_t now = os_gettime_ns();
+	if (!registry.intervalStart)
+		registry.intervalStart = now;
+
+	uint64_t interval = now - registry.intervalStart;
+	if (interval < kIntervalNs)
+		return registry.last;
+
+	Stats stats;
+	stats.dropped = registry.currentDropped;
+
+	for (auto &[name, durations] : registry.current) {
+		if (!durations.empty())
+			stats.scopes.push_back(
+				Summarize(name, durations, interval));
+	}
+
+	sort(stats.scopes.begin(), stats.scopes.end(),
+	     [](const ScopeStats &a, const ScopeStats &b) {
+		     return a.rate * a.p50 > b.rate * b.p50;
+	     });
+
+	/* Keeps the names around, scopes that stop being called drop out */
+	for (auto &entry : registry.current)
+		entry.second.clear();
+	registry.currentDropped = 0;
+	registry.intervalStart = now;
+	registry.last = stats;
+
+	return stats;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "plugin-trace.hpp"
+
+#include <util/platform.h>
+#include <util/profiler.hpp>
+
+#include <cstdint>
+#include <vector>
+
+#define PERF_SCOPE_CONCAT_(a, b) a##b
+#define PERF_SCOPE_CONCAT(a, b) PERF_SCOPE_CONCAT_(a, b)
+
+/* Times the enclosing scope for OBS's profiler as well as for the live
+ * numbers in the encoder preview and the trace recorder. name has to be a
+ * string literal, scopes are told apart by its address. */
+#define PERF_SCOPE(name)    \
+	ProfileScope(name); \
+	PerfScope PERF_SCOPE_CONCAT(perfScope, __LINE__)(name)
+
+class PerfScope {
+public:
+	explicit PerfScope(const char *name)
+		: name(name),
+		  start(os_gettime_ns())
+	{
+	}
+	~PerfScope()
+	{
+		uint64_t end = os_gettime_ns();
+		Record(name, end - start);
+
+		if (TraceRecorder::Active())
+			TraceRecorder::Complete(name, start, end);
+	}
+
+	PerfScope(const PerfScope &) = delete;
+	PerfScope &operator=(const PerfScope &) = delete;
+
+	/* Lock-free, goes into a ring owned by the calling thread */
+	static void Record(const char *name, uint64_t duration);
+
+private:
+	const char *name;
+	uint64_t start;
+};
+
+/* Collects what the scopes recorded on all threads */
+class PerfMonitor {
+public:
+	struct ScopeStats {
+		const char *name = nullptr;
+		uint64_t calls = 0;
+		double rate = 0.0;
+		/* In ms */
+		double p50 = 0.0;
+		double p99 = 0.0;
+		double max = 0.0;
+	};
+
+	struct Stats {
+		/* Sorted by the time spent in each scope, highest first */
+		std::vector<ScopeStats> scopes;
+		/* Samples lost because a thread's ring was full */
+		uint64_t dropped = 0;
+	};
+
+	/* Stats of the last completed interval of at least a second, so any
+	 * number of callers see the same numbers. */
+	static Stats Collect();
+};
@@ -0,0 +1,287 @@
+#include "plugin-trace.hpp"
+
+#include <util/base.h>
+#include <util/platform.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/* Enough for the writer to fall a few hundred ms behind on a busy thread */
+static constexpr size_t kRingSize = 8192;
+static constexpr auto kFlushInterval = chrono::milliseconds(100);
+
+/*
+ * Per-thread rings
+ */
+
+namespace {
+
+struct Event {
+	const char *name;
+	const char *argName;
+	int64_t arg;
+	uint64_t start;
+	/* Zero for instants */
+	uint64_t end;
+};
+
+/* Single producer (the owning thread), single consumer (the writer) */
+class TraceRing {
+public:
+	explicit TraceRing(uint32_t tid) : tid(tid) {}
+
+	void Push(const Event &event)
+	{
+		uint64_t pos = head.load(memory_order_relaxed);
+		if (pos - tail.load(memory_order_acquire) >= kRingSize) {
+			dropped.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+
+		events[pos % kRingSize] = event;
+		head.store(pos + 1, memory_order_release);
+	}
+
+	template<typename Func> void Drain(Func func)
+	{
+		uint64_t end = head.load(memory_order_acquire);
+		uint64_t pos = tail.load(memory_order_relaxed);
+
+		for (; pos != end; pos++)
+			func(events[pos % kRingSize]);
+
+		tail.store(end, memory_order_release);
+	}
+
+	uint64_t TakeDropped() { return dropped.exchange(0); }
+
+	const uint32_t tid;
+	/* The thread is gone once drained */
+	atomic_bool finished = false;
+
+private:
+	array<Event, kRingSize> events;
+	atomic<uint64_t> head = 0;
+	atomic<uint64_t> tail = 0;
+	atomic<uint64_t> dropped = 0;
+};
+
+struct Recorder {
+	/* Guards the rings and the file, held by the writer while draining */
+	mutex lock;
+	vector<shared_ptr<TraceRing>> rings;
+	uint32_t nextTid = 1;
+
+	FILE *file = nullptr;
+	uint64_t origin = 0;
+	uint64_t written = 0;
+	uint64_t dropped = 0;
+	bool first = true;
+
+	/* Start() and Stop() */
+	mutex controlLock;
+	thread writer;
+	condition_variable cond;
+	bool stopping = false;
+};
+
+/* Never destroyed, threads may still record while the module unloads */
+Recorder &GetRecorder()
+{
+	static Recorder *recorder = new Recorder;
+	return *recorder;
+}
+
+struct RingOwner {
+	shared_ptr<TraceRing> ring;
+
+	RingOwner()
+	{
+		Recorder &recorder = GetRecorder();
+		lock_guard guard(recorder.lock);
+		ring = make_shared<TraceRing>(recorder.nextTid++);
+		recorder.rings.push_back(ring);
+	}
+
+	~RingOwner() { ring->finished = true; }
+};
+
+TraceRing *LocalRing()
+{
+	thread_local RingOwner owner;
+	return owner.ring.get();
+}
+
+} // namespace
+
+/*
+ * Writer
+ */
+
+static void WriteEvent(Recorder &recorder, uint32_t tid, const Event &event)
+{
+	/* Left over from before this recording started */
+	if (event.start < recorder.origin)
+		return;
+
+	FILE *file = recorder.file;
+	double ts = (double)(event.start - recorder.origin) / 1000.0;
+
+	fprintf(file, "%s{\"name\":\"%s\",\"pid\":1,\"tid\":%" PRIu32
+		      ",\"ts\":%.3f",
+		recorder.first ? "" : ",\n", event.name, tid, ts);
+
+	if (event.end) {
+		double dur = (double)(event.end - event.start) / 1000.0;
+		fprintf(file, ",\"ph\":\"X\",\"dur\":%.3f", dur);
+	} else {
+		fprintf(file, ",\"ph\":\"i\",\"s\":\"t\"");
+	}
+
+	if (event.argName)
+		fprintf(file, ",\"args\":{\"%s\":%" PRId64 "}", event.argName,
+			event.arg);
+
+	fprintf(file, "}");
+
+	recorder.first = false;
+	recorder.written++;
+}
+
+/* Ring order is not time order, the viewers sort events themselves */
+static void Flush(Recorder &recorder)
+{
+	lock_guard guard(recorder.lock);
+
+	for (auto &ring : recorder.rings) {
+		ring->Drain([&](const Event &event) {
+			if (recorder.file)
+				WriteEvent(recorder, ring->tid, event);
+		});
+		recorder.dropped += ring->TakeDropped();
+	}
+
+	auto finished = [](const shared_ptr<TraceRing> &ring) {
+		return ring->finished.load();
+	};
+	recorder.rings.erase(remove_if(recorder.rings.begin(),
+				       recorder.rings.end(), finished),
+			     recorder.rings.end());
+
+	if (recorder.file)
+		fflush(recorder.file);
+}
+
+static void WriterThread()
+{
+	os_set_thread_name("obs-roi-ui: trace writer");
+
+	Recorder &recorder = GetRecorder();
+	unique_lock lock(recorder.controlLock);
+
+	while (!recorder.stopping) {
+		recorder.cond.wait_for(lock, kFlushInterval);
+
+		lock.unlock();
+		Flush(recorder);
+		lock.lock();
+	}
+}
+
+/*
+ * Recording
+ */
+
+bool TraceRecorder::Start(const string &path)
+{
+	Stop();
+
+	Recorder &recorder = GetRecorder();
+	lock_guard control(recorder.controlLock);
+
+	FILE *file = os_fopen(path.c_str(), "w");
+	if (!file) {
+		blog(LOG_WARNING, "Failed to open '%s' for writing",
+		     path.c_str());
+		return false;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	{
+		lock_guard guard(recorder.lock);
+
+		recorder.file = file;
+		recorder.origin = os_gettime_ns();
+		recorder.written = 0;
+		recorder.dropped = 0;
+		recorder.first = true;
+	}
+
+	recorder.stopping = false;
+	recorder.writer = thread(WriterThread);
+	recording = true;
+
+	blog(LOG_INFO, "Started recording a trace to '%s'", path.c_str());
+	return true;
+}
+
+void TraceRecorder::Stop()
+{
+	Recorder &recorder = GetRecorder();
+
+	{
+		lock_guard control(recorder.controlLock);
+		if (!recorder.writer.joinable())
+			return;
+
+		recording = false;
+		recorder.stopping = true;
+	}
+
+	recorder.cond.notify_one();
+	recorder.writer.join();
+
+	/* Whatever made it in before recording was switched off */
+	Flush(recorder);
+
+	lock_guard guard(recorder.lock);
+
+	fprintf(recorder.file, "\n]}\n");
+	fclose(recorder.file);
+	recorder.file = nullptr;
+
+	blog(LOG_INFO, "Stopped recording the trace, %" PRIu64 " events",
+	     recorder.written);
+	if (recorder.dropped)
+		blog(LOG_WARNING, "%" PRIu64 " trace events were lost",
+		     recorder.dropped);
+}
+
+void TraceRecorder::Complete(const char *name, uint64_t start, uint64_t end)
+{
+	if (!Active())
+		return;
+
+	/* Zero-length events would be taken for instants */
+	LocalRing()->Push({name, nullptr, 0, start, std::max(end, start + 1)});
+}
+
+void TraceRecorder::Instant(const char *name, const char *arg_name,
+			    int64_t arg)
+{
+	if (!Active())
+		return;
+
+	LocalRing()->Push({name, arg_name, arg, os_gettime_ns(), 0});
+}
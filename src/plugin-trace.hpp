@@ -0,0 +1,30 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/* Records what the plugin is doing into a trace file that can be opened in
+ * chrome://tracing or ui.perfetto.dev. Every PERF_SCOPE() becomes a complete
+ * event while recording, instants mark single points in time.
+ *
+ * Events go into per-thread rings and are written out by a background
+ * thread, names have to be string literals. */
+class TraceRecorder {
+public:
+	static bool Start(const std::string &path);
+	static void Stop();
+
+	static bool Active()
+	{
+		return recording.load(std::memory_order_relaxed);
+	}
+
+	/* Times are in os_gettime_ns() time */
+	static void Complete(const char *name, uint64_t start, uint64_t end);
+	static void Instant(const char *name, const char *arg_name = nullptr,
+			    int64_t arg = 0);
+
+private:
+	static inline std::atomic_bool recording = false;
+};
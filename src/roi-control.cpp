@@ -0,0 +1,489 @@
+#include "roi-control.hpp"
+#include "plugin-profiler.hpp"
+#include "roi-regions.hpp"
+
+#include <obs.hpp>
+#include <util/platform.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/* A second of updates at 60 fps for a few dozen scenes, beyond that the
+ * producer is not keeping to the frame rate */
+static constexpr uint32_t kMaxPending = 4096;
+static constexpr size_t kMaxClients = 8;
+static constexpr size_t kMaxMessage = 1024 * 1024;
+static constexpr int kPollMs = 100;
+
+/*
+ * Sockets
+ */
+
+#if defined(_WIN32)
+using socket_t = SOCKET;
+static const socket_t kInvalidSocket = INVALID_SOCKET;
+
+static void CloseSocket(socket_t fd)
+{
+	closesocket(fd);
+}
+
+static int PollSockets(pollfd *fds, size_t count)
+{
+	return WSAPoll(fds, (ULONG)count, kPollMs);
+}
+#else
+using socket_t = int;
+static const socket_t kInvalidSocket = -1;
+
+static void CloseSocket(socket_t fd)
+{
+	close(fd);
+}
+
+static int PollSockets(pollfd *fds, size_t count)
+{
+	return poll(fds, (nfds_t)count, kPollMs);
+}
+#endif
+
+static socket_t Listen(const string &path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		blog(LOG_WARNING, "ROI control socket path is too long: %s",
+		     path.c_str());
+		return kInvalidSocket;
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	/* A socket left behind by a crash is replaced, one another instance
+	 * still listens on is not taken over. */
+	socket_t probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe != kInvalidSocket) {
+		bool in_use = connect(probe, (sockaddr *)&addr, sizeof(addr)) ==
+			      0;
+		CloseSocket(probe);
+
+		if (in_use) {
+			blog(LOG_WARNING, "ROI control socket %s is in use",
+			     path.c_str());
+			return kInvalidSocket;
+		}
+	}
+
+	os_unlink(path.c_str());
+
+	socket_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == kInvalidSocket)
+		return kInvalidSocket;
+
+	if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, (int)kMaxClients) != 0) {
+		blog(LOG_WARNING, "Failed to listen on ROI control socket %s",
+		     path.c_str());
+		CloseSocket(fd);
+		return kInvalidSocket;
+	}
+
+#ifndef _WIN32
+	/* Only processes of the same user may move the regions */
+	chmod(path.c_str(), 0600);
+#endif
+
+	return fd;
+}
+
+/*
+ * Queue
+ */
+
+RoiControl::UpdateQueue::UpdateQueue() : head(new Node), tail(head.load()) {}
+
+RoiControl::UpdateQueue::~UpdateQueue()
+{
+	Update update;
+	while (Pop(update))
+		;
+	delete tail;
+}
+
+void RoiControl::UpdateQueue::Push(Update &&update)
+{
+	Node *node = new Node;
+	node->update = std::move(update);
+
+	Node *prev = head.exchange(node, memory_order_acq_rel);
+	prev->next.store(node, memory_order_release);
+}
+
+/* The tail is a node that has already been taken, its successor holds the
+ * next update and becomes the new tail. */
+bool RoiControl::UpdateQueue::Pop(Update &update)
+{
+	Node *next = tail->next.load(memory_order_acquire);
+	if (!next)
+		return false;
+
+	update = std::move(next->update);
+	delete tail;
+	tail = next;
+	return true;
+}
+
+/*
+ * Control
+ */
+
+RoiControl &RoiControl::Shared()
+{
+	static RoiControl control;
+	return control;
+}
+
+string RoiControl::SocketPath()
+{
+	const char *path = getenv("OBS_ROI_UI_SOCKET");
+	if (path && *path)
+		return path;
+
+#if defined(_WIN32)
+	const char *dir = getenv("TEMP");
+	return string(dir ? dir : ".") + "\\obs-roi-ui.sock";
+#else
+	/* Per user, unlike /tmp */
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	if (dir && *dir)
+		return string(dir) + "/obs-roi-ui.sock";
+
+	return "/tmp/obs-roi-ui-" + to_string(getuid()) + ".sock";
+#endif
+}
+
+void RoiControl::Start(ApplyCallback new_apply, RevertCallback new_revert)
+{
+	if (running)
+		return;
+
+	apply = std::move(new_apply);
+	revert = std::move(new_revert);
+
+	/* libobs cannot remove proc handlers, it stays registered and only
+	 * does something while running. */
+	static once_flag once;
+	call_once(once, [this]() {
+		proc_handler_add(obs_get_proc_handler(),
+				 "void roi_ui_push_regions(in string json, "
+				 "out bool success)",
+				 ProcPush, this);
+	});
+
+	running = true;
+	obs_add_tick_callback(Tick, this);
+
+	serverStopping = false;
+	server = std::thread(&RoiControl::ServerThread, this, SocketPath());
+}
+
+void RoiControl::Stop()
+{
+	if (!running)
+		return;
+
+	running = false;
+	obs_remove_tick_callback(Tick, this);
+
+	serverStopping = true;
+	if (server.joinable())
+		server.join();
+
+	Update update;
+	while (queue.Pop(update))
+		;
+	pending = 0;
+
+	{
+		lock_guard lock(mutex);
+		scenes.clear();
+	}
+
+	blog(LOG_INFO,
+	     "ROI control stopped, %llu updates applied, %llu invalid, "
+	     "%llu dropped",
+	     (unsigned long long)applied.exchange(0),
+	     (unsigned long long)invalid.exchange(0),
+	     (unsigned long long)dropped.exchange(0));
+}
+
+bool RoiControl::Push(const char *json)
+{
+	if (!running)
+		return false;
+
+	if (pending >= kMaxPending) {
+		dropped++;
+		return false;
+	}
+
+	OBSDataAutoRelease message = obs_data_create_from_json(json);
+	if (!message) {
+		invalid++;
+		return false;
+	}
+
+	Update update;
+	OBSSourceAutoRelease source;
+
+	const char *scene = obs_data_get_string(message, "scene");
+	if (*scene) {
+		source = obs_get_source_by_uuid(scene);
+		if (!source)
+			source = obs_get_source_by_name(scene);
+		if (!source || !obs_scene_from_source(source)) {
+			invalid++;
+			return false;
+		}
+
+		update.scene = obs_source_get_uuid(source);
+	}
+
+	update.clear = obs_data_get_bool(message, "clear");
+
+	if (!update.clear) {
+		OBSDataArrayAutoRelease array =
+			obs_data_get_array(message, "regions");
+		if (!array) {
+			invalid++;
+			return false;
+		}
+
+		vector<OBSDataAutoRelease> settings;
+		size_t count = obs_data_array_count(array);
+		for (size_t idx = 0; idx < count; idx++) {
+			obs_data_t *region = obs_data_array_item(array, idx);
+			obs_data_set_default_int(region, "type",
+						 RoiRegionManual);
+			obs_data_set_default_bool(region, "enabled", true);
+			settings.emplace_back(region);
+		}
+
+		/* Scenes are as large as the canvas */
+		obs_video_info ovi = {};
+		obs_get_video_info(&ovi);
+		uint32_t width = source ? obs_source_get_width(source)
+					: ovi.base_width;
+		uint32_t height = source ? obs_source_get_height(source)
+					 : ovi.base_height;
+
+		/* Scene items cannot be looked up safely from here */
+		update.regions = CompileRegions(settings, width, height);
+	}
+
+	pending++;
+	queue.Push(std::move(update));
+	return true;
+}
+
+void RoiControl::SetProgramScene(const string &uuid)
+{
+	lock_guard lock(mutex);
+	programScene = uuid;
+}
+
+bool RoiControl::GetRegions(const string &uuid,
+			    vector<obs_encoder_roi> &regions)
+{
+	lock_guard lock(mutex);
+
+	auto found = scenes.find(uuid);
+	if (found == scenes.end())
+		return false;
+
+	regions = found->second;
+	return true;
+}
+
+void RoiControl::ProcPush(void *param, calldata_t *cd)
+{
+	auto control = static_cast<RoiControl *>(param);
+	const char *json = calldata_string(cd, "json");
+	calldata_set_bool(cd, "success", json && control->Push(json));
+}
+
+void RoiControl::Tick(void *param, float)
+{
+	auto control = static_cast<RoiControl *>(param);
+	if (control->pending)
+		control->ApplyPending();
+}
+
+void RoiControl::ApplyPending()
+{
+	PERF_SCOPE("RoiControl::ApplyPending");
+
+	bool changed = false;
+	bool cleared = false;
+	vector<obs_encoder_roi> regions;
+
+	{
+		lock_guard lock(mutex);
+
+		Update update;
+		while (queue.Pop(update)) {
+			pending--;
+
+			const string &uuid = update.scene.empty()
+						     ? programScene
+						     : update.scene;
+			/* Nothing has been shown yet */
+			if (uuid.empty())
+				continue;
+
+			if (update.clear)
+				scenes.erase(uuid);
+			else
+				scenes[uuid] = std::move(update.regions);
+
+			if (uuid == programScene) {
+				changed = true;
+				cleared = update.clear;
+			}
+		}
+
+		if (changed && !cleared)
+			regions = scenes[programScene];
+	}
+
+	if (!changed)
+		return;
+
+	applied++;
+
+	if (cleared)
+		revert();
+	else
+		apply(regions);
+}
+
+void RoiControl::ServerThread(string path)
+{
+	os_set_thread_name("roi-control");
+
+#if defined(_WIN32)
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return;
+#endif
+
+	socket_t listener = Listen(path);
+	if (listener == kInvalidSocket) {
+#if defined(_WIN32)
+		WSACleanup();
+#endif
+		return;
+	}
+
+	blog(LOG_INFO, "ROI control listening on %s", path.c_str());
+
+	struct Client {
+		socket_t fd;
+		string buffer;
+		/* Only the first invalid message of a client is logged */
+		bool warned = false;
+	};
+
+	vector<Client> clients;
+	vector<pollfd> fds;
+
+	auto handle = [&](Client &client, string &&line) {
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty() || Push(line.c_str()) || client.warned)
+			return;
+
+		blog(LOG_WARNING, "Ignoring ROI control message: %.200s",
+		     line.c_str());
+		client.warned = true;
+	};
+
+	/* False once a client sends more than a message could take */
+	auto consume = [&](Client &client) {
+		string &buffer = client.buffer;
+		size_t start = 0, end;
+
+		while ((end = buffer.find('\n', start)) != string::npos) {
+			handle(client, buffer.substr(start, end - start));
+			start = end + 1;
+		}
+
+		buffer.erase(0, start);
+		return buffer.size() <= kMaxMessage;
+	};
+
+	while (!serverStopping) {
+		fds.clear();
+		fds.push_back({listener, POLLIN, 0});
+		for (const Client &client : clients)
+			fds.push_back({client.fd, POLLIN, 0});
+
+		if (PollSockets(fds.data(), fds.size()) <= 0)
+			continue;
+
+		/* Clients are handled back to front so they can be removed */
+		for (size_t idx = clients.size(); idx > 0; idx--) {
+			if (!fds[idx].revents)
+				continue;
+
+			Client &client = clients[idx - 1];
+			char data[4096];
+			int size = (int)recv(client.fd, data, sizeof(data), 0);
+
+			bool keep = size > 0;
+			if (keep) {
+				client.buffer.append(data, (size_t)size);
+				keep = consume(client);
+			}
+
+			if (!keep) {
+				CloseSocket(client.fd);
+				clients.erase(clients.begin() + (idx - 1));
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			socket_t fd = accept(listener, nullptr, nullptr);
+			if (fd == kInvalidSocket)
+				continue;
+
+			if (clients.size() < kMaxClients)
+				clients.push_back({fd, string()});
+			else
+				CloseSocket(fd);
+		}
+	}
+
+	for (Client &client : clients)
+		CloseSocket(client.fd);
+	CloseSocket(listener);
+	os_unlink(path.c_str());
+
+#if defined(_WIN32)
+	WSACleanup();
+#endif
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <obs.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* Lets other processes and scripts set the regions of a scene at frame
+ * rate, e.g. to follow a tracked face. Messages arrive through a local
+ * socket or the "roi_ui_push_regions" proc handler, are queued without
+ * locking and applied once per video tick, only the latest regions of
+ * each scene count. Pushed regions take the place of the ones set up in
+ * the editor until they are cleared again.
+ *
+ * Messages are JSON objects, one per line on the socket:
+ *   {"scene": "Gameplay", "regions": [{"x": 0, "y": 0, "width": 320,
+ *    "height": 240, "priority": 0.8}]}
+ *   {"scene": "Gameplay", "clear": true}
+ * Regions use the editor's format, manual regions being the default type.
+ * Without a scene the program scene is meant. */
+class RoiControl {
+public:
+	/* Both called on the graphics thread, apply with the regions pushed
+	 * for the program scene, revert once they were cleared and the
+	 * editor's regions are to be used again. */
+	using ApplyCallback =
+		std::function<void(const std::vector<obs_encoder_roi> &)>;
+	using RevertCallback = std::function<void()>;
+
+	static RoiControl &Shared();
+	/* Where the socket is created, OBS_ROI_UI_SOCKET overrides it */
+	static std::string SocketPath();
+
+	void Start(ApplyCallback apply, RevertCallback revert);
+	/* Forgets all pushed regions */
+	void Stop();
+	bool Running() const { return running; }
+
+	/* Any thread, false if the message is invalid or too many are
+	 * waiting to be applied */
+	bool Push(const char *json);
+
+	/* UI thread, once the program scene changed */
+	void SetProgramScene(const std::string &uuid);
+	/* Pushed regions of a scene, false if there are none */
+	bool GetRegions(const std::string &uuid,
+			std::vector<obs_encoder_roi> &regions);
+
+private:
+	struct Update {
+		/* Empty for the program scene */
+		std::string scene;
+		bool clear = false;
+		std::vector<obs_encoder_roi> regions;
+	};
+
+	/* Multiple producers, a single consumer, producers never wait. An
+	 * update whose producer was interrupted halfway only shows up with
+	 * the next tick. */
+	class UpdateQueue {
+	public:
+		UpdateQueue();
+		~UpdateQueue();
+
+		void Push(Update &&update);
+		/* Consumer only */
+		bool Pop(Update &update);
+
+	private:
+		struct Node {
+			std::atomic<Node *> next = nullptr;
+			Update update;
+		};
+
+		std::atomic<Node *> head;
+		Node *tail;
+	};
+
+	RoiControl() = default;
+	~RoiControl() { Stop(); }
+
+	static void ProcPush(void *param, calldata_t *cd);
+	static void Tick(void *param, float seconds);
+	void ApplyPending();
+	void ServerThread(std::string path);
+
+	std::atomic_bool running = false;
+	ApplyCallback apply;
+	RevertCallback revert;
+
+	UpdateQueue queue;
+	std::atomic<uint32_t> pending = 0;
+	std::atomic<uint64_t> applied = 0;
+	std::atomic<uint64_t> invalid = 0;
+	std::atomic<uint64_t> dropped = 0;
+
+	/* Read by the UI thread, written by the tick */
+	std::mutex mutex;
+	std::string programScene;
+	std::unordered_map<std::string, std::vector<obs_encoder_roi>> scenes;
+
+	std::thread server;
+	std::atomic_bool serverStopping = false;
+};
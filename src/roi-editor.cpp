@@ -1,4 +1,8 @@
 #include "roi-editor.hpp"
+#include "plugin-encoders.hpp"
+#include "plugin-profiler.hpp"
+#include "roi-control.hpp"
+#include "roi-history.hpp"
 
 #ifdef BUILD_STANDALONE
 #include "external/display-helpers.hpp"
@@ -68,6 +72,12 @@ RoiEditor::RoiEditor(QWidget *parent)
 		&RoiEditor::UpdateEncoders);
 	connect(ui->excludeRecordings, &QCheckBox::stateChanged, this,
 		&RoiEditor::UpdateEncoders);
+	connect(ui->allowExternal, &QCheckBox::toggled, this,
+		&RoiEditor::SetExternalControl);
+
+	ui->allowExternal->setToolTip(
+		QString(obs_module_text("ROI.AllowExternal.ToolTip"))
+			.arg(QT_UTF8(RoiControl::SocketPath().c_str())));
 
 	connect(ui->sceneSelect, &QComboBox::currentIndexChanged, this,
 		&RoiEditor::SceneSelectionChanged);
@@ -492,265 +502,19 @@ void RoiEditor::RegionItemsToData()
 
 static obs_encoder_roi GetItemROI(obs_sceneitem_t *item, float priority)
 {
-	obs_encoder_roi roi;
-
 	matrix4 boxTransform;
 	obs_sceneitem_get_box_transform(item, &boxTransform);
 
 	/* ToDo: Scale to output resolution. */
 
-	vec3 tl, br;
-	vec3_set(&tl, M_INFINITE, M_INFINITE, 0.0f);
-	vec3_set(&br, -M_INFINITE, -M_INFINITE, 0.0f);
-
-	auto GetMinPos = [&](float x, float y) {
-		vec3 pos;
-		vec3_set(&pos, x, y, 0.0f);
-		vec3_transform(&pos, &pos, &boxTransform);
-		vec3_min(&tl, &tl, &pos);
-		vec3_max(&br, &br, &pos);
-	};
-
-	GetMinPos(0.0f, 0.0f);
-	GetMinPos(1.0f, 0.0f);
-	GetMinPos(0.0f, 1.0f);
-	GetMinPos(1.0f, 1.0f);
-
-	roi.left = static_cast<uint32_t>(std::max(tl.x, 0.0f));
-	roi.top = static_cast<uint32_t>(std::max(tl.y, 0.0f));
-	roi.right = static_cast<uint32_t>(std::max(br.x, 0.0f));
-	roi.bottom = static_cast<uint32_t>(std::max(br.y, 0.0f));
-	roi.priority = priority;
-
-	return roi;
-}
-
-static constexpr int32_t kMinBlockSize = 16; // Use H.264 as a baseline
-
-static void BuildInnerRegions(vector<obs_encoder_roi> &rois, float priority,
-			      int64_t steps, int64_t radius,
-			      bool correct_aspect, int32_t center_x,
-			      int32_t center_y, bool circle_inner,
-			      uint32_t width, uint32_t height)
-{
-	if (!radius || height < radius || width < radius ||
-	    radius < kMinBlockSize / 2 || priority == 0.0 || !steps)
-		return;
-	int32_t interval = radius / steps;
-
-	if (interval < kMinBlockSize) {
-		/* Clamp interval size and step count to the smallest block size */
-		interval = kMinBlockSize;
-		steps = std::max(radius / interval, 1LL);
-	} else if (interval % kMinBlockSize) {
-		/* Round interval to nearest multiple of kMinBlockSize */
-		interval =
-			(int32_t)round((float)interval / float(kMinBlockSize)) *
-			kMinBlockSize;
-		steps = std::max((radius + kMinBlockSize) / interval, 1LL);
-	}
-
-	double priority_interval = priority / (double)steps;
-	double aspect = 1.0;
-	if (correct_aspect)
-		aspect = (double)width / (double)height;
-
-	int32_t middle_x = center_x >= 0 ? center_x : width / 2;
-	int32_t middle_y = center_y >= 0 ? center_y : height / 2;
-
-	if (!circle_inner) {
-		for (int32_t i = 1; i <= steps; i++) {
-			// Configurable center point means we have to clamp these.
-			uint32_t top =
-				std::clamp(middle_y - interval * i, 0, 16384);
-			uint32_t bottom =
-				std::clamp(middle_y + interval * i, 0, 16384);
-			uint32_t left = std::clamp(
-				(int32_t)(middle_x - interval * i * aspect), 0,
-				16384);
-			uint32_t right = std::clamp(
-				(int32_t)(middle_x + interval * i * aspect), 0,
-				16384);
-			float region_priority =
-				(float)(priority - priority_interval * (i - 1));
-
-			obs_encoder_roi roi = {top, bottom, left, right,
-					       region_priority};
-			rois.push_back(roi);
-		}
-	} else {
-		// Circular region, extremely inefficient.
-		for (int32_t i = 1; i <= steps; i++) {
-			float region_priority =
-				(float)(priority - priority_interval * (i - 1));
-
-			int32_t radius = interval * i;
-			int32_t x_off = kMinBlockSize / 2;
-			int32_t prev_y_off = 0;
-
-			while (x_off < radius) {
-				int32_t y_off =
-					sqrt(pow(radius, 2) - pow(x_off, 2));
-				if (y_off <= 0)
-					break;
-
-				// Avoid overlapping/duplicate regions
-				if (y_off != prev_y_off) {
-					obs_encoder_roi roi = {
-						(uint32_t)(middle_y - y_off),
-						(uint32_t)(middle_y + y_off),
-						(uint32_t)(middle_x -
-							   x_off * aspect),
-						(uint32_t)(middle_x +
-							   x_off * aspect),
-						region_priority};
-					rois.push_back(roi);
-					prev_y_off = y_off;
-				}
-
-				x_off += kMinBlockSize / 2;
-			}
-		}
-	}
-}
-
-static void BuildOuterRegions(vector<obs_encoder_roi> &rois, float priority,
-			      int64_t steps, int64_t radius,
-			      bool correct_aspect, uint32_t width,
-			      uint32_t height)
-{
-	if (!radius || height / 2 < radius || width / 2 < radius ||
-	    radius < kMinBlockSize || priority == 0.0 || !steps)
-		return;
-
-	int64_t interval = radius / steps;
-
-	if (interval < kMinBlockSize) {
-		/* Clamp interval size and step count to the smallest block size */
-		interval = kMinBlockSize;
-		steps = std::max(radius / interval, 1LL);
-	} else if (interval % kMinBlockSize) {
-		/* Round interval to nearest multiple of kMinBlockSize */
-		interval =
-			(int64_t)round((float)interval / float(kMinBlockSize)) *
-			kMinBlockSize;
-		steps = std::max((radius + kMinBlockSize) / interval, 1LL);
-	}
-
-	double priority_interval = priority / (double)steps;
-	double aspect = 1.0;
-	if (correct_aspect)
-		aspect = (double)width / (double)height;
-
-	/* Add neutral baseline */
-	obs_encoder_roi neutral = {(uint32_t)radius,
-				   (uint32_t)(height - radius),
-				   (uint32_t)((double)radius * aspect),
-				   (uint32_t)(width - (double)radius * aspect),
-				   0.0f};
-	rois.push_back(neutral);
-
-	for (int i = 1; steps > 1 && i < steps; i++) {
-		obs_encoder_roi roi = {
-			(uint32_t)(radius - interval * i),
-			(uint32_t)(height - radius + interval * i),
-			(uint32_t)((double)(radius - interval * i) * aspect),
-			(uint32_t)(width -
-				   (double)(radius - interval * i) * aspect),
-			(float)(priority_interval * i)};
-		rois.push_back(roi);
-	}
-
-	/* Ensure last region always goes to frame edges */
-	obs_encoder_roi final = {0, height, 0, width, (float)priority};
-	rois.push_back(final);
-}
-
-static void BuildCenterFocusROI(vector<obs_encoder_roi> &rois, obs_data_t *data,
-				uint32_t width, uint32_t height)
-{
-	int64_t inner_radius = obs_data_get_int(data, "center_radius_inner");
-	bool aspect_inner = obs_data_get_bool(data, "center_aspect_inner");
-	bool circle_inner = obs_data_get_bool(data, "center_circle");
-	int64_t outer_radius = obs_data_get_int(data, "center_radius_outer");
-	bool aspect_outer = obs_data_get_bool(data, "center_aspect_outer");
-	int64_t steps_inner = obs_data_get_int(data, "center_steps_inner");
-	int64_t steps_outer = obs_data_get_int(data, "center_steps_outer");
-	int32_t center_x = obs_data_get_int(data, "center_x");
-	int32_t center_y = obs_data_get_int(data, "center_y");
-	double priority_outer =
-		obs_data_get_double(data, "center_priority_outer");
-	double priority = obs_data_get_double(data, "priority");
-
-	/* Inner regions (if any) */
-	BuildInnerRegions(rois, priority, steps_inner, inner_radius,
-			  aspect_inner, center_x, center_y, circle_inner, width,
-			  height);
-	BuildOuterRegions(rois, priority_outer, steps_outer, outer_radius,
-			  aspect_outer, width, height);
-}
-
-/// Split specified ROI up into multiple based on given mode
-static void SmoothROI(vector<obs_encoder_roi> &regions,
-		      const obs_encoder_roi &roi, RoiEditor::Smoothing type,
-		      int steps, const double edge_priority)
-{
-	int max_steps = 0;
-	uint32_t width = roi.right - roi.left;
-	uint32_t height = roi.bottom - roi.top;
-
-	// Figure out how many steps we can even do
-	if (type == RoiEditor::Inside) {
-		max_steps = std::min(width / kMinBlockSize / 2,
-				     height / kMinBlockSize / 2);
-	} else if (type == RoiEditor::Outside) {
-		max_steps = 64; // limit to something reasonable
-	} else if (type == RoiEditor::Edge) {
-		// Effectively gives us inside + outside
-		max_steps = std::min(width / kMinBlockSize + 1,
-				     height / kMinBlockSize + 1);
-	}
-
-	steps = std::min(steps, max_steps);
-
-	if (type == RoiEditor::None || steps < 2) {
-		regions.push_back(roi);
-		return;
-	}
-
-	// Just create a bunch of additional zones fading to outside priority
-	double interval = (roi.priority - edge_priority) / (double)(steps - 1);
-
-	int32_t step_offset = 0;
-	if (type == RoiEditor::Edge)
-		step_offset = -steps / 2 + 1;
-	else if (type == RoiEditor::Inside)
-		step_offset = -steps + 1;
-
-	for (int32_t step = 0; step < steps; step++) {
-		float region_priority = std::clamp(
-			roi.priority - (float)(interval * step), -1.0f, 1.0f);
-
-		int32_t mul = step + step_offset;
-		uint32_t top = std::clamp(
-			(int32_t)roi.top - kMinBlockSize * mul, 0, 16384);
-		uint32_t bottom = std::clamp(
-			(int32_t)roi.bottom + kMinBlockSize * mul, 0, 16384);
-		uint32_t left = std::clamp(
-			(int32_t)roi.left - kMinBlockSize * mul, 0, 16384);
-		uint32_t right = std::clamp(
-			(int32_t)roi.right + kMinBlockSize * mul, 0, 16384);
-
-		obs_encoder_roi step_region = {
-			top, bottom, left, right, region_priority,
-		};
-		regions.push_back(step_region);
-	}
+	return BoxTransformToRegion(boxTransform, priority);
 }
 
 /// Create actual obs_encoder_roi structs from configured regions
 vector<obs_encoder_roi> RoiEditor::RegionsFromData(const string &uuid)
 {
+	PERF_SCOPE("RegionsFromData");
+
 	const auto &region_data = roi_data[uuid];
 	if (region_data.empty())
 		return {};
@@ -758,77 +522,18 @@ vector<obs_encoder_roi> RoiEditor::RegionsFromData(const string &uuid)
 	if (!source)
 		return {};
 
-	vector<obs_encoder_roi> regions;
-
-	for (obs_data_t *data : region_data) {
-		float priority = obs_data_get_double(data, "priority");
-
-		if (!obs_data_get_bool(data, "enabled"))
-			continue;
+	auto lookup = [&](int64_t id, obs_encoder_roi &box) {
+		OBSSceneItem sceneItem = obs_scene_find_sceneitem_by_id(
+			obs_scene_from_source(source), id);
+		if (!sceneItem || !obs_sceneitem_visible(sceneItem))
+			return false;
 
-		auto type = static_cast<RoiListItem::RoiItemType>(
-			obs_data_get_int(data, "type"));
-		auto smoothing_type = static_cast<RoiEditor::Smoothing>(
-			obs_data_get_int(data, "smoothing_type"));
-		int smoothing_steps = obs_data_get_int(data, "smoothing_steps");
-		double smoothing_priority =
-			obs_data_get_double(data, "smoothing_priority");
-
-		if (type == RoiListItem::SceneItem) {
-			/* Scene Item ROI */
-			int64_t id = obs_data_get_int(data, "scene_item_id");
-			OBSSceneItem sceneItem = obs_scene_find_sceneitem_by_id(
-				obs_scene_from_source(source), id);
-
-			if (sceneItem && obs_sceneitem_visible(sceneItem)) {
-				auto roi = GetItemROI(sceneItem, priority);
-				if (roi.bottom == 0 || roi.right == 0)
-					continue;
-
-				if (smoothing_type != Smoothing::None &&
-				    smoothing_steps > 1 &&
-				    smoothing_priority != priority) {
-					SmoothROI(regions, roi, smoothing_type,
-						  smoothing_steps,
-						  smoothing_priority);
-				} else {
-					regions.push_back(roi);
-				}
-			}
-
-		} else if (type == RoiListItem::Manual) {
-			/* Fixed ROI */
-			uint32_t left = (uint32_t)obs_data_get_int(data, "x");
-			uint32_t top = (uint32_t)obs_data_get_int(data, "y");
-			uint32_t right = left + (uint32_t)obs_data_get_int(
-							data, "width");
-			uint32_t bottom = top + (uint32_t)obs_data_get_int(
-							data, "height");
-
-			// Invalid ROI
-			if (right == 0 || bottom == 0)
-				continue;
-
-			obs_encoder_roi roi{top, bottom, left, right, priority};
-
-			if (smoothing_type != Smoothing::None &&
-			    smoothing_steps > 1 &&
-			    smoothing_priority != priority) {
-				SmoothROI(regions, roi, smoothing_type,
-					  smoothing_steps, smoothing_priority);
-			} else {
-				regions.push_back(roi);
-			}
-
-		} else if (type == RoiListItem::CenterFocus) {
-			/* Center-focus ROI */
-			uint32_t cx = obs_source_get_width(source);
-			uint32_t cy = obs_source_get_height(source);
-			BuildCenterFocusROI(regions, data, cx, cy);
-		}
-	}
+		box = GetItemROI(sceneItem, 0.0f);
+		return true;
+	};
 
-	return regions;
+	return CompileRegions(region_data, obs_source_get_width(source),
+			      obs_source_get_height(source), lookup);
 }
 
 /*
@@ -853,41 +558,57 @@ void RoiEditor::ShowHideDialog()
 
 void RoiEditor::UpdateEncoders()
 {
+	PERF_SCOPE("UpdateEncoders");
+
 	OBSSourceAutoRelease scene = obs_frontend_get_current_scene();
 	if (!scene)
 		return;
 
 	const string uuid = obs_source_get_uuid(scene);
 
+	const bool enabled = ui->enableRoi->isChecked();
+
+	{
+		lock_guard lock(encoderMutex);
+		encoderSettings.enabled = enabled;
+		encoderSettings.excludeRecordings =
+			ui->excludeRecordings->isChecked();
+		encoderSettings.enumerateAll = enumerate_all_encoders;
+	}
+
+	RoiControl::Shared().SetProgramScene(uuid);
+
+	std::vector<obs_encoder_roi> regions;
+	if (enabled) {
+		/* Regions pushed by other applications replace the scene's */
+		if (!RoiControl::Shared().GetRegions(uuid, regions) &&
+		    roi_data.count(uuid))
+			regions = RegionsFromData(uuid);
+	}
+
+	ApplyRegions(regions);
+}
+
+void RoiEditor::ApplyRegions(const std::vector<obs_encoder_roi> &regions,
+			     bool external)
+{
+	PERF_SCOPE("ApplyRegions");
+
+	/* Clearing and adding must not interleave with another update */
+	lock_guard lock(encoderMutex);
+
+	/* ROI may have been disabled since the regions were pushed */
+	if (external && !encoderSettings.enabled)
+		return;
+
 	std::vector<OBSEncoder> encoders;
-	std::vector<OBSOutputAutoRelease> outputs;
-
-	if (!enumerate_all_encoders) {
-		outputs.push_back(obs_frontend_get_streaming_output());
-		if (!ui->excludeRecordings->isChecked()) {
-			outputs.push_back(obs_frontend_get_recording_output());
-			outputs.push_back(
-				obs_frontend_get_replay_buffer_output());
-		}
-		outputs.push_back(obs_get_output_by_name("encoder_preview"));
-
-		// Find all video encoders that could reasonably be in use
-		for (obs_output_t *output : outputs) {
-			if (!output)
-				continue;
-
-			for (size_t idx = 0; idx < MAX_OUTPUT_VIDEO_ENCODERS;
-			     idx++) {
-				obs_encoder_t *enc =
-					obs_output_get_video_encoder2(output,
-								      idx);
-				if (!enc)
-					continue;
-				if (obs_encoder_get_caps(enc) &
-				    OBS_ENCODER_CAP_ROI)
-					encoders.emplace_back(enc);
-			}
-		}
+
+	if (!encoderSettings.enumerateAll) {
+		uint32_t flags = RoiEncodersPreviews;
+		if (!encoderSettings.excludeRecordings)
+			flags |= RoiEncodersRecordings;
+
+		encoders = FindRoiEncoders(flags);
 	} else {
 		// Alternative more thorough option for special cases
 		auto cb = [](void *param, obs_encoder_t *enc) {
@@ -906,16 +627,22 @@ void RoiEditor::UpdateEncoders()
 	if (encoders.empty())
 		return;
 
+	/* An A/B test may be switching the regions of one of them */
+	lock_guard encoder_lock(RoiEncoderMutex());
+
 	// Clear any ROIs that might exist
-	for (obs_encoder_t *enc : encoders)
+	for (obs_encoder_t *enc : encoders) {
+		TraceRecorder::Instant("obs_encoder_clear_roi");
 		obs_encoder_clear_roi(enc);
+	}
 
-	if (!ui->enableRoi->isChecked())
-		return;
-	if (!roi_data.count(uuid))
-		return;
+	/* Encoders pick up the change with the next frame they encode, which
+	 * at the earliest is the next one rendered. Previews use this to
+	 * overlay the regions their decoded frames were encoded with. */
+	RoiHistory::Shared().Push(obs_get_video_frame_time() +
+					  obs_get_frame_interval_ns(),
+				  regions);
 
-	auto regions = RegionsFromData(uuid);
 	if (regions.empty())
 		return;
 
@@ -925,11 +652,32 @@ void RoiEditor::UpdateEncoders()
 			continue;
 		blog(LOG_DEBUG, "Adding ROI to encoder: %s",
 		     obs_encoder_get_name(enc));
+		TraceRecorder::Instant("obs_encoder_add_roi", "regions",
+				       (int64_t)regions.size());
 		for (const obs_encoder_roi &roi : regions)
 			obs_encoder_add_roi(enc, &roi);
 	}
 }
 
+void RoiEditor::SetExternalControl(bool enable)
+{
+	if (!enable) {
+		RoiControl::Shared().Stop();
+		/* Back to the regions set up here */
+		UpdateEncoders();
+		return;
+	}
+
+	RoiControl::Shared().Start(
+		[this](const std::vector<obs_encoder_roi> &regions) {
+			ApplyRegions(regions, true);
+		},
+		[this]() {
+			QMetaObject::invokeMethod(this, "UpdateEncoders",
+						  Qt::QueuedConnection);
+		});
+}
+
 /*
  * Toolbar actions
  */
@@ -1061,10 +809,7 @@ void RoiEditor::ConnectSceneSignals()
 static void DrawROI(const obs_encoder_roi &roi, const float opacity,
 		    gs_eparam_t *colour_param, const uint32_t blockSize)
 {
-	const uint32_t roi_left = roi.left / blockSize;
-	const uint32_t roi_top = roi.top / blockSize;
-	const uint32_t roi_right = (roi.right + blockSize - 1) / blockSize;
-	const uint32_t roi_bottom = (roi.bottom + blockSize - 1) / blockSize;
+	const RoiBlockRect blocks = RegionToBlocks(roi, blockSize);
 
 	float red = roi.priority < 0.0f ? -roi.priority : 0.0f;
 	float green = roi.priority > 0.0f ? roi.priority : 0.0f;
@@ -1076,8 +821,9 @@ static void DrawROI(const obs_encoder_roi &roi, const float opacity,
 	gs_matrix_push();
 	gs_matrix_identity();
 
-	gs_matrix_translate3f(roi_left, roi_top, 0.0f);
-	gs_matrix_scale3f(roi_right - roi_left, roi_bottom - roi_top, 1.0f);
+	gs_matrix_translate3f(blocks.left, blocks.top, 0.0f);
+	gs_matrix_scale3f(blocks.right - blocks.left, blocks.bottom - blocks.top,
+			  1.0f);
 
 	gs_effect_set_vec4(colour_param, &fillColor);
 	gs_draw(GS_TRISTRIP, 0, 0);
@@ -1088,6 +834,8 @@ static void DrawROI(const obs_encoder_roi &roi, const float opacity,
 void RoiEditor::CreatePreviewTexture(RoiEditor *editor, uint32_t cx,
 				     uint32_t cy)
 {
+	PERF_SCOPE("CreatePreviewTexture");
+
 	static size_t draw_until_layer = 1;
 
 	if (!editor->texRender)
@@ -1255,6 +1003,8 @@ void RoiEditor::LoadRoisFromOBSData(obs_data_t *obj)
 	ui->enableRoi->setChecked(obs_data_get_bool(obj, "enabled"));
 	ui->excludeRecordings->setChecked(
 		obs_data_get_bool(obj, "ignore_recording_encoder"));
+	ui->allowExternal->setChecked(
+		obs_data_get_bool(obj, "allow_external_regions"));
 
 	debug_draw = obs_data_get_bool(obj, "debug_draw");
 	debug_draw_single = obs_data_get_bool(obj, "debug_draw_single");
@@ -1315,6 +1065,8 @@ void RoiEditor::SaveRoisToOBSData(obs_data_t *obj) const
 			  enumerate_all_encoders);
 	obs_data_set_bool(obj, "ignore_recording_encoder",
 			  ui->excludeRecordings->isChecked());
+	obs_data_set_bool(obj, "allow_external_regions",
+			  ui->allowExternal->isChecked());
 }
 
 /*
@@ -1433,6 +1185,10 @@ static void OBSEvent(obs_frontend_event event, void *)
 	case OBS_FRONTEND_EVENT_REPLAY_BUFFER_STARTED:
 		roi_edit->UpdateEncoders();
 		break;
+	case OBS_FRONTEND_EVENT_EXIT:
+		/* Ticks and the socket must be gone before libobs shuts down */
+		RoiControl::Shared().Stop();
+		break;
 	default:
 		break;
 	}
@@ -3,6 +3,7 @@
 #include <mutex>
 
 #include "ui_roi-editor.h"
+#include "roi-regions.hpp"
 
 #include <obs.hpp>
 
@@ -44,7 +45,12 @@ class RoiEditor : public QDialog {
 	enum Direction { Up, Down };
 
 public:
-	enum Smoothing { None, Inside, Outside, Edge };
+	enum Smoothing {
+		None = RoiSmoothingNone,
+		Inside = RoiSmoothingInside,
+		Outside = RoiSmoothingOutside,
+		Edge = RoiSmoothingEdge,
+	};
 
 	std::unique_ptr<Ui_ROIEditor> ui;
 	RoiEditor(QWidget *parent);
@@ -58,6 +64,11 @@ public:
 	}
 
 	void ConnectSceneSignals();
+	/* Hands the regions to all encoders ROI is applied to, may be
+	 * called from any thread. External regions are dropped while ROI
+	 * is disabled. */
+	void ApplyRegions(const std::vector<obs_encoder_roi> &regions,
+			  bool external = false);
 	void LoadRoisFromOBSData(obs_data_t *obj);
 	void SaveRoisToOBSData(obs_data_t *obj) const;
 
@@ -79,6 +90,7 @@ private slots:
 
 	void RefreshData();
 	void RefreshSceneItems();
+	void SetExternalControl(bool enable);
 
 private:
 	void AddRegionItem(int type);
@@ -107,6 +119,17 @@ private:
 
 	bool enumerate_all_encoders = false;
 
+	/* Settings as of the last UpdateEncoders(), for regions applied from
+	 * other threads. Guarded by encoderMutex, which also keeps updates
+	 * from interleaving. */
+	struct EncoderSettings {
+		bool enabled = false;
+		bool excludeRecordings = false;
+		bool enumerateAll = false;
+	};
+	std::mutex encoderMutex;
+	EncoderSettings encoderSettings;
+
 	// Rendering stuff
 	std::mutex preview_roi_mutex;
 	std::vector<obs_encoder_roi> preview_roi;
@@ -133,9 +156,9 @@ class RoiListItem : public QListWidgetItem {
 
 public:
 	enum RoiItemType {
-		SceneItem = QListWidgetItem::UserType,
-		Manual,
-		CenterFocus,
+		SceneItem = RoiRegionSceneItem,
+		Manual = RoiRegionManual,
+		CenterFocus = RoiRegionCenterFocus,
 	};
 
 	RoiListItem(int type) : QListWidgetItem(nullptr, type) {}
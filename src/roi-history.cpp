@@ -0,0 +1,51 @@
+#include "roi-history.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+RoiHistory &RoiHistory::Shared()
+{
+	static RoiHistory history;
+	return history;
+}
+
+void RoiHistory::Push(uint64_t frame_ts, const vector<obs_encoder_roi> &regions,
+		      const obs_encoder_t *encoder)
+{
+	lock_guard lock(mutex);
+
+	/* Entries keep their allocations when the ring wraps around */
+	Entry &entry = ring[next % kCapacity];
+	entry.sequence = next++;
+	entry.frame_ts = frame_ts;
+	entry.encoder = encoder;
+	entry.regions.assign(regions.begin(), regions.end());
+}
+
+bool RoiHistory::GetRegionsAt(const obs_encoder_t *encoder, uint64_t frame_ts,
+			      vector<obs_encoder_roi> &regions,
+			      uint64_t &sequence)
+{
+	lock_guard lock(mutex);
+
+	size_t count = (size_t)min<uint64_t>(next - 1, kCapacity);
+
+	/* Newest first, sets are pushed in frame order */
+	for (size_t idx = 1; idx <= count; idx++) {
+		const Entry &entry = ring[(next - idx) % kCapacity];
+		if (entry.frame_ts > frame_ts)
+			continue;
+		/* Another encoder's A/B test */
+		if (entry.encoder && entry.encoder != encoder)
+			continue;
+
+		if (entry.sequence != sequence) {
+			regions = entry.regions;
+			sequence = entry.sequence;
+		}
+		return true;
+	}
+
+	return false;
+}
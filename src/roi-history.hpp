@@ -0,0 +1,49 @@
+#pragma once
+
+#include <obs.h>
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/* The last ROI sets the editor applied to the encoders, or an A/B test to
+ * a single one, each stamped with the first video frame that can have been
+ * encoded with it. Lets previews show the regions a decoded frame was
+ * actually encoded with, rather than the current ones, which matters for
+ * regions following moving items. */
+class RoiHistory {
+public:
+	static RoiHistory &Shared();
+
+	/* An empty set records that the regions were removed. Without an
+	 * encoder the set was applied to all of them. */
+	void Push(uint64_t frame_ts,
+		  const std::vector<obs_encoder_roi> &regions,
+		  const obs_encoder_t *encoder = nullptr);
+
+	/* Finds the set in effect on the encoder for a frame of the given
+	 * timestamp, false if the history does not reach back that far.
+	 * sequence identifies the set, regions are only copied if it
+	 * differs from the one passed in. */
+	bool GetRegionsAt(const obs_encoder_t *encoder, uint64_t frame_ts,
+			  std::vector<obs_encoder_roi> &regions,
+			  uint64_t &sequence);
+
+private:
+	/* A few seconds worth even of regions following moving items */
+	static constexpr size_t kCapacity = 256;
+
+	struct Entry {
+		uint64_t sequence = 0;
+		uint64_t frame_ts = 0;
+		/* Only compared, never dereferenced */
+		const obs_encoder_t *encoder = nullptr;
+		std::vector<obs_encoder_roi> regions;
+	};
+
+	std::mutex mutex;
+	std::array<Entry, kCapacity> ring;
+	/* Sequence of the next entry, the ring holds the ones before it */
+	uint64_t next = 1;
+};
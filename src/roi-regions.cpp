@@ -0,0 +1,341 @@
+#include "roi-regions.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+static constexpr int32_t kMinBlockSize = 16; // Use H.264 as a baseline
+
+void BuildInnerRegions(vector<obs_encoder_roi> &rois, float priority,
+		       int64_t steps, int64_t radius, bool correct_aspect,
+		       int32_t center_x, int32_t center_y, bool circle_inner,
+		       uint32_t width, uint32_t height)
+{
+	if (!radius || height < radius || width < radius ||
+	    radius < kMinBlockSize / 2 || priority == 0.0 || !steps)
+		return;
+	int32_t interval = radius / steps;
+
+	if (interval < kMinBlockSize) {
+		/* Clamp interval size and step count to the smallest block size */
+		interval = kMinBlockSize;
+		steps = std::max<int64_t>(radius / interval, 1);
+	} else if (interval % kMinBlockSize) {
+		/* Round interval to nearest multiple of kMinBlockSize */
+		interval =
+			(int32_t)round((float)interval / float(kMinBlockSize)) *
+			kMinBlockSize;
+		steps = std::max<int64_t>((radius + kMinBlockSize) / interval,
+					  1);
+	}
+
+	double priority_interval = priority / (double)steps;
+	double aspect = 1.0;
+	if (correct_aspect)
+		aspect = (double)width / (double)height;
+
+	int32_t middle_x = center_x >= 0 ? center_x : width / 2;
+	int32_t middle_y = center_y >= 0 ? center_y : height / 2;
+
+	if (!circle_inner) {
+		for (int32_t i = 1; i <= steps; i++) {
+			// Configurable center point means we have to clamp these.
+			uint32_t top =
+				std::clamp(middle_y - interval * i, 0, 16384);
+			uint32_t bottom =
+				std::clamp(middle_y + interval * i, 0, 16384);
+			uint32_t left = std::clamp(
+				(int32_t)(middle_x - interval * i * aspect), 0,
+				16384);
+			uint32_t right = std::clamp(
+				(int32_t)(middle_x + interval * i * aspect), 0,
+				16384);
+			float region_priority =
+				(float)(priority - priority_interval * (i - 1));
+
+			obs_encoder_roi roi = {top, bottom, left, right,
+					       region_priority};
+			rois.push_back(roi);
+		}
+	} else {
+		// Circular region, extremely inefficient.
+		for (int32_t i = 1; i <= steps; i++) {
+			float region_priority =
+				(float)(priority - priority_interval * (i - 1));
+
+			int32_t radius = interval * i;
+			int32_t x_off = kMinBlockSize / 2;
+			int32_t prev_y_off = 0;
+
+			while (x_off < radius) {
+				int32_t y_off =
+					sqrt(pow(radius, 2) - pow(x_off, 2));
+				if (y_off <= 0)
+					break;
+
+				// Avoid overlapping/duplicate regions
+				if (y_off != prev_y_off) {
+					obs_encoder_roi roi = {
+						(uint32_t)(middle_y - y_off),
+						(uint32_t)(middle_y + y_off),
+						(uint32_t)(middle_x -
+							   x_off * aspect),
+						(uint32_t)(middle_x +
+							   x_off * aspect),
+						region_priority};
+					rois.push_back(roi);
+					prev_y_off = y_off;
+				}
+
+				x_off += kMinBlockSize / 2;
+			}
+		}
+	}
+}
+
+void BuildOuterRegions(vector<obs_encoder_roi> &rois, float priority,
+		       int64_t steps, int64_t radius, bool correct_aspect,
+		       uint32_t width, uint32_t height)
+{
+	if (!radius || height / 2 < radius || width / 2 < radius ||
+	    radius < kMinBlockSize || priority == 0.0 || !steps)
+		return;
+
+	int64_t interval = radius / steps;
+
+	if (interval < kMinBlockSize) {
+		/* Clamp interval size and step count to the smallest block size */
+		interval = kMinBlockSize;
+		steps = std::max<int64_t>(radius / interval, 1);
+	} else if (interval % kMinBlockSize) {
+		/* Round interval to nearest multiple of kMinBlockSize */
+		interval =
+			(int64_t)round((float)interval / float(kMinBlockSize)) *
+			kMinBlockSize;
+		steps = std::max<int64_t>((radius + kMinBlockSize) / interval,
+					  1);
+	}
+
+	double priority_interval = priority / (double)steps;
+	double aspect = 1.0;
+	if (correct_aspect)
+		aspect = (double)width / (double)height;
+
+	/* Add neutral baseline */
+	obs_encoder_roi neutral = {(uint32_t)radius,
+				   (uint32_t)(height - radius),
+				   (uint32_t)((double)radius * aspect),
+				   (uint32_t)(width - (double)radius * aspect),
+				   0.0f};
+	rois.push_back(neutral);
+
+	for (int i = 1; steps > 1 && i < steps; i++) {
+		obs_encoder_roi roi = {
+			(uint32_t)(radius - interval * i),
+			(uint32_t)(height - radius + interval * i),
+			(uint32_t)((double)(radius - interval * i) * aspect),
+			(uint32_t)(width -
+				   (double)(radius - interval * i) * aspect),
+			(float)(priority_interval * i)};
+		rois.push_back(roi);
+	}
+
+	/* Ensure last region always goes to frame edges */
+	obs_encoder_roi final = {0, height, 0, width, (float)priority};
+	rois.push_back(final);
+}
+
+static void BuildCenterFocusROI(vector<obs_encoder_roi> &rois, obs_data_t *data,
+				uint32_t width, uint32_t height)
+{
+	int64_t inner_radius = obs_data_get_int(data, "center_radius_inner");
+	bool aspect_inner = obs_data_get_bool(data, "center_aspect_inner");
+	bool circle_inner = obs_data_get_bool(data, "center_circle");
+	int64_t outer_radius = obs_data_get_int(data, "center_radius_outer");
+	bool aspect_outer = obs_data_get_bool(data, "center_aspect_outer");
+	int64_t steps_inner = obs_data_get_int(data, "center_steps_inner");
+	int64_t steps_outer = obs_data_get_int(data, "center_steps_outer");
+	int32_t center_x = obs_data_get_int(data, "center_x");
+	int32_t center_y = obs_data_get_int(data, "center_y");
+	double priority_outer =
+		obs_data_get_double(data, "center_priority_outer");
+	double priority = obs_data_get_double(data, "priority");
+
+	/* Inner regions (if any) */
+	BuildInnerRegions(rois, priority, steps_inner, inner_radius,
+			  aspect_inner, center_x, center_y, circle_inner, width,
+			  height);
+	BuildOuterRegions(rois, priority_outer, steps_outer, outer_radius,
+			  aspect_outer, width, height);
+}
+
+/// Split specified ROI up into multiple based on given mode
+void SmoothROI(vector<obs_encoder_roi> &regions, const obs_encoder_roi &roi,
+	       RoiSmoothing type, int steps, const double edge_priority)
+{
+	int max_steps = 0;
+	uint32_t width = roi.right - roi.left;
+	uint32_t height = roi.bottom - roi.top;
+
+	// Figure out how many steps we can even do
+	if (type == RoiSmoothingInside) {
+		max_steps = std::min(width / kMinBlockSize / 2,
+				     height / kMinBlockSize / 2);
+	} else if (type == RoiSmoothingOutside) {
+		max_steps = 64; // limit to something reasonable
+	} else if (type == RoiSmoothingEdge) {
+		// Effectively gives us inside + outside
+		max_steps = std::min(width / kMinBlockSize + 1,
+				     height / kMinBlockSize + 1);
+	}
+
+	steps = std::min(steps, max_steps);
+
+	if (type == RoiSmoothingNone || steps < 2) {
+		regions.push_back(roi);
+		return;
+	}
+
+	// Just create a bunch of additional zones fading to outside priority
+	double interval = (roi.priority - edge_priority) / (double)(steps - 1);
+
+	int32_t step_offset = 0;
+	if (type == RoiSmoothingEdge)
+		step_offset = -steps / 2 + 1;
+	else if (type == RoiSmoothingInside)
+		step_offset = -steps + 1;
+
+	for (int32_t step = 0; step < steps; step++) {
+		float region_priority = std::clamp(
+			roi.priority - (float)(interval * step), -1.0f, 1.0f);
+
+		int32_t mul = step + step_offset;
+		uint32_t top = std::clamp(
+			(int32_t)roi.top - kMinBlockSize * mul, 0, 16384);
+		uint32_t bottom = std::clamp(
+			(int32_t)roi.bottom + kMinBlockSize * mul, 0, 16384);
+		uint32_t left = std::clamp(
+			(int32_t)roi.left - kMinBlockSize * mul, 0, 16384);
+		uint32_t right = std::clamp(
+			(int32_t)roi.right + kMinBlockSize * mul, 0, 16384);
+
+		obs_encoder_roi step_region = {
+			top, bottom, left, right, region_priority,
+		};
+		regions.push_back(step_region);
+	}
+}
+
+obs_encoder_roi BoxTransformToRegion(const matrix4 &transform, float priority)
+{
+	obs_encoder_roi roi;
+
+	vec3 tl, br;
+	vec3_set(&tl, M_INFINITE, M_INFINITE, 0.0f);
+	vec3_set(&br, -M_INFINITE, -M_INFINITE, 0.0f);
+
+	auto GetMinPos = [&](float x, float y) {
+		vec3 pos;
+		vec3_set(&pos, x, y, 0.0f);
+		vec3_transform(&pos, &pos, &transform);
+		vec3_min(&tl, &tl, &pos);
+		vec3_max(&br, &br, &pos);
+	};
+
+	GetMinPos(0.0f, 0.0f);
+	GetMinPos(1.0f, 0.0f);
+	GetMinPos(0.0f, 1.0f);
+	GetMinPos(1.0f, 1.0f);
+
+	roi.left = static_cast<uint32_t>(std::max(tl.x, 0.0f));
+	roi.top = static_cast<uint32_t>(std::max(tl.y, 0.0f));
+	roi.right = static_cast<uint32_t>(std::max(br.x, 0.0f));
+	roi.bottom = static_cast<uint32_t>(std::max(br.y, 0.0f));
+	roi.priority = priority;
+
+	return roi;
+}
+
+RoiBlockRect RegionToBlocks(const obs_encoder_roi &roi, uint32_t block_size)
+{
+	return {
+		roi.left / block_size,
+		roi.top / block_size,
+		(roi.right + block_size - 1) / block_size,
+		(roi.bottom + block_size - 1) / block_size,
+	};
+}
+
+static void AddRegion(vector<obs_encoder_roi> &regions,
+		      const obs_encoder_roi &roi, RoiSmoothing smoothing_type,
+		      int smoothing_steps, double smoothing_priority)
+{
+	if (smoothing_type != RoiSmoothingNone && smoothing_steps > 1 &&
+	    smoothing_priority != roi.priority) {
+		SmoothROI(regions, roi, smoothing_type, smoothing_steps,
+			  smoothing_priority);
+	} else {
+		regions.push_back(roi);
+	}
+}
+
+vector<obs_encoder_roi>
+CompileRegions(const vector<OBSDataAutoRelease> &settings, uint32_t width,
+	       uint32_t height, const RoiItemLookup &lookup)
+{
+	vector<obs_encoder_roi> regions;
+
+	for (obs_data_t *data : settings) {
+		float priority = obs_data_get_double(data, "priority");
+
+		if (!obs_data_get_bool(data, "enabled"))
+			continue;
+
+		auto type = static_cast<RoiRegionType>(
+			obs_data_get_int(data, "type"));
+		auto smoothing_type = static_cast<RoiSmoothing>(
+			obs_data_get_int(data, "smoothing_type"));
+		int smoothing_steps = obs_data_get_int(data, "smoothing_steps");
+		double smoothing_priority =
+			obs_data_get_double(data, "smoothing_priority");
+
+		if (type == RoiRegionSceneItem) {
+			/* Scene Item ROI */
+			int64_t id = obs_data_get_int(data, "scene_item_id");
+			obs_encoder_roi roi;
+
+			if (!lookup || !lookup(id, roi))
+				continue;
+			if (roi.bottom == 0 || roi.right == 0)
+				continue;
+
+			roi.priority = priority;
+			AddRegion(regions, roi, smoothing_type, smoothing_steps,
+				  smoothing_priority);
+
+		} else if (type == RoiRegionManual) {
+			/* Fixed ROI */
+			uint32_t left = (uint32_t)obs_data_get_int(data, "x");
+			uint32_t top = (uint32_t)obs_data_get_int(data, "y");
+			uint32_t right = left + (uint32_t)obs_data_get_int(
+							data, "width");
+			uint32_t bottom = top + (uint32_t)obs_data_get_int(
+							data, "height");
+
+			// Invalid ROI
+			if (right == 0 || bottom == 0)
+				continue;
+
+			obs_encoder_roi roi{top, bottom, left, right, priority};
+			AddRegion(regions, roi, smoothing_type, smoothing_steps,
+				  smoothing_priority);
+
+		} else if (type == RoiRegionCenterFocus) {
+			/* Center-focus ROI */
+			BuildCenterFocusROI(regions, data, width, height);
+		}
+	}
+
+	return regions;
+}
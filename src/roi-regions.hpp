@@ -0,0 +1,61 @@
+#pragma once
+
+#include <obs.hpp>
+#include <graphics/matrix4.h>
+
+#include <functional>
+#include <vector>
+
+/* Values of the "type" key of a saved region. Scene item regions start at
+ * QListWidgetItem::UserType as the editor uses them as list item types. */
+enum RoiRegionType {
+	RoiRegionSceneItem = 1000,
+	RoiRegionManual,
+	RoiRegionCenterFocus,
+};
+
+/* Values of the "smoothing_type" key */
+enum RoiSmoothing {
+	RoiSmoothingNone,
+	RoiSmoothingInside,
+	RoiSmoothingOutside,
+	RoiSmoothingEdge,
+};
+
+/* Looks up the bounding box of a scene item in canvas coordinates. Returns
+ * false if the item does not exist or is hidden. */
+using RoiItemLookup = std::function<bool(int64_t id, obs_encoder_roi &box)>;
+
+/* Compiles the saved regions of a scene into what is handed to encoders,
+ * for a canvas of the given size. The first region containing a block
+ * decides its priority, like with the encoders. Scene item regions are
+ * skipped without a lookup. */
+std::vector<obs_encoder_roi>
+CompileRegions(const std::vector<OBSDataAutoRelease> &settings,
+	       uint32_t width, uint32_t height,
+	       const RoiItemLookup &lookup = nullptr);
+
+/* Building blocks of CompileRegions(), exposed for the benchmarks */
+void BuildInnerRegions(std::vector<obs_encoder_roi> &rois, float priority,
+		       int64_t steps, int64_t radius, bool correct_aspect,
+		       int32_t center_x, int32_t center_y, bool circle_inner,
+		       uint32_t width, uint32_t height);
+void BuildOuterRegions(std::vector<obs_encoder_roi> &rois, float priority,
+		       int64_t steps, int64_t radius, bool correct_aspect,
+		       uint32_t width, uint32_t height);
+void SmoothROI(std::vector<obs_encoder_roi> &regions,
+	       const obs_encoder_roi &roi, RoiSmoothing type, int steps,
+	       double edge_priority);
+
+/* Canvas space bounding box of a scene item's box transform */
+obs_encoder_roi BoxTransformToRegion(const matrix4 &transform, float priority);
+
+/* Blocks of the given size a region touches, right and bottom exclusive */
+struct RoiBlockRect {
+	uint32_t left;
+	uint32_t top;
+	uint32_t right;
+	uint32_t bottom;
+};
+
+RoiBlockRect RegionToBlocks(const obs_encoder_roi &roi, uint32_t block_size);
@@ -0,0 +1,118 @@
+#include "clip.hpp"
+
+#include <util/platform.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+using namespace std;
+
+bool Clip::Open(const string &path, uint32_t raw_width, uint32_t raw_height,
+		AVRational raw_fps)
+{
+	file = os_fopen(path.c_str(), "rb");
+	if (!file) {
+		fprintf(stderr, "Could not open '%s'\n", path.c_str());
+		return false;
+	}
+
+	char magic[10] = {};
+	y4m = fread(magic, 1, 9, file) == 9 &&
+	      strncmp(magic, "YUV4MPEG2", 9) == 0;
+
+	if (y4m) {
+		if (!ParseY4mHeader())
+			return false;
+	} else {
+		width = raw_width;
+		height = raw_height;
+		fps = raw_fps;
+		fseek(file, 0, SEEK_SET);
+
+		if (!width || !height) {
+			fprintf(stderr, "Raw input needs --size\n");
+			return false;
+		}
+	}
+
+	if (width % 2 || height % 2) {
+		fprintf(stderr, "Only even frame sizes are supported\n");
+		return false;
+	}
+
+	dataStart = ftell(file);
+	return true;
+}
+
+bool Clip::ParseY4mHeader()
+{
+	char line[256];
+	if (!fgets(line, sizeof(line), file)) {
+		fprintf(stderr, "Truncated Y4M header\n");
+		return false;
+	}
+
+	istringstream params(line);
+	string param;
+
+	while (params >> param) {
+		const char *value = param.c_str() + 1;
+
+		switch (param[0]) {
+		case 'W':
+			width = (uint32_t)atoi(value);
+			break;
+		case 'H':
+			height = (uint32_t)atoi(value);
+			break;
+		case 'F':
+			if (sscanf(value, "%d:%d", &fps.num, &fps.den) != 2)
+				fps = {0, 0};
+			break;
+		case 'C':
+			if (strncmp(value, "420", 3) != 0) {
+				fprintf(stderr,
+					"Only 4:2:0 Y4M input is supported\n");
+				return false;
+			}
+			break;
+		}
+	}
+
+	if (!width || !height || fps.num <= 0 || fps.den <= 0) {
+		fprintf(stderr, "Invalid Y4M header\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool Clip::Rewind()
+{
+	return fseek(file, dataStart, SEEK_SET) == 0;
+}
+
+bool Clip::Read(AVFrame *frame)
+{
+	if (y4m) {
+		char line[256];
+		if (!fgets(line, sizeof(line), file) ||
+		    strncmp(line, "FRAME", 5) != 0)
+			return false;
+	}
+
+	for (int plane = 0; plane < 3; plane++) {
+		const size_t w = plane ? width / 2 : width;
+		const size_t h = plane ? height / 2 : height;
+
+		for (size_t y = 0; y < h; y++) {
+			uint8_t *row = frame->data[plane] +
+				       y * (size_t)frame->linesize[plane];
+			if (fread(row, 1, w, file) != w)
+				return false;
+		}
+	}
+
+	return true;
+}
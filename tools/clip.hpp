@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/rational.h>
+}
+
+/* Y4M or headerless I420 input of the command line tools */
+class Clip {
+public:
+	Clip() = default;
+	~Clip()
+	{
+		if (file)
+			fclose(file);
+	}
+
+	Clip(const Clip &) = delete;
+	Clip &operator=(const Clip &) = delete;
+
+	/* Size and frame rate are only used for headerless input */
+	bool Open(const std::string &path, uint32_t raw_width,
+		  uint32_t raw_height, AVRational raw_fps);
+	bool Rewind();
+	/* Frame must have I420 buffers of the clip's size */
+	bool Read(AVFrame *frame);
+
+	uint32_t Width() const { return width; }
+	uint32_t Height() const { return height; }
+	AVRational Fps() const { return fps; }
+
+private:
+	bool ParseY4mHeader();
+
+	FILE *file = nullptr;
+	bool y4m = false;
+	long dataStart = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	AVRational fps = {60, 1};
+};
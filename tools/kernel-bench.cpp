@@ -0,0 +1,507 @@
+/* Microbenchmarks of the ROI geometry and the frame conversion the preview
+ * runs per frame, swept over canvas sizes from 720p to 8K.
+ *
+ * Results are written as JSON. Given a baseline from an earlier run, every
+ * benchmark is compared against it and the exit code is 2 if any of them
+ * got slower by more than the threshold. */
+
+#include "encoder-preview-ff-glue.hpp"
+#include "roi-regions.hpp"
+
+#include <util/platform.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+using namespace std;
+
+static constexpr int kRepeats = 5;
+
+struct Options {
+	string filter;
+	string output;
+	string baseline;
+	/* Percent */
+	double threshold = 10.0;
+	uint64_t minTimeNs = 250000000;
+};
+
+struct Canvas {
+	const char *name;
+	uint32_t width;
+	uint32_t height;
+};
+
+static constexpr Canvas kCanvases[] = {
+	{"720p", 1280, 720},  {"1080p", 1920, 1080}, {"1440p", 2560, 1440},
+	{"2160p", 3840, 2160}, {"4320p", 7680, 4320},
+};
+
+static void Usage()
+{
+	fprintf(stderr,
+		"Usage: kernel-bench [options]\n"
+		"\n"
+		"  --filter TEXT     Only run benchmarks containing TEXT\n"
+		"  --min-time MS     Time spent per benchmark (250)\n"
+		"  --output FILE     Write the results to FILE, not stdout\n"
+		"  --baseline FILE   Compare against the results in FILE\n"
+		"  --threshold PCT   Slowdown counted as a regression (10)\n");
+}
+
+/*
+ * Runner
+ */
+
+struct Result {
+	string name;
+	uint64_t iterations = 0;
+	double nsPerOp = 0.0;
+	double minNsPerOp = 0.0;
+};
+
+/* Returns something derived from the work so it is not optimized out */
+using Kernel = function<size_t()>;
+
+class Runner {
+public:
+	explicit Runner(const Options &opts) : opts(opts) {}
+
+	void Run(const string &name, const Kernel &kernel);
+	const vector<Result> &Results() const { return results; }
+
+private:
+	static uint64_t Time(const Kernel &kernel, uint64_t iterations);
+
+	const Options &opts;
+	vector<Result> results;
+};
+
+uint64_t Runner::Time(const Kernel &kernel, uint64_t iterations)
+{
+	size_t sink = 0;
+	uint64_t start = os_gettime_ns();
+
+	for (uint64_t i = 0; i < iterations; i++)
+		sink += kernel();
+
+	uint64_t elapsed = os_gettime_ns() - start;
+
+	/* Keep the results alive */
+	volatile size_t keep = sink;
+	(void)keep;
+
+	return max<uint64_t>(elapsed, 1);
+}
+
+void Runner::Run(const string &name, const Kernel &kernel)
+{
+	if (!opts.filter.empty() && name.find(opts.filter) == string::npos)
+		return;
+
+	/* Grow the batch until it fills its share of the time, this also
+	 * warms up caches and allocations. */
+	const uint64_t batch_ns = opts.minTimeNs / kRepeats;
+	uint64_t iterations = 1;
+	uint64_t elapsed;
+
+	while ((elapsed = Time(kernel, iterations)) < batch_ns) {
+		double scale = (double)batch_ns / (double)elapsed;
+		iterations = max<uint64_t>(
+			iterations + 1, (uint64_t)((double)iterations *
+						   min(scale * 1.2, 10.0)));
+	}
+
+	vector<double> per_op;
+	for (int i = 0; i < kRepeats; i++)
+		per_op.push_back((double)Time(kernel, iterations) /
+				 (double)iterations);
+
+	sort(per_op.begin(), per_op.end());
+
+	Result result;
+	result.name = name;
+	result.iterations = iterations;
+	result.nsPerOp = per_op[per_op.size() / 2];
+	result.minNsPerOp = per_op.front();
+	results.push_back(result);
+
+	fprintf(stderr, "%-48s %14.1f ns/op\n", name.c_str(), result.nsPerOp);
+}
+
+/*
+ * Benchmarks
+ */
+
+static const char *SmoothingName(RoiSmoothing type)
+{
+	switch (type) {
+	case RoiSmoothingNone:
+		return "none";
+	case RoiSmoothingInside:
+		return "inside";
+	case RoiSmoothingOutside:
+		return "outside";
+	case RoiSmoothingEdge:
+		return "edge";
+	}
+
+	return "unknown";
+}
+
+/* A region covering the middle quarter of the canvas */
+static obs_encoder_roi CenterRegion(const Canvas &canvas, float priority)
+{
+	return {canvas.height / 4, canvas.height * 3 / 4, canvas.width / 4,
+		canvas.width * 3 / 4, priority};
+}
+
+static void BenchSmoothing(Runner &runner, const Canvas &canvas)
+{
+	static constexpr RoiSmoothing kTypes[] = {
+		RoiSmoothingNone,
+		RoiSmoothingInside,
+		RoiSmoothingOutside,
+		RoiSmoothingEdge,
+	};
+	static constexpr int kSteps[] = {2, 8, 32};
+
+	const obs_encoder_roi roi = CenterRegion(canvas, 1.0f);
+
+	for (RoiSmoothing type : kTypes) {
+		for (int steps : kSteps) {
+			string name = string("SmoothROI/") +
+				      SmoothingName(type) + "/" +
+				      to_string(steps) + "/" + canvas.name;
+
+			/* Kept across iterations like the editor's vectors */
+			vector<obs_encoder_roi> regions;
+			runner.Run(name, [&]() {
+				regions.clear();
+				SmoothROI(regions, roi, type, steps, -0.5);
+				return regions.size();
+			});
+		}
+	}
+}
+
+static void BenchCenterFocus(Runner &runner, const Canvas &canvas)
+{
+	static constexpr int64_t kSteps[] = {4, 16};
+
+	vector<obs_encoder_roi> regions;
+
+	for (bool circle : {false, true}) {
+		for (int64_t steps : kSteps) {
+			string name = string("BuildInnerRegions/") +
+				      (circle ? "circle/" : "rect/") +
+				      to_string(steps) + "/" + canvas.name;
+			const int64_t radius = canvas.height * 2 / 5;
+
+			runner.Run(name, [&]() {
+				regions.clear();
+				BuildInnerRegions(regions, 1.0f, steps, radius,
+						  true, -1, -1, circle,
+						  canvas.width, canvas.height);
+				return regions.size();
+			});
+		}
+	}
+
+	for (int64_t steps : kSteps) {
+		string name = "BuildOuterRegions/" + to_string(steps) + "/" +
+			      canvas.name;
+		const int64_t radius = canvas.height / 4;
+
+		runner.Run(name, [&]() {
+			regions.clear();
+			BuildOuterRegions(regions, -1.0f, steps, radius, true,
+					  canvas.width, canvas.height);
+			return regions.size();
+		});
+	}
+}
+
+/* Box transforms of a few scene items, scaled and rotated around */
+static vector<matrix4> ItemTransforms(const Canvas &canvas)
+{
+	vector<matrix4> transforms;
+
+	for (int i = 0; i < 16; i++) {
+		matrix4 transform;
+		matrix4_identity(&transform);
+		matrix4_scale3f(&transform, &transform,
+				(float)canvas.width / (3.0f + (float)i / 4.0f),
+				(float)canvas.height / (3.0f + (float)i / 4.0f),
+				1.0f);
+		matrix4_rotate_aa4f(&transform, &transform, 0.0f, 0.0f, 1.0f,
+				    RAD((float)(i * 15)));
+		matrix4_translate3f(&transform, &transform,
+				    (float)canvas.width / 2.0f,
+				    (float)canvas.height / 2.0f, 0.0f);
+		transforms.push_back(transform);
+	}
+
+	return transforms;
+}
+
+static void BenchItemTransform(Runner &runner, const Canvas &canvas)
+{
+	const vector<matrix4> transforms = ItemTransforms(canvas);
+	size_t idx = 0;
+
+	runner.Run(string("BoxTransformToRegion/") + canvas.name, [&]() {
+		const matrix4 &box = transforms[idx++ % transforms.size()];
+		obs_encoder_roi roi = BoxTransformToRegion(box, 0.0f);
+		return (size_t)(roi.right - roi.left);
+	});
+}
+
+/* The layers the editor's preview draws, painted on the CPU */
+static void BenchBlockMapping(Runner &runner, const Canvas &canvas)
+{
+	vector<obs_encoder_roi> regions;
+	SmoothROI(regions, CenterRegion(canvas, 1.0f), RoiSmoothingEdge, 8,
+		  0.0);
+	BuildInnerRegions(regions, 0.5f, 8, canvas.height / 3, true, -1, -1,
+			  true, canvas.width, canvas.height);
+	BuildOuterRegions(regions, -1.0f, 8, canvas.height / 4, true,
+			  canvas.width, canvas.height);
+
+	for (uint32_t block_size : {16u, 64u}) {
+		const uint32_t cols = (canvas.width + block_size - 1) /
+				      block_size;
+		const uint32_t rows = (canvas.height + block_size - 1) /
+				      block_size;
+		vector<float> blocks((size_t)cols * rows);
+
+		string name = "RegionToBlocks/" + to_string(block_size) + "/" +
+			      canvas.name;
+
+		runner.Run(name, [&]() {
+			fill(blocks.begin(), blocks.end(), 0.0f);
+
+			/* Back to front, the first region wins */
+			for (auto it = regions.rbegin(); it != regions.rend();
+			     ++it) {
+				RoiBlockRect rect =
+					RegionToBlocks(*it, block_size);
+				uint32_t right = min(rect.right, cols);
+				uint32_t bottom = min(rect.bottom, rows);
+
+				for (uint32_t y = rect.top; y < bottom; y++)
+					fill(blocks.begin() + y * cols +
+						     rect.left,
+					     blocks.begin() + y * cols + right,
+					     it->priority);
+			}
+
+			return (size_t)blocks[blocks.size() / 2];
+		});
+	}
+}
+
+static void BenchSourceFrame(Runner &runner, const Canvas &canvas)
+{
+	static constexpr struct {
+		const char *name;
+		AVPixelFormat format;
+	} kFormats[] = {
+		{"i420", AV_PIX_FMT_YUV420P},
+		{"nv12", AV_PIX_FMT_NV12},
+		{"p010", AV_PIX_FMT_P010LE},
+	};
+
+	for (const auto &format : kFormats) {
+		AVFrame *frame = av_frame_alloc();
+		frame->format = format.format;
+		frame->width = (int)canvas.width;
+		frame->height = (int)canvas.height;
+		frame->color_range = AVCOL_RANGE_MPEG;
+		frame->colorspace = AVCOL_SPC_BT709;
+		frame->color_trc = AVCOL_TRC_BT709;
+		frame->color_primaries = AVCOL_PRI_BT709;
+
+		if (av_frame_get_buffer(frame, 0) < 0) {
+			av_frame_free(&frame);
+			continue;
+		}
+
+		string name = string("AVFrameToSourceFrame/") + format.name +
+			      "/" + canvas.name;
+
+		runner.Run(name, [&]() {
+			obs_source_frame out;
+			AVFrameToSourceFrame(&out, frame, {1, 60});
+			return (size_t)out.linesize[0];
+		});
+
+		av_frame_free(&frame);
+	}
+}
+
+/*
+ * Output
+ */
+
+static bool WriteResults(const Options &opts, const vector<Result> &results)
+{
+	OBSDataAutoRelease data = obs_data_create();
+	OBSDataArrayAutoRelease arr = obs_data_array_create();
+
+	for (const Result &result : results) {
+		OBSDataAutoRelease item = obs_data_create();
+		obs_data_set_string(item, "name", result.name.c_str());
+		obs_data_set_int(item, "iterations",
+				 (long long)result.iterations);
+		obs_data_set_double(item, "ns_per_op", result.nsPerOp);
+		obs_data_set_double(item, "min_ns_per_op", result.minNsPerOp);
+		obs_data_array_push_back(arr, item);
+	}
+
+	obs_data_set_int(data, "min_time_ms",
+			 (long long)(opts.minTimeNs / 1000000));
+	obs_data_set_array(data, "benchmarks", arr);
+
+	const char *json = obs_data_get_json_pretty(data);
+
+	if (opts.output.empty()) {
+		puts(json);
+		return true;
+	}
+
+	if (!os_quick_write_utf8_file(opts.output.c_str(), json, strlen(json),
+				      false)) {
+		fprintf(stderr, "Could not write '%s'\n", opts.output.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+/* Returns the number of regressions, or -1 if the baseline is unusable */
+static int Compare(const Options &opts, const vector<Result> &results)
+{
+	OBSDataAutoRelease data =
+		obs_data_create_from_json_file(opts.baseline.c_str());
+	if (!data) {
+		fprintf(stderr, "Could not load '%s'\n", opts.baseline.c_str());
+		return -1;
+	}
+
+	map<string, double> baseline;
+	OBSDataArrayAutoRelease arr = obs_data_get_array(data, "benchmarks");
+	for (size_t idx = 0; idx < obs_data_array_count(arr); idx++) {
+		OBSDataAutoRelease item = obs_data_array_item(arr, idx);
+		baseline[obs_data_get_string(item, "name")] =
+			obs_data_get_double(item, "ns_per_op");
+	}
+
+	int regressions = 0;
+
+	fprintf(stderr, "\n%-48s %12s %12s %9s\n", "", "Baseline", "Current",
+		"Change");
+
+	for (const Result &result : results) {
+		auto it = baseline.find(result.name);
+		if (it == baseline.end() || it->second <= 0.0) {
+			fprintf(stderr, "%-48s %12s %12.1f\n",
+				result.name.c_str(), "-", result.nsPerOp);
+			continue;
+		}
+
+		double change = (result.nsPerOp / it->second - 1.0) * 100.0;
+		bool regressed = change > opts.threshold;
+		if (regressed)
+			regressions++;
+
+		fprintf(stderr, "%-48s %12.1f %12.1f %+8.1f%%%s\n",
+			result.name.c_str(), it->second, result.nsPerOp,
+			change, regressed ? "  REGRESSION" : "");
+	}
+
+	return regressions;
+}
+
+/*
+ * Main
+ */
+
+static bool ParseArgs(int argc, char **argv, Options &opts)
+{
+	for (int idx = 1; idx < argc; idx++) {
+		string arg = argv[idx];
+		const char *value = idx + 1 < argc ? argv[idx + 1] : nullptr;
+
+		if (!value)
+			return false;
+		idx++;
+
+		if (arg == "--filter") {
+			opts.filter = value;
+		} else if (arg == "--min-time") {
+			int ms = atoi(value);
+			if (ms <= 0)
+				return false;
+			opts.minTimeNs = (uint64_t)ms * 1000000;
+		} else if (arg == "--output") {
+			opts.output = value;
+		} else if (arg == "--baseline") {
+			opts.baseline = value;
+		} else if (arg == "--threshold") {
+			opts.threshold = atof(value);
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	Options opts;
+	if (!ParseArgs(argc, argv, opts)) {
+		Usage();
+		return 1;
+	}
+
+	Runner runner(opts);
+
+	for (const Canvas &canvas : kCanvases) {
+		BenchSmoothing(runner, canvas);
+		BenchCenterFocus(runner, canvas);
+		BenchItemTransform(runner, canvas);
+		BenchBlockMapping(runner, canvas);
+		BenchSourceFrame(runner, canvas);
+	}
+
+	if (!WriteResults(opts, runner.Results()))
+		return 1;
+
+	if (opts.baseline.empty())
+		return 0;
+
+	int regressions = Compare(opts, runner.Results());
+	if (regressions < 0)
+		return 1;
+
+	if (regressions)
+		fprintf(stderr,
+			"%d benchmark(s) regressed by more than %.1f%%\n",
+			regressions, opts.threshold);
+
+	return regressions ? 2 : 0;
+}
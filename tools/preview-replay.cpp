@@ -0,0 +1,687 @@
+/* Headless harness for the encoder preview's decode path.
+ *
+ * "record" encodes a raw clip with libx264 or libsvtav1 into a packet trace,
+ * the same format the preview writes when capturing packet traces. "play"
+ * feeds a trace through the decoder setup the preview uses, either as fast
+ * as possible or paced by the packets' timestamps, and reports decode
+ * throughput, latency from sending a packet to getting its frame back and
+ * how many frame buffers had to be allocated. With --netsim the packets go
+ * through the preview's network simulation first, which reports how often
+ * the stream dropped out and whether it recovered. */
+
+#include "clip.hpp"
+#include "encoder-preview-ff-glue.hpp"
+#include "encoder-preview-netsim.hpp"
+#include "encoder-preview-packet-trace.hpp"
+
+#include <util/platform.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+using namespace std;
+
+struct Options {
+	string mode;
+	string input;
+	string output;
+
+	/* record */
+	string codec = "h264";
+	uint32_t width = 0;
+	uint32_t height = 0;
+	AVRational fps = {60, 1};
+	int bitrate = 6000;
+	int keyint = 0;
+	int frames = 0;
+	string preset;
+
+	/* play */
+	bool realtime = false;
+	int loops = 1;
+	/* kbps, 0 sends every packet straight to the decoder */
+	int netsim = 0;
+};
+
+static void Usage()
+{
+	fprintf(stderr,
+		"Usage: preview-replay record [options] <clip> <out.obspkt>\n"
+		"       preview-replay play [options] <trace.obspkt>\n"
+		"\n"
+		"record:\n"
+		"  --codec NAME     h264 (libx264) or av1 (libsvtav1) (h264)\n"
+		"  --size WxH       Size of raw .yuv input (I420)\n"
+		"  --fps N[/D]      Frame rate of raw .yuv input (60)\n"
+		"  --bitrate KBPS   CBR bitrate (6000)\n"
+		"  --keyint N       Keyframe interval in frames (2 seconds)\n"
+		"  --preset NAME    Encoder preset (encoder default)\n"
+		"  --frames N       Only encode the first N frames\n"
+		"\n"
+		"play:\n"
+		"  --realtime       Send packets at their original pace\n"
+		"  --loops N        Play the trace N times (1)\n"
+		"  --netsim KBPS    Send packets over a simulated link (off)\n");
+}
+
+/*
+ * Recording
+ */
+
+static const char *EncoderName(const string &codec)
+{
+	if (codec == "h264")
+		return "libx264";
+	if (codec == "av1")
+		return "libsvtav1";
+
+	return nullptr;
+}
+
+static bool WritePackets(AVCodecContext *encoder, AVPacket *packet,
+			 PacketTraceWriter &trace, uint64_t &written)
+{
+	const AVRational usec = {1, 1000000};
+
+	for (;;) {
+		int ret = avcodec_receive_packet(encoder, packet);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return true;
+		if (ret < 0)
+			return false;
+
+		/* Like OBS hands them out, timestamps in frames */
+		encoder_packet pkt = {};
+		pkt.type = OBS_ENCODER_VIDEO;
+		pkt.data = packet->data;
+		pkt.size = (size_t)packet->size;
+		pkt.pts = packet->pts;
+		pkt.dts = packet->dts;
+		pkt.timebase_num = encoder->time_base.num;
+		pkt.timebase_den = encoder->time_base.den;
+		pkt.keyframe = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+		pkt.dts_usec = av_rescale_q(packet->dts, encoder->time_base,
+					    usec);
+		pkt.sys_dts_usec = pkt.dts_usec;
+
+		bool ok = trace.Write(pkt);
+		av_packet_unref(packet);
+		if (!ok)
+			return false;
+
+		written++;
+	}
+}
+
+static bool Record(const Options &opts)
+{
+	const char *name = EncoderName(opts.codec);
+	const AVCodec *codec = name ? avcodec_find_encoder_by_name(name)
+				    : nullptr;
+	if (!codec) {
+		fprintf(stderr, "No encoder for codec '%s'\n",
+			opts.codec.c_str());
+		return false;
+	}
+
+	Clip clip;
+	if (!clip.Open(opts.input, opts.width, opts.height, opts.fps))
+		return false;
+
+	const AVRational fps = clip.Fps();
+	const int64_t bitrate = (int64_t)opts.bitrate * 1000;
+
+	AVCodecContext *encoder = avcodec_alloc_context3(codec);
+	encoder->width = (int)clip.Width();
+	encoder->height = (int)clip.Height();
+	encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+	encoder->time_base = av_inv_q(fps);
+	encoder->framerate = fps;
+	encoder->gop_size = opts.keyint ? opts.keyint
+					: (int)(2 * av_q2d(fps) + 0.5);
+	encoder->bit_rate = bitrate;
+	encoder->rc_max_rate = bitrate;
+	encoder->rc_buffer_size = (int)bitrate;
+	/* Headers go into the extra data like with OBS's encoders */
+	encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if (!opts.preset.empty())
+		av_opt_set(encoder->priv_data, "preset", opts.preset.c_str(),
+			   0);
+
+	if (avcodec_open2(encoder, codec, nullptr) < 0) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		avcodec_free_context(&encoder);
+		return false;
+	}
+
+	PacketTraceInfo info;
+	info.codec = opts.codec;
+	info.width = clip.Width();
+	info.height = clip.Height();
+	info.format = VIDEO_FORMAT_I420;
+	if (encoder->extradata_size > 0)
+		info.extra_data.assign(encoder->extradata,
+				       encoder->extradata +
+					       encoder->extradata_size);
+
+	PacketTraceWriter trace;
+	bool success = trace.Open(opts.output, info);
+
+	AVPacket *packet = av_packet_alloc();
+	AVFrame *frame = av_frame_alloc();
+	uint64_t written = 0;
+	int64_t pts = 0;
+
+	for (; success && (!opts.frames || pts < opts.frames); pts++) {
+		/* The encoder may still reference the previous buffers */
+		av_frame_unref(frame);
+		frame->format = AV_PIX_FMT_YUV420P;
+		frame->width = (int)clip.Width();
+		frame->height = (int)clip.Height();
+
+		if (av_frame_get_buffer(frame, 0) < 0 || !clip.Read(frame))
+			break;
+
+		frame->pts = pts;
+		success = avcodec_send_frame(encoder, frame) >= 0 &&
+			  WritePackets(encoder, packet, trace, written);
+	}
+
+	/* Drain */
+	success = success && avcodec_send_frame(encoder, nullptr) >= 0 &&
+		  WritePackets(encoder, packet, trace, written);
+
+	trace.Close();
+	av_frame_free(&frame);
+	av_packet_free(&packet);
+	avcodec_free_context(&encoder);
+
+	if (!success) {
+		fprintf(stderr, "Encoding failed\n");
+		return false;
+	}
+
+	printf("Wrote %" PRIu64 " packets of %" PRId64 " frames to '%s'\n",
+	       written, pts, opts.output.c_str());
+	return true;
+}
+
+/*
+ * Playback
+ */
+
+struct PlayStats {
+	uint64_t packets = 0;
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	uint64_t wallNs = 0;
+	uint64_t sendNs = 0;
+	uint64_t receiveNs = 0;
+	uint64_t convertNs = 0;
+
+	/* Send to frame, per frame */
+	vector<uint64_t> latencies;
+
+	uint64_t prewarmAllocations = 0;
+	uint64_t allocations = 0;
+	/* After the second keyframe, when the pool should have settled */
+	uint64_t steadyAllocations = 0;
+
+	/* --netsim, an outage lasts from a dropped packet to the next one
+	 * that made it */
+	uint64_t netDelivered = 0;
+	uint64_t netDropped = 0;
+	uint64_t netDroppedKeyframes = 0;
+	uint64_t outages = 0;
+	uint64_t recovered = 0;
+	int64_t longestOutageUsec = 0;
+};
+
+class Player {
+public:
+	Player(const Options &opts, PacketTraceReader &trace)
+		: opts(opts),
+		  trace(trace)
+	{
+	}
+	~Player();
+
+	bool Run(PlayStats &stats);
+
+private:
+	bool Open();
+	bool Forward(encoder_packet &pkt);
+	bool Send(const encoder_packet &pkt);
+	bool Receive();
+	bool Drain();
+	uint64_t Allocations() const;
+
+	void Arrived(packet &&pkt);
+	bool Settle();
+	void CountOutages();
+
+	const Options &opts;
+	PacketTraceReader &trace;
+
+	AVCodecContext *ctx = nullptr;
+	AVFrame *decoded = nullptr;
+	AVRational timeBase = {0, 1};
+
+	/* Send time by PTS of packets whose frames are still in the decoder */
+	unordered_map<int64_t, uint64_t> sent;
+	uint64_t keyframes = 0;
+	uint64_t steadyStart = 0;
+
+	/* Decoding happens on the simulator's thread while it runs */
+	std::unique_ptr<NetworkSimulator> network;
+	std::mutex netMutex;
+	std::condition_variable netCond;
+	/* DTS and keyframe flag of every packet pushed this loop */
+	vector<pair<int64_t, bool>> pushed;
+	unordered_set<int64_t> arrived;
+	bool netOk = true;
+
+	PlayStats *stats = nullptr;
+};
+
+Player::~Player()
+{
+	/* Stops the simulator's thread before it can touch the decoder */
+	network.reset();
+	DestroyCodecContext(&ctx);
+	av_frame_free(&decoded);
+}
+
+uint64_t Player::Allocations() const
+{
+	return static_cast<FramePool *>(ctx->opaque)->Allocations();
+}
+
+bool Player::Open()
+{
+	const PacketTraceInfo &info = trace.Info();
+
+	if (!CreateCodecContext(&ctx, info.codec.c_str(), (int)info.width,
+				(int)info.height, info.format)) {
+		fprintf(stderr, "No decoder for codec '%s'\n",
+			info.codec.c_str());
+		return false;
+	}
+
+	vector<uint8_t> extra_data = info.extra_data;
+	extra_data.resize(extra_data.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+	SendExtraData(ctx, extra_data.data(), info.extra_data.size());
+
+	decoded = av_frame_alloc();
+	stats->prewarmAllocations = Allocations();
+
+	if (opts.netsim > 0) {
+		network = make_unique<NetworkSimulator>(
+			[this](packet &&pkt) { Arrived(std::move(pkt)); });
+
+		NetworkSimulator::Config config;
+		config.bandwidth = (uint32_t)opts.netsim;
+		network->SetConfig(config);
+	}
+	return true;
+}
+
+bool Player::Forward(encoder_packet &pkt)
+{
+	if (!network)
+		return Send(pkt);
+
+	pushed.emplace_back(pkt.dts_usec, pkt.keyframe);
+	network->Push(packet(&pkt));
+
+	lock_guard lock(netMutex);
+	return netOk;
+}
+
+bool Player::Send(const encoder_packet &pkt)
+{
+	timeBase = {pkt.timebase_num, pkt.timebase_den};
+
+	if (pkt.keyframe && ++keyframes == 2)
+		steadyStart = Allocations();
+
+	uint64_t start = os_gettime_ns();
+	sent[pkt.pts] = start;
+	bool ok = SendPacket(ctx, &pkt);
+	stats->sendNs += os_gettime_ns() - start;
+
+	stats->packets++;
+	stats->bytes += pkt.size;
+
+	return ok && Receive();
+}
+
+bool Player::Receive()
+{
+	for (;;) {
+		uint64_t start = os_gettime_ns();
+		bool got = ReceiveFrame(ctx, decoded);
+		uint64_t received = os_gettime_ns();
+		stats->receiveNs += received - start;
+
+		if (!got)
+			return true;
+
+		auto it = sent.find(decoded->pts);
+		if (it != sent.end()) {
+			stats->latencies.push_back(received - it->second);
+			sent.erase(it);
+		}
+
+		/* What the preview does before handing frames to libobs */
+		obs_source_frame frame;
+		AVFrameToSourceFrame(&frame, decoded, timeBase);
+		stats->convertNs += os_gettime_ns() - received;
+
+		av_frame_unref(decoded);
+		stats->frames++;
+	}
+}
+
+void Player::Arrived(packet &&pkt)
+{
+	bool ok = Send(pkt.m_pkt);
+
+	lock_guard lock(netMutex);
+	arrived.insert(pkt.m_pkt.dts_usec);
+	netOk = netOk && ok;
+	netCond.notify_one();
+}
+
+/* The link only moves on with the next packet, whatever is still queued on
+ * the sender side at the end of the trace never arrives. Everything that
+ * left goes to the decoder right away though, the trace's timestamps are
+ * all in the past as far as the simulator is concerned. */
+bool Player::Settle()
+{
+	NetworkSimulator::Stats net = network->TakeStats();
+
+	{
+		unique_lock lock(netMutex);
+		netCond.wait(lock, [&] {
+			return !netOk || arrived.size() >= net.delivered;
+		});
+	}
+
+	network->Stop();
+
+	stats->netDelivered += net.delivered;
+	stats->netDropped += net.dropped;
+	CountOutages();
+
+	pushed.clear();
+	arrived.clear();
+	return netOk;
+}
+
+void Player::CountOutages()
+{
+	bool out = false;
+	int64_t outage_start = 0;
+
+	for (auto &[dts_usec, keyframe] : pushed) {
+		if (!arrived.count(dts_usec)) {
+			if (!out) {
+				outage_start = dts_usec;
+				stats->outages++;
+				out = true;
+			}
+			if (keyframe)
+				stats->netDroppedKeyframes++;
+			continue;
+		}
+
+		if (out) {
+			stats->recovered++;
+			stats->longestOutageUsec =
+				std::max(stats->longestOutageUsec,
+					 dts_usec - outage_start);
+			out = false;
+		}
+	}
+}
+
+bool Player::Drain()
+{
+	if (avcodec_send_packet(ctx, nullptr) < 0)
+		return false;
+
+	bool ok = Receive();
+	avcodec_flush_buffers(ctx);
+	sent.clear();
+	return ok;
+}
+
+bool Player::Run(PlayStats &play_stats)
+{
+	stats = &play_stats;
+
+	if (!Open())
+		return false;
+
+	encoder_packet pkt;
+	uint64_t start = os_gettime_ns();
+
+	for (int loop = 0; loop < opts.loops; loop++) {
+		uint64_t loop_start = os_gettime_ns();
+		int64_t first_usec = 0;
+
+		if (network)
+			network->Start(trace.Info().codec.c_str());
+
+		for (size_t idx = 0; idx < trace.Count(); idx++) {
+			if (!trace.Read(idx, pkt)) {
+				fprintf(stderr, "Failed to read packet %zu\n",
+					idx);
+				return false;
+			}
+
+			if (!idx)
+				first_usec = pkt.dts_usec;
+
+			int64_t offset = pkt.dts_usec - first_usec;
+			if (opts.realtime && offset > 0)
+				os_sleepto_ns(loop_start +
+					      (uint64_t)offset * 1000);
+
+			if (!Forward(pkt)) {
+				fprintf(stderr, "Decoding packet %zu failed\n",
+					idx);
+				return false;
+			}
+		}
+
+		if (network && !Settle()) {
+			fprintf(stderr, "Decoding failed\n");
+			return false;
+		}
+		if (!Drain())
+			return false;
+	}
+
+	stats->wallNs = os_gettime_ns() - start;
+	stats->allocations = Allocations();
+	stats->steadyAllocations = keyframes >= 2 ? Allocations() - steadyStart
+						  : 0;
+	return true;
+}
+
+static double Percentile(vector<uint64_t> &values, double fraction)
+{
+	if (values.empty())
+		return 0.0;
+
+	size_t idx = (size_t)(fraction * (double)(values.size() - 1));
+	nth_element(values.begin(), values.begin() + idx, values.end());
+	return (double)values[idx] / 1e6;
+}
+
+static void Report(const Options &opts, const PacketTraceInfo &info,
+		   PlayStats &stats)
+{
+	auto per_frame = [&](uint64_t ns) {
+		return stats.frames ? (double)ns / 1e6 / (double)stats.frames
+				    : 0.0;
+	};
+
+	double seconds = (double)stats.wallNs / 1e9;
+
+	printf("Trace: %s %ux%u, %" PRIu64 " packets, %.1f MiB\n",
+	       info.codec.c_str(), info.width, info.height, stats.packets,
+	       (double)stats.bytes / 1048576.0);
+	printf("Decoded %" PRIu64 " frames in %.2f s: %.1f fps (%s)\n",
+	       stats.frames, seconds,
+	       seconds > 0.0 ? (double)stats.frames / seconds : 0.0,
+	       opts.realtime ? "real time" : "max speed");
+	printf("Per frame: send %.3f ms, receive %.3f ms, convert %.3f ms\n",
+	       per_frame(stats.sendNs), per_frame(stats.receiveNs),
+	       per_frame(stats.convertNs));
+
+	vector<uint64_t> &lat = stats.latencies;
+	uint64_t max_lat = lat.empty() ? 0
+				       : *max_element(lat.begin(), lat.end());
+	printf("Send to frame: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+	       "max %.3f ms\n",
+	       Percentile(lat, 0.5), Percentile(lat, 0.9),
+	       Percentile(lat, 0.99), (double)max_lat / 1e6);
+
+	printf("Frame pool: %" PRIu64 " buffers allocated (%" PRIu64
+	       " up front, %" PRIu64 " after the first GOP)\n",
+	       stats.allocations, stats.prewarmAllocations,
+	       stats.steadyAllocations);
+
+	if (opts.netsim <= 0)
+		return;
+
+	printf("Network: %d kbps, %" PRIu64 " packets delivered, %" PRIu64
+	       " dropped (%" PRIu64 " keyframes)\n",
+	       opts.netsim, stats.netDelivered, stats.netDropped,
+	       stats.netDroppedKeyframes);
+	printf("Outages: %" PRIu64 ", %" PRIu64 " recovered, longest "
+	       "%.1f ms\n",
+	       stats.outages, stats.recovered,
+	       (double)stats.longestOutageUsec / 1000.0);
+}
+
+static bool Play(const Options &opts)
+{
+	PacketTraceReader trace;
+	if (!trace.Open(opts.input)) {
+		fprintf(stderr, "Could not read '%s'\n", opts.input.c_str());
+		return false;
+	}
+
+	PlayStats stats;
+	Player player(opts, trace);
+	if (!player.Run(stats))
+		return false;
+
+	Report(opts, trace.Info(), stats);
+	return true;
+}
+
+/*
+ * Main
+ */
+
+static bool ParseArgs(int argc, char **argv, Options &opts)
+{
+	vector<string> positional;
+
+	for (int idx = 1; idx < argc; idx++) {
+		string arg = argv[idx];
+		const char *value = idx + 1 < argc ? argv[idx + 1] : nullptr;
+
+		if (arg.rfind("--", 0) != 0) {
+			positional.push_back(arg);
+			continue;
+		}
+
+		if (arg == "--realtime") {
+			opts.realtime = true;
+			continue;
+		}
+
+		if (!value)
+			return false;
+		idx++;
+
+		if (arg == "--codec") {
+			opts.codec = value;
+		} else if (arg == "--size") {
+			if (sscanf(value, "%ux%u", &opts.width,
+				   &opts.height) != 2)
+				return false;
+		} else if (arg == "--fps") {
+			opts.fps.den = 1;
+			if (sscanf(value, "%d/%d", &opts.fps.num,
+				   &opts.fps.den) < 1 ||
+			    opts.fps.num <= 0 || opts.fps.den <= 0)
+				return false;
+		} else if (arg == "--bitrate") {
+			opts.bitrate = atoi(value);
+		} else if (arg == "--keyint") {
+			opts.keyint = atoi(value);
+		} else if (arg == "--preset") {
+			opts.preset = value;
+		} else if (arg == "--frames") {
+			opts.frames = atoi(value);
+		} else if (arg == "--loops") {
+			opts.loops = atoi(value);
+		} else if (arg == "--netsim") {
+			opts.netsim = atoi(value);
+		} else {
+			return false;
+		}
+	}
+
+	if (positional.empty())
+		return false;
+
+	opts.mode = positional[0];
+
+	if (opts.mode == "record" && positional.size() == 3) {
+		opts.input = positional[1];
+		opts.output = positional[2];
+		return opts.bitrate > 0;
+	}
+	if (opts.mode == "play" && positional.size() == 2) {
+		opts.input = positional[1];
+		return opts.loops > 0;
+	}
+
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	Options opts;
+	if (!ParseArgs(argc, argv, opts)) {
+		Usage();
+		return 1;
+	}
+
+	bool success = opts.mode == "record" ? Record(opts) : Play(opts);
+	return success ? 0 : 1;
+}
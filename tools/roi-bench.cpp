@@ -0,0 +1,560 @@
+/* Offline benchmark for ROI configurations. Encodes a raw clip with libx264
+ * once without and once with the regions of a saved configuration, then
+ * compares bitrate, encoding speed and quality inside and outside of the
+ * regions. Only the luma plane is compared.
+ *
+ * The configuration is the "roi" object of a scene collection, or the whole
+ * scene collection file. Scene item regions need a running OBS to know where
+ * the items are and are skipped. */
+
+#include "clip.hpp"
+#include "encoder-preview-metrics.hpp"
+#include "roi-regions.hpp"
+
+#include <util/platform.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+using namespace std;
+
+static constexpr uint32_t kBlockSize = 16;
+static constexpr int kSsimWindow = 8;
+
+struct Options {
+	string input;
+	string config;
+	string scene;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	AVRational fps = {60, 1};
+	int bitrate = 6000;
+	int keyint = 0;
+	int frames = 0;
+	string preset = "veryfast";
+};
+
+static void Usage()
+{
+	fprintf(stderr,
+		"Usage: roi-bench [options] <clip.y4m|clip.yuv> <config.json>\n"
+		"\n"
+		"  --size WxH       Size of raw .yuv input (I420)\n"
+		"  --fps N[/D]      Frame rate of raw .yuv input (60)\n"
+		"  --scene NAME     Scene name or UUID to take the regions from\n"
+		"                   (first scene with regions)\n"
+		"  --bitrate KBPS   CBR bitrate like OBS's x264 (6000)\n"
+		"  --keyint N       Keyframe interval in frames (2 seconds)\n"
+		"  --preset NAME    x264 preset (veryfast)\n"
+		"  --frames N       Only encode the first N frames\n");
+}
+
+/*
+ * Regions
+ */
+
+/* Regions of the given scene, or of the first one that has any */
+static obs_data_array_t *FindRegions(obs_data_t *collection, obs_data_t *roi,
+				     const string &scene)
+{
+	OBSDataAutoRelease scenes = obs_data_get_obj(roi, "scenes");
+	if (!scenes)
+		return nullptr;
+
+	/* Regions are stored by UUID, a scene collection also has names */
+	string uuid = scene;
+	OBSDataArrayAutoRelease sources =
+		obs_data_get_array(collection, "sources");
+	for (size_t idx = 0; idx < obs_data_array_count(sources); idx++) {
+		OBSDataAutoRelease source = obs_data_array_item(sources, idx);
+		if (scene == obs_data_get_string(source, "name"))
+			uuid = obs_data_get_string(source, "uuid");
+	}
+
+	for (obs_data_item_t *item = obs_data_first(scenes); item;
+	     obs_data_item_next(&item)) {
+		if (!uuid.empty() && uuid != obs_data_item_get_name(item))
+			continue;
+
+		obs_data_array_t *arr = obs_data_item_get_array(item);
+		if (obs_data_array_count(arr)) {
+			obs_data_item_release(&item);
+			return arr;
+		}
+
+		obs_data_array_release(arr);
+	}
+
+	return nullptr;
+}
+
+static bool LoadRegions(const Options &opts, uint32_t width, uint32_t height,
+			vector<obs_encoder_roi> &regions)
+{
+	OBSDataAutoRelease collection =
+		obs_data_create_from_json_file(opts.config.c_str());
+	if (!collection) {
+		fprintf(stderr, "Could not load '%s'\n", opts.config.c_str());
+		return false;
+	}
+
+	OBSDataAutoRelease roi = obs_data_get_obj(collection, "roi");
+	obs_data_t *config = roi ? roi.Get() : collection.Get();
+
+	OBSDataArrayAutoRelease arr =
+		FindRegions(collection, config, opts.scene);
+	if (!arr) {
+		fprintf(stderr, "No regions found for scene '%s'\n",
+			opts.scene.c_str());
+		return false;
+	}
+
+	vector<OBSDataAutoRelease> settings;
+	size_t skipped = 0;
+
+	for (size_t idx = 0; idx < obs_data_array_count(arr); idx++) {
+		obs_data_t *data = obs_data_array_item(arr, idx);
+		if (obs_data_get_int(data, "type") == RoiRegionSceneItem &&
+		    obs_data_get_bool(data, "enabled"))
+			skipped++;
+
+		settings.emplace_back(data);
+	}
+
+	if (skipped)
+		fprintf(stderr, "Skipping %zu scene item region(s)\n", skipped);
+
+	regions = CompileRegions(settings, width, height);
+	if (regions.empty()) {
+		fprintf(stderr, "The regions are empty at %ux%u\n", width,
+			height);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Encoding
+ */
+
+struct PassResult {
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	uint64_t encodeNs = 0;
+
+	/* Indexed by whether samples are inside the regions */
+	uint64_t sse[2] = {};
+	uint64_t samples[2] = {};
+	double ssim[2] = {};
+	uint64_t windows[2] = {};
+};
+
+class Pass {
+public:
+	Pass(const Options &opts, Clip &clip,
+	     const vector<obs_encoder_roi> &regions, bool roi)
+		: opts(opts),
+		  clip(clip),
+		  regions(regions),
+		  roi(roi)
+	{
+	}
+	~Pass();
+
+	bool Run(PassResult &result);
+
+private:
+	bool Open();
+	bool AttachRegions(AVFrame *frame);
+	bool Encode(AVFrame *frame);
+	bool Decode(const AVPacket *pkt);
+	void Compare(const uint8_t *raw, const AVFrame *decoded);
+
+	const Options &opts;
+	Clip &clip;
+	const vector<obs_encoder_roi> &regions;
+	const bool roi;
+
+	AVCodecContext *encoder = nullptr;
+	AVCodecContext *decoder = nullptr;
+	AVPacket *packet = nullptr;
+	AVFrame *decoded = nullptr;
+
+	/* Raw luma until the decoded frame comes back, keyed by PTS */
+	map<int64_t, vector<uint8_t>> pending;
+	vector<uint8_t> mask;
+	PassResult *result = nullptr;
+};
+
+Pass::~Pass()
+{
+	avcodec_free_context(&encoder);
+	avcodec_free_context(&decoder);
+	av_packet_free(&packet);
+	av_frame_free(&decoded);
+}
+
+bool Pass::Open()
+{
+	const AVCodec *x264 = avcodec_find_encoder_by_name("libx264");
+	const AVCodec *h264 = avcodec_find_decoder(AV_CODEC_ID_H264);
+	if (!x264 || !h264) {
+		fprintf(stderr, "FFmpeg was built without libx264\n");
+		return false;
+	}
+
+	const AVRational fps = clip.Fps();
+	const int64_t bitrate = (int64_t)opts.bitrate * 1000;
+
+	encoder = avcodec_alloc_context3(x264);
+	encoder->width = (int)clip.Width();
+	encoder->height = (int)clip.Height();
+	encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+	encoder->time_base = av_inv_q(fps);
+	encoder->framerate = fps;
+	encoder->gop_size = opts.keyint ? opts.keyint
+					: (int)(2 * av_q2d(fps) + 0.5);
+
+	/* Same as OBS's x264 in CBR mode */
+	encoder->bit_rate = bitrate;
+	encoder->rc_max_rate = bitrate;
+	encoder->rc_min_rate = bitrate;
+	encoder->rc_buffer_size = (int)bitrate;
+	av_opt_set(encoder->priv_data, "preset", opts.preset.c_str(), 0);
+	av_opt_set(encoder->priv_data, "nal-hrd", "cbr", 0);
+
+	if (avcodec_open2(encoder, x264, nullptr) < 0) {
+		fprintf(stderr, "Failed to open libx264\n");
+		return false;
+	}
+
+	decoder = avcodec_alloc_context3(h264);
+	if (avcodec_open2(decoder, h264, nullptr) < 0) {
+		fprintf(stderr, "Failed to open the H.264 decoder\n");
+		return false;
+	}
+
+	packet = av_packet_alloc();
+	decoded = av_frame_alloc();
+
+	/* Like the preview's quality analysis, per block by its center */
+	const uint32_t cols = (clip.Width() + kBlockSize - 1) / kBlockSize;
+	const uint32_t rows = (clip.Height() + kBlockSize - 1) / kBlockSize;
+	RegionMask(regions, cols, rows, kBlockSize, mask);
+
+	return true;
+}
+
+bool Pass::AttachRegions(AVFrame *frame)
+{
+	AVFrameSideData *side = av_frame_new_side_data(
+		frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+		regions.size() * sizeof(AVRegionOfInterest));
+	if (!side)
+		return false;
+
+	auto *out = reinterpret_cast<AVRegionOfInterest *>(side->data);
+
+	/* Both take the first region containing a block, positive priority
+	 * means better quality, i.e. a negative quantizer offset. */
+	for (const obs_encoder_roi &region : regions) {
+		out->self_size = sizeof(AVRegionOfInterest);
+		out->top = (int)region.top;
+		out->bottom = (int)region.bottom;
+		out->left = (int)region.left;
+		out->right = (int)region.right;
+		out->qoffset = av_d2q(-region.priority, 1000);
+		out++;
+	}
+
+	return true;
+}
+
+bool Pass::Run(PassResult &pass_result)
+{
+	result = &pass_result;
+
+	if (!Open() || !clip.Rewind())
+		return false;
+
+	AVFrame *frame = av_frame_alloc();
+	bool success = true;
+
+	for (int64_t pts = 0; !opts.frames || pts < opts.frames; pts++) {
+		/* The encoder may still reference the previous buffers */
+		av_frame_unref(frame);
+		frame->format = AV_PIX_FMT_YUV420P;
+		frame->width = (int)clip.Width();
+		frame->height = (int)clip.Height();
+
+		if (av_frame_get_buffer(frame, 0) < 0 || !clip.Read(frame))
+			break;
+
+		frame->pts = pts;
+		if (roi && !AttachRegions(frame)) {
+			success = false;
+			break;
+		}
+
+		vector<uint8_t> &luma = pending[pts];
+		luma.resize((size_t)clip.Width() * clip.Height());
+		for (uint32_t y = 0; y < clip.Height(); y++)
+			memcpy(luma.data() + (size_t)y * clip.Width(),
+			       frame->data[0] + (size_t)y * frame->linesize[0],
+			       clip.Width());
+
+		if (!Encode(frame)) {
+			success = false;
+			break;
+		}
+
+		result->frames++;
+	}
+
+	av_frame_free(&frame);
+
+	return success && Encode(nullptr) && Decode(nullptr);
+}
+
+bool Pass::Encode(AVFrame *frame)
+{
+	uint64_t start = os_gettime_ns();
+
+	if (avcodec_send_frame(encoder, frame) < 0)
+		return false;
+
+	for (;;) {
+		int ret = avcodec_receive_packet(encoder, packet);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			break;
+		if (ret < 0)
+			return false;
+
+		result->encodeNs += os_gettime_ns() - start;
+		result->bytes += (uint64_t)packet->size;
+
+		bool decoded_ok = Decode(packet);
+		av_packet_unref(packet);
+		if (!decoded_ok)
+			return false;
+
+		start = os_gettime_ns();
+	}
+
+	result->encodeNs += os_gettime_ns() - start;
+	return true;
+}
+
+bool Pass::Decode(const AVPacket *pkt)
+{
+	if (avcodec_send_packet(decoder, pkt) < 0)
+		return false;
+
+	for (;;) {
+		int ret = avcodec_receive_frame(decoder, decoded);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return true;
+		if (ret < 0)
+			return false;
+
+		auto it = pending.find(decoded->best_effort_timestamp);
+		if (it != pending.end()) {
+			Compare(it->second.data(), decoded);
+			pending.erase(it);
+		}
+
+		av_frame_unref(decoded);
+	}
+}
+
+void Pass::Compare(const uint8_t *raw, const AVFrame *frame)
+{
+	const uint32_t width = clip.Width();
+	const uint32_t height = clip.Height();
+	const uint32_t cols = (width + kBlockSize - 1) / kBlockSize;
+	const uint32_t rows = (height + kBlockSize - 1) / kBlockSize;
+	const int stride = frame->linesize[0];
+
+	for (uint32_t row = 0; row < rows; row++) {
+		for (uint32_t col = 0; col < cols; col++) {
+			const uint32_t x = col * kBlockSize;
+			const uint32_t y = row * kBlockSize;
+			const int bw = (int)std::min(kBlockSize, width - x);
+			const int bh = (int)std::min(kBlockSize, height - y);
+			const int inside = mask[row * cols + col];
+
+			const uint8_t *a = raw + (size_t)y * width + x;
+			const uint8_t *b = frame->data[0] +
+					   (size_t)y * (size_t)stride + x;
+
+			result->sse[inside] +=
+				BlockSSE(a, (int)width, b, stride, bw, bh);
+			result->samples[inside] += (uint64_t)(bw * bh);
+
+			for (int wy = 0; wy + kSsimWindow <= bh;
+			     wy += kSsimWindow) {
+				for (int wx = 0; wx + kSsimWindow <= bw;
+				     wx += kSsimWindow) {
+					SsimStats stats = WindowSsimStats(
+						a + (size_t)wy * width + wx,
+						(int)width,
+						b + (size_t)wy * stride + wx,
+						stride);
+					result->ssim[inside] += SsimFromStats(
+						stats,
+						kSsimWindow * kSsimWindow);
+					result->windows[inside]++;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Report
+ */
+
+static void PrintRow(const char *name, double off, double on, int precision)
+{
+	printf("%-16s %12.*f %12.*f %+12.*f\n", name, precision, off,
+	       precision, on, precision, on - off);
+}
+
+static void Report(const Clip &clip, const PassResult &off,
+		   const PassResult &on)
+{
+	auto kbps = [&](const PassResult &pass) {
+		double seconds = (double)pass.frames / av_q2d(clip.Fps());
+		return seconds > 0.0 ? (double)pass.bytes * 8.0 / seconds / 1e3
+				     : 0.0;
+	};
+	auto fps = [](const PassResult &pass) {
+		return pass.encodeNs ? (double)pass.frames /
+					       ((double)pass.encodeNs / 1e9)
+				     : 0.0;
+	};
+	auto psnr = [](const PassResult &pass, int inside) {
+		return PsnrFromSSE(pass.sse[inside], pass.samples[inside]);
+	};
+	auto ssim = [](const PassResult &pass, int inside) {
+		return pass.windows[inside] ? pass.ssim[inside] /
+						      (double)pass.windows[inside]
+					    : 0.0;
+	};
+
+	uint64_t total = off.samples[0] + off.samples[1];
+	printf("%" PRIu64 " frames, %.1f%% of the picture inside regions\n\n",
+	       off.frames,
+	       total ? 100.0 * (double)off.samples[1] / (double)total : 0.0);
+
+	printf("%-16s %12s %12s %12s\n", "", "ROI off", "ROI on", "Change");
+	PrintRow("Bitrate (kbps)", kbps(off), kbps(on), 1);
+	PrintRow("Encode FPS", fps(off), fps(on), 1);
+	PrintRow("PSNR inside", psnr(off, 1), psnr(on, 1), 3);
+	PrintRow("PSNR outside", psnr(off, 0), psnr(on, 0), 3);
+	PrintRow("SSIM inside", ssim(off, 1), ssim(on, 1), 5);
+	PrintRow("SSIM outside", ssim(off, 0), ssim(on, 0), 5);
+}
+
+/*
+ * Main
+ */
+
+static bool ParseArgs(int argc, char **argv, Options &opts)
+{
+	vector<string> positional;
+
+	for (int idx = 1; idx < argc; idx++) {
+		string arg = argv[idx];
+		const char *value = idx + 1 < argc ? argv[idx + 1] : nullptr;
+
+		if (arg.rfind("--", 0) != 0) {
+			positional.push_back(arg);
+			continue;
+		}
+		if (!value)
+			return false;
+		idx++;
+
+		if (arg == "--size") {
+			if (sscanf(value, "%ux%u", &opts.width,
+				   &opts.height) != 2)
+				return false;
+		} else if (arg == "--fps") {
+			opts.fps.den = 1;
+			if (sscanf(value, "%d/%d", &opts.fps.num,
+				   &opts.fps.den) < 1 ||
+			    opts.fps.num <= 0 || opts.fps.den <= 0)
+				return false;
+		} else if (arg == "--scene") {
+			opts.scene = value;
+		} else if (arg == "--bitrate") {
+			opts.bitrate = atoi(value);
+		} else if (arg == "--keyint") {
+			opts.keyint = atoi(value);
+		} else if (arg == "--preset") {
+			opts.preset = value;
+		} else if (arg == "--frames") {
+			opts.frames = atoi(value);
+		} else {
+			return false;
+		}
+	}
+
+	if (positional.size() != 2 || opts.bitrate <= 0)
+		return false;
+
+	opts.input = positional[0];
+	opts.config = positional[1];
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	Options opts;
+	if (!ParseArgs(argc, argv, opts)) {
+		Usage();
+		return 1;
+	}
+
+	Clip clip;
+	if (!clip.Open(opts.input, opts.width, opts.height, opts.fps))
+		return 1;
+
+	vector<obs_encoder_roi> regions;
+	if (!LoadRegions(opts, clip.Width(), clip.Height(), regions))
+		return 1;
+
+	PassResult off, on;
+
+	Pass baseline(opts, clip, regions, false);
+	if (!baseline.Run(off)) {
+		fprintf(stderr, "Encoding without regions failed\n");
+		return 1;
+	}
+
+	Pass with_roi(opts, clip, regions, true);
+	if (!with_roi.Run(on)) {
+		fprintf(stderr, "Encoding with regions failed\n");
+		return 1;
+	}
+
+	if (!off.frames) {
+		fprintf(stderr, "No frames could be read\n");
+		return 1;
+	}
+
+	Report(clip, off, on);
+	return 0;
+}
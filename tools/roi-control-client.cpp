@@ -0,0 +1,273 @@
+/* Stand-in for an external ROI producer like a face tracker.
+ *
+ * Connects to the plugin's control socket and pushes a region that circles
+ * around the canvas, one message per frame at the given rate, then clears
+ * the pushed regions again so the editor's ones take over. Useful to check
+ * that the encoders follow along without the editor's UI being involved. */
+
+#include <util/platform.h>
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#if defined(_WIN32)
+using socket_t = SOCKET;
+static const socket_t kInvalidSocket = INVALID_SOCKET;
+
+static void CloseSocket(socket_t fd)
+{
+	closesocket(fd);
+}
+#else
+using socket_t = int;
+static const socket_t kInvalidSocket = -1;
+
+static void CloseSocket(socket_t fd)
+{
+	close(fd);
+}
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct Options {
+	string socket;
+	string scene;
+	int fps = 60;
+	double seconds = 10.0;
+	uint32_t width = 320;
+	uint32_t height = 240;
+	uint32_t canvasWidth = 1920;
+	uint32_t canvasHeight = 1080;
+	double priority = 0.8;
+};
+
+static void Usage()
+{
+	fprintf(stderr,
+		"Usage: roi-control-client [options]\n"
+		"\n"
+		"  --socket PATH    Control socket (the plugin's default)\n"
+		"  --scene NAME     Scene name or UUID (program scene)\n"
+		"  --fps N          Messages per second (60)\n"
+		"  --seconds N      How long to keep moving the region (10)\n"
+		"  --size WxH       Size of the region (320x240)\n"
+		"  --canvas WxH     Size of the scene (1920x1080)\n"
+		"  --priority P     Priority of the region, -1 to 1 (0.8)\n");
+}
+
+/* Same as RoiControl::SocketPath() */
+static string DefaultSocketPath()
+{
+	const char *path = getenv("OBS_ROI_UI_SOCKET");
+	if (path && *path)
+		return path;
+
+#if defined(_WIN32)
+	const char *dir = getenv("TEMP");
+	return string(dir ? dir : ".") + "\\obs-roi-ui.sock";
+#else
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	if (dir && *dir)
+		return string(dir) + "/obs-roi-ui.sock";
+
+	return "/tmp/obs-roi-ui-" + to_string(getuid()) + ".sock";
+#endif
+}
+
+static socket_t Connect(const string &path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long: %s\n", path.c_str());
+		return kInvalidSocket;
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	socket_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == kInvalidSocket)
+		return kInvalidSocket;
+
+	if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr,
+			"Failed to connect to %s, is \"Accept Regions from "
+			"Other Applications\" enabled?\n",
+			path.c_str());
+		CloseSocket(fd);
+		return kInvalidSocket;
+	}
+
+	return fd;
+}
+
+static bool Send(socket_t fd, const string &message)
+{
+	size_t sent = 0;
+	while (sent < message.size()) {
+		int size = (int)send(fd, message.data() + sent,
+				     (int)(message.size() - sent),
+				     MSG_NOSIGNAL);
+		if (size <= 0)
+			return false;
+		sent += (size_t)size;
+	}
+	return true;
+}
+
+/* Scene names are passed through as they are, quotes and backslashes
+ * escaped */
+static string SceneField(const string &scene)
+{
+	if (scene.empty())
+		return string();
+
+	string field = "\"scene\": \"";
+	for (char c : scene) {
+		if (c == '"' || c == '\\')
+			field += '\\';
+		field += c;
+	}
+	return field + "\", ";
+}
+
+static string RegionMessage(const Options &opts, double t)
+{
+	/* Around the center, touching the edges */
+	double range_x = (double)(opts.canvasWidth - opts.width) / 2.0;
+	double range_y = (double)(opts.canvasHeight - opts.height) / 2.0;
+	/* One lap every four seconds */
+	double angle = t * 2.0 * 3.14159265358979 / 4.0;
+
+	long x = lround(range_x + range_x * cos(angle));
+	long y = lround(range_y + range_y * sin(angle));
+
+	char region[256];
+	snprintf(region, sizeof(region),
+		 "{\"x\": %ld, \"y\": %ld, \"width\": %u, \"height\": %u, "
+		 "\"priority\": %.3f}",
+		 x, y, opts.width, opts.height, opts.priority);
+
+	return "{" + SceneField(opts.scene) + "\"regions\": [" + region +
+	       "]}\n";
+}
+
+static bool Run(const Options &opts)
+{
+	socket_t fd = Connect(opts.socket);
+	if (fd == kInvalidSocket)
+		return false;
+
+	const uint64_t interval = 1000000000ULL / (uint64_t)opts.fps;
+	const uint64_t start = os_gettime_ns();
+	const uint64_t frames = (uint64_t)(opts.seconds * opts.fps);
+	uint64_t sent = 0;
+	bool success = true;
+
+	for (; sent < frames; sent++) {
+		double t = (double)(sent * interval) / 1e9;
+		if (!Send(fd, RegionMessage(opts, t))) {
+			fprintf(stderr, "Connection lost after %" PRIu64
+					" messages\n",
+				sent);
+			success = false;
+			break;
+		}
+
+		os_sleepto_ns(start + (sent + 1) * interval);
+	}
+
+	if (success)
+		success = Send(fd, "{" + SceneField(opts.scene) +
+					   "\"clear\": true}\n");
+
+	double elapsed = (double)(os_gettime_ns() - start) / 1e9;
+	printf("Sent %" PRIu64 " updates in %.2f s (%.1f per second)\n", sent,
+	       elapsed, elapsed > 0.0 ? (double)sent / elapsed : 0.0);
+
+	CloseSocket(fd);
+	return success;
+}
+
+static bool ParseArgs(int argc, char **argv, Options &opts)
+{
+	for (int idx = 1; idx < argc; idx++) {
+		string arg = argv[idx];
+		const char *value = idx + 1 < argc ? argv[idx + 1] : nullptr;
+
+		if (!value)
+			return false;
+		idx++;
+
+		if (arg == "--socket") {
+			opts.socket = value;
+		} else if (arg == "--scene") {
+			opts.scene = value;
+		} else if (arg == "--fps") {
+			opts.fps = atoi(value);
+		} else if (arg == "--seconds") {
+			opts.seconds = atof(value);
+		} else if (arg == "--size") {
+			if (sscanf(value, "%ux%u", &opts.width,
+				   &opts.height) != 2)
+				return false;
+		} else if (arg == "--canvas") {
+			if (sscanf(value, "%ux%u", &opts.canvasWidth,
+				   &opts.canvasHeight) != 2)
+				return false;
+		} else if (arg == "--priority") {
+			opts.priority = atof(value);
+		} else {
+			return false;
+		}
+	}
+
+	if (opts.socket.empty())
+		opts.socket = DefaultSocketPath();
+
+	return opts.fps > 0 && opts.seconds > 0.0 &&
+	       opts.width <= opts.canvasWidth &&
+	       opts.height <= opts.canvasHeight;
+}
+
+int main(int argc, char **argv)
+{
+	Options opts;
+	if (!ParseArgs(argc, argv, opts)) {
+		Usage();
+		return 1;
+	}
+
+#if defined(_WIN32)
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return 1;
+#endif
+
+	bool success = Run(opts);
+
+#if defined(_WIN32)
+	WSACleanup();
+#endif
+
+	return success ? 0 : 1;
+}